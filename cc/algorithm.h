@@ -6,14 +6,24 @@
 
 
 #include <algorithm>
+#include <vector>
 #include <boost/function.hpp>
 #include <boost/array.hpp>
 #include <boost/mpi/communicator.hpp>
 #include <boost/mpi/request.hpp>
 #include <boost/mpi/nonblocking.hpp>
+#include <boost/static_assert.hpp>
+#include <boost/type_traits/integral_constant.hpp>
+#include <boost/type_traits/is_same.hpp>
 #include <boost/numeric/ublas/storage.hpp>
 #include "matrix.h"
+#include "block_sparse.h"
 #include "mpi.h"
+#include "datatype.h"
+#include "persistent.h"
+#include "convert.h"
+#include "transport.h"
+#include "trace.h"
 #include "debug.h"
 
 
@@ -29,10 +39,59 @@ namespace
 
 static const int CANNON_ALGORITHM_MPI_TAG = 42;
 
+// Pipelined mode sends panel `p` with tag `CANNON_PANEL_MPI_TAG + p`.
+static const int CANNON_PANEL_MPI_TAG = CANNON_ALGORITHM_MPI_TAG + 1;
+
+// Most panels of the pipelined mode on `comm`: the tags of the left and
+// the right ones have to fit its tag upper bound.
+inline size_t max_panels(const ::boost::mpi::communicator & comm)
+{
+    return static_cast<size_t>(mpi::tag_upper_bound(comm) - CANNON_PANEL_MPI_TAG + 1) / 2;
+}
+
+// Batch mode skews the next product's partials with this tag.
+static const int CANNON_SKEW_MPI_TAG = CANNON_ALGORITHM_MPI_TAG - 1;
+
+// Block-sparse partials send their indices with the algorithm's tag
+// and their tiles with this one.
+static const int CANNON_TILES_MPI_TAG = CANNON_ALGORITHM_MPI_TAG - 2;
+
 
 }  // namespace (unnamed)
 
 
+// Partials `cannon_prod` shifts for `transport_t` (see below): matrices
+// of `transport_t` elements stored like the operands.
+template<typename transport_t, typename storage_t, size_t SIZE>
+struct partials_of
+{
+    typedef transport_t element_type;
+    typedef typename rebind_storage<storage_t, element_type>::type storage_type;
+    typedef typename square_matrix_concept<element_type, storage_type, row_major, SIZE>::type row_type;
+    typedef typename square_matrix_concept<element_type, storage_type, col_major, SIZE>::type col_type;
+};
+
+
+// Block-sparse ones, see block_sparse.h.
+template<typename element_t, typename storage_t, size_t SIZE>
+struct partials_of<block_sparse_transport<element_t>, storage_t, SIZE>
+{
+    typedef element_t element_type;
+    typedef block_sparse_matrix<element_type, row_major> row_type;
+    typedef block_sparse_matrix<element_type, col_major> col_type;
+};
+
+
+// Partials put back after a product, see `cannon_prod::operator()`.
+enum realign_mode
+{
+    REALIGN_NONE = 0,
+    REALIGN_LEFT = 1,
+    REALIGN_RIGHT = 2,
+    REALIGN_BOTH = REALIGN_LEFT | REALIGN_RIGHT
+};
+
+
 // The Cannon's multiply algorithm signature
 //   `real_t` The actual matrix element type
 //   `SIZE` The size of a single partial, e.g.
@@ -42,7 +101,17 @@ static const int CANNON_ALGORITHM_MPI_TAG = 42;
 //       cartesian topology (the grid will have
 //       CART_SIZE*CART_SIZE nodes) with periods
 //       in both dimensions.
-template<typename real_t, typename storage_t, size_t SIZE, size_t CART_SIZE>
+// Either may be `DYNAMIC_SIZE`, then it is taken from the temp partials
+// or the communicator's topology. Partials of `DYNAMIC_SIZE` may be
+// rectangular: left ones `rows()` x `inner()` (the shape of `row_temp`),
+// right ones `inner()` x `cols()` (`col_temp`) and the result `rows()` x `cols()`.
+//   `transport_t` The element type the partials are shifted as. If it is
+//       narrower than `real_t` (see transport.h) the operands are rounded
+//       to it once per product and their copies are skewed and shifted
+//       instead of them, the operands are never moved. Same for
+//       `block_sparse_transport<real_t>`, whose copies are the operands'
+//       non-zero tiles (see block_sparse.h).
+template<typename real_t, typename storage_t, size_t SIZE, size_t CART_SIZE, typename transport_t = real_t>
 class cannon_prod
 {
 public:
@@ -54,91 +123,444 @@ public:
     // Column-major matrix type
     typedef square_matrix_concept<real_type, storage_type, col_major, SIZE> col_matrix_concept;
     typedef typename col_matrix_concept::type col_matrix_type;
+    // Shifted partials, the operands themselves unless `COPIED`.
+    typedef partials_of<transport_t, storage_type, SIZE> partials_type;
+    typedef typename partials_type::element_type transport_type;
+    typedef typename partials_type::row_type row_partial_type;
+    typedef typename partials_type::col_type col_partial_type;
+    static const bool COPIED = !::boost::is_same<row_matrix_type, row_partial_type>::value;
     // Local multiplication function
     typedef ::boost::function<
         void (
                 row_matrix_type & product_result,
-                row_matrix_type & product_first_argument,
-                col_matrix_type & product_second_argument)
+                row_partial_type & product_first_argument,
+                col_partial_type & product_second_argument)
         throw()> product_function_type;
+    // Sub-matrix multiplication function (used by the pipelined mode,
+    // and instead of the local product if that is empty)
+    //   c += a * b
+    // `a` row-major, `b` col-major, `c` row-major with given leading dimensions.
+    typedef ::boost::function<
+        void (
+                size_t m,
+                size_t n,
+                size_t k,
+                const transport_type * a,
+                size_t lda,
+                const transport_type * b,
+                size_t ldb,
+                real_type * c,
+                size_t ldc)
+        throw()> block_product_function_type;
+    // Rounds the operands to their narrowed copies, see convert.h.
+    typedef typename narrow_function<real_type, transport_type>::type narrow_function_type;
     // MPI Communicator - boost wrapped
     typedef ::boost::mpi::communicator communicator_type;
+    // Partials are sent as native MPI datatypes (see datatype.h),
+    // never through Boost's serialization.
+    BOOST_STATIC_ASSERT(::boost::mpi::is_mpi_datatype<transport_type>::value);
+    // One product of a batch:
+    //   result += left * right
+    struct batch_product
+    {
+        row_matrix_type * result;
+        row_matrix_type * left;
+        col_matrix_type * right;
+    };
+    typedef ::std::vector<batch_product> batch_type;
 private:
     typedef mpi::ranks_array_type ranks_array_type;
     typedef ::boost::mpi::request mpi_request_type;
-    typedef ::boost::array<mpi_request_type, 2 * mpi::DIMS> mpi_request_array_type;
+    // Transfer of the partials and (batch mode) the skew of the next ones.
+    typedef ::boost::array<mpi_request_type, 2 * 2 * mpi::DIMS> mpi_request_array_type;
+    typedef ::std::vector<mpi_request_type> mpi_request_vector_type;
+    // Picks the `shipped` partials.
+    typedef ::boost::integral_constant<bool, COPIED> copied_tag;
+    // Where a partial goes (and comes from) in one phase of the
+    // algorithm, `moves` is false if it stays in place.
+    struct route
+    {
+        ranks_array_type ranks;
+        bool moves;
+    };
+    // Pipelined mode requests and panel states, indexed by panel.
+    struct pipeline_state
+    {
+        mpi_request_vector_type temp_receives;
+        mpi_request_vector_type current_sends;
+        mpi_request_vector_type temp_sends;
+        ::std::vector<bool> sending;
+        ::std::vector<bool> temp_sending;
+        // Outstanding receives of the current partials.
+        mpi_request_vector_type pending_requests;
+        ::std::vector<size_t> pending_panels;
+        ::std::vector<bool> ready;
+        ::std::vector<bool> done;
+    };
 private:
     const communicator_type & cart_2d;
+    // Used only for `DYNAMIC_SIZE`, see `rows()`, `inner()`, `cols()`
+    // and `cart_size()`.
+    const size_t runtime_rows;
+    const size_t runtime_inner;
+    const size_t runtime_cols;
+    const size_t runtime_cart_size;
     const product_function_type local_product;
-    const ranks_array_type vertical_ranks;
-    const ranks_array_type horizontal_ranks;
+    const size_t panels;
+    const block_product_function_type block_product;
+    // Runs only steps `first_step..first_step+steps-1` (mod `cart_size()`).
+    const size_t first_step;
+    const size_t steps;
+    const mpi::coords_type coords;
+    // Every step's shift.
+    const route left_shift;
+    const route right_shift;
+    // Initial skew: left partial of row `i` goes `i + first_step` ranks down
+    // vertically, right partial of column `j` `j + first_step` ranks horizontally.
+    const route left_align;
+    const route right_align;
+    // Puts the partials back after the last step.
+    const route left_realign;
+    const route right_realign;
+    // Leaves a partial where it is.
+    const route stay;
+    // Every step's shift of the classic mode, set up once per buffers.
+    mpi::persistent_shift<transport_type> left_shift_requests;
+    mpi::persistent_shift<transport_type> right_shift_requests;
+    bool shifting;
     row_matrix_type * result;
-    row_matrix_type * left_current;
-    col_matrix_type * right_current;
-    row_matrix_type * left_temp;
-    col_matrix_type * right_temp;
-    row_matrix_type * row_temp;
-    col_matrix_type * col_temp;
+    row_partial_type * left_current;
+    col_partial_type * right_current;
+    row_partial_type * left_temp;
+    col_partial_type * right_temp;
+    row_partial_type * left_original;
+    col_partial_type * right_original;
+    row_partial_type * row_temp;
+    col_partial_type * col_temp;
+    // Copies of the operands, if `COPIED`.
+    row_partial_type left_copy;
+    col_partial_type right_copy;
+    narrow_function_type narrow_copy;
+    // Rounding errors of the narrowed copies, tiles of the block-sparse
+    // ones and the stored ones among them.
+    rounding_stats stats;
+    size_t tiles;
+    size_t stored;
+    // Batch mode receives the next product's skewed partials here.
+    row_matrix_type left_spare;
+    col_matrix_type right_spare;
     mutable mpi_request_array_type mpi_requests;
+    size_t active_requests;
+    // Steps of the products are traced if not NULL.
+    tracer * trace;
 public:
     // Creates the algorithm framework,
     // reuses `row_temp` and `col_temp`
     // through sequential runs.
+    // Without a `local_product` the `block_product` multiplies the whole
+    // partials.
+    // With `panels` > 1 the partials are shifted as `panels` separate
+    // row (left) / column (right) panels and `block_product` multiplies
+    // the result tiles as soon as their panels arrive. There are at most
+    // as many panels as rows and cols of the result and as `max_panels`.
+    // With `steps` (1 at least) less than the cart size only a part of the
+    // product is done, starting with the `first_step`th one; see cannon25d.h.
+    // 0 `steps` are all of them.
     cannon_prod(
             const communicator_type & cart_2d,
             product_function_type local_product,
-            row_matrix_type & row_temp,
-            col_matrix_type & col_temp)
+            row_partial_type & row_temp,
+            col_partial_type & col_temp,
+            size_t panels = 1,
+            block_product_function_type block_product = block_product_function_type(),
+            size_t first_step = 0,
+            size_t steps = 0)
         throw();
     ~cannon_prod()
         throw();
     // Performs the multiplication.
     //   result += first * second
+    // The partials are skewed and (unless `realign` is false) put back
+    // by the algorithm itself. Without the realign `left` and `right`
+    // are left with unspecified contents, which is fine if they are
+    // not needed any more, e.g. when `result` feeds the next product.
+    // Copied partials are shifted instead of the operands, which are
+    // left untouched.
+    void operator()(
+            row_matrix_type & result,
+            row_matrix_type & left,
+            col_matrix_type & right,
+            bool realign = true)
+        throw();
+    // Same, but only the `realign` partials are put back. The others
+    // are left with unspecified contents.
     void operator()(
             row_matrix_type & result,
             row_matrix_type & left,
-            col_matrix_type & right)
+            col_matrix_type & right,
+            realign_mode realign)
+        throw();
+    // Same on the shifted partials themselves, the caller's copies of
+    // the operands if `COPIED` (e.g. block-sparse operands compressed
+    // once for many products), which are put back as the operands.
+    void multiply_partials(
+            row_matrix_type & result,
+            row_partial_type & left,
+            col_partial_type & right,
+            realign_mode realign = REALIGN_BOTH)
+        throw();
+    // Performs independent multiplications one after another, as if
+    // every one of them was given to the above, but the skew of every
+    // product (but the first) is done during the last local product of
+    // the previous one. The products must not share partials.
+    // Copied products are run one after another.
+    void operator()(
+            const batch_type & batch,
+            bool realign = true)
+        throw();
+    // Makes the products record their skew, local products and waits
+    // of every step to `trace` (or stop tracing if NULL).
+    void trace_steps(tracer * trace)
+        throw();
+    // Makes the narrowed copies be rounded by `narrow` (e.g. a vectorized
+    // one, see `make_narrow`) instead of the scalar `::cannon::narrow`.
+    void narrow_copies(narrow_function_type narrow)
+        throw();
+    // Rounding errors of this processor's narrowed operands since the
+    // creation.
+    const rounding_stats & rounding() const
+        throw();
+    // Share of this processor's block-sparse operands' tiles that were
+    // non-zero since the creation.
+    double density() const
         throw();
 private:
+    // Storage of the copies of the operands: as `temp` if `COPIED`.
+    template<typename partial_t>
+    static partial_t copy_storage(const partial_t & temp, ::boost::true_type)
+        throw()
+    {
+        return temp;
+    }
+    template<typename partial_t>
+    static partial_t copy_storage(const partial_t &, ::boost::false_type)
+        throw()
+    {
+        return partial_t();
+    }
+    // The partial shifted for an operand: the operand itself, or its
+    // copy (see `copy_partial`).
+    row_partial_type & shipped(row_matrix_type & left, ::boost::false_type)
+        throw()
+    {
+        return left;
+    }
+    col_partial_type & shipped(col_matrix_type & right, ::boost::false_type)
+        throw()
+    {
+        return right;
+    }
+    row_partial_type & shipped(row_matrix_type & left, ::boost::true_type)
+        throw();
+    col_partial_type & shipped(col_matrix_type & right, ::boost::true_type)
+        throw();
+    // Rounds `operand` to `partial`'s elements.
+    template<typename layout_t, typename element_t, typename partial_storage_t>
+    void copy_partial(
+            const ::boost::numeric::ublas::matrix<real_type, layout_t, storage_type> & operand,
+            ::boost::numeric::ublas::matrix<element_t, layout_t, partial_storage_t> & partial)
+        throw();
+    // Stores the non-zero tiles of `operand`.
+    template<typename layout_t>
+    void copy_partial(
+            const ::boost::numeric::ublas::matrix<real_type, layout_t, storage_type> & operand,
+            block_sparse_matrix<real_type, layout_t> & partial)
+        throw();
+    // Start of an interval of `step` if traced, see `tracer::record`.
+    double trace_begin() const
+        throw();
+    void trace_end(trace_kind kind, size_t step, double begin)
+        throw();
+    // The local product of `step`, traced.
+    void traced_product(size_t step)
+        throw();
+    // Partial shapes, see above.
+    size_t rows() const
+        throw();
+    size_t inner() const
+        throw();
+    size_t cols() const
+        throw();
+    size_t cart_size() const
+        throw();
     // Assigns current and temp inner
     // algorithm's pointers.
     void init_partials(
             row_matrix_type & result,
-            row_matrix_type & left,
-            col_matrix_type & right)
+            row_partial_type & left,
+            col_partial_type & right)
         throw();
     // Performs initial realignment of the partials
     // according to the Cannon's algorithm.
     void align_partials()
         throw();
-    // Realigns the partials after the actual algorithm
-    // so that the data is on its correct place.
-    void realign_partials()
+    // All the steps of the classic mode but the last.
+    void shift_steps()
+        throw();
+    // Runs `batch` skewing every product during the previous one, only
+    // the operands themselves are skewed so.
+    void overlap_batch(const batch_type & batch, bool realign, ::boost::false_type)
+        throw();
+    void overlap_batch(const batch_type &, bool, ::boost::true_type)
+        throw()
+    {
+    }
+    // Starts skewing `next`'s partials into the spare ones.
+    void iskew_partials(const batch_product & next)
+        throw();
+    // Moves the skewed partials from the spare ones to `next`'s.
+    void take_skewed_partials(const batch_product & next)
         throw();
-    // Swaps temp with current pointers.
-    void swap_partials()
+    // Moves the partials back to the buffers given to `operator()`.
+    void restore_partials()
+        throw();
+    // Swaps temp with current pointers of the moved partials.
+    void swap_partials(const route & left_route, const route & right_route)
         throw();
     // Performs nonblocking send on current pointers
     // and nonblocing receive on temp pointers
-    // according to Cannon's algorithm.
+    // of the partials moving along the routes.
+    void itransfer_partials(const route & left_route, const route & right_route)
+        throw();
+    // Nonblocking send / receive of a whole partial, adds the requests.
+    template<typename element_t, typename layout_t, typename partial_storage_t>
+    void isend_partial(
+            mpi::rank_type destination,
+            ::boost::numeric::ublas::matrix<element_t, layout_t, partial_storage_t> * partial)
+        throw();
+    template<typename element_t, typename layout_t, typename partial_storage_t>
+    void irecv_partial(
+            mpi::rank_type source,
+            ::boost::numeric::ublas::matrix<element_t, layout_t, partial_storage_t> * partial)
+        throw();
+    // The block-sparse ones send (and receive into) their indices and
+    // tiles, see `block_sparse_matrix::index_data`.
+    template<typename layout_t>
+    void isend_partial(mpi::rank_type destination, block_sparse_matrix<transport_type, layout_t> * partial)
+        throw();
+    template<typename layout_t>
+    void irecv_partial(mpi::rank_type source, block_sparse_matrix<transport_type, layout_t> * partial)
+        throw();
+    // Takes a received partial, a dense one is all there already.
+    template<typename partial_t>
+    void take_received(partial_t *)
+        throw()
+    {
+    }
+    template<typename layout_t>
+    void take_received(block_sparse_matrix<transport_type, layout_t> * partial)
+        throw()
+    {
+        partial->received();
+    }
+    // Makes room in the block-sparse partials for the most tiles of any
+    // processor's ones and counts their tiles, dense ones have it.
+    template<typename left_t, typename right_t>
+    void reserve_partials(left_t *, right_t *)
+        throw()
+    {
+    }
+    void reserve_partials(
+            block_sparse_matrix<transport_type, row_major> * left,
+            block_sparse_matrix<transport_type, col_major> * right)
+        throw();
+    // Starts every step's shift according to Cannon's algorithm.
     void ishift_partials()
         throw();
-    // Waits for all requests performed by `ishift_partials`.
+    // Persistent for dense partials, whose sizes don't change.
+    template<typename left_t, typename right_t>
+    void ishift_partials(left_t * left, right_t * right)
+        throw();
+    template<typename right_t>
+    void ishift_partials(block_sparse_matrix<transport_type, row_major> *, right_t *)
+        throw();
+    // Waits for all requests performed by `itransfer_partials`
+    // or `ishift_partials`.
     void wait()
         throw();
+    // All the steps of the pipelined mode.
+    void pipelined_steps(realign_mode realign)
+        throw();
+    // One phase of the pipelined mode: panels are moved along the routes
+    // as soon as they are here and (if `compute`) multiplied meanwhile.
+    // `step` is the traced step of the phase.
+    void pipelined_phase(
+            pipeline_state & state,
+            const route & left_route,
+            const route & right_route,
+            bool compute,
+            size_t step)
+        throw();
+    // Route of the partial panel `panel` belongs to.
+    const route & panel_route(size_t panel, const route & left_route, const route & right_route)
+        throw();
+    // First and one-past-last row (left) or column (right) of
+    // panel `panel`, left panels are `0..panels-1`, right ones follow.
+    size_t panel_first(size_t panel)
+        throw();
+    size_t panel_last(size_t panel)
+        throw();
+    // Nonblocking send / receive of a single panel of `left` or `right`.
+    mpi_request_type isend_panel(
+            size_t panel,
+            mpi::rank_type destination,
+            row_partial_type * left,
+            col_partial_type * right)
+        throw();
+    mpi_request_type irecv_panel(
+            size_t panel,
+            mpi::rank_type source,
+            row_partial_type * left,
+            col_partial_type * right)
+        throw();
+    // Multiplies result tile of left panel `row_panel` and right panel
+    // `col_panel` (both `0..panels-1`).
+    void tile_product(size_t row_panel, size_t col_panel)
+        throw();
+    // Route `step` ranks in `DIRECTION`.
+    template<int DIRECTION, int DISPL>
+    route make_route(uint32_t step) const
+        throw()
+    {
+        const route shift = {mpi::shift<DIRECTION, DISPL>(cart_2d, step), step % cart_size() != 0};
+        return shift;
+    }
     // Partial send.
     template<typename matrix_t>
     mpi_request_type isend(mpi::rank_type destination, matrix_t * matrix)
         throw()
     {
-        return cart_2d.isend(destination, CANNON_ALGORITHM_MPI_TAG, begin(matrix), SIZE * SIZE);
+        return cart_2d.isend(destination, CANNON_ALGORITHM_MPI_TAG, begin(matrix), elements(matrix));
     }
     // Patrial receive.
     template<typename matrix_t>
     mpi_request_type irecv(mpi::rank_type source, matrix_t * matrix)
         throw()
     {
-        return cart_2d.irecv(source, CANNON_ALGORITHM_MPI_TAG, begin(matrix), SIZE * SIZE);
+        return cart_2d.irecv(source, CANNON_ALGORITHM_MPI_TAG, begin(matrix), elements(matrix));
+    }
+    // Amount of elements of a left (row-major) or right (col-major) partial.
+    template<typename element_t, typename matrix_storage_t>
+    size_t elements(const ::boost::numeric::ublas::matrix<element_t, row_major, matrix_storage_t> *) const
+        throw()
+    {
+        return rows() * inner();
+    }
+    template<typename element_t, typename matrix_storage_t>
+    size_t elements(const ::boost::numeric::ublas::matrix<element_t, col_major, matrix_storage_t> *) const
+        throw()
+    {
+        return inner() * cols();
     }
     // Returns pointer to the memory a matrix is stored.
     // Placeholder
@@ -150,143 +572,802 @@ private:
         return NULL;
     }
     // "Specializations" (overloaded actually)
-    real_type * begin(row_matrix_type * matrix)
-        throw();
-    real_type * begin(col_matrix_type * matrix)
-        throw();
+    template<typename element_t, typename layout_t, typename matrix_storage_t>
+    element_t * begin(::boost::numeric::ublas::matrix<element_t, layout_t, matrix_storage_t> * matrix)
+        throw()
+    {
+        return square_matrix_concept<element_t, matrix_storage_t, layout_t, SIZE>::begin(matrix);
+    }
 };
 
 
 
 
-template<typename real_t, typename storage_t, size_t SIZE, size_t CART_SIZE>
-cannon_prod<real_t, storage_t, SIZE, CART_SIZE>::cannon_prod(
+template<typename real_t, typename storage_t, size_t SIZE, size_t CART_SIZE, typename transport_t>
+cannon_prod<real_t, storage_t, SIZE, CART_SIZE, transport_t>::cannon_prod(
         const communicator_type & cart_2d,
         product_function_type local_product,
-        row_matrix_type & row_temp,
-        col_matrix_type & col_temp)
+        row_partial_type & row_temp,
+        col_partial_type & col_temp,
+        size_t panels,
+        block_product_function_type block_product,
+        size_t first_step,
+        size_t steps)
+    throw()
   : cart_2d(cart_2d),
+    runtime_rows(row_temp.size1()),
+    runtime_inner(row_temp.size2()),
+    runtime_cols(col_temp.size2()),
+    runtime_cart_size(mpi::dims(cart_2d)[mpi::DIRECTION_VERTICAL]),
     local_product(local_product),
-    vertical_ranks(mpi::shift<mpi::DIRECTION_VERTICAL, mpi::DISPLACEMENT_DOWNWARD>(cart_2d)),
-    horizontal_ranks(mpi::shift<mpi::DIRECTION_HORIZONTAL, mpi::DISPLACEMENT_DOWNWARD>(cart_2d)),
+    panels(block_product
+            ? ::std::max<size_t>(::std::min(::std::min(panels, ::std::min(rows(), cols())), max_panels(cart_2d)), 1)
+            : 1),
+    block_product(block_product),
+    first_step(first_step),
+    steps(steps != 0 ? steps : cart_size()),
+    coords(mpi::coords(cart_2d)),
+    left_shift(make_route<mpi::DIRECTION_VERTICAL, mpi::DISPLACEMENT_DOWNWARD>(1)),
+    right_shift(make_route<mpi::DIRECTION_HORIZONTAL, mpi::DISPLACEMENT_DOWNWARD>(1)),
+    left_align(make_route<mpi::DIRECTION_VERTICAL, mpi::DISPLACEMENT_DOWNWARD>(
+            (coords[mpi::DIRECTION_HORIZONTAL] + first_step) % cart_size())),
+    right_align(make_route<mpi::DIRECTION_HORIZONTAL, mpi::DISPLACEMENT_DOWNWARD>(
+            (coords[mpi::DIRECTION_VERTICAL] + first_step) % cart_size())),
+    left_realign(make_route<mpi::DIRECTION_VERTICAL, mpi::DISPLACEMENT_UPWARD>(
+            (coords[mpi::DIRECTION_HORIZONTAL] + first_step + this->steps - 1) % cart_size())),
+    right_realign(make_route<mpi::DIRECTION_HORIZONTAL, mpi::DISPLACEMENT_UPWARD>(
+            (coords[mpi::DIRECTION_VERTICAL] + first_step + this->steps - 1) % cart_size())),
+    stay(make_route<mpi::DIRECTION_VERTICAL, mpi::DISPLACEMENT_DOWNWARD>(0)),
+    left_shift_requests(cart_2d, left_shift.ranks, CANNON_ALGORITHM_MPI_TAG, rows() * inner()),
+    right_shift_requests(cart_2d, right_shift.ranks, CANNON_ALGORITHM_MPI_TAG, inner() * cols()),
+    shifting(false),
     result(NULL),
     left_current(NULL),
     right_current(NULL),
     left_temp(NULL),
     right_temp(NULL),
+    left_original(NULL),
+    right_original(NULL),
     row_temp(& row_temp),
-    col_temp(& col_temp)
+    col_temp(& col_temp),
+    left_copy(copy_storage(row_temp, copied_tag())),
+    right_copy(copy_storage(col_temp, copied_tag())),
+    narrow_copy(),
+    stats(),
+    tiles(0),
+    stored(0),
+    active_requests(0),
+    trace(NULL)
+{
+}
+
+
+template<typename real_t, typename storage_t, size_t SIZE, size_t CART_SIZE, typename transport_t>
+cannon_prod<real_t, storage_t, SIZE, CART_SIZE, transport_t>::~cannon_prod()
+    throw()
+{
+}
+
+
+template<typename real_t, typename storage_t, size_t SIZE, size_t CART_SIZE, typename transport_t>
+inline size_t cannon_prod<real_t, storage_t, SIZE, CART_SIZE, transport_t>::rows() const
+    throw()
+{
+    return actual_size<SIZE>(runtime_rows);
+}
+
+
+template<typename real_t, typename storage_t, size_t SIZE, size_t CART_SIZE, typename transport_t>
+inline size_t cannon_prod<real_t, storage_t, SIZE, CART_SIZE, transport_t>::inner() const
+    throw()
+{
+    return actual_size<SIZE>(runtime_inner);
+}
+
+
+template<typename real_t, typename storage_t, size_t SIZE, size_t CART_SIZE, typename transport_t>
+inline size_t cannon_prod<real_t, storage_t, SIZE, CART_SIZE, transport_t>::cols() const
+    throw()
+{
+    return actual_size<SIZE>(runtime_cols);
+}
+
+
+template<typename real_t, typename storage_t, size_t SIZE, size_t CART_SIZE, typename transport_t>
+inline size_t cannon_prod<real_t, storage_t, SIZE, CART_SIZE, transport_t>::cart_size() const
+    throw()
+{
+    return actual_size<CART_SIZE>(runtime_cart_size);
+}
+
+
+template<typename real_t, typename storage_t, size_t SIZE, size_t CART_SIZE, typename transport_t>
+inline void cannon_prod<real_t, storage_t, SIZE, CART_SIZE, transport_t>::trace_steps(tracer * trace)
+    throw()
+{
+    this->trace = trace;
+}
+
+
+template<typename real_t, typename storage_t, size_t SIZE, size_t CART_SIZE, typename transport_t>
+inline void cannon_prod<real_t, storage_t, SIZE, CART_SIZE, transport_t>::narrow_copies(
+        narrow_function_type narrow)
+    throw()
+{
+    narrow_copy = narrow;
+}
+
+
+template<typename real_t, typename storage_t, size_t SIZE, size_t CART_SIZE, typename transport_t>
+inline const rounding_stats &
+cannon_prod<real_t, storage_t, SIZE, CART_SIZE, transport_t>::rounding() const
+    throw()
+{
+    return stats;
+}
+
+
+template<typename real_t, typename storage_t, size_t SIZE, size_t CART_SIZE, typename transport_t>
+inline double cannon_prod<real_t, storage_t, SIZE, CART_SIZE, transport_t>::density() const
+    throw()
 {
+    return tiles > 0 ? static_cast<double>(stored) / tiles : 1.0;
+}
+
+
+template<typename real_t, typename storage_t, size_t SIZE, size_t CART_SIZE, typename transport_t>
+inline double cannon_prod<real_t, storage_t, SIZE, CART_SIZE, transport_t>::trace_begin() const
+    throw()
+{
+    return trace != NULL ? trace->now() : 0.0;
+}
+
+
+template<typename real_t, typename storage_t, size_t SIZE, size_t CART_SIZE, typename transport_t>
+inline void cannon_prod<real_t, storage_t, SIZE, CART_SIZE, transport_t>::trace_end(
+        trace_kind kind,
+        size_t step,
+        double begin)
+    throw()
+{
+    if(trace != NULL)
+    {
+        trace->record(kind, step, begin);
+    }
+}
+
+
+template<typename real_t, typename storage_t, size_t SIZE, size_t CART_SIZE, typename transport_t>
+inline void cannon_prod<real_t, storage_t, SIZE, CART_SIZE, transport_t>::traced_product(size_t step)
+    throw()
+{
+    const double begin = trace_begin();
+    if(local_product)
+    {
+        local_product(* this->result, * left_current, * right_current);
+    }
+    else
+    {
+        block_product(rows(), cols(), inner(),
+                this->begin(left_current), inner(), this->begin(right_current), inner(),
+                this->begin(result), cols());
+    }
+    trace_end(TRACE_PRODUCT, step, begin);
 }
 
 
-template<typename real_t, typename storage_t, size_t SIZE, size_t CART_SIZE>
-cannon_prod<real_t, storage_t, SIZE, CART_SIZE>::~cannon()
+template<typename real_t, typename storage_t, size_t SIZE, size_t CART_SIZE, typename transport_t>
+inline void cannon_prod<real_t, storage_t, SIZE, CART_SIZE, transport_t>::operator()(
+        row_matrix_type & result,
+        row_matrix_type & left,
+        col_matrix_type & right,
+        bool realign)
+    throw()
 {
+    (* this)(result, left, right, realign ? REALIGN_BOTH : REALIGN_NONE);
 }
 
 
-template<typename real_t, typename storage_t, size_t SIZE, size_t CART_SIZE>
-inline void cannon_prod<real_t, storage_t, SIZE, CART_SIZE>::operator()(
+// Copies of the operands are not worth putting back.
+template<typename real_t, typename storage_t, size_t SIZE, size_t CART_SIZE, typename transport_t>
+inline void cannon_prod<real_t, storage_t, SIZE, CART_SIZE, transport_t>::operator()(
         row_matrix_type & result,
         row_matrix_type & left,
-        col_matrix_type & right)
+        col_matrix_type & right,
+        realign_mode realign)
+    throw()
+{
+    multiply_partials(result, shipped(left, copied_tag()), shipped(right, copied_tag()),
+            COPIED ? REALIGN_NONE : realign);
+}
+
+
+// After `steps - 1` shifts every partial is `steps - 1` ranks
+// from where it was skewed to, so the realign of rank `i` moves it
+// `i + first_step + steps - 1` ranks the other way. The realign is started right before the
+// last local product and waited for after it.
+template<typename real_t, typename storage_t, size_t SIZE, size_t CART_SIZE, typename transport_t>
+void cannon_prod<real_t, storage_t, SIZE, CART_SIZE, transport_t>::multiply_partials(
+        row_matrix_type & result,
+        row_partial_type & left,
+        col_partial_type & right,
+        realign_mode realign)
     throw()
 {
     init_partials(result, left, right);
-    //align_partials();
-    for(uint32_t step = 0; step + 1 < CART_SIZE; ++step)
+    reserve_partials(left_current, right_current);
+    if(panels > 1)
+    {
+        pipelined_steps(realign);
+        if(realign != REALIGN_NONE)
+        {
+            restore_partials();
+        }
+        return;
+    }
+    align_partials();
+    shift_steps();
+    if(realign == REALIGN_NONE)
+    {
+        traced_product(steps - 1);
+        return;
+    }
+    const route & left_back = realign & REALIGN_LEFT ? left_realign : stay;
+    const route & right_back = realign & REALIGN_RIGHT ? right_realign : stay;
+    itransfer_partials(left_back, right_back);
+    traced_product(steps - 1);
+    const double begin = trace_begin();
+    wait();
+    trace_end(TRACE_REALIGN, steps - 1, begin);
+    swap_partials(left_back, right_back);
+    restore_partials();
+}
+
+
+// The skew of product `i + 1` goes from its own partials to the spare
+// ones, which no other product uses, so it can be started together with
+// the realign of product `i`, before its last local product. The spare
+// storage is then swapped into product `i + 1`'s partials and they start
+// right away with the first shift. The pipelined mode has its own overlap
+// within a single product and runs the batch one product after another,
+// so do copied products, whose skew starts from a fresh copy.
+template<typename real_t, typename storage_t, size_t SIZE, size_t CART_SIZE, typename transport_t>
+void cannon_prod<real_t, storage_t, SIZE, CART_SIZE, transport_t>::operator()(
+        const batch_type & batch,
+        bool realign)
+    throw()
+{
+    if(panels > 1 || COPIED)
+    {
+        for(size_t i = 0; i < batch.size(); ++i)
+        {
+            (* this)(* batch[i].result, * batch[i].left, * batch[i].right, realign);
+        }
+        return;
+    }
+    overlap_batch(batch, realign, copied_tag());
+}
+
+
+template<typename real_t, typename storage_t, size_t SIZE, size_t CART_SIZE, typename transport_t>
+void cannon_prod<real_t, storage_t, SIZE, CART_SIZE, transport_t>::overlap_batch(
+        const batch_type & batch,
+        bool realign,
+        ::boost::false_type)
+    throw()
+{
+    left_spare.resize(rows(), inner(), false);
+    right_spare.resize(inner(), cols(), false);
+    for(size_t i = 0; i < batch.size(); ++i)
+    {
+        ::debug::info << "Begin batch product " << i + 1 << ".\n" << ::std::flush;
+        init_partials(* batch[i].result, * batch[i].left, * batch[i].right);
+        if(i == 0)
+        {
+            align_partials();
+        }
+        shift_steps();
+        if(realign)
+        {
+            itransfer_partials(left_realign, right_realign);
+        }
+        if(i + 1 < batch.size())
+        {
+            iskew_partials(batch[i + 1]);
+        }
+        traced_product(steps - 1);
+        const double begin = trace_begin();
+        wait();
+        trace_end(TRACE_REALIGN, steps - 1, begin);
+        if(realign)
+        {
+            swap_partials(left_realign, right_realign);
+            restore_partials();
+        }
+        if(i + 1 < batch.size())
+        {
+            take_skewed_partials(batch[i + 1]);
+        }
+    }
+}
+
+
+template<typename real_t, typename storage_t, size_t SIZE, size_t CART_SIZE, typename transport_t>
+inline void cannon_prod<real_t, storage_t, SIZE, CART_SIZE, transport_t>::shift_steps()
+    throw()
+{
+    for(uint32_t step = 0; step + 1 < steps; ++step)
     {
         ::debug::info << "Begin iteration " << step + 1 << ".\n" << ::std::flush;
         ishift_partials();
         ::debug::info << "Begin product.\n" << ::std::flush;
-        local_product(* this->result, * left_current, * right_current);
+        traced_product(step);
         ::debug::info << "Waiting for exchange.\n" << ::std::flush;
+        const double begin = trace_begin();
         wait();
+        trace_end(TRACE_WAIT, step, begin);
         ::debug::info << "Swapping partials.\n" << ::std::flush;
-        swap_partials();
+        swap_partials(left_shift, right_shift);
+    }
+}
+
+
+// Appends to the requests of `itransfer_partials` (if any), so that
+// `wait` waits for both.
+template<typename real_t, typename storage_t, size_t SIZE, size_t CART_SIZE, typename transport_t>
+inline void cannon_prod<real_t, storage_t, SIZE, CART_SIZE, transport_t>::iskew_partials(const batch_product & next)
+    throw()
+{
+    if(left_align.moves)
+    {
+        mpi_requests[active_requests++] = cart_2d.isend(
+                left_align.ranks[mpi::DESTINATION_RANK_INDEX], CANNON_SKEW_MPI_TAG,
+                begin(next.left), elements(next.left));
+        mpi_requests[active_requests++] = cart_2d.irecv(
+                left_align.ranks[mpi::SOURCE_RANK_INDEX], CANNON_SKEW_MPI_TAG,
+                begin(& left_spare), elements(& left_spare));
+    }
+    if(right_align.moves)
+    {
+        mpi_requests[active_requests++] = cart_2d.isend(
+                right_align.ranks[mpi::DESTINATION_RANK_INDEX], CANNON_SKEW_MPI_TAG,
+                begin(next.right), elements(next.right));
+        mpi_requests[active_requests++] = cart_2d.irecv(
+                right_align.ranks[mpi::SOURCE_RANK_INDEX], CANNON_SKEW_MPI_TAG,
+                begin(& right_spare), elements(& right_spare));
+    }
+}
+
+
+// O(1) storage swaps, the spare partials get the storage that was sent.
+template<typename real_t, typename storage_t, size_t SIZE, size_t CART_SIZE, typename transport_t>
+inline void cannon_prod<real_t, storage_t, SIZE, CART_SIZE, transport_t>::take_skewed_partials(const batch_product & next)
+    throw()
+{
+    if(left_align.moves)
+    {
+        next.left->swap(left_spare);
+    }
+    if(right_align.moves)
+    {
+        next.right->swap(right_spare);
+    }
+}
+
+
+
+
+// Every step the panels of the current partials are forwarded as soon
+// as they arrive and result tiles are multiplied as soon as both their
+// panels are here, so the local product of step `s` starts before the
+// whole shift of step `s - 1` is done. Receives into the temp partials
+// are posted only once the sends of the previous step from them are done.
+// The skew is a phase without a product: its panels are what the first
+// step waits for, so the first tiles are multiplied as soon as their
+// skewed panels arrive. The realign is done by the last step's forwards.
+template<typename real_t, typename storage_t, size_t SIZE, size_t CART_SIZE, typename transport_t>
+void cannon_prod<real_t, storage_t, SIZE, CART_SIZE, transport_t>::pipelined_steps(realign_mode realign)
+    throw()
+{
+    const size_t all_panels = 2 * panels;
+    pipeline_state state;
+    state.temp_receives.resize(all_panels);
+    state.current_sends.resize(all_panels);
+    state.temp_sends.resize(all_panels);
+    state.sending.assign(all_panels, false);
+    state.temp_sending.assign(all_panels, false);
+    state.ready.assign(all_panels, true);
+    state.done.resize(panels * panels);
+    ::debug::info << "Begin pipelined alignment.\n" << ::std::flush;
+    pipelined_phase(state, left_align, right_align, false, 0);
+    for(uint32_t step = 0; step < steps; ++step)
+    {
+        ::debug::info << "Begin pipelined iteration " << step + 1 << ".\n" << ::std::flush;
+        if(step + 1 < steps)
+        {
+            pipelined_phase(state, left_shift, right_shift, true, step);
+        }
+        else
+        {
+            pipelined_phase(
+                    state,
+                    realign & REALIGN_LEFT ? left_realign : stay,
+                    realign & REALIGN_RIGHT ? right_realign : stay,
+                    true,
+                    step);
+        }
     }
-    local_product(* this->result, * left_current, * right_current);
-    //realign_partials();
+    const double begin = trace_begin();
+    ::boost::mpi::wait_all(state.pending_requests.begin(), state.pending_requests.end());
+    for(size_t panel = 0; panel < all_panels; ++panel)
+    {
+        if(state.temp_sending[panel])
+        {
+            state.temp_sends[panel].wait();
+        }
+    }
+    trace_end(TRACE_REALIGN, steps - 1, begin);
+}
+
+
+template<typename real_t, typename storage_t, size_t SIZE, size_t CART_SIZE, typename transport_t>
+void cannon_prod<real_t, storage_t, SIZE, CART_SIZE, transport_t>::pipelined_phase(
+        pipeline_state & state,
+        const route & left_route,
+        const route & right_route,
+        bool compute,
+        size_t step)
+    throw()
+{
+    const size_t all_panels = 2 * panels;
+    const size_t all_tiles = compute ? panels * panels : 0;
+    for(size_t panel = 0; panel < all_panels; ++panel)
+    {
+        const route & moved = panel_route(panel, left_route, right_route);
+        if(!moved.moves)
+        {
+            continue;
+        }
+        if(state.temp_sending[panel])
+        {
+            state.temp_sends[panel].wait();
+            state.temp_sending[panel] = false;
+        }
+        state.temp_receives[panel] = irecv_panel(
+                panel, moved.ranks[mpi::SOURCE_RANK_INDEX], left_temp, right_temp);
+    }
+    for(size_t panel = 0; panel < all_panels; ++panel)
+    {
+        const route & moved = panel_route(panel, left_route, right_route);
+        if(moved.moves && state.ready[panel])
+        {
+            state.current_sends[panel] = isend_panel(
+                    panel, moved.ranks[mpi::DESTINATION_RANK_INDEX], left_current, right_current);
+            state.sending[panel] = true;
+        }
+    }
+    ::std::fill(state.done.begin(), state.done.end(), false);
+    size_t computed = 0;
+    // Without a product the phase only has to forward all its panels.
+    while(computed < all_tiles || (!compute && !state.pending_requests.empty()))
+    {
+        // Forward whatever arrived.
+        size_t arrived = state.pending_requests.size();
+        for(size_t i = 0; i < state.pending_requests.size(); )
+        {
+            if(state.pending_requests[i].test())
+            {
+                arrived = i;
+                break;
+            }
+            ++i;
+        }
+        if(arrived == state.pending_requests.size() && compute)
+        {
+            // Multiply the first tile with both panels here.
+            size_t tile = 0;
+            while(tile < all_tiles
+                    && (state.done[tile]
+                        || !state.ready[tile / panels]
+                        || !state.ready[panels + tile % panels]))
+            {
+                ++tile;
+            }
+            if(tile < all_tiles)
+            {
+                const double begin = trace_begin();
+                tile_product(tile / panels, tile % panels);
+                trace_end(TRACE_PRODUCT, step, begin);
+                state.done[tile] = true;
+                ++computed;
+                continue;
+            }
+        }
+        if(arrived == state.pending_requests.size())
+        {
+            // Nothing to multiply, block for the next panel.
+            const double begin = trace_begin();
+            ::std::pair< ::boost::mpi::status, typename mpi_request_vector_type::iterator> completed =
+                ::boost::mpi::wait_any(state.pending_requests.begin(), state.pending_requests.end());
+            trace_end(compute ? TRACE_WAIT : TRACE_SKEW, step, begin);
+            arrived = completed.second - state.pending_requests.begin();
+        }
+        const size_t panel = state.pending_panels[arrived];
+        const route & moved = panel_route(panel, left_route, right_route);
+        state.ready[panel] = true;
+        if(moved.moves)
+        {
+            state.current_sends[panel] = isend_panel(
+                    panel, moved.ranks[mpi::DESTINATION_RANK_INDEX], left_current, right_current);
+            state.sending[panel] = true;
+        }
+        state.pending_requests[arrived] = state.pending_requests.back();
+        state.pending_requests.pop_back();
+        state.pending_panels[arrived] = state.pending_panels.back();
+        state.pending_panels.pop_back();
+    }
+    swap_partials(left_route, right_route);
+    for(size_t panel = 0; panel < all_panels; ++panel)
+    {
+        if(!panel_route(panel, left_route, right_route).moves)
+        {
+            continue;
+        }
+        ::std::swap(state.temp_sends[panel], state.current_sends[panel]);
+        state.temp_sending[panel] = state.sending[panel];
+        state.sending[panel] = false;
+        state.pending_requests.push_back(state.temp_receives[panel]);
+        state.pending_panels.push_back(panel);
+        state.ready[panel] = false;
+    }
+}
+
+
+template<typename real_t, typename storage_t, size_t SIZE, size_t CART_SIZE, typename transport_t>
+inline const typename cannon_prod<real_t, storage_t, SIZE, CART_SIZE, transport_t>::route &
+cannon_prod<real_t, storage_t, SIZE, CART_SIZE, transport_t>::panel_route(
+        size_t panel,
+        const route & left_route,
+        const route & right_route)
+    throw()
+{
+    return panel < panels ? left_route : right_route;
+}
+
+
+template<typename real_t, typename storage_t, size_t SIZE, size_t CART_SIZE, typename transport_t>
+inline size_t cannon_prod<real_t, storage_t, SIZE, CART_SIZE, transport_t>::panel_first(size_t panel)
+    throw()
+{
+    return (panel % panels) * (panel < panels ? rows() : cols()) / panels;
 }
 
 
+template<typename real_t, typename storage_t, size_t SIZE, size_t CART_SIZE, typename transport_t>
+inline size_t cannon_prod<real_t, storage_t, SIZE, CART_SIZE, transport_t>::panel_last(size_t panel)
+    throw()
+{
+    return (panel % panels + 1) * (panel < panels ? rows() : cols()) / panels;
+}
 
 
-template<typename real_t, typename storage_t, size_t SIZE, size_t CART_SIZE>
-inline void cannon_prod<real_t, storage_t, SIZE, CART_SIZE>::align_partials()
+template<typename real_t, typename storage_t, size_t SIZE, size_t CART_SIZE, typename transport_t>
+inline typename cannon_prod<real_t, storage_t, SIZE, CART_SIZE, transport_t>::mpi_request_type
+cannon_prod<real_t, storage_t, SIZE, CART_SIZE, transport_t>::isend_panel(
+        size_t panel,
+        mpi::rank_type destination,
+        row_partial_type * left,
+        col_partial_type * right)
+    throw()
 {
-    mpi::coords_type coords = mpi::coords(cart_2d);
-    if(coords[mpi::DIRECTION_VERTICAL] != 0)
+    const size_t offset = panel_first(panel) * inner();
+    const size_t count = (panel_last(panel) - panel_first(panel)) * inner();
+    const int tag = CANNON_PANEL_MPI_TAG + panel;
+    if(panel < panels)
     {
-        const int step = coords[mpi::DIRECTION_VERTICAL];
-        ranks_array_type align_ranks =
-            mpi::shift<mpi::DIRECTION_VERTICAL, mpi::DISPLACEMENT_DOWNWARD>(cart_2d, step);
-        mpi_requests[mpi::DIMS * mpi::DIRECTION_VERTICAL + 0] =
-            isend(align_ranks[mpi::DESTINATION_RANK_INDEX], left_current);
-        mpi_requests[mpi::DIMS * mpi::DIRECTION_VERTICAL + 1] =
-            irecv(align_ranks[mpi::SOURCE_RANK_INDEX], left_temp);
+        return cart_2d.isend(destination, tag, begin(left) + offset, count);
     }
-    if(coords[mpi::DIRECTION_HORIZONTAL] != 0)
+    return cart_2d.isend(destination, tag, begin(right) + offset, count);
+}
+
+
+template<typename real_t, typename storage_t, size_t SIZE, size_t CART_SIZE, typename transport_t>
+inline typename cannon_prod<real_t, storage_t, SIZE, CART_SIZE, transport_t>::mpi_request_type
+cannon_prod<real_t, storage_t, SIZE, CART_SIZE, transport_t>::irecv_panel(
+        size_t panel,
+        mpi::rank_type source,
+        row_partial_type * left,
+        col_partial_type * right)
+    throw()
+{
+    const size_t offset = panel_first(panel) * inner();
+    const size_t count = (panel_last(panel) - panel_first(panel)) * inner();
+    const int tag = CANNON_PANEL_MPI_TAG + panel;
+    if(panel < panels)
     {
-        const int step = coords[mpi::DIRECTION_HORIZONTAL];
-        ranks_array_type align_ranks =
-            mpi::shift<mpi::DIRECTION_HORIZONTAL, mpi::DISPLACEMENT_DOWNWARD>(cart_2d, step);
-        mpi_requests[mpi::DIMS * mpi::DIRECTION_HORIZONTAL + 0] =
-            isend(align_ranks[mpi::DESTINATION_RANK_INDEX], right_current);
-        mpi_requests[mpi::DIMS * mpi::DIRECTION_HORIZONTAL + 1] =
-            irecv(align_ranks[mpi::SOURCE_RANK_INDEX], right_temp);
+        return cart_2d.irecv(source, tag, begin(left) + offset, count);
     }
-    if(coords[mpi::DIRECTION_VERTICAL] != 0)
+    return cart_2d.irecv(source, tag, begin(right) + offset, count);
+}
+
+
+template<typename real_t, typename storage_t, size_t SIZE, size_t CART_SIZE, typename transport_t>
+inline void cannon_prod<real_t, storage_t, SIZE, CART_SIZE, transport_t>::tile_product(
+        size_t row_panel,
+        size_t col_panel)
+    throw()
+{
+    const size_t first_row = panel_first(row_panel);
+    const size_t first_col = panel_first(panels + col_panel);
+    block_product(
+            panel_last(row_panel) - first_row,
+            panel_last(panels + col_panel) - first_col,
+            inner(),
+            begin(left_current) + first_row * inner(), inner(),
+            begin(right_current) + first_col * inner(), inner(),
+            begin(result) + first_row * cols() + first_col, cols());
+}
+
+
+// Left and right partials are skewed at the same time.
+template<typename real_t, typename storage_t, size_t SIZE, size_t CART_SIZE, typename transport_t>
+inline void cannon_prod<real_t, storage_t, SIZE, CART_SIZE, transport_t>::align_partials()
+    throw()
+{
+    const double begin = trace_begin();
+    itransfer_partials(left_align, right_align);
+    wait();
+    swap_partials(left_align, right_align);
+    trace_end(TRACE_SKEW, 0, begin);
+}
+
+
+// The partials may end up in the temp buffers, swapping
+// the storage back is O(1) for the `std::vector` storage.
+template<typename real_t, typename storage_t, size_t SIZE, size_t CART_SIZE, typename transport_t>
+inline void cannon_prod<real_t, storage_t, SIZE, CART_SIZE, transport_t>::restore_partials()
+    throw()
+{
+    if(left_current != left_original)
     {
-        const size_t offset = mpi::DIMS * mpi::DIRECTION_VERTICAL;
-        ::boost::mpi::wait_all(
-                mpi_requests.begin() + offset,
-                mpi_requests.begin() + offset + mpi::DIMS);
+        left_original->swap(* left_current);
         ::std::swap(left_current, left_temp);
     }
-    if(coords[mpi::DIRECTION_HORIZONTAL] != 0)
+    if(right_current != right_original)
     {
-        const size_t offset = mpi::DIMS * mpi::DIRECTION_HORIZONTAL;
-        ::boost::mpi::wait_all(
-                mpi_requests.begin() + offset,
-                mpi_requests.begin() + offset + mpi::DIMS);
+        right_original->swap(* right_current);
         ::std::swap(right_current, right_temp);
     }
 }
 
 
-template<typename real_t, typename storage_t, size_t SIZE, size_t CART_SIZE>
-inline void cannon_prod<real_t, storage_t, SIZE, CART_SIZE>::realign_partials()
+template<typename real_t, typename storage_t, size_t SIZE, size_t CART_SIZE, typename transport_t>
+inline void cannon_prod<real_t, storage_t, SIZE, CART_SIZE, transport_t>::itransfer_partials(
+        const route & left_route,
+        const route & right_route)
+    throw()
+{
+    active_requests = 0;
+    if(left_route.moves)
+    {
+        isend_partial(left_route.ranks[mpi::DESTINATION_RANK_INDEX], left_current);
+        irecv_partial(left_route.ranks[mpi::SOURCE_RANK_INDEX], left_temp);
+    }
+    if(right_route.moves)
+    {
+        isend_partial(right_route.ranks[mpi::DESTINATION_RANK_INDEX], right_current);
+        irecv_partial(right_route.ranks[mpi::SOURCE_RANK_INDEX], right_temp);
+    }
+}
+
+
+template<typename real_t, typename storage_t, size_t SIZE, size_t CART_SIZE, typename transport_t>
+template<typename element_t, typename layout_t, typename partial_storage_t>
+inline void cannon_prod<real_t, storage_t, SIZE, CART_SIZE, transport_t>::isend_partial(
+        mpi::rank_type destination,
+        ::boost::numeric::ublas::matrix<element_t, layout_t, partial_storage_t> * partial)
+    throw()
+{
+    mpi_requests[active_requests++] = isend(destination, partial);
+}
+
+
+template<typename real_t, typename storage_t, size_t SIZE, size_t CART_SIZE, typename transport_t>
+template<typename element_t, typename layout_t, typename partial_storage_t>
+inline void cannon_prod<real_t, storage_t, SIZE, CART_SIZE, transport_t>::irecv_partial(
+        mpi::rank_type source,
+        ::boost::numeric::ublas::matrix<element_t, layout_t, partial_storage_t> * partial)
+    throw()
+{
+    mpi_requests[active_requests++] = irecv(source, partial);
+}
+
+
+// Only the stored tiles travel, so a step's shift (as well as its
+// product) takes time proportional to the density of the partials.
+template<typename real_t, typename storage_t, size_t SIZE, size_t CART_SIZE, typename transport_t>
+template<typename layout_t>
+inline void cannon_prod<real_t, storage_t, SIZE, CART_SIZE, transport_t>::isend_partial(
+        mpi::rank_type destination,
+        block_sparse_matrix<transport_type, layout_t> * partial)
+    throw()
+{
+    mpi_requests[active_requests++] = cart_2d.isend(destination, CANNON_ALGORITHM_MPI_TAG,
+            partial->index_data(), partial->stored() + 1);
+    mpi_requests[active_requests++] = cart_2d.isend(destination, CANNON_TILES_MPI_TAG,
+            partial->tile_data(), partial->stored() * partial->tile_elements());
+}
+
+
+// Receives are posted for as many tiles as there's room for (at least
+// the most of any processor, see `reserve_partials`), the received count
+// tells how many came.
+template<typename real_t, typename storage_t, size_t SIZE, size_t CART_SIZE, typename transport_t>
+template<typename layout_t>
+inline void cannon_prod<real_t, storage_t, SIZE, CART_SIZE, transport_t>::irecv_partial(
+        mpi::rank_type source,
+        block_sparse_matrix<transport_type, layout_t> * partial)
+    throw()
+{
+    mpi_requests[active_requests++] = cart_2d.irecv(source, CANNON_ALGORITHM_MPI_TAG,
+            partial->index_data(), partial->tile_rows() * partial->tile_cols() + 1);
+    mpi_requests[active_requests++] = cart_2d.irecv(source, CANNON_TILES_MPI_TAG,
+            partial->tile_data(), partial->capacity() * partial->tile_elements());
+}
+
+
+template<typename real_t, typename storage_t, size_t SIZE, size_t CART_SIZE, typename transport_t>
+inline void cannon_prod<real_t, storage_t, SIZE, CART_SIZE, transport_t>::ishift_partials()
+    throw()
 {
-    // TODO
+    ishift_partials(left_current, right_current);
 }
 
 
-template<typename real_t, typename storage_t, size_t SIZE, size_t CART_SIZE>
-inline void cannon_prod<real_t, storage_t, SIZE, CART_SIZE>::ishift_partials()
+template<typename real_t, typename storage_t, size_t SIZE, size_t CART_SIZE, typename transport_t>
+template<typename left_t, typename right_t>
+inline void cannon_prod<real_t, storage_t, SIZE, CART_SIZE, transport_t>::ishift_partials(left_t * left, right_t * right)
     throw()
 {
-    mpi_requests[0] = isend(vertical_ranks[mpi::DESTINATION_RANK_INDEX], left_current);
-    mpi_requests[1] = irecv(vertical_ranks[mpi::SOURCE_RANK_INDEX], left_temp);
-    mpi_requests[2] = isend(horizontal_ranks[mpi::DESTINATION_RANK_INDEX], right_current);
-    mpi_requests[3] = irecv(horizontal_ranks[mpi::SOURCE_RANK_INDEX], right_temp);
+    left_shift_requests.bind(begin(left), begin(left_temp));
+    right_shift_requests.bind(begin(right), begin(right_temp));
+    left_shift_requests.start(begin(left));
+    right_shift_requests.start(begin(right));
+    shifting = true;
 }
 
 
-template<typename real_t, typename storage_t, size_t SIZE, size_t CART_SIZE>
-inline void cannon_prod<real_t, storage_t, SIZE, CART_SIZE>::wait()
+// Block-sparse partials are shifted like the other transfers, the
+// amount of their tiles changes every step.
+template<typename real_t, typename storage_t, size_t SIZE, size_t CART_SIZE, typename transport_t>
+template<typename right_t>
+inline void cannon_prod<real_t, storage_t, SIZE, CART_SIZE, transport_t>::ishift_partials(block_sparse_matrix<transport_type, row_major> *, right_t *)
     throw()
 {
-    ::boost::mpi::wait_all(mpi_requests.begin(), mpi_requests.end());
+    itransfer_partials(left_shift, right_shift);
 }
 
 
-template<typename real_t, typename storage_t, size_t SIZE, size_t CART_SIZE>
-inline void cannon_prod<real_t, storage_t, SIZE, CART_SIZE>::init_partials(
+template<typename real_t, typename storage_t, size_t SIZE, size_t CART_SIZE, typename transport_t>
+inline void cannon_prod<real_t, storage_t, SIZE, CART_SIZE, transport_t>::wait()
+    throw()
+{
+    ::boost::mpi::wait_all(mpi_requests.begin(), mpi_requests.begin() + active_requests);
+    active_requests = 0;
+    if(shifting)
+    {
+        left_shift_requests.wait();
+        right_shift_requests.wait();
+        shifting = false;
+    }
+}
+
+
+template<typename real_t, typename storage_t, size_t SIZE, size_t CART_SIZE, typename transport_t>
+inline void cannon_prod<real_t, storage_t, SIZE, CART_SIZE, transport_t>::init_partials(
         row_matrix_type & result,
-        row_matrix_type & left,
-        col_matrix_type & right)
+        row_partial_type & left,
+        col_partial_type & right)
     throw()
 {
     this->result = & result;
@@ -294,33 +1375,95 @@ inline void cannon_prod<real_t, storage_t, SIZE, CART_SIZE>::init_partials(
     right_current = & right;
     left_temp = row_temp;
     right_temp = col_temp;
+    left_original = & left;
+    right_original = & right;
 }
 
 
-template<typename real_t, typename storage_t, size_t SIZE, size_t CART_SIZE>
-inline void cannon_prod<real_t, storage_t, SIZE, CART_SIZE>::swap_partials()
+template<typename real_t, typename storage_t, size_t SIZE, size_t CART_SIZE, typename transport_t>
+inline void cannon_prod<real_t, storage_t, SIZE, CART_SIZE, transport_t>::swap_partials(
+        const route & left_route,
+        const route & right_route)
     throw()
 {
-    ::std::swap(left_current, left_temp);
-    ::std::swap(right_current, right_temp);
+    if(left_route.moves)
+    {
+        take_received(left_temp);
+        ::std::swap(left_current, left_temp);
+    }
+    if(right_route.moves)
+    {
+        take_received(right_temp);
+        ::std::swap(right_current, right_temp);
+    }
+}
+
+
+template<typename real_t, typename storage_t, size_t SIZE, size_t CART_SIZE, typename transport_t>
+typename cannon_prod<real_t, storage_t, SIZE, CART_SIZE, transport_t>::row_partial_type &
+cannon_prod<real_t, storage_t, SIZE, CART_SIZE, transport_t>::shipped(row_matrix_type & left, ::boost::true_type)
+    throw()
+{
+    copy_partial(left, left_copy);
+    return left_copy;
+}
+
+
+template<typename real_t, typename storage_t, size_t SIZE, size_t CART_SIZE, typename transport_t>
+typename cannon_prod<real_t, storage_t, SIZE, CART_SIZE, transport_t>::col_partial_type &
+cannon_prod<real_t, storage_t, SIZE, CART_SIZE, transport_t>::shipped(col_matrix_type & right, ::boost::true_type)
+    throw()
+{
+    copy_partial(right, right_copy);
+    return right_copy;
+}
+
+
+template<typename real_t, typename storage_t, size_t SIZE, size_t CART_SIZE, typename transport_t>
+template<typename layout_t, typename element_t, typename partial_storage_t>
+inline void cannon_prod<real_t, storage_t, SIZE, CART_SIZE, transport_t>::copy_partial(
+        const ::boost::numeric::ublas::matrix<real_type, layout_t, storage_type> & operand,
+        ::boost::numeric::ublas::matrix<element_t, layout_t, partial_storage_t> & partial)
+    throw()
+{
+    if(narrow_copy)
+    {
+        narrow_copy(& operand.data()[0], operand.data().size(), begin(& partial), stats);
+        return;
+    }
+    narrow(& operand.data()[0], operand.data().size(), begin(& partial), stats);
 }
 
 
-template<typename real_t, typename storage_t, size_t SIZE, size_t CART_SIZE>
-typename cannon_prod<real_t, storage_t, SIZE, CART_SIZE>::real_type *
-cannon_prod<real_t, storage_t, SIZE, CART_SIZE>::begin(row_matrix_type * matrix)
+template<typename real_t, typename storage_t, size_t SIZE, size_t CART_SIZE, typename transport_t>
+template<typename layout_t>
+inline void cannon_prod<real_t, storage_t, SIZE, CART_SIZE, transport_t>::copy_partial(
+        const ::boost::numeric::ublas::matrix<real_type, layout_t, storage_type> & operand,
+        block_sparse_matrix<real_type, layout_t> & partial)
     throw()
 {
-    return row_matrix_concept::begin(matrix);
+    partial.compress(operand);
 }
 
 
-template<typename real_t, typename storage_t, size_t SIZE, size_t CART_SIZE>
-typename cannon_prod<real_t, storage_t, SIZE, CART_SIZE>::real_type *
-cannon_prod<real_t, storage_t, SIZE, CART_SIZE>::begin(col_matrix_type * matrix)
+// Every partial a processor gets during the product is one of some
+// processor's, so the room for the most tiles of them is enough for all
+// the shifts. The temps hold as many, and so do the partials, as they
+// take turns receiving.
+template<typename real_t, typename storage_t, size_t SIZE, size_t CART_SIZE, typename transport_t>
+void cannon_prod<real_t, storage_t, SIZE, CART_SIZE, transport_t>::reserve_partials(
+        block_sparse_matrix<transport_type, row_major> * left,
+        block_sparse_matrix<transport_type, col_major> * right)
     throw()
 {
-    return col_matrix_concept::begin(matrix);
+    tiles += left->tile_rows() * left->tile_cols() + right->tile_rows() * right->tile_cols();
+    stored += left->stored() + right->stored();
+    unsigned long most[2] = {left->stored(), right->stored()};
+    MPI_Allreduce(MPI_IN_PLACE, most, 2, MPI_UNSIGNED_LONG, MPI_MAX, cart_2d);
+    left->reserve(most[0]);
+    left_temp->reserve(most[0]);
+    right->reserve(most[1]);
+    right_temp->reserve(most[1]);
 }
 
 
@@ -0,0 +1,166 @@
+// Author: Cezary Bartoszuk
+// Email: cbart@students.mimuw.edu.pl
+
+#ifndef __CANNON__ALLOCATOR__H__
+#define __CANNON__ALLOCATOR__H__
+
+
+#include <cstdlib>
+#include <limits>
+#include <new>
+#include <utility>
+#include <sys/mman.h>
+#include <boost/throw_exception.hpp>
+
+
+// Alignment of small allocations (a cache line).
+#ifndef MATRIX_ALIGNMENT
+#define MATRIX_ALIGNMENT 64
+#endif
+
+// Allocations of at least this many bytes are mapped in huge pages.
+#ifndef HUGE_PAGE_SIZE
+#define HUGE_PAGE_SIZE (2l * 1024 * 1024)
+#endif
+
+
+namespace cannon
+{
+
+
+// Allocator for the matrix storage (`std::vector`, see matrix.h):
+//  * small blocks are `MATRIX_ALIGNMENT` aligned,
+//  * large ones are anonymous mappings rounded up to `HUGE_PAGE_SIZE`,
+//    advised for transparent huge pages (or, built with
+//    `-DCANNON_HUGETLB`, taken from the explicit huge page pool
+//    if it has enough pages),
+//  * elements are default- (not value-) initialized, so a fresh vector
+//    of numbers is never written. Pages are not touched until the
+//    first write, so they are placed on the NUMA node of whoever fills
+//    the matrix first - the rank (and its threads) that uses it.
+template<typename element_t>
+class matrix_allocator
+{
+public:
+    typedef element_t value_type;
+    typedef element_t * pointer;
+    typedef const element_t * const_pointer;
+    typedef element_t & reference;
+    typedef const element_t & const_reference;
+    typedef size_t size_type;
+    typedef ptrdiff_t difference_type;
+    template<typename other_t>
+    struct rebind
+    {
+        typedef matrix_allocator<other_t> other;
+    };
+public:
+    matrix_allocator()
+        throw()
+    {
+    }
+    template<typename other_t>
+    matrix_allocator(const matrix_allocator<other_t> &)
+        throw()
+    {
+    }
+    pointer allocate(size_type count, const void * = NULL)
+    {
+        const size_t bytes = count * sizeof(value_type);
+        void * memory = NULL;
+        if(bytes < HUGE_PAGE_SIZE)
+        {
+            if(posix_memalign(& memory, MATRIX_ALIGNMENT, bytes ? bytes : 1) != 0)
+            {
+                ::boost::throw_exception(::std::bad_alloc());
+            }
+            return static_cast<pointer>(memory);
+        }
+        const size_t length = mapped_length(bytes);
+#if defined(CANNON_HUGETLB) && defined(MAP_HUGETLB)
+        memory = mmap(NULL, length, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if(memory != MAP_FAILED)
+        {
+            return static_cast<pointer>(memory);
+        }
+#endif
+        memory = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if(memory == MAP_FAILED)
+        {
+            ::boost::throw_exception(::std::bad_alloc());
+        }
+#ifdef MADV_HUGEPAGE
+        madvise(memory, length, MADV_HUGEPAGE);
+#endif
+        return static_cast<pointer>(memory);
+    }
+    void deallocate(pointer memory, size_type count)
+        throw()
+    {
+        const size_t bytes = count * sizeof(value_type);
+        if(bytes < HUGE_PAGE_SIZE)
+        {
+            free(memory);
+            return;
+        }
+        munmap(memory, mapped_length(bytes));
+    }
+    size_type max_size() const
+        throw()
+    {
+        return ::std::numeric_limits<size_type>::max() / sizeof(value_type);
+    }
+    // Whether `count` elements are allocated as a (page aligned) mapping,
+    // so their pages may be replaced with `mmap(MAP_FIXED)`, e.g. by
+    // a file's (see tiled_file.h).
+    static bool mapped(size_type count)
+        throw()
+    {
+        return count * sizeof(value_type) >= HUGE_PAGE_SIZE;
+    }
+    // No value-initialization for `vector(n)` and `resize(n)`.
+    template<typename other_t>
+    void construct(other_t * place)
+    {
+        ::new(static_cast<void *>(place)) other_t;
+    }
+    template<typename other_t, typename... arguments_t>
+    void construct(other_t * place, arguments_t &&... arguments)
+    {
+        ::new(static_cast<void *>(place)) other_t(::std::forward<arguments_t>(arguments)...);
+    }
+    template<typename other_t>
+    void destroy(other_t * place)
+    {
+        place->~other_t();
+    }
+private:
+    static size_t mapped_length(size_t bytes)
+        throw()
+    {
+        return (bytes + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+    }
+};
+
+
+template<typename first_t, typename second_t>
+inline bool operator==(const matrix_allocator<first_t> &, const matrix_allocator<second_t> &)
+    throw()
+{
+    return true;
+}
+
+
+template<typename first_t, typename second_t>
+inline bool operator!=(const matrix_allocator<first_t> &, const matrix_allocator<second_t> &)
+    throw()
+{
+    return false;
+}
+
+
+}  // namespace cannon
+
+
+#endif
@@ -0,0 +1,354 @@
+// Author: Cezary Bartoszuk
+// Email: cbart@students.mimuw.edu.pl
+
+#ifndef __CANNON__BLOCK_SPARSE__H__
+#define __CANNON__BLOCK_SPARSE__H__
+
+
+#include <algorithm>
+#include <vector>
+#include <stdint.h>
+#include <boost/type_traits/is_same.hpp>
+#include "matrix.h"
+#include "allocator.h"
+
+
+namespace cannon
+{
+
+
+// Block-sparse matrix: `rows` x `cols` split into `tile` x `tile` tiles
+// (edge ones padded with zeros) of which only the non-zero ones are
+// stored, compacted in order of their index
+//   tile_row * tile_cols() + tile_col
+// The tile map is the bitmap of the stored tiles, with their positions.
+// There's room for the stored tiles only (and as many more as `reserve`
+// asks for), so a sparse matrix takes as much memory as its density.
+// Every tile is stored in `layout_t` with `tile` leading dimension, so
+// a row-major tile is `gemm::gemm`'s left operand and a col-major one
+// its right one as they are.
+template<typename element_t, typename layout_t>
+class block_sparse_matrix
+{
+public:
+    typedef element_t element_type;
+    typedef layout_t layout_type;
+    typedef uint32_t index_type;
+    typedef ::std::vector<element_type, matrix_allocator<element_type> > storage_type;
+    typedef ::std::vector<index_type> indices_type;
+private:
+    // Tile map entry of a tile that isn't stored.
+    static const index_type EMPTY = ~static_cast<index_type>(0);
+    size_t rows;
+    size_t cols;
+    size_t side;
+    size_t row_tiles;
+    size_t col_tiles;
+    // Count and indices of the stored tiles (room for all of them), then
+    // their elements.
+    indices_type indices;
+    storage_type tiles;
+    indices_type map;
+    size_t count;
+public:
+    block_sparse_matrix(size_t rows, size_t cols, size_t tile)
+        throw();
+    size_t size1() const
+        throw();
+    size_t size2() const
+        throw();
+    size_t tile() const
+        throw();
+    size_t tile_rows() const
+        throw();
+    size_t tile_cols() const
+        throw();
+    // Elements of a stored tile.
+    size_t tile_elements() const
+        throw();
+    // Stored tiles.
+    size_t stored() const
+        throw();
+    // Tiles there's room for.
+    size_t capacity() const
+        throw();
+    // Makes room for at least `tiles` tiles, e.g. to receive a matrix of
+    // as many.
+    void reserve(size_t tiles)
+        throw();
+    // Tile `tile_row`, `tile_col` or NULL if it's zero.
+    const element_type * tile_at(size_t tile_row, size_t tile_col) const
+        throw();
+    // Stores the non-zero tiles of `dense` (of the same shape and layout).
+    template<typename storage_t>
+    void compress(const ::boost::numeric::ublas::matrix<element_type, layout_type, storage_t> & dense)
+        throw();
+    // The stored tiles' count followed by their indices, and their
+    // elements, so that they are sent and received as they are:
+    // `stored() + 1` indices and `stored()` tiles (`capacity()` fit).
+    index_type * index_data()
+        throw();
+    element_type * tile_data()
+        throw();
+    // Takes the indices and tiles received.
+    void received()
+        throw();
+    // O(1) exchange of the contents of two matrices of the same shape.
+    void swap(block_sparse_matrix & other)
+        throw();
+private:
+    // Whether the `tile_lines` x `tile_length` tile from `first_line`,
+    // `first_element` of the `length` long lines of `data` is all zeros.
+    static bool zero_tile(
+            const element_type * data,
+            size_t length,
+            size_t first_line,
+            size_t first_element,
+            size_t tile_lines,
+            size_t tile_length)
+        throw();
+};
+
+
+template<typename element_t, typename layout_t>
+block_sparse_matrix<element_t, layout_t>::block_sparse_matrix(size_t rows, size_t cols, size_t tile)
+    throw()
+  : rows(rows),
+    cols(cols),
+    side(::std::max<size_t>(tile, 1)),
+    row_tiles((rows + side - 1) / side),
+    col_tiles((cols + side - 1) / side),
+    indices(row_tiles * col_tiles + 1),
+    tiles(),
+    map(row_tiles * col_tiles, EMPTY),
+    count(0)
+{
+}
+
+
+template<typename element_t, typename layout_t>
+inline size_t block_sparse_matrix<element_t, layout_t>::size1() const
+    throw()
+{
+    return rows;
+}
+
+
+template<typename element_t, typename layout_t>
+inline size_t block_sparse_matrix<element_t, layout_t>::size2() const
+    throw()
+{
+    return cols;
+}
+
+
+template<typename element_t, typename layout_t>
+inline size_t block_sparse_matrix<element_t, layout_t>::tile() const
+    throw()
+{
+    return side;
+}
+
+
+template<typename element_t, typename layout_t>
+inline size_t block_sparse_matrix<element_t, layout_t>::tile_rows() const
+    throw()
+{
+    return row_tiles;
+}
+
+
+template<typename element_t, typename layout_t>
+inline size_t block_sparse_matrix<element_t, layout_t>::tile_cols() const
+    throw()
+{
+    return col_tiles;
+}
+
+
+template<typename element_t, typename layout_t>
+inline size_t block_sparse_matrix<element_t, layout_t>::tile_elements() const
+    throw()
+{
+    return side * side;
+}
+
+
+template<typename element_t, typename layout_t>
+inline size_t block_sparse_matrix<element_t, layout_t>::stored() const
+    throw()
+{
+    return count;
+}
+
+
+template<typename element_t, typename layout_t>
+inline size_t block_sparse_matrix<element_t, layout_t>::capacity() const
+    throw()
+{
+    return tiles.size() / tile_elements();
+}
+
+
+// Only the stored tiles are copied to the grown storage.
+template<typename element_t, typename layout_t>
+void block_sparse_matrix<element_t, layout_t>::reserve(size_t tiles)
+    throw()
+{
+    if(capacity() >= tiles)
+    {
+        return;
+    }
+    storage_type grown(tiles * tile_elements());
+    ::std::copy(this->tiles.begin(), this->tiles.begin() + count * tile_elements(), grown.begin());
+    grown.swap(this->tiles);
+}
+
+
+template<typename element_t, typename layout_t>
+inline const typename block_sparse_matrix<element_t, layout_t>::element_type *
+block_sparse_matrix<element_t, layout_t>::tile_at(size_t tile_row, size_t tile_col) const
+    throw()
+{
+    const index_type position = map[tile_row * col_tiles + tile_col];
+    return position != EMPTY ? & tiles[position * tile_elements()] : NULL;
+}
+
+
+// The tiles to store are found first, every check ends at the first
+// non-zero element, then only they are copied (none of the old ones
+// when the storage grows). Storage lines are rows of
+// a row-major matrix and columns of a col-major one, both the dense
+// matrix's and the tiles'.
+template<typename element_t, typename layout_t>
+template<typename storage_t>
+void block_sparse_matrix<element_t, layout_t>::compress(
+        const ::boost::numeric::ublas::matrix<element_type, layout_type, storage_t> & dense)
+    throw()
+{
+    const bool col_major = ::boost::is_same<layout_type, ::cannon::col_major>::value;
+    const size_t lines = col_major ? cols : rows;
+    const size_t length = col_major ? rows : cols;
+    const element_type * data = & dense.data()[0];
+    size_t found = 0;
+    count = 0;
+    for(size_t tile_row = 0; tile_row < row_tiles; ++tile_row)
+    {
+        for(size_t tile_col = 0; tile_col < col_tiles; ++tile_col)
+        {
+            const size_t first_line = (col_major ? tile_col : tile_row) * side;
+            const size_t first_element = (col_major ? tile_row : tile_col) * side;
+            const index_type index = tile_row * col_tiles + tile_col;
+            if(zero_tile(data, length, first_line, first_element,
+                        ::std::min(side, lines - first_line), ::std::min(side, length - first_element)))
+            {
+                map[index] = EMPTY;
+                continue;
+            }
+            indices[1 + found] = index;
+            map[index] = found++;
+        }
+    }
+    reserve(found);
+    count = found;
+    indices[0] = count;
+    for(size_t position = 0; position < count; ++position)
+    {
+        const size_t tile_row = indices[1 + position] / col_tiles;
+        const size_t tile_col = indices[1 + position] % col_tiles;
+        const size_t first_line = (col_major ? tile_col : tile_row) * side;
+        const size_t first_element = (col_major ? tile_row : tile_col) * side;
+        const size_t tile_lines = ::std::min(side, lines - first_line);
+        const size_t tile_length = ::std::min(side, length - first_element);
+        element_type * out = & tiles[position * tile_elements()];
+        for(size_t line = 0; line < tile_lines; ++line)
+        {
+            const element_type * in = data + (first_line + line) * length + first_element;
+            ::std::copy(in, in + tile_length, out + line * side);
+            ::std::fill(out + line * side + tile_length, out + (line + 1) * side, element_type());
+        }
+        ::std::fill(out + tile_lines * side, out + tile_elements(), element_type());
+    }
+}
+
+
+template<typename element_t, typename layout_t>
+bool block_sparse_matrix<element_t, layout_t>::zero_tile(
+        const element_type * data,
+        size_t length,
+        size_t first_line,
+        size_t first_element,
+        size_t tile_lines,
+        size_t tile_length)
+    throw()
+{
+    for(size_t line = 0; line < tile_lines; ++line)
+    {
+        const element_type * in = data + (first_line + line) * length + first_element;
+        for(size_t i = 0; i < tile_length; ++i)
+        {
+            if(in[i] != element_type())
+            {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+
+template<typename element_t, typename layout_t>
+inline typename block_sparse_matrix<element_t, layout_t>::index_type *
+block_sparse_matrix<element_t, layout_t>::index_data()
+    throw()
+{
+    return & indices[0];
+}
+
+
+template<typename element_t, typename layout_t>
+inline typename block_sparse_matrix<element_t, layout_t>::element_type *
+block_sparse_matrix<element_t, layout_t>::tile_data()
+    throw()
+{
+    return tiles.empty() ? NULL : & tiles[0];
+}
+
+
+template<typename element_t, typename layout_t>
+void block_sparse_matrix<element_t, layout_t>::received()
+    throw()
+{
+    ::std::fill(map.begin(), map.end(), EMPTY);
+    count = indices[0];
+    for(size_t position = 0; position < count; ++position)
+    {
+        map[indices[1 + position]] = position;
+    }
+}
+
+
+template<typename element_t, typename layout_t>
+inline void block_sparse_matrix<element_t, layout_t>::swap(block_sparse_matrix & other)
+    throw()
+{
+    indices.swap(other.indices);
+    tiles.swap(other.tiles);
+    map.swap(other.map);
+    ::std::swap(count, other.count);
+}
+
+
+// Transport of `cannon_prod`'s partials (see algorithm.h) as
+// block-sparse matrices of `element_t` elements.
+template<typename element_t>
+struct block_sparse_transport
+{
+    typedef element_t element_type;
+};
+
+
+}  // namespace cannon
+
+
+#endif
@@ -7,87 +7,1073 @@
 #endif
 
 
+#include <boost/mpi/collectives/all_reduce.hpp>
 #include <boost/mpi/communicator.hpp>
 #include <boost/mpi/environment.hpp>
 #include <boost/numeric/ublas/storage.hpp>
+#include <complex>
+#include <cstdarg>
+#include <cstdio>
+#include <functional>
+#include <vector>
 #include "matrix.h"
+#include "allocator.h"
 #include "random.h"
 #include "fill.h"
 #include "multiply.h"
-#include "constant.h"
 #include "mpi.h"
+#include "matrix_file.h"
+#include "tiled_file.h"
+#include "trace.h"
+#include "verify.h"
 #include "exceptions.h"
 #include "algorithm.h"
+#include "chain.h"
+#include "summa.h"
+#include "cannon25d.h"
+#include "thread_pool.h"
+#include "options.h"
+#include "transport.h"
+#include "dispatch.h"
 #include "debug.h"
 
 
+// Default matrix size (`--size`).
 #ifndef MATRIXSIZE
 #define MATRIXSIZE 65536l
 #endif
 
-// The size of a single parial matrix.
-const size_t SIZE = MATRIXSIZE/CARTSIZE;
-
+// Default side of the MPI cart (`--grid`).
 #ifndef CARTSIZE
 #define CARTSIZE 8l
 #endif
 
-// The MPI cart will be a `CART_SIZE` x `CART_SIZE` square.
-const size_t CART_SIZE = CARTSIZE;
+// Matrix and cart sizes the algorithms are precompiled for, as
+// `HOT(matrix size, cart size)` list, e.g.
+//   -D'HOT_SIZES(HOT)=HOT(128, 2) HOT(65536, 8)'
+// Other sizes run the `DYNAMIC_SIZE` code.
+#ifndef HOT_SIZES
+#define HOT_SIZES(HOT) HOT(MATRIXSIZE, CARTSIZE)
+#endif
+
+
+// The types we work with for a given element type
+// (chosen at runtime with `--type`) and sizes (`DYNAMIC_SIZE` or hot ones):
+//   `SIZE` The size of a single partial matrix.
+//   `CART_SIZE` The MPI cart is a `CART_SIZE` x `CART_SIZE` square.
+template<typename real_t, size_t SIZE, size_t CART_SIZE>
+struct cannon_types
+{
+    typedef real_t real_type;
+    // Storage type - we use unbounded_array because of performance reasons
+    // typedef ::boost::numeric::ublas::unbounded_array<real_type> storage_type;
+    // Aligned, huge page backed and not zeroed on creation (see allocator.h).
+    typedef ::std::vector<real_type, ::cannon::matrix_allocator<real_type> > storage_type;
+    // The algorithm we work with.
+    typedef ::cannon::algorithm::cannon_prod<real_type, storage_type, SIZE, CART_SIZE> cannon_prod_type;
+    typedef ::cannon::algorithm::cannon_25d_prod<real_type, storage_type, SIZE, CART_SIZE> cannon_25d_prod_type;
+    typedef ::cannon::algorithm::summa_prod<real_type, storage_type, SIZE> summa_prod_type;
+    typedef ::cannon::algorithm::chain_prod<real_type, storage_type, SIZE, CART_SIZE> chain_prod_type;
+};
+
+
+// Random streams (see random.h) of the operands, chain's operands after
+// the first one are `STREAM_CHAIN`, `STREAM_CHAIN + 1`, ...
+const uint32_t STREAM_LEFT = 0;
+const uint32_t STREAM_RIGHT = 1;
+const uint32_t STREAM_CHAIN = 2;
+// Random streams of the Freivalds' vectors: vector `v` is
+// `STREAM_VERIFY + v`, way past the chain's.
+const uint32_t STREAM_VERIFY = 0x80000000u;
+// Random streams of the zero tiles of sparse operands: operand of
+// stream `s`'s are `STREAM_TILES + s`.
+const uint32_t STREAM_TILES = 0x40000000u;
+
+
+// Features of a run, see `FEATURE_RULES`.
+enum run_feature
+{
+    FEATURE_SUMMA = 1 << 0,
+    FEATURE_LAYERS = 1 << 1,
+    FEATURE_PANELS = 1 << 2,
+    FEATURE_BATCH = 1 << 3,
+    FEATURE_CHAIN = 1 << 4,
+    FEATURE_NARROWED = 1 << 5,
+    FEATURE_SPARSE = 1 << 6,
+    FEATURE_RECTANGULAR = 1 << 7
+};
+
+
+// Features `opts` ask for.
+inline unsigned run_features(const ::cannon::options & opts)
+{
+    using namespace ::cannon;
+    return (opts.engine == ENGINE_SUMMA ? FEATURE_SUMMA : 0)
+        | (opts.depth > 1 ? FEATURE_LAYERS : 0)
+        | (opts.panels > 1 ? FEATURE_PANELS : 0)
+        | (opts.batch > 1 ? FEATURE_BATCH : 0)
+        | (opts.chain > 1 ? FEATURE_CHAIN : 0)
+        | (opts.transport != TRANSPORT_FULL ? FEATURE_NARROWED : 0)
+        | (opts.partials == PARTIALS_BLOCK_SPARSE ? FEATURE_SPARSE : 0)
+        | (opts.shape.inner != opts.shape.rows || opts.shape.cols != opts.shape.rows ? FEATURE_RECTANGULAR : 0);
+}
+
+
+// Features that don't go with some others, and why.
+struct feature_rule
+{
+    unsigned feature;
+    unsigned excluded;
+    const char * message;
+};
+
+
+const feature_rule FEATURE_RULES[] = {
+    {FEATURE_BATCH, FEATURE_SUMMA | FEATURE_LAYERS,
+        "Batches need the plain Cannon's algorithm!"},
+    {FEATURE_CHAIN, FEATURE_SUMMA | FEATURE_LAYERS | FEATURE_BATCH | FEATURE_RECTANGULAR,
+        "Chains need the plain Cannon's algorithm and square matrices!"},
+    {FEATURE_NARROWED, FEATURE_SUMMA | FEATURE_LAYERS | FEATURE_BATCH | FEATURE_CHAIN,
+        "Narrowed transport needs the plain Cannon's algorithm!"},
+    {FEATURE_SPARSE, FEATURE_SUMMA | FEATURE_LAYERS | FEATURE_BATCH | FEATURE_CHAIN | FEATURE_PANELS
+        | FEATURE_NARROWED,
+        "Block-sparse partials need the plain Cannon's algorithm without panels!"}};
+
+
+// Checks `opts`' features against `FEATURE_RULES`, tells the first
+// one broken.
+inline bool compatible_features(const ::cannon::options & opts)
+{
+    const unsigned features = run_features(opts);
+    for(size_t i = 0; i < sizeof(FEATURE_RULES) / sizeof(FEATURE_RULES[0]); ++i)
+    {
+        const feature_rule & rule = FEATURE_RULES[i];
+        if((features & rule.feature) != 0 && (features & rule.excluded) != 0)
+        {
+            ::debug::err << rule.message << "\n";
+            return false;
+        }
+    }
+    return true;
+}
+
+
+// Shape of every processor's partials of `opts`' product on `cart_2d`.
+// Cannon's algorithm splits all three dimensions in `opts.cart_size`,
+// SUMMA the result over its grid and the inner dimension in its steps.
+inline ::cannon::product_shape partial_shape(
+        const ::boost::mpi::communicator & cart_2d,
+        const ::cannon::options & opts)
+{
+    using namespace ::cannon;
+    if(opts.engine == ENGINE_SUMMA)
+    {
+        const mpi::coords_type dims = mpi::dims(cart_2d);
+        const size_t grid_rows = dims[mpi::DIRECTION_VERTICAL];
+        const size_t grid_cols = dims[mpi::DIRECTION_HORIZONTAL];
+        const product_shape partial = {
+            partial_size(opts.shape.rows, grid_rows),
+            partial_size(opts.shape.inner, algorithm::summa_steps(grid_rows, grid_cols)),
+            partial_size(opts.shape.cols, grid_cols)};
+        return partial;
+    }
+    const product_shape partial = {
+        partial_size(opts.shape.rows, opts.cart_size),
+        partial_size(opts.shape.inner, opts.cart_size),
+        partial_size(opts.shape.cols, opts.cart_size)};
+    return partial;
+}
+
+
+// Tiles of an operand that aren't zeroed, at random with
+// `density` probability.
+struct tile_density
+{
+    ::cannon::random_generator<double> generator;
+    double density;
+    bool operator()(size_t tile_row, size_t tile_col) const
+    {
+        return generator(tile_row, tile_col) < density;
+    }
+};
+
+
+// Fills `operand` - the part of a global matrix from its `first_row`,
+// `first_col` element on - with `opts`' operand values. The zero tiles
+// of sparse operands are those of the global matrix, whatever the grid.
+template<typename matrix_t>
+void fill_operand(
+        matrix_t & operand,
+        const ::cannon::options & opts,
+        uint32_t stream,
+        size_t first_row,
+        size_t first_col,
+        ::cannon::thread_pool & pool)
+{
+    using namespace ::cannon;
+    typedef typename matrix_t::value_type value_type;
+    switch(opts.operands)
+    {
+    case OPERANDS_RANDOM:
+        fill(operand, random_generator<value_type>(opts.seed, stream), first_row, first_col, pool);
+        break;
+    case OPERANDS_ONES:
+        fill_constant(operand, value_type(1), pool);
+        break;
+    case OPERANDS_IDENTITY:
+        fill_identity(operand, first_row, first_col, pool);
+        break;
+    }
+    if(opts.density < 1.0)
+    {
+        const tile_density keep = {random_generator<double>(opts.seed, STREAM_TILES + stream), opts.density};
+        fill_tiles(operand, keep, opts.tile, first_row, first_col, pool);
+    }
+}
+
 
+// Reads the `block_row`, `block_col` partial of `rows` x `cols` matrix
+// from `path` - maps it from a tiled file, reads it collectively from
+// a flat one.
+template<typename matrix_t>
+bool load_partial(
+        const ::boost::mpi::communicator & comm,
+        const ::std::string & path,
+        matrix_t & partial,
+        size_t rows,
+        size_t cols,
+        size_t block_row,
+        size_t block_col)
+{
+    using namespace ::cannon;
+    if(tiled_file::is_tiled(path.c_str()))
+    {
+        return load_tiled_partial(path, partial, rows, cols, block_row, block_col);
+    }
+    return mpi::load_partial(comm, path, partial, rows, cols, block_row, block_col);
+}
+
+
+// Writes the `block_row`, `block_col` partial of `rows` x `cols` matrix
+// to `opts`' result file in its format.
+template<typename matrix_t>
+bool save_partial(
+        const ::boost::mpi::communicator & comm,
+        const ::cannon::options & opts,
+        const matrix_t & partial,
+        size_t rows,
+        size_t cols,
+        size_t block_row,
+        size_t block_col)
+{
+    using namespace ::cannon;
+    if(opts.result_format == FORMAT_TILED)
+    {
+        return save_tiled_partial(opts.result_file, partial, rows, cols, block_row, block_col);
+    }
+    return mpi::save_partial(comm, opts.result_file, partial, rows, cols, block_row, block_col);
+}
+
+
+// Reads the operands from `opts`' files (those given) into `cart_2d`'s
+// processor's partials, collectively.
+template<typename row_matrix_t, typename col_matrix_t>
+bool load_operands(
+        const ::boost::mpi::communicator & cart_2d,
+        const ::cannon::options & opts,
+        row_matrix_t & left,
+        col_matrix_t & right)
+{
+    using namespace ::cannon;
+    const mpi::coords_type coords = mpi::coords(cart_2d);
+    const size_t block_row = coords[mpi::DIRECTION_HORIZONTAL];
+    const size_t block_col = coords[mpi::DIRECTION_VERTICAL];
+    if(!opts.left_file.empty())
+    {
+        ::debug::info << "Reading " << opts.left_file << "..." << ::std::endl;
+        if(!load_partial(cart_2d, opts.left_file, left,
+                    opts.shape.rows, opts.shape.inner, block_row, block_col))
+        {
+            return false;
+        }
+    }
+    if(!opts.right_file.empty())
+    {
+        ::debug::info << "Reading " << opts.right_file << "..." << ::std::endl;
+        if(!load_partial(cart_2d, opts.right_file, right,
+                    opts.shape.inner, opts.shape.cols, block_row, block_col))
+        {
+            return false;
+        }
+    }
+    return true;
+}
 
-// The type we work with.
-typedef double real_type;
 
-// Storage type - we use unbounded_array because of performance reasons
-// typedef ::boost::numeric::ublas::unbounded_array<real_type> storage_type;
-typedef ::std::vector<real_type> storage_type;
+// Writes `result` to `opts`' result file (if given) collectively, returns
+// the error code of the run.
+template<typename row_matrix_t>
+int save_result(
+        const ::boost::mpi::communicator & cart_2d,
+        const ::cannon::options & opts,
+        const row_matrix_t & result)
+{
+    using namespace ::cannon;
+    if(opts.result_file.empty())
+    {
+        return 0;
+    }
+    ::debug::info << "Writing " << opts.result_file << "..." << ::std::endl;
+    const mpi::coords_type coords = mpi::coords(cart_2d);
+    return save_partial(cart_2d, opts, result, opts.shape.rows, opts.shape.cols,
+            coords[mpi::DIRECTION_HORIZONTAL], coords[mpi::DIRECTION_VERTICAL]) ? 0 : -1;
+}
 
-// The algorithm we work with.
-typedef ::cannon::algorithm::cannon_prod<real_type, storage_type, SIZE, CART_SIZE> cannon_prod_type;
+
+// Events of `opts`' Cannon products: the skew, then every
+// step's products (a tile's each when pipelined) and waits (one per
+// arrived panel at most), and the realign.
+inline size_t trace_capacity(const ::cannon::options & opts)
+{
+    const size_t panels = opts.panels;
+    const size_t step = panels * panels + 2 * panels + 2;
+    return opts.batch * (opts.cart_size * step + 2 * panels + 2);
+}
+
+
+// Writes the trace to `opts`' trace file (if given) collectively.
+inline bool write_trace(const ::cannon::tracer & trace, const ::cannon::options & opts)
+{
+    if(opts.trace_file.empty())
+    {
+        return true;
+    }
+    ::debug::info << "Writing " << opts.trace_file << "..." << ::std::endl;
+    return trace.write(opts.trace_file);
+}
+
+
+// Prints a line of the run's results to the standard output on `comm`'s
+// rank 0, whatever the debug level (the logs may be compiled out, see
+// debug.h).
+inline void report(const ::boost::mpi::communicator & comm, const char * format, ...)
+    __attribute__((format(printf, 2, 3)));
+
+
+inline void report(const ::boost::mpi::communicator & comm, const char * format, ...)
+{
+    if(comm.rank() != 0)
+    {
+        return;
+    }
+    va_list arguments;
+    va_start(arguments, format);
+    ::std::vprintf(format, arguments);
+    va_end(arguments);
+    ::std::fflush(stdout);
+}
+
+
+// Blocks of a Cannon's product, given to the Freivalds' check (see
+// verify.h) and to `run_loop`: every partial is the `block_row`,
+// `block_col` block of its matrix.
+template<typename row_matrix_t, typename col_matrix_t>
+struct cannon_blocks
+{
+    const ::cannon::options * opts;
+    row_matrix_t * result;
+    row_matrix_t * left;
+    col_matrix_t * right;
+    size_t block_row;
+    size_t block_col;
+    template<typename check_t>
+    void operator()(check_t & check) const
+    {
+        check.multiply_result(* result,
+                block_row * result->size1(), block_col * result->size2(), opts->shape.rows);
+        check.multiply(* right,
+                block_row * right->size1(), block_col * right->size2(), opts->shape.inner);
+        check.next();
+        check.multiply(* left,
+                block_row * left->size1(), block_col * left->size2(), opts->shape.rows);
+    }
+};
+
+
+// Blocks of a chained product, distributed as the Cannon's left ones.
+template<typename row_matrix_t>
+struct chain_blocks
+{
+    const ::cannon::options * opts;
+    row_matrix_t * result;
+    const ::std::vector<row_matrix_t *> * operands;
+    size_t block_row;
+    size_t block_col;
+    template<typename check_t>
+    void operator()(check_t & check) const
+    {
+        check.multiply_result(* result,
+                block_row * result->size1(), block_col * result->size2(), opts->shape.rows);
+        for(size_t i = operands->size(); i-- > 0; )
+        {
+            const row_matrix_t & operand = * (* operands)[i];
+            check.multiply(operand,
+                    block_row * operand.size1(), block_col * operand.size2(), opts->shape.rows);
+            if(i > 0)
+            {
+                check.next();
+            }
+        }
+    }
+};
+
+
+// Blocks of a SUMMA product, see `run_summa_product`.
+template<typename row_partials_t, typename col_partials_t, typename row_matrix_t>
+struct summa_blocks
+{
+    const ::cannon::options * opts;
+    const row_matrix_t * result;
+    const row_partials_t * left;
+    const col_partials_t * right;
+    size_t row;
+    size_t col;
+    size_t grid_rows;
+    size_t grid_cols;
+    template<typename check_t>
+    void operator()(check_t & check) const
+    {
+        check.multiply_result(* result, row * result->size1(), col * result->size2(), opts->shape.rows);
+        for(size_t i = 0; i < right->size(); ++i)
+        {
+            check.multiply((* right)[i], (i * grid_rows + row) * (* right)[i].size1(),
+                    col * (* right)[i].size2(), opts->shape.inner);
+        }
+        check.next();
+        for(size_t i = 0; i < left->size(); ++i)
+        {
+            check.multiply((* left)[i], row * (* left)[i].size1(),
+                    (i * grid_cols + col) * (* left)[i].size2(), opts->shape.rows);
+        }
+    }
+};
+
+
+// Checks the product (its `blocks` on `comm`) with `opts.verify`
+// random vectors, if any, and reports the largest relative error.
+// Returns whether it is within the rounding errors of the product (and
+// of both operands, if they were shipped narrowed, with a margin for
+// complex ones' cancellations).
+template<typename value_t, typename blocks_t>
+bool verify_result(
+        const ::boost::mpi::communicator & comm,
+        const ::cannon::options & opts,
+        const blocks_t & blocks)
+{
+    using namespace ::cannon;
+    if(opts.verify == 0)
+    {
+        return true;
+    }
+    double error = 0.0;
+    for(size_t vector = 0; vector < opts.verify; ++vector)
+    {
+        freivalds<value_t> check(comm, opts.shape.cols, opts.seed, STREAM_VERIFY + vector);
+        blocks(check);
+        error = ::std::max(error, check.error());
+    }
+    const size_t products = opts.chain > 1 ? opts.chain - 1 : 1;
+    const double tolerance = freivalds<value_t>::tolerance(opts.shape.inner, products)
+        + 4.0 * transport_epsilon(opts.transport);
+    const bool verified = error <= tolerance;
+    report(comm, "%s: relative error %g, tolerance %g\n",
+            verified ? "Result verified" : "Wrong result", error, tolerance);
+    return verified;
+}
+
+
+// Runs `product` of `blocks`' operands.
+template<typename prod_t, typename row_matrix_t, typename col_matrix_t>
+void run_blocks(prod_t & product, const cannon_blocks<row_matrix_t, col_matrix_t> & blocks)
+{
+    product(* blocks.result, * blocks.left, * blocks.right);
+}
+
+
+template<typename prod_t, typename row_matrix_t>
+void run_blocks(prod_t & product, const chain_blocks<row_matrix_t> & blocks)
+{
+    product(* blocks.result, * blocks.operands);
+}
+
+
+// Runs `product` of every `blocks`' operands, a Cannon's product runs
+// more of them as a batch.
+template<typename prod_t, typename blocks_t>
+void run_blocks(prod_t & product, const ::std::vector<blocks_t> & blocks)
+{
+    for(size_t i = 0; i < blocks.size(); ++i)
+    {
+        run_blocks(product, blocks[i]);
+    }
+}
+
+
+// Blocks of a Cannon's product whose operands are also compressed to
+// `left_tiles` and `right_tiles`, once for the run (see block_sparse.h).
+// The product takes the compressed ones, the check the dense ones.
+template<typename row_matrix_t, typename col_matrix_t, typename row_partial_t, typename col_partial_t>
+struct compressed_blocks
+  : cannon_blocks<row_matrix_t, col_matrix_t>
+{
+    row_partial_t * left_tiles;
+    col_partial_t * right_tiles;
+    compressed_blocks(
+            const cannon_blocks<row_matrix_t, col_matrix_t> & blocks,
+            row_partial_t * left_tiles,
+            col_partial_t * right_tiles)
+      : cannon_blocks<row_matrix_t, col_matrix_t>(blocks),
+        left_tiles(left_tiles),
+        right_tiles(right_tiles)
+    {
+    }
+};
+
+
+template<typename prod_t, typename row_matrix_t, typename col_matrix_t, typename row_partial_t, typename col_partial_t>
+void run_blocks(
+        prod_t & product,
+        const compressed_blocks<row_matrix_t, col_matrix_t, row_partial_t, col_partial_t> & blocks)
+{
+    product.multiply_partials(* blocks.result, * blocks.left_tiles, * blocks.right_tiles);
+}
+
+
+template<typename real_t, typename storage_t, size_t SIZE, size_t CART_SIZE, typename transport_t,
+    typename row_matrix_t, typename col_matrix_t>
+void run_blocks(
+        ::cannon::algorithm::cannon_prod<real_t, storage_t, SIZE, CART_SIZE, transport_t> & product,
+        const ::std::vector<cannon_blocks<row_matrix_t, col_matrix_t> > & blocks)
+{
+    if(blocks.size() == 1)
+    {
+        run_blocks(product, blocks[0]);
+        return;
+    }
+    typename ::cannon::algorithm::cannon_prod<real_t, storage_t, SIZE, CART_SIZE, transport_t>::batch_type
+        batch(blocks.size());
+    for(size_t i = 0; i < blocks.size(); ++i)
+    {
+        batch[i].result = blocks[i].result;
+        batch[i].left = blocks[i].left;
+        batch[i].right = blocks[i].right;
+    }
+    product(batch);
+}
+
+
+// Runs `product` of `blocks`' operands on `comm`, checks every result
+// and writes `trace` (if any) and the first result. Returns the error
+// code of the run.
+template<typename real_t, typename prod_t, typename blocks_t>
+int run_loop(
+        const ::boost::mpi::communicator & comm,
+        const ::cannon::options & opts,
+        prod_t & product,
+        const ::std::vector<blocks_t> & blocks,
+        const ::cannon::tracer * trace = NULL)
+{
+    ::debug::info << "Running the algorithm..." << ::std::endl;
+    run_blocks(product, blocks);
+    bool verified = true;
+    for(size_t i = 0; i < blocks.size(); ++i)
+    {
+        verified = verify_result<real_t>(comm, opts, blocks[i]) && verified;
+    }
+    if((trace != NULL && !write_trace(* trace, opts)) || !verified)
+    {
+        return -1;
+    }
+    return save_result(comm, opts, * blocks[0].result);
+}
+
+
+// A single product.
+template<typename real_t, typename prod_t, typename blocks_t>
+int run_loop(
+        const ::boost::mpi::communicator & comm,
+        const ::cannon::options & opts,
+        prod_t & product,
+        const blocks_t & blocks,
+        const ::cannon::tracer * trace = NULL)
+{
+    return run_loop<real_t>(comm, opts, product, ::std::vector<blocks_t>(1, blocks), trace);
+}
 
 
 // The maintenance function.
+template<typename real_t, size_t SIZE, size_t CART_SIZE>
 int run_product(
         const ::boost::mpi::communicator & cart_2d,
-        const cannon_prod_type::product_function_type local_product);
+        const ::cannon::options & opts,
+        const typename cannon_types<real_t, SIZE, CART_SIZE>::cannon_prod_type::product_function_type local_product,
+        const typename cannon_types<real_t, SIZE, CART_SIZE>::cannon_prod_type::block_product_function_type block_product,
+        ::cannon::thread_pool & pool);
+
+
+// The maintenance function of the SUMMA engine.
+template<typename real_t, size_t SIZE, size_t CART_SIZE>
+int run_summa_product(
+        const ::boost::mpi::communicator & grid_2d,
+        const ::cannon::options & opts,
+        const typename cannon_types<real_t, SIZE, CART_SIZE>::summa_prod_type::product_function_type local_product,
+        ::cannon::thread_pool & pool);
+
+
+// Builds the local product for `real_t` elements and runs it.
+template<typename real_t, size_t SIZE, size_t CART_SIZE>
+int run_typed_product(
+        const ::boost::mpi::communicator & cart_2d,
+        const ::cannon::options & opts,
+        ::cannon::thread_pool & pool)
+{
+    typedef typename cannon_types<real_t, SIZE, CART_SIZE>::storage_type storage_type;
+    const size_t size = partial_shape(cart_2d, opts).rows;
+    if(opts.engine == ::cannon::ENGINE_SUMMA)
+    {
+        return run_summa_product<real_t, SIZE, CART_SIZE>(
+                cart_2d,
+                opts,
+                ::cannon::make_product<real_t, storage_type, SIZE>(opts.product, pool, size),
+                pool);
+    }
+    return run_product<real_t, SIZE, CART_SIZE>(
+            cart_2d,
+            opts,
+            ::cannon::make_product<real_t, storage_type, SIZE>(opts.product, pool, size),
+            ::cannon::make_block_product<real_t>(opts.product, pool),
+            pool);
+}
+
+
+// Runs the precompiled code for `opts`' sizes if they are hot (square
+// partials of a hot size), the `DYNAMIC_SIZE` one otherwise.
+template<typename real_t>
+int run_sized_product(
+        const ::boost::mpi::communicator & cart_2d,
+        const ::cannon::options & opts,
+        ::cannon::thread_pool & pool)
+{
+    const ::cannon::product_shape partial = partial_shape(cart_2d, opts);
+#define CANNON_HOT_SIZE(hot_matrix_size, hot_cart_size) \
+    if(opts.cart_size == (hot_cart_size) \
+            && partial.rows == ::cannon::partial_size((hot_matrix_size), (hot_cart_size)) \
+            && partial.inner == partial.rows \
+            && partial.cols == partial.rows) \
+    { \
+        return run_typed_product<real_t, \
+                ((hot_matrix_size) + (hot_cart_size) - 1) / (hot_cart_size), (hot_cart_size)>( \
+                cart_2d, opts, pool); \
+    }
+    HOT_SIZES(CANNON_HOT_SIZE)
+#undef CANNON_HOT_SIZE
+    return run_typed_product<real_t, ::cannon::DYNAMIC_SIZE, ::cannon::DYNAMIC_SIZE>(cart_2d, opts, pool);
+}
 
 
 int main(int argc, char * * argv)
 {
     ::debug::info << "Setting MPI environment..." << ::std::endl;
     ::boost::mpi::environment env(argc, argv);
+    ::cannon::options opts;
+    opts.matrix_size = MATRIXSIZE;
+    opts.cart_size = CARTSIZE;
+    if(!::cannon::parse_options(argc, argv, opts))
+    {
+        env.abort(-1);
+    }
+    if(!compatible_features(opts))
+    {
+        ::debug::err << "Aborting..." << ::std::endl;
+        env.abort(-1);
+    }
     ::debug::info << "Setting the cartesian communicator..." << ::std::endl;
-    ::boost::mpi::communicator cart_2d = ::cannon::mpi::cart_square_sphere_create<CART_SIZE>();
-    ::debug::info << "Checking amount of processors..." << ::std::endl;
-    ::cannon::mpi::assert_processors<CART_SIZE * CART_SIZE>(cart_2d, env);
-    int error_code = run_product(cart_2d, ::cannon::prod<real_type, storage_type, SIZE>);
+    ::boost::mpi::communicator cart_2d;
+    if(opts.engine == ::cannon::ENGINE_SUMMA)
+    {
+        cart_2d = ::cannon::mpi::cart_grid_create(
+                ::boost::mpi::communicator(), opts.shape.rows, opts.shape.cols);
+    }
+    else if(opts.depth > 1)
+    {
+        if(opts.depth > opts.cart_size)
+        {
+            ::debug::err << "Depth can't exceed " << opts.cart_size << "!\n";
+            ::debug::err << "Aborting..." << ::std::endl;
+            env.abort(-1);
+        }
+        ::debug::info << "Checking amount of processors..." << ::std::endl;
+        ::cannon::mpi::assert_processors(
+                ::boost::mpi::communicator(), env, opts.cart_size * opts.cart_size * opts.depth);
+        cart_2d = ::cannon::mpi::cart_layered_sphere_create(opts.cart_size, opts.depth);
+    }
+    else
+    {
+        ::debug::info << "Checking amount of processors..." << ::std::endl;
+        ::cannon::mpi::assert_processors(
+                ::boost::mpi::communicator(), env, opts.cart_size * opts.cart_size);
+        cart_2d = ::cannon::mpi::cart_square_sphere_create(opts.cart_size);
+    }
+    const ::cannon::kernel_variant kernel = opts.product.kernel == ::cannon::KERNEL_AUTO
+        ? ::cannon::detect_kernel()
+        : opts.product.kernel;
+    opts.product.kernel = kernel;
+    if(!::cannon::kernel_supported(kernel))
+    {
+        ::debug::err << "This CPU can't run " << ::cannon::kernel_name(kernel) << " kernel!\n";
+        ::debug::err << "Aborting..." << ::std::endl;
+        env.abort(-1);
+    }
+    ::debug::info << "Using " << ::cannon::kernel_name(kernel) << " kernel..." << ::std::endl;
+    ::debug::info << "Starting " << opts.threads << " threads..." << ::std::endl;
+    ::cannon::thread_pool pool(opts.threads);
+    int error_code = 0;
+    switch(opts.element)
+    {
+    case ::cannon::ELEMENT_DOUBLE:
+        error_code = run_sized_product<double>(cart_2d, opts, pool);
+        break;
+    case ::cannon::ELEMENT_FLOAT:
+        error_code = run_sized_product<float>(cart_2d, opts, pool);
+        break;
+    case ::cannon::ELEMENT_COMPLEX_DOUBLE:
+        error_code = run_sized_product< ::std::complex<double> >(cart_2d, opts, pool);
+        break;
+    case ::cannon::ELEMENT_COMPLEX_FLOAT:
+        error_code = run_sized_product< ::std::complex<float> >(cart_2d, opts, pool);
+        break;
+    }
+    return error_code;
+}
+
+
+// Runs `run_product`'s operands' product with the partials shifted as
+// `TRANSPORT` elements (see transport.h).
+template<typename real_t, ::cannon::transport_kind TRANSPORT, size_t SIZE, size_t CART_SIZE>
+inline int run_narrow_product(
+        const ::boost::mpi::communicator & cart_2d,
+        const ::cannon::options & opts,
+        typename cannon_types<real_t, SIZE, CART_SIZE>::cannon_prod_type::row_matrix_type & result,
+        typename cannon_types<real_t, SIZE, CART_SIZE>::cannon_prod_type::row_matrix_type & left,
+        typename cannon_types<real_t, SIZE, CART_SIZE>::cannon_prod_type::col_matrix_type & right,
+        size_t block_row,
+        size_t block_col,
+        ::cannon::thread_pool & pool)
+{
+    using namespace ::cannon;
+    typedef transport_of<real_t, TRANSPORT> transport;
+    typedef typename cannon_types<real_t, SIZE, CART_SIZE>::storage_type storage_type;
+    typedef algorithm::cannon_prod<real_t, storage_type, SIZE, CART_SIZE, typename transport::type>
+        cannon_narrow_prod_type;
+    if(!transport::SUPPORTED)
+    {
+        ::debug::err << "Can't ship " << element_name(opts.element) << " partials as "
+            << transport_name(TRANSPORT) << "!" << ::std::endl;
+        return -1;
+    }
+    ::debug::info << "Initiating the algorithm (" << transport_name(TRANSPORT) << " transport)..." << ::std::endl;
+    typename cannon_narrow_prod_type::row_partial_type row_temp(left.size1(), left.size2());
+    typename cannon_narrow_prod_type::col_partial_type col_temp(right.size1(), right.size2());
+    cannon_narrow_prod_type cannon_product(
+            cart_2d, typename cannon_narrow_prod_type::product_function_type(), row_temp, col_temp, opts.panels,
+            make_transport_block_product<real_t, typename transport::type>(opts.product, pool));
+    cannon_product.narrow_copies(make_narrow<real_t, typename transport::type>(opts.product));
+    tracer trace(cart_2d, opts.trace_file.empty() ? 0 : trace_capacity(opts));
+    if(!opts.trace_file.empty())
+    {
+        cannon_product.trace_steps(& trace);
+    }
+    const cannon_blocks<typename cannon_narrow_prod_type::row_matrix_type,
+          typename cannon_narrow_prod_type::col_matrix_type>
+        blocks = {& opts, & result, & left, & right, block_row, block_col};
+    const int error_code = run_loop<real_t>(cart_2d, opts, cannon_product, blocks, & trace);
+    rounding_stats rounding = cannon_product.rounding();
+    rounding.all_reduce(cart_2d);
+    report(cart_2d, "Operands rounded to %s: relative error %g at most, %g in norm\n",
+            transport_name(TRANSPORT), rounding.max_error, rounding.norm_error());
+    return error_code;
+}
+
+
+// `prod_t`'s local product of block-sparse partials.
+template<typename prod_t>
+struct sparse_local_product
+{
+    typename ::cannon::block_sparse_product_function<typename prod_t::real_type>::type product;
+    void operator()(
+            typename prod_t::row_matrix_type & result,
+            typename prod_t::row_partial_type & left,
+            typename prod_t::col_partial_type & right) const
+        throw()
+    {
+        product(prod_t::row_matrix_concept::begin(& result), result.size2(), left, right);
+    }
+};
+
+
+// Runs `run_product`'s operands' product on block-sparse partials (see
+// block_sparse.h).
+template<typename real_t, size_t SIZE, size_t CART_SIZE>
+inline int run_sparse_product(
+        const ::boost::mpi::communicator & cart_2d,
+        const ::cannon::options & opts,
+        typename cannon_types<real_t, SIZE, CART_SIZE>::cannon_prod_type::row_matrix_type & result,
+        typename cannon_types<real_t, SIZE, CART_SIZE>::cannon_prod_type::row_matrix_type & left,
+        typename cannon_types<real_t, SIZE, CART_SIZE>::cannon_prod_type::col_matrix_type & right,
+        size_t block_row,
+        size_t block_col,
+        ::cannon::thread_pool & pool)
+{
+    using namespace ::cannon;
+    typedef typename cannon_types<real_t, SIZE, CART_SIZE>::storage_type storage_type;
+    typedef algorithm::cannon_prod<real_t, storage_type, SIZE, CART_SIZE, block_sparse_transport<real_t> >
+        cannon_sparse_prod_type;
+    ::debug::info << "Initiating the algorithm (" << opts.tile << " x " << opts.tile << " tiles)..." << ::std::endl;
+    typename cannon_sparse_prod_type::row_partial_type row_temp(left.size1(), left.size2(), opts.tile);
+    typename cannon_sparse_prod_type::col_partial_type col_temp(right.size1(), right.size2(), opts.tile);
+    const sparse_local_product<cannon_sparse_prod_type> local_product = {
+        make_block_sparse_product<real_t>(opts.product, pool)};
+    cannon_sparse_prod_type cannon_product(cart_2d, local_product, row_temp, col_temp);
+    tracer trace(cart_2d, opts.trace_file.empty() ? 0 : trace_capacity(opts));
+    if(!opts.trace_file.empty())
+    {
+        cannon_product.trace_steps(& trace);
+    }
+    ::debug::info << "Compressing the operands..." << ::std::endl;
+    typename cannon_sparse_prod_type::row_partial_type left_tiles(left.size1(), left.size2(), opts.tile);
+    typename cannon_sparse_prod_type::col_partial_type right_tiles(right.size1(), right.size2(), opts.tile);
+    left_tiles.compress(left);
+    right_tiles.compress(right);
+    const cannon_blocks<typename cannon_sparse_prod_type::row_matrix_type,
+          typename cannon_sparse_prod_type::col_matrix_type>
+        dense_blocks = {& opts, & result, & left, & right, block_row, block_col};
+    const compressed_blocks<typename cannon_sparse_prod_type::row_matrix_type,
+          typename cannon_sparse_prod_type::col_matrix_type,
+          typename cannon_sparse_prod_type::row_partial_type,
+          typename cannon_sparse_prod_type::col_partial_type>
+        blocks(dense_blocks, & left_tiles, & right_tiles);
+    const int error_code = run_loop<real_t>(cart_2d, opts, cannon_product, blocks, & trace);
+    double density = cannon_product.density();
+    MPI_Allreduce(MPI_IN_PLACE, & density, 1, MPI_DOUBLE, MPI_SUM, cart_2d);
+    report(cart_2d, "Non-zero tiles: %g of the operands'\n", density / cart_2d.size());
     return error_code;
 }
 
 
+template<typename real_t, size_t SIZE, size_t CART_SIZE>
 inline int run_product(
         const ::boost::mpi::communicator & cart_2d,
-        const cannon_prod_type::product_function_type local_product)
+        const ::cannon::options & opts,
+        const typename cannon_types<real_t, SIZE, CART_SIZE>::cannon_prod_type::product_function_type local_product,
+        const typename cannon_types<real_t, SIZE, CART_SIZE>::cannon_prod_type::block_product_function_type block_product,
+        ::cannon::thread_pool & pool)
 {
     using namespace ::cannon;
+    typedef typename cannon_types<real_t, SIZE, CART_SIZE>::cannon_prod_type cannon_prod_type;
+    const product_shape partial = partial_shape(cart_2d, opts);
     ::debug::info << "Creating matrices..." << ::std::endl;
-    cannon_prod_type::row_matrix_type left(SIZE, SIZE);
-    cannon_prod_type::col_matrix_type right(SIZE, SIZE);
-    cannon_prod_type::row_matrix_type result(SIZE, SIZE);
-    cannon_prod_type::row_matrix_type row_temp(SIZE, SIZE);
-    cannon_prod_type::col_matrix_type col_temp(SIZE, SIZE);
-    // Generate pseudo-random values.
+    typename cannon_prod_type::row_matrix_type left(partial.rows, partial.inner);
+    typename cannon_prod_type::col_matrix_type right(partial.inner, partial.cols);
+    typename cannon_prod_type::row_matrix_type result(partial.rows, partial.cols);
+    typename cannon_prod_type::row_matrix_type row_temp(partial.rows, partial.inner);
+    typename cannon_prod_type::col_matrix_type col_temp(partial.inner, partial.cols);
+    // Generate pseudo-random values, the partials of global matrices.
     ::debug::info << "Filling matrices with random values..." << ::std::endl;
-    random_generator<real_type> generator;
-    fill(left, generator);
-    fill(right, generator);
-    fill(result, & constant<real_type, 0>);
+    const mpi::coords_type coords = mpi::coords(cart_2d);
+    const size_t block_row = coords[mpi::DIRECTION_HORIZONTAL];
+    const size_t block_col = coords[mpi::DIRECTION_VERTICAL];
+    fill_operand(left, opts, STREAM_LEFT,
+            block_row * partial.rows, block_col * partial.inner, pool);
+    fill_operand(right, opts, STREAM_RIGHT,
+            block_row * partial.inner, block_col * partial.cols, pool);
+    fill_zero(result, pool);
+    // Matrix sizes need not be multiples of the cart size, the edge
+    // partials are padded with zeros.
+    fill_padding(left,
+            partial_extent(opts.shape.rows, partial.rows, block_row),
+            partial_extent(opts.shape.inner, partial.inner, block_col));
+    fill_padding(right,
+            partial_extent(opts.shape.inner, partial.inner, block_row),
+            partial_extent(opts.shape.cols, partial.cols, block_col));
+    // Operands given in files replace the random ones. The 2.5D algorithm
+    // takes them (and gives the result) on layer 0 only.
+    if(opts.depth > 1)
+    {
+        typedef typename cannon_types<real_t, SIZE, CART_SIZE>::cannon_25d_prod_type cannon_25d_prod_type;
+        const ::boost::mpi::communicator layer_2d = mpi::cart_layer<false>(cart_2d);
+        const bool base_layer = mpi::cart_layer<true>(cart_2d).rank() == 0;
+        const bool loaded = !base_layer || load_operands(layer_2d, opts, left, right);
+        if(!::boost::mpi::all_reduce(cart_2d, loaded, ::std::logical_and<bool>()))
+        {
+            return -1;
+        }
+        ::debug::info << "Initiating the 2.5D algorithm..." << ::std::endl;
+        cannon_25d_prod_type cannon_product(
+                cart_2d, local_product, row_temp, col_temp, opts.panels, block_product);
+        if(!base_layer)
+        {
+            cannon_product(result, left, right);
+            return 0;
+        }
+        const cannon_blocks<typename cannon_prod_type::row_matrix_type, typename cannon_prod_type::col_matrix_type>
+            blocks = {& opts, & result, & left, & right, block_row, block_col};
+        return run_loop<real_t>(layer_2d, opts, cannon_product, blocks);
+    }
+    if(!load_operands(cart_2d, opts, left, right))
+    {
+        return -1;
+    }
+    if(opts.transport == TRANSPORT_FLOAT)
+    {
+        return run_narrow_product<real_t, TRANSPORT_FLOAT, SIZE, CART_SIZE>(
+                cart_2d, opts, result, left, right, block_row, block_col, pool);
+    }
+    if(opts.transport == TRANSPORT_BFLOAT16)
+    {
+        return run_narrow_product<real_t, TRANSPORT_BFLOAT16, SIZE, CART_SIZE>(
+                cart_2d, opts, result, left, right, block_row, block_col, pool);
+    }
+    if(opts.partials == PARTIALS_BLOCK_SPARSE)
+    {
+        return run_sparse_product<real_t, SIZE, CART_SIZE>(
+                cart_2d, opts, result, left, right, block_row, block_col, pool);
+    }
+    if(opts.chain > 1)
+    {
+        typedef typename cannon_types<real_t, SIZE, CART_SIZE>::chain_prod_type chain_prod_type;
+        // `left` times `chain - 1` operands like `right`, all of them row-major.
+        ::debug::info << "Creating " << opts.chain << " operands..." << ::std::endl;
+        ::std::vector<typename chain_prod_type::row_matrix_type> operands(opts.chain - 1, left);
+        typename chain_prod_type::operands_type chain(1, & left);
+        for(size_t i = 0; i < operands.size(); ++i)
+        {
+            fill_operand(operands[i], opts, STREAM_CHAIN + i,
+                    block_row * partial.rows, block_col * partial.cols, pool);
+            fill_padding(operands[i],
+                    partial_extent(opts.shape.rows, partial.rows, block_row),
+                    partial_extent(opts.shape.cols, partial.cols, block_col));
+            chain.push_back(& operands[i]);
+        }
+        ::debug::info << "Initiating the chain..." << ::std::endl;
+        chain_prod_type chain_product(cart_2d, local_product, opts.panels, block_product);
+        const chain_blocks<typename chain_prod_type::row_matrix_type>
+            blocks = {& opts, & result, & chain, block_row, block_col};
+        return run_loop<real_t>(cart_2d, opts, chain_product, blocks);
+    }
     // Initiate the algorithm.
     ::debug::info << "Initiating the algorithm..." << ::std::endl;
-    cannon_prod_type cannon_product(cart_2d, local_product, row_temp, col_temp);
+    cannon_prod_type cannon_product(
+            cart_2d, local_product, row_temp, col_temp, opts.panels, block_product);
+    tracer trace(cart_2d, opts.trace_file.empty() ? 0 : trace_capacity(opts));
+    if(!opts.trace_file.empty())
+    {
+        cannon_product.trace_steps(& trace);
+    }
+    // Copies of the operands, every product of a batch has its own.
+    if(opts.batch > 1)
+    {
+        ::debug::info << "Creating " << opts.batch << " products..." << ::std::endl;
+    }
+    ::std::vector<typename cannon_prod_type::row_matrix_type> lefts(opts.batch - 1, left);
+    ::std::vector<typename cannon_prod_type::col_matrix_type> rights(opts.batch - 1, right);
+    ::std::vector<typename cannon_prod_type::row_matrix_type> results(opts.batch - 1, result);
+    typedef cannon_blocks<typename cannon_prod_type::row_matrix_type, typename cannon_prod_type::col_matrix_type>
+        blocks_type;
+    const blocks_type first = {& opts, & result, & left, & right, block_row, block_col};
+    ::std::vector<blocks_type> blocks(1, first);
+    for(size_t i = 0; i < results.size(); ++i)
+    {
+        const blocks_type next = {& opts, & results[i], & lefts[i], & rights[i], block_row, block_col};
+        blocks.push_back(next);
+    }
+    return run_loop<real_t>(cart_2d, opts, cannon_product, blocks, & trace);
+}
+
+
+template<typename real_t, size_t SIZE, size_t CART_SIZE>
+inline int run_summa_product(
+        const ::boost::mpi::communicator & grid_2d,
+        const ::cannon::options & opts,
+        const typename cannon_types<real_t, SIZE, CART_SIZE>::summa_prod_type::product_function_type local_product,
+        ::cannon::thread_pool & pool)
+{
+    using namespace ::cannon;
+    typedef typename cannon_types<real_t, SIZE, CART_SIZE>::summa_prod_type summa_prod_type;
+    const product_shape partial = partial_shape(grid_2d, opts);
+    ::debug::info << "Initiating the algorithm..." << ::std::endl;
+    summa_prod_type summa_product(grid_2d, local_product, partial.rows, partial.inner, partial.cols);
+    ::debug::info << "Creating matrices..." << ::std::endl;
+    typename summa_prod_type::row_partials_type left(summa_product.left_partials());
+    typename summa_prod_type::col_partials_type right(summa_product.right_partials());
+    typename summa_prod_type::row_matrix_type result(partial.rows, partial.cols);
+    // Generate pseudo-random values.
+    ::debug::info << "Filling matrices with random values..." << ::std::endl;
+    // Partials past the matrix size are padded with zeros, see `run_product`.
+    const mpi::coords_type coords = mpi::coords(grid_2d);
+    const mpi::coords_type dims = mpi::dims(grid_2d);
+    const size_t row = coords[mpi::DIRECTION_VERTICAL];
+    const size_t col = coords[mpi::DIRECTION_HORIZONTAL];
+    for(size_t i = 0; i < left.size(); ++i)
+    {
+        left[i].resize(partial.rows, partial.inner, false);
+        fill_operand(left[i], opts, STREAM_LEFT,
+                row * partial.rows, (i * dims[mpi::DIRECTION_HORIZONTAL] + col) * partial.inner, pool);
+        fill_padding(left[i],
+                partial_extent(opts.shape.rows, partial.rows, row),
+                partial_extent(opts.shape.inner, partial.inner, i * dims[mpi::DIRECTION_HORIZONTAL] + col));
+    }
+    for(size_t i = 0; i < right.size(); ++i)
+    {
+        right[i].resize(partial.inner, partial.cols, false);
+        fill_operand(right[i], opts, STREAM_RIGHT,
+                (i * dims[mpi::DIRECTION_VERTICAL] + row) * partial.inner, col * partial.cols, pool);
+        fill_padding(right[i],
+                partial_extent(opts.shape.inner, partial.inner, i * dims[mpi::DIRECTION_VERTICAL] + row),
+                partial_extent(opts.shape.cols, partial.cols, col));
+    }
+    fill_zero(result, pool);
+    for(size_t i = 0; i < left.size() && !opts.left_file.empty(); ++i)
+    {
+        if(!load_partial(grid_2d, opts.left_file, left[i],
+                    opts.shape.rows, opts.shape.inner, row, i * dims[mpi::DIRECTION_HORIZONTAL] + col))
+        {
+            return -1;
+        }
+    }
+    for(size_t i = 0; i < right.size() && !opts.right_file.empty(); ++i)
+    {
+        if(!load_partial(grid_2d, opts.right_file, right[i],
+                    opts.shape.inner, opts.shape.cols, i * dims[mpi::DIRECTION_VERTICAL] + row, col))
+        {
+            return -1;
+        }
+    }
     // Run the algorithm.
+    const summa_blocks<typename summa_prod_type::row_partials_type, typename summa_prod_type::col_partials_type,
+          typename summa_prod_type::row_matrix_type> blocks = {
+        & opts, & result, & left, & right, row, col,
+        static_cast<size_t>(dims[mpi::DIRECTION_VERTICAL]), static_cast<size_t>(dims[mpi::DIRECTION_HORIZONTAL])};
     ::debug::info << "Running the algorithm..." << ::std::endl;
-    cannon_product(result, left, right);
-    return 0;
+    summa_product(result, left, right);
+    const bool verified = verify_result<real_t>(grid_2d, opts, blocks);
+    if(!verified)
+    {
+        return -1;
+    }
+    if(opts.result_file.empty())
+    {
+        return 0;
+    }
+    return save_partial(grid_2d, opts, result,
+            opts.shape.rows, opts.shape.cols, row, col) ? 0 : -1;
 }
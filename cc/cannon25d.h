@@ -0,0 +1,205 @@
+// Author: Cezary Bartoszuk
+// Email: cbart@students.mimuw.edu.pl
+
+#ifndef __CANNON__CANNON25D__H__
+#define __CANNON__CANNON25D__H__
+
+
+#include <algorithm>
+#include <boost/array.hpp>
+#include <boost/mpi/communicator.hpp>
+#include "algorithm.h"
+#include "mpi.h"
+#include "datatype.h"
+#include "debug.h"
+
+
+namespace cannon
+{
+namespace algorithm
+{
+
+
+// 2.5D (communication avoiding) Cannon's algorithm on `depth` layers
+// of `CART_SIZE` x `CART_SIZE` square spheres
+// (see `mpi::cart_layered_sphere_create`).
+// The operands are given on layer 0 and replicated to the other
+// layers, layer `l` runs steps `l * CART_SIZE / depth` up to (but
+// without) `(l + 1) * CART_SIZE / depth` of the Cannon's algorithm
+// and the partial results are summed up on layer 0.
+// Every layer shifts its partials only `CART_SIZE / depth` times.
+// `SIZE` and `CART_SIZE` may be `DYNAMIC_SIZE` (and the partials
+// rectangular) as in `cannon_prod`.
+template<typename real_t, typename storage_t, size_t SIZE, size_t CART_SIZE>
+class cannon_25d_prod
+{
+public:
+    typedef cannon_prod<real_t, storage_t, SIZE, CART_SIZE> layer_prod_type;
+    typedef typename layer_prod_type::real_type real_type;
+    typedef typename layer_prod_type::row_matrix_concept row_matrix_concept;
+    typedef typename layer_prod_type::row_matrix_type row_matrix_type;
+    typedef typename layer_prod_type::col_matrix_concept col_matrix_concept;
+    typedef typename layer_prod_type::col_matrix_type col_matrix_type;
+    typedef typename layer_prod_type::product_function_type product_function_type;
+    typedef typename layer_prod_type::block_product_function_type block_product_function_type;
+    typedef typename layer_prod_type::communicator_type communicator_type;
+private:
+    // Layer the operands and the result live on.
+    static const size_t ROOT_LAYER = 0;
+    const communicator_type layer_2d;
+    const communicator_type across;
+    // Used only for `DYNAMIC_SIZE`, see `rows()`, `inner()`, `cols()`
+    // and `cart_size()`.
+    const size_t runtime_rows;
+    const size_t runtime_inner;
+    const size_t runtime_cols;
+    const size_t runtime_cart_size;
+    const size_t depth;
+    const size_t layer;
+    layer_prod_type layer_product;
+public:
+    // Creates the algorithm framework on `cart_3d` layered topology,
+    // the arguments are passed on to every layer's `cannon_prod`.
+    cannon_25d_prod(
+            const communicator_type & cart_3d,
+            product_function_type local_product,
+            row_matrix_type & row_temp,
+            col_matrix_type & col_temp,
+            size_t panels = 1,
+            block_product_function_type block_product = block_product_function_type())
+        throw();
+    ~cannon_25d_prod()
+        throw();
+    // Performs the multiplication.
+    //   result += first * second
+    // The arguments are meaningful on layer 0 only, other layers
+    // use them as scratch (`result` including). `realign` is
+    // as in `cannon_prod` and only concerns layer 0.
+    void operator()(
+            row_matrix_type & result,
+            row_matrix_type & left,
+            col_matrix_type & right,
+            bool realign = true)
+        throw();
+private:
+    size_t rows() const
+        throw();
+    size_t inner() const
+        throw();
+    size_t cols() const
+        throw();
+    size_t cart_size() const
+        throw();
+    size_t first_step(size_t layer) const
+        throw();
+};
+
+
+template<typename real_t, typename storage_t, size_t SIZE, size_t CART_SIZE>
+cannon_25d_prod<real_t, storage_t, SIZE, CART_SIZE>::cannon_25d_prod(
+        const communicator_type & cart_3d,
+        product_function_type local_product,
+        row_matrix_type & row_temp,
+        col_matrix_type & col_temp,
+        size_t panels,
+        block_product_function_type block_product)
+    throw()
+  : layer_2d(mpi::cart_layer<false>(cart_3d)),
+    across(mpi::cart_layer<true>(cart_3d)),
+    runtime_rows(row_temp.size1()),
+    runtime_inner(row_temp.size2()),
+    runtime_cols(col_temp.size2()),
+    runtime_cart_size(mpi::dims(layer_2d)[mpi::DIRECTION_VERTICAL]),
+    depth(across.size()),
+    layer(across.rank()),
+    layer_product(
+            layer_2d, local_product, row_temp, col_temp, panels, block_product,
+            first_step(layer),
+            first_step(layer + 1) - first_step(layer))
+{
+}
+
+
+template<typename real_t, typename storage_t, size_t SIZE, size_t CART_SIZE>
+cannon_25d_prod<real_t, storage_t, SIZE, CART_SIZE>::~cannon_25d_prod()
+    throw()
+{
+}
+
+
+// Replication and reduction are collectives across the layers,
+// the layer products in between only talk within their layer.
+template<typename real_t, typename storage_t, size_t SIZE, size_t CART_SIZE>
+void cannon_25d_prod<real_t, storage_t, SIZE, CART_SIZE>::operator()(
+        row_matrix_type & result,
+        row_matrix_type & left,
+        col_matrix_type & right,
+        bool realign)
+    throw()
+{
+    const MPI_Datatype datatype = ::boost::mpi::get_mpi_datatype<real_type>(real_type());
+    const int count = rows() * cols();
+    ::debug::info << "Replicating partials.\n" << ::std::flush;
+    ::boost::array<MPI_Request, 2> requests;
+    MPI_Ibcast(row_matrix_concept::begin(& left), rows() * inner(), datatype,
+            ROOT_LAYER, across, & requests[0]);
+    MPI_Ibcast(col_matrix_concept::begin(& right), inner() * cols(), datatype,
+            ROOT_LAYER, across, & requests[1]);
+    if(layer != ROOT_LAYER)
+    {
+        real_type * first = row_matrix_concept::begin(& result);
+        ::std::fill(first, first + count, real_type());
+    }
+    MPI_Waitall(requests.size(), requests.begin(), MPI_STATUSES_IGNORE);
+    layer_product(result, left, right, realign && layer == ROOT_LAYER);
+    ::debug::info << "Reducing results.\n" << ::std::flush;
+    real_type * sum = row_matrix_concept::begin(& result);
+    MPI_Reduce(layer == ROOT_LAYER ? MPI_IN_PLACE : sum, sum, count, datatype, MPI_SUM, ROOT_LAYER, across);
+}
+
+
+template<typename real_t, typename storage_t, size_t SIZE, size_t CART_SIZE>
+inline size_t cannon_25d_prod<real_t, storage_t, SIZE, CART_SIZE>::rows() const
+    throw()
+{
+    return actual_size<SIZE>(runtime_rows);
+}
+
+
+template<typename real_t, typename storage_t, size_t SIZE, size_t CART_SIZE>
+inline size_t cannon_25d_prod<real_t, storage_t, SIZE, CART_SIZE>::inner() const
+    throw()
+{
+    return actual_size<SIZE>(runtime_inner);
+}
+
+
+template<typename real_t, typename storage_t, size_t SIZE, size_t CART_SIZE>
+inline size_t cannon_25d_prod<real_t, storage_t, SIZE, CART_SIZE>::cols() const
+    throw()
+{
+    return actual_size<SIZE>(runtime_cols);
+}
+
+
+template<typename real_t, typename storage_t, size_t SIZE, size_t CART_SIZE>
+inline size_t cannon_25d_prod<real_t, storage_t, SIZE, CART_SIZE>::cart_size() const
+    throw()
+{
+    return actual_size<CART_SIZE>(runtime_cart_size);
+}
+
+
+template<typename real_t, typename storage_t, size_t SIZE, size_t CART_SIZE>
+inline size_t cannon_25d_prod<real_t, storage_t, SIZE, CART_SIZE>::first_step(size_t layer) const
+    throw()
+{
+    return layer * cart_size() / depth;
+}
+
+
+}  // namespace algorithm
+}  // namespace cannon
+
+
+#endif
@@ -1,7 +1,15 @@
 #!/bin/sh
+# Hybrid mode: set RANKS, GRID, SIZE, RANKS_PER_NODE and THREADS (per rank), e.g.
+#   qsub -v RANKS=16,GRID=4,SIZE=8192,RANKS_PER_NODE=1,THREADS=4 cannon.pbs
+# (runs with --grid=GRID, which needs GRID*GRID == RANKS, and --size=SIZE,
+# the binary's MATRIXSIZE if not set).
+RANKS=${RANKS:-64}
+GRID=${GRID:-8}
+RANKS_PER_NODE=${RANKS_PER_NODE:-4}
+THREADS=${THREADS:-1}
 ulimit -s unlimited
 cat ${PBS_NODEFILE} | sort | uniq > /home/users/cbart/par_lab_2011/nodes
 export BOOST_LIBS=/home/users/cbart/lib
 export LD_LIBRARY_PATH=${LD_LIBRARY_PATH}:${BOOST_LIBS}
 export LD_RUN_PATH=${LD_RUN_PATH}:${BOOST_LIBS}
-time mpiexec --mca btl self,openib -n 64 --machinefile /home/users/cbart/par_lab_2011/nodes /home/users/cbart/par_lab_2011/cc/cannon
+time mpiexec --mca btl self,openib -n ${RANKS} -npernode ${RANKS_PER_NODE} --machinefile /home/users/cbart/par_lab_2011/nodes /home/users/cbart/par_lab_2011/cc/cannon --grid=${GRID} ${SIZE:+--size=${SIZE}} --threads=${THREADS}
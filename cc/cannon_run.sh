@@ -1,3 +1,4 @@
 #!/bin/sh
+# Usage: cannon_run.sh RANKS [THREADS_PER_RANK]
 ulimit -s unlimited
-time mpiexec -n $1 cannon
+time mpiexec -n $1 cannon --threads=${2:-1}
@@ -0,0 +1,485 @@
+// Author: Cezary Bartoszuk
+// Email: cbart@students.mimuw.edu.pl
+
+#ifndef __CANNON__CHAIN__H__
+#define __CANNON__CHAIN__H__
+
+
+#include <algorithm>
+#include <limits>
+#include <utility>
+#include <vector>
+#include <boost/shared_ptr.hpp>
+#include <boost/numeric/ublas/matrix_expression.hpp>
+#include "algorithm.h"
+#include "debug.h"
+#include "mpi.h"
+
+
+namespace cannon
+{
+namespace algorithm
+{
+namespace
+{
+
+
+// Operand without a col-major copy, see `chain_prod::copy_index`.
+static const size_t CHAIN_NOT_COPIED = static_cast<size_t>(-1);
+
+// Side of the square tiles `chain_prod::relayout` copies one by one,
+// so that both layouts' lines of a tile stay in the cache.
+static const size_t CHAIN_RELAYOUT_TILE = 32;
+
+
+}  // namespace (unnamed)
+
+
+// Chained product of distributed matrices on `cannon_prod`:
+//   result += operands[0] * operands[1] * ... * operands[n - 1]
+// Every operand is a row-major partial distributed as the left ones (and
+// the results) of `cannon_prod`. The operands are skewed in place by the
+// products that take them and put back before the call returns.
+// Intermediate products are never gathered nor copied: a product's
+// result is distributed as a left operand, so the next product takes it
+// in place and doesn't realign it afterwards. A right intermediate is
+// computed col-major right away, as its transposition
+//   (X * Y)^T = Y^T * X^T
+// on the transposed cart (see `mpi::cart_transposed`), where a col-major
+// `Y` is the row-major `Y^T` and a row-major `X` the col-major `X^T`. The
+// leaves used as right operands are copied to the col-major layout
+// locally, once per call (the same operand given more than once, e.g.
+// `A` of `A * A * A * X`, is copied once), and the copies are realigned
+// only for the products that use them again.
+// Every product still skews its operands from the plain distribution,
+// the results aren't left in the skewed one the next product starts
+// from.
+// There's one `cannon_prod` (with its temp partials and persistent
+// requests) per partial shape and cart, reused by all the products of
+// that shape and by the following calls.
+// The order of the products is planned as the matrix chain problem on
+// the partial shapes: a product costs its flops plus the layout copy of
+// its right operand if it is a leaf.
+template<typename real_t, typename storage_t, size_t SIZE, size_t CART_SIZE>
+class chain_prod
+{
+public:
+    typedef cannon_prod<real_t, storage_t, SIZE, CART_SIZE> product_type;
+    typedef typename product_type::real_type real_type;
+    typedef typename product_type::row_matrix_concept row_matrix_concept;
+    typedef typename product_type::row_matrix_type row_matrix_type;
+    typedef typename product_type::col_matrix_concept col_matrix_concept;
+    typedef typename product_type::col_matrix_type col_matrix_type;
+    typedef typename product_type::product_function_type product_function_type;
+    typedef typename product_type::block_product_function_type block_product_function_type;
+    typedef typename product_type::communicator_type communicator_type;
+    typedef ::std::vector<row_matrix_type *> operands_type;
+private:
+    // A product of `rows` x `inner` and `inner` x `cols` partials, with
+    // the temps it reuses, on the transposed cart if `transposed`.
+    struct shaped_product
+    {
+        row_matrix_type row_temp;
+        col_matrix_type col_temp;
+        bool transposed;
+        ::boost::shared_ptr<product_type> product;
+    };
+    const communicator_type & cart_2d;
+    const communicator_type transposed_cart;
+    const product_function_type local_product;
+    const size_t panels;
+    const block_product_function_type block_product;
+    // Planned order: operands `i..j` are split after `split[i * count + j]`.
+    size_t count;
+    ::std::vector<size_t> split;
+    // Col-major copies of the operands used as right ones, by operand
+    // (`CHAIN_NOT_COPIED` if it has none), and how many products are
+    // still to use each copy.
+    ::std::vector<size_t> copy_index;
+    ::std::vector<col_matrix_type> copies;
+    ::std::vector<size_t> copy_uses;
+    ::std::vector< ::boost::shared_ptr<shaped_product> > products;
+public:
+    // Creates the chain framework, every product is a `cannon_prod`
+    // with the given arguments.
+    chain_prod(
+            const communicator_type & cart_2d,
+            product_function_type local_product,
+            size_t panels = 1,
+            block_product_function_type block_product = block_product_function_type())
+        throw();
+    ~chain_prod()
+        throw();
+    // Performs the chained multiplication.
+    //   result += operands[0] * ... * operands[n - 1]
+    void operator()(
+            row_matrix_type & result,
+            const operands_type & operands)
+        throw();
+private:
+    // Plans the order of the products of `operands`.
+    void plan(const operands_type & operands)
+        throw();
+    // Makes the col-major copies of the operands used as right ones.
+    void copy_right_operands(const operands_type & operands)
+        throw();
+    // result += operands[first] * ... * operands[last]
+    // (at least two operands), `result` is row- or col-major.
+    template<typename result_t>
+    void multiply(
+            result_t & result,
+            const operands_type & operands,
+            size_t first,
+            size_t last)
+        throw();
+    // result += left * right
+    void product_into(
+            row_matrix_type & result,
+            row_matrix_type & left,
+            col_matrix_type & right,
+            int realign)
+        throw();
+    // The same into a col-major `result`, as the transposed product.
+    void product_into(
+            col_matrix_type & result,
+            row_matrix_type & left,
+            col_matrix_type & right,
+            int realign)
+        throw();
+    // The product of `left` and `right` partials' shape (on the
+    // transposed cart if `transposed`), created at the first use.
+    product_type & product_of(
+            const row_matrix_type & left,
+            const col_matrix_type & right,
+            bool transposed)
+        throw();
+    // Zeroed `rows` x `cols` partial.
+    template<typename matrix_t>
+    static void make_zero(matrix_t & matrix, size_t rows, size_t cols)
+        throw();
+    // `right` becomes the col-major copy of `left`.
+    static void relayout(col_matrix_type & right, const row_matrix_type & left)
+        throw();
+    // `view` (with no elements) takes over `matrix`'s elements as the
+    // partial of its transposition in the other layout, no copy made.
+    // The same call the other way round gives them back.
+    template<typename view_t, typename matrix_t>
+    static void transpose_view(view_t & view, matrix_t & matrix)
+        throw();
+    chain_prod(const chain_prod &);
+    chain_prod & operator=(const chain_prod &);
+};
+
+
+template<typename real_t, typename storage_t, size_t SIZE, size_t CART_SIZE>
+chain_prod<real_t, storage_t, SIZE, CART_SIZE>::chain_prod(
+        const communicator_type & cart_2d,
+        product_function_type local_product,
+        size_t panels,
+        block_product_function_type block_product)
+    throw()
+  : cart_2d(cart_2d),
+    transposed_cart(mpi::cart_transposed(cart_2d)),
+    local_product(local_product),
+    panels(panels),
+    block_product(block_product),
+    count(0)
+{
+}
+
+
+template<typename real_t, typename storage_t, size_t SIZE, size_t CART_SIZE>
+chain_prod<real_t, storage_t, SIZE, CART_SIZE>::~chain_prod()
+    throw()
+{
+}
+
+
+template<typename real_t, typename storage_t, size_t SIZE, size_t CART_SIZE>
+void chain_prod<real_t, storage_t, SIZE, CART_SIZE>::operator()(
+        row_matrix_type & result,
+        const operands_type & operands)
+    throw()
+{
+    if(operands.empty())
+    {
+        return;
+    }
+    if(operands.size() == 1)
+    {
+        ::boost::numeric::ublas::noalias(result) += * operands[0];
+        return;
+    }
+    plan(operands);
+    copy_right_operands(operands);
+    multiply(result, operands, 0, count - 1);
+    copies.clear();
+    copy_uses.clear();
+}
+
+
+// The shapes are the same on every processor, and so is the plan.
+template<typename real_t, typename storage_t, size_t SIZE, size_t CART_SIZE>
+void chain_prod<real_t, storage_t, SIZE, CART_SIZE>::plan(const operands_type & operands)
+    throw()
+{
+    count = operands.size();
+    ::std::vector<double> dims(count + 1);
+    for(size_t i = 0; i < count; ++i)
+    {
+        dims[i] = operands[i]->size1();
+    }
+    dims[count] = operands[count - 1]->size2();
+    ::std::vector<double> cost(count * count, 0.0);
+    split.assign(count * count, 0);
+    for(size_t length = 2; length <= count; ++length)
+    {
+        for(size_t i = 0; i + length <= count; ++i)
+        {
+            const size_t j = i + length - 1;
+            cost[i * count + j] = ::std::numeric_limits<double>::max();
+            for(size_t k = i; k < j; ++k)
+            {
+                const double relayout_cost = k + 1 == j ? dims[j] * dims[j + 1] : 0.0;
+                const double candidate = cost[i * count + k] + cost[(k + 1) * count + j]
+                    + dims[i] * dims[k + 1] * dims[j + 1] + relayout_cost;
+                if(candidate < cost[i * count + j])
+                {
+                    cost[i * count + j] = candidate;
+                    split[i * count + j] = k;
+                }
+            }
+        }
+    }
+}
+
+
+// Walks the plan for the leaves that end up as right operands.
+template<typename real_t, typename storage_t, size_t SIZE, size_t CART_SIZE>
+void chain_prod<real_t, storage_t, SIZE, CART_SIZE>::copy_right_operands(const operands_type & operands)
+    throw()
+{
+    copy_index.assign(count, CHAIN_NOT_COPIED);
+    ::std::vector<size_t> right_leaves;
+    ::std::vector< ::std::pair<size_t, size_t> > pending(1, ::std::make_pair(static_cast<size_t>(0), count - 1));
+    while(!pending.empty())
+    {
+        const size_t first = pending.back().first;
+        const size_t last = pending.back().second;
+        pending.pop_back();
+        const size_t k = split[first * count + last];
+        if(first < k)
+        {
+            pending.push_back(::std::make_pair(first, k));
+        }
+        if(k + 1 < last)
+        {
+            pending.push_back(::std::make_pair(k + 1, last));
+        }
+        else
+        {
+            right_leaves.push_back(last);
+        }
+    }
+    copies.clear();
+    copies.reserve(right_leaves.size());
+    copy_uses.clear();
+    for(size_t i = 0; i < right_leaves.size(); ++i)
+    {
+        const size_t leaf = right_leaves[i];
+        for(size_t other = 0; other < count && copy_index[leaf] == CHAIN_NOT_COPIED; ++other)
+        {
+            if(operands[other] == operands[leaf] && copy_index[other] != CHAIN_NOT_COPIED)
+            {
+                copy_index[leaf] = copy_index[other];
+            }
+        }
+        if(copy_index[leaf] == CHAIN_NOT_COPIED)
+        {
+            copy_index[leaf] = copies.size();
+            copies.push_back(col_matrix_type());
+            copy_uses.push_back(0);
+            relayout(copies.back(), * operands[leaf]);
+        }
+        ++copy_uses[copy_index[leaf]];
+    }
+}
+
+
+// The user's operands are realigned, the shared copies only if they're
+// used again, intermediate operands are dropped after the product, so
+// they are not.
+template<typename real_t, typename storage_t, size_t SIZE, size_t CART_SIZE>
+template<typename result_t>
+void chain_prod<real_t, storage_t, SIZE, CART_SIZE>::multiply(
+        result_t & result,
+        const operands_type & operands,
+        size_t first,
+        size_t last)
+    throw()
+{
+    const size_t k = split[first * count + last];
+    row_matrix_type left_product;
+    col_matrix_type right_product;
+    row_matrix_type * left;
+    col_matrix_type * right;
+    int realign = REALIGN_NONE;
+    if(first == k)
+    {
+        // `cannon_prod` skews and puts back the leaf in place.
+        left = operands[first];
+        realign |= REALIGN_LEFT;
+    }
+    else
+    {
+        make_zero(left_product, operands[first]->size1(), operands[k]->size2());
+        multiply(left_product, operands, first, k);
+        left = & left_product;
+    }
+    if(k + 1 == last)
+    {
+        right = & copies[copy_index[last]];
+        if(--copy_uses[copy_index[last]] > 0)
+        {
+            realign |= REALIGN_RIGHT;
+        }
+    }
+    else
+    {
+        make_zero(right_product, operands[k + 1]->size1(), operands[last]->size2());
+        multiply(right_product, operands, k + 1, last);
+        right = & right_product;
+    }
+    ::debug::info << "Chain product of operands " << first << ".." << last << ".\n" << ::std::flush;
+    product_into(result, * left, * right, realign);
+}
+
+
+template<typename real_t, typename storage_t, size_t SIZE, size_t CART_SIZE>
+inline void chain_prod<real_t, storage_t, SIZE, CART_SIZE>::product_into(
+        row_matrix_type & result,
+        row_matrix_type & left,
+        col_matrix_type & right,
+        int realign)
+    throw()
+{
+    product_of(left, right, false)(result, left, right, static_cast<realign_mode>(realign));
+}
+
+
+// The operands swap places and layouts, so do their realign flags.
+template<typename real_t, typename storage_t, size_t SIZE, size_t CART_SIZE>
+void chain_prod<real_t, storage_t, SIZE, CART_SIZE>::product_into(
+        col_matrix_type & result,
+        row_matrix_type & left,
+        col_matrix_type & right,
+        int realign)
+    throw()
+{
+    row_matrix_type result_view;
+    row_matrix_type left_view;
+    col_matrix_type right_view;
+    transpose_view(result_view, result);
+    transpose_view(left_view, right);
+    transpose_view(right_view, left);
+    const int transposed_realign = (realign & REALIGN_LEFT ? REALIGN_RIGHT : REALIGN_NONE)
+        | (realign & REALIGN_RIGHT ? REALIGN_LEFT : REALIGN_NONE);
+    product_of(left_view, right_view, true)(
+            result_view, left_view, right_view, static_cast<realign_mode>(transposed_realign));
+    transpose_view(left, right_view);
+    transpose_view(right, left_view);
+    transpose_view(result, result_view);
+}
+
+
+template<typename real_t, typename storage_t, size_t SIZE, size_t CART_SIZE>
+typename chain_prod<real_t, storage_t, SIZE, CART_SIZE>::product_type &
+chain_prod<real_t, storage_t, SIZE, CART_SIZE>::product_of(
+        const row_matrix_type & left,
+        const col_matrix_type & right,
+        bool transposed)
+    throw()
+{
+    for(size_t i = 0; i < products.size(); ++i)
+    {
+        const shaped_product & shaped = * products[i];
+        if(shaped.transposed == transposed
+                && shaped.row_temp.size1() == left.size1()
+                && shaped.row_temp.size2() == left.size2()
+                && shaped.col_temp.size2() == right.size2())
+        {
+            return * shaped.product;
+        }
+    }
+    ::boost::shared_ptr<shaped_product> shaped(new shaped_product());
+    shaped->row_temp.resize(left.size1(), left.size2(), false);
+    shaped->col_temp.resize(right.size1(), right.size2(), false);
+    shaped->transposed = transposed;
+    shaped->product.reset(new product_type(
+                transposed ? transposed_cart : cart_2d, local_product, shaped->row_temp, shaped->col_temp, panels, block_product));
+    products.push_back(shaped);
+    return * shaped->product;
+}
+
+
+template<typename real_t, typename storage_t, size_t SIZE, size_t CART_SIZE>
+template<typename matrix_t>
+inline void chain_prod<real_t, storage_t, SIZE, CART_SIZE>::make_zero(
+        matrix_t & matrix,
+        size_t rows,
+        size_t cols)
+    throw()
+{
+    matrix.resize(rows, cols, false);
+    ::std::fill(matrix.data().begin(), matrix.data().end(), real_type());
+}
+
+
+template<typename real_t, typename storage_t, size_t SIZE, size_t CART_SIZE>
+void chain_prod<real_t, storage_t, SIZE, CART_SIZE>::relayout(
+        col_matrix_type & right,
+        const row_matrix_type & left)
+    throw()
+{
+    const size_t rows = left.size1();
+    const size_t cols = left.size2();
+    right.resize(rows, cols, false);
+    const real_type * source = row_matrix_concept::begin(const_cast<row_matrix_type *>(& left));
+    real_type * destination = col_matrix_concept::begin(& right);
+    for(size_t tile_row = 0; tile_row < rows; tile_row += CHAIN_RELAYOUT_TILE)
+    {
+        const size_t row_end = ::std::min(rows, tile_row + CHAIN_RELAYOUT_TILE);
+        for(size_t tile_col = 0; tile_col < cols; tile_col += CHAIN_RELAYOUT_TILE)
+        {
+            const size_t col_end = ::std::min(cols, tile_col + CHAIN_RELAYOUT_TILE);
+            for(size_t i = tile_row; i < row_end; ++i)
+            {
+                for(size_t j = tile_col; j < col_end; ++j)
+                {
+                    destination[j * rows + i] = source[i * cols + j];
+                }
+            }
+        }
+    }
+}
+
+
+// Only the element counts of `view` and `matrix` are equal, so the
+// storage is swapped before `view` is resized (which keeps it then).
+template<typename real_t, typename storage_t, size_t SIZE, size_t CART_SIZE>
+template<typename view_t, typename matrix_t>
+inline void chain_prod<real_t, storage_t, SIZE, CART_SIZE>::transpose_view(
+        view_t & view,
+        matrix_t & matrix)
+    throw()
+{
+    view.data().swap(matrix.data());
+    view.resize(matrix.size2(), matrix.size1(), false);
+}
+
+
+}  // namespace algorithm
+}  // namespace cannon
+
+
+#endif
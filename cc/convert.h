@@ -0,0 +1,774 @@
+// Author: Cezary Bartoszuk
+// Email: cbart@students.mimuw.edu.pl
+
+#ifndef __CANNON__CONVERT__H__
+#define __CANNON__CONVERT__H__
+
+
+#include <algorithm>
+#include <complex>
+#include <limits>
+#include <boost/function.hpp>
+#include "kernel.h"
+#include "transport.h"
+
+
+namespace cannon
+{
+
+
+// Instruction sets of the conversions below.
+enum convert_isa
+{
+    CONVERT_SCALAR,
+    CONVERT_SSE2,
+    CONVERT_AVX2
+};
+
+
+// Narrowing (see transport.h) and widening of `count` elements with
+// `ISA`, pairs of element types without a vectorized conversion use
+// the scalar one.
+//   `narrow` rounds `from` to `to`, adding their errors to `stats`.
+//   `widen` converts rounded `from` back to `to`. `from` may lie inside
+//       `to` if it doesn't end before it: the packing widens in place.
+// The vectorized ones run the scalar ones on the last (less than a
+// vector of) elements.
+template<typename real_t, typename transport_t, convert_isa ISA>
+struct converter
+{
+    static void narrow(const real_t * from, size_t count, transport_t * to, rounding_stats & stats)
+        throw()
+    {
+        ::cannon::narrow(from, count, to, stats);
+    }
+    static void widen(const transport_t * from, size_t count, real_t * to)
+        throw()
+    {
+        ::cannon::widen(from, count, to);
+    }
+};
+
+
+// Rounding of the narrowed operands, as `converter::narrow`.
+template<typename real_t, typename transport_t>
+struct narrow_function
+{
+    typedef ::boost::function<
+        void (
+                const real_t * from,
+                size_t count,
+                transport_t * to,
+                rounding_stats & stats)
+        throw()> type;
+};
+
+
+// Instruction set of a micro-kernel's conversions: the one of the kernel.
+template<typename kernel_t>
+struct kernel_isa
+{
+    static const convert_isa value = CONVERT_SCALAR;
+};
+
+
+template<typename real_kernel_t, gemm::complex_method METHOD>
+struct kernel_isa<gemm::complex_kernel<real_kernel_t, METHOD> >
+{
+    static const convert_isa value = kernel_isa<real_kernel_t>::value;
+};
+
+
+#ifdef CANNON_X86_KERNELS
+
+
+template<>
+struct kernel_isa<gemm::sse2_double_kernel>
+{
+    static const convert_isa value = CONVERT_SSE2;
+};
+
+
+template<>
+struct kernel_isa<gemm::sse2_float_kernel>
+{
+    static const convert_isa value = CONVERT_SSE2;
+};
+
+
+template<>
+struct kernel_isa<gemm::avx2_double_kernel>
+{
+    static const convert_isa value = CONVERT_AVX2;
+};
+
+
+template<>
+struct kernel_isa<gemm::avx2_float_kernel>
+{
+    static const convert_isa value = CONVERT_AVX2;
+};
+
+
+// Every AVX-512 CPU has AVX2 too.
+template<>
+struct kernel_isa<gemm::avx512_double_kernel>
+{
+    static const convert_isa value = CONVERT_AVX2;
+};
+
+
+template<>
+struct kernel_isa<gemm::avx512_float_kernel>
+{
+    static const convert_isa value = CONVERT_AVX2;
+};
+
+
+// Rounding stats kept in vector lanes, see `rounding_stats`. Complex
+// elements keep their squared relative errors in `max_error`.
+struct sse2_rounding
+{
+    __m128d max_error;
+    __m128d error_squares;
+    __m128d value_squares;
+};
+
+
+struct avx2_rounding
+{
+    __m256d max_error;
+    __m256d error_squares;
+    __m256d value_squares;
+};
+
+
+CANNON_TARGET_SSE2
+inline void sse2_clear(sse2_rounding & lanes)
+    throw()
+{
+    lanes.max_error = _mm_setzero_pd();
+    lanes.error_squares = _mm_setzero_pd();
+    lanes.value_squares = _mm_setzero_pd();
+}
+
+
+// Adds the errors of `back`, the rounded `value`s widened back.
+CANNON_TARGET_SSE2
+inline void sse2_account(sse2_rounding & lanes, __m128d value, __m128d back)
+    throw()
+{
+    const __m128d sign = _mm_set1_pd(-0.0);
+    const __m128d error = _mm_sub_pd(value, back);
+    const __m128d magnitude = _mm_max_pd(_mm_andnot_pd(sign, value),
+            _mm_set1_pd(::std::numeric_limits<double>::min()));
+    lanes.error_squares = _mm_add_pd(lanes.error_squares, _mm_mul_pd(error, error));
+    lanes.value_squares = _mm_add_pd(lanes.value_squares, _mm_mul_pd(value, value));
+    lanes.max_error = _mm_max_pd(lanes.max_error, _mm_div_pd(_mm_andnot_pd(sign, error), magnitude));
+}
+
+
+// Same for two complex elements, `value` and `back` hold one each.
+CANNON_TARGET_SSE2
+inline void sse2_account_complex(
+        sse2_rounding & lanes,
+        __m128d value0,
+        __m128d back0,
+        __m128d value1,
+        __m128d back1)
+    throw()
+{
+    const __m128d error0 = _mm_sub_pd(value0, back0);
+    const __m128d error1 = _mm_sub_pd(value1, back1);
+    const __m128d error_parts0 = _mm_mul_pd(error0, error0);
+    const __m128d error_parts1 = _mm_mul_pd(error1, error1);
+    const __m128d value_parts0 = _mm_mul_pd(value0, value0);
+    const __m128d value_parts1 = _mm_mul_pd(value1, value1);
+    const __m128d errors = _mm_add_pd(
+            _mm_unpacklo_pd(error_parts0, error_parts1), _mm_unpackhi_pd(error_parts0, error_parts1));
+    const __m128d values = _mm_add_pd(
+            _mm_unpacklo_pd(value_parts0, value_parts1), _mm_unpackhi_pd(value_parts0, value_parts1));
+    lanes.error_squares = _mm_add_pd(lanes.error_squares, errors);
+    lanes.value_squares = _mm_add_pd(lanes.value_squares, values);
+    lanes.max_error = _mm_max_pd(lanes.max_error,
+            _mm_div_pd(errors, _mm_max_pd(values, _mm_set1_pd(::std::numeric_limits<double>::min()))));
+}
+
+
+// Adds up the lanes to `stats`.
+CANNON_TARGET_SSE2
+inline void sse2_reduce(const sse2_rounding & lanes, bool complex, rounding_stats & stats)
+    throw()
+{
+    double max_error[2];
+    double error_squares[2];
+    double value_squares[2];
+    _mm_storeu_pd(max_error, complex ? _mm_sqrt_pd(lanes.max_error) : lanes.max_error);
+    _mm_storeu_pd(error_squares, lanes.error_squares);
+    _mm_storeu_pd(value_squares, lanes.value_squares);
+    stats.max_error = ::std::max(stats.max_error, ::std::max(max_error[0], max_error[1]));
+    stats.error_squares += error_squares[0] + error_squares[1];
+    stats.value_squares += value_squares[0] + value_squares[1];
+}
+
+
+// Rounds four floats to bfloat16 (see `bfloat16`), returns them widened
+// back to float bits: the bfloat16 in the upper halves of the lanes.
+CANNON_TARGET_SSE2
+inline __m128i sse2_round_bfloat16(__m128 value)
+    throw()
+{
+    const __m128i bits = _mm_castps_si128(value);
+    const __m128i nan = _mm_cmpgt_epi32(
+            _mm_and_si128(bits, _mm_set1_epi32(0x7fffffff)), _mm_set1_epi32(0x7f800000));
+    const __m128i odd = _mm_and_si128(_mm_srli_epi32(bits, 16), _mm_set1_epi32(1));
+    const __m128i rounded = _mm_add_epi32(bits, _mm_add_epi32(_mm_set1_epi32(0x7fff), odd));
+    const __m128i quiet = _mm_or_si128(bits, _mm_set1_epi32(0x00400000));
+    const __m128i upper = _mm_or_si128(_mm_and_si128(nan, quiet), _mm_andnot_si128(nan, rounded));
+    return _mm_and_si128(upper, _mm_set1_epi32(static_cast<int>(0xffff0000u)));
+}
+
+
+// The upper halves of `low`'s and `high`'s lanes, in this order.
+CANNON_TARGET_SSE2
+inline __m128i sse2_pack_upper(__m128i low, __m128i high)
+    throw()
+{
+    return _mm_packs_epi32(_mm_srai_epi32(low, 16), _mm_srai_epi32(high, 16));
+}
+
+
+CANNON_TARGET_AVX2
+inline void avx2_clear(avx2_rounding & lanes)
+    throw()
+{
+    lanes.max_error = _mm256_setzero_pd();
+    lanes.error_squares = _mm256_setzero_pd();
+    lanes.value_squares = _mm256_setzero_pd();
+}
+
+
+CANNON_TARGET_AVX2
+inline void avx2_account(avx2_rounding & lanes, __m256d value, __m256d back)
+    throw()
+{
+    const __m256d sign = _mm256_set1_pd(-0.0);
+    const __m256d error = _mm256_sub_pd(value, back);
+    const __m256d magnitude = _mm256_max_pd(_mm256_andnot_pd(sign, value),
+            _mm256_set1_pd(::std::numeric_limits<double>::min()));
+    lanes.error_squares = _mm256_fmadd_pd(error, error, lanes.error_squares);
+    lanes.value_squares = _mm256_fmadd_pd(value, value, lanes.value_squares);
+    lanes.max_error = _mm256_max_pd(lanes.max_error, _mm256_div_pd(_mm256_andnot_pd(sign, error), magnitude));
+}
+
+
+// Same for four complex elements, `value` and `back` hold two each.
+CANNON_TARGET_AVX2
+inline void avx2_account_complex(
+        avx2_rounding & lanes,
+        __m256d value0,
+        __m256d back0,
+        __m256d value1,
+        __m256d back1)
+    throw()
+{
+    const __m256d error0 = _mm256_sub_pd(value0, back0);
+    const __m256d error1 = _mm256_sub_pd(value1, back1);
+    const __m256d errors = _mm256_hadd_pd(_mm256_mul_pd(error0, error0), _mm256_mul_pd(error1, error1));
+    const __m256d values = _mm256_hadd_pd(_mm256_mul_pd(value0, value0), _mm256_mul_pd(value1, value1));
+    lanes.error_squares = _mm256_add_pd(lanes.error_squares, errors);
+    lanes.value_squares = _mm256_add_pd(lanes.value_squares, values);
+    lanes.max_error = _mm256_max_pd(lanes.max_error,
+            _mm256_div_pd(errors, _mm256_max_pd(values, _mm256_set1_pd(::std::numeric_limits<double>::min()))));
+}
+
+
+CANNON_TARGET_AVX2
+inline void avx2_reduce(const avx2_rounding & lanes, bool complex, rounding_stats & stats)
+    throw()
+{
+    sse2_rounding halves;
+    halves.max_error = _mm_max_pd(
+            _mm256_castpd256_pd128(lanes.max_error), _mm256_extractf128_pd(lanes.max_error, 1));
+    halves.error_squares = _mm_add_pd(
+            _mm256_castpd256_pd128(lanes.error_squares), _mm256_extractf128_pd(lanes.error_squares, 1));
+    halves.value_squares = _mm_add_pd(
+            _mm256_castpd256_pd128(lanes.value_squares), _mm256_extractf128_pd(lanes.value_squares, 1));
+    sse2_reduce(halves, complex, stats);
+}
+
+
+// Eight floats at a time, as `sse2_round_bfloat16`.
+CANNON_TARGET_AVX2
+inline __m256i avx2_round_bfloat16(__m256 value)
+    throw()
+{
+    const __m256i bits = _mm256_castps_si256(value);
+    const __m256i nan = _mm256_cmpgt_epi32(
+            _mm256_and_si256(bits, _mm256_set1_epi32(0x7fffffff)), _mm256_set1_epi32(0x7f800000));
+    const __m256i odd = _mm256_and_si256(_mm256_srli_epi32(bits, 16), _mm256_set1_epi32(1));
+    const __m256i rounded = _mm256_add_epi32(bits, _mm256_add_epi32(_mm256_set1_epi32(0x7fff), odd));
+    const __m256i quiet = _mm256_or_si256(bits, _mm256_set1_epi32(0x00400000));
+    const __m256i upper = _mm256_blendv_epi8(rounded, quiet, nan);
+    return _mm256_and_si256(upper, _mm256_set1_epi32(static_cast<int>(0xffff0000u)));
+}
+
+
+// The upper halves of `upper`'s lanes, in order.
+CANNON_TARGET_AVX2
+inline __m128i avx2_pack_upper(__m256i upper)
+    throw()
+{
+    const __m256i shifted = _mm256_srai_epi32(upper, 16);
+    const __m256i packed = _mm256_packs_epi32(shifted, shifted);
+    return _mm256_castsi256_si128(_mm256_permute4x64_epi64(packed, _MM_SHUFFLE(3, 1, 2, 0)));
+}
+
+
+// Double precision to single: cvtpd2ps.
+template<>
+struct converter<double, float, CONVERT_SSE2>
+{
+    static void narrow(const double * from, size_t count, float * to, rounding_stats & stats)
+        throw();
+    static void widen(const float * from, size_t count, double * to)
+        throw();
+};
+
+
+CANNON_TARGET_SSE2
+inline void converter<double, float, CONVERT_SSE2>::narrow(
+        const double * from,
+        size_t count,
+        float * to,
+        rounding_stats & stats)
+    throw()
+{
+    sse2_rounding lanes;
+    sse2_clear(lanes);
+    size_t i = 0;
+    for(; i + 4 <= count; i += 4)
+    {
+        const __m128d value0 = _mm_loadu_pd(from + i);
+        const __m128d value1 = _mm_loadu_pd(from + i + 2);
+        const __m128 narrowed0 = _mm_cvtpd_ps(value0);
+        const __m128 narrowed1 = _mm_cvtpd_ps(value1);
+        _mm_storeu_ps(to + i, _mm_movelh_ps(narrowed0, narrowed1));
+        sse2_account(lanes, value0, _mm_cvtps_pd(narrowed0));
+        sse2_account(lanes, value1, _mm_cvtps_pd(narrowed1));
+    }
+    sse2_reduce(lanes, false, stats);
+    ::cannon::narrow(from + i, count - i, to + i, stats);
+}
+
+
+CANNON_TARGET_SSE2
+inline void converter<double, float, CONVERT_SSE2>::widen(
+        const float * from,
+        size_t count,
+        double * to)
+    throw()
+{
+    size_t i = 0;
+    for(; i + 4 <= count; i += 4)
+    {
+        const __m128 narrowed = _mm_loadu_ps(from + i);
+        _mm_storeu_pd(to + i, _mm_cvtps_pd(narrowed));
+        _mm_storeu_pd(to + i + 2, _mm_cvtps_pd(_mm_movehl_ps(narrowed, narrowed)));
+    }
+    ::cannon::widen(from + i, count - i, to + i);
+}
+
+
+template<>
+struct converter<double, float, CONVERT_AVX2>
+{
+    static void narrow(const double * from, size_t count, float * to, rounding_stats & stats)
+        throw();
+    static void widen(const float * from, size_t count, double * to)
+        throw();
+};
+
+
+CANNON_TARGET_AVX2
+inline void converter<double, float, CONVERT_AVX2>::narrow(
+        const double * from,
+        size_t count,
+        float * to,
+        rounding_stats & stats)
+    throw()
+{
+    avx2_rounding lanes;
+    avx2_clear(lanes);
+    size_t i = 0;
+    for(; i + 8 <= count; i += 8)
+    {
+        const __m256d value0 = _mm256_loadu_pd(from + i);
+        const __m256d value1 = _mm256_loadu_pd(from + i + 4);
+        const __m128 narrowed0 = _mm256_cvtpd_ps(value0);
+        const __m128 narrowed1 = _mm256_cvtpd_ps(value1);
+        _mm_storeu_ps(to + i, narrowed0);
+        _mm_storeu_ps(to + i + 4, narrowed1);
+        avx2_account(lanes, value0, _mm256_cvtps_pd(narrowed0));
+        avx2_account(lanes, value1, _mm256_cvtps_pd(narrowed1));
+    }
+    avx2_reduce(lanes, false, stats);
+    ::cannon::narrow(from + i, count - i, to + i, stats);
+}
+
+
+CANNON_TARGET_AVX2
+inline void converter<double, float, CONVERT_AVX2>::widen(
+        const float * from,
+        size_t count,
+        double * to)
+    throw()
+{
+    size_t i = 0;
+    for(; i + 8 <= count; i += 8)
+    {
+        const __m256 narrowed = _mm256_loadu_ps(from + i);
+        _mm256_storeu_pd(to + i, _mm256_cvtps_pd(_mm256_castps256_ps128(narrowed)));
+        _mm256_storeu_pd(to + i + 4, _mm256_cvtps_pd(_mm256_extractf128_ps(narrowed, 1)));
+    }
+    ::cannon::widen(from + i, count - i, to + i);
+}
+
+
+// Single precision to bfloat16: round to nearest even on the bits, the
+// errors are summed up in double precision.
+template<>
+struct converter<float, bfloat16, CONVERT_SSE2>
+{
+    static void narrow(const float * from, size_t count, bfloat16 * to, rounding_stats & stats)
+        throw();
+    static void widen(const bfloat16 * from, size_t count, float * to)
+        throw();
+};
+
+
+CANNON_TARGET_SSE2
+inline void converter<float, bfloat16, CONVERT_SSE2>::narrow(
+        const float * from,
+        size_t count,
+        bfloat16 * to,
+        rounding_stats & stats)
+    throw()
+{
+    sse2_rounding lanes;
+    sse2_clear(lanes);
+    size_t i = 0;
+    for(; i + 8 <= count; i += 8)
+    {
+        const __m128 value0 = _mm_loadu_ps(from + i);
+        const __m128 value1 = _mm_loadu_ps(from + i + 4);
+        const __m128i upper0 = sse2_round_bfloat16(value0);
+        const __m128i upper1 = sse2_round_bfloat16(value1);
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(to + i), sse2_pack_upper(upper0, upper1));
+        const __m128 back0 = _mm_castsi128_ps(upper0);
+        const __m128 back1 = _mm_castsi128_ps(upper1);
+        sse2_account(lanes, _mm_cvtps_pd(value0), _mm_cvtps_pd(back0));
+        sse2_account(lanes, _mm_cvtps_pd(_mm_movehl_ps(value0, value0)), _mm_cvtps_pd(_mm_movehl_ps(back0, back0)));
+        sse2_account(lanes, _mm_cvtps_pd(value1), _mm_cvtps_pd(back1));
+        sse2_account(lanes, _mm_cvtps_pd(_mm_movehl_ps(value1, value1)), _mm_cvtps_pd(_mm_movehl_ps(back1, back1)));
+    }
+    sse2_reduce(lanes, false, stats);
+    ::cannon::narrow(from + i, count - i, to + i, stats);
+}
+
+
+CANNON_TARGET_SSE2
+inline void converter<float, bfloat16, CONVERT_SSE2>::widen(
+        const bfloat16 * from,
+        size_t count,
+        float * to)
+    throw()
+{
+    const __m128i zero = _mm_setzero_si128();
+    size_t i = 0;
+    for(; i + 8 <= count; i += 8)
+    {
+        const __m128i narrowed = _mm_loadu_si128(reinterpret_cast<const __m128i *>(from + i));
+        _mm_storeu_ps(to + i, _mm_castsi128_ps(_mm_unpacklo_epi16(zero, narrowed)));
+        _mm_storeu_ps(to + i + 4, _mm_castsi128_ps(_mm_unpackhi_epi16(zero, narrowed)));
+    }
+    ::cannon::widen(from + i, count - i, to + i);
+}
+
+
+template<>
+struct converter<float, bfloat16, CONVERT_AVX2>
+{
+    static void narrow(const float * from, size_t count, bfloat16 * to, rounding_stats & stats)
+        throw();
+    static void widen(const bfloat16 * from, size_t count, float * to)
+        throw();
+};
+
+
+CANNON_TARGET_AVX2
+inline void converter<float, bfloat16, CONVERT_AVX2>::narrow(
+        const float * from,
+        size_t count,
+        bfloat16 * to,
+        rounding_stats & stats)
+    throw()
+{
+    avx2_rounding lanes;
+    avx2_clear(lanes);
+    size_t i = 0;
+    for(; i + 8 <= count; i += 8)
+    {
+        const __m256 value = _mm256_loadu_ps(from + i);
+        const __m256i upper = avx2_round_bfloat16(value);
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(to + i), avx2_pack_upper(upper));
+        const __m256 back = _mm256_castsi256_ps(upper);
+        avx2_account(lanes, _mm256_cvtps_pd(_mm256_castps256_ps128(value)),
+                _mm256_cvtps_pd(_mm256_castps256_ps128(back)));
+        avx2_account(lanes, _mm256_cvtps_pd(_mm256_extractf128_ps(value, 1)),
+                _mm256_cvtps_pd(_mm256_extractf128_ps(back, 1)));
+    }
+    avx2_reduce(lanes, false, stats);
+    ::cannon::narrow(from + i, count - i, to + i, stats);
+}
+
+
+CANNON_TARGET_AVX2
+inline void converter<float, bfloat16, CONVERT_AVX2>::widen(
+        const bfloat16 * from,
+        size_t count,
+        float * to)
+    throw()
+{
+    size_t i = 0;
+    for(; i + 8 <= count; i += 8)
+    {
+        const __m128i narrowed = _mm_loadu_si128(reinterpret_cast<const __m128i *>(from + i));
+        _mm256_storeu_ps(to + i, _mm256_castsi256_ps(_mm256_slli_epi32(_mm256_cvtepu16_epi32(narrowed), 16)));
+    }
+    ::cannon::widen(from + i, count - i, to + i);
+}
+
+
+// Double precision to bfloat16: through single precision, as the scalar
+// `bfloat16`.
+template<>
+struct converter<double, bfloat16, CONVERT_SSE2>
+{
+    static void narrow(const double * from, size_t count, bfloat16 * to, rounding_stats & stats)
+        throw();
+    static void widen(const bfloat16 * from, size_t count, double * to)
+        throw();
+};
+
+
+CANNON_TARGET_SSE2
+inline void converter<double, bfloat16, CONVERT_SSE2>::narrow(
+        const double * from,
+        size_t count,
+        bfloat16 * to,
+        rounding_stats & stats)
+    throw()
+{
+    sse2_rounding lanes;
+    sse2_clear(lanes);
+    size_t i = 0;
+    for(; i + 8 <= count; i += 8)
+    {
+        __m128i upper[2];
+        for(size_t half = 0; half < 2; ++half)
+        {
+            const __m128d value0 = _mm_loadu_pd(from + i + 4 * half);
+            const __m128d value1 = _mm_loadu_pd(from + i + 4 * half + 2);
+            upper[half] = sse2_round_bfloat16(_mm_movelh_ps(_mm_cvtpd_ps(value0), _mm_cvtpd_ps(value1)));
+            const __m128 back = _mm_castsi128_ps(upper[half]);
+            sse2_account(lanes, value0, _mm_cvtps_pd(back));
+            sse2_account(lanes, value1, _mm_cvtps_pd(_mm_movehl_ps(back, back)));
+        }
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(to + i), sse2_pack_upper(upper[0], upper[1]));
+    }
+    sse2_reduce(lanes, false, stats);
+    ::cannon::narrow(from + i, count - i, to + i, stats);
+}
+
+
+CANNON_TARGET_SSE2
+inline void converter<double, bfloat16, CONVERT_SSE2>::widen(
+        const bfloat16 * from,
+        size_t count,
+        double * to)
+    throw()
+{
+    const __m128i zero = _mm_setzero_si128();
+    size_t i = 0;
+    for(; i + 8 <= count; i += 8)
+    {
+        const __m128i narrowed = _mm_loadu_si128(reinterpret_cast<const __m128i *>(from + i));
+        const __m128 low = _mm_castsi128_ps(_mm_unpacklo_epi16(zero, narrowed));
+        const __m128 high = _mm_castsi128_ps(_mm_unpackhi_epi16(zero, narrowed));
+        _mm_storeu_pd(to + i, _mm_cvtps_pd(low));
+        _mm_storeu_pd(to + i + 2, _mm_cvtps_pd(_mm_movehl_ps(low, low)));
+        _mm_storeu_pd(to + i + 4, _mm_cvtps_pd(high));
+        _mm_storeu_pd(to + i + 6, _mm_cvtps_pd(_mm_movehl_ps(high, high)));
+    }
+    ::cannon::widen(from + i, count - i, to + i);
+}
+
+
+template<>
+struct converter<double, bfloat16, CONVERT_AVX2>
+{
+    static void narrow(const double * from, size_t count, bfloat16 * to, rounding_stats & stats)
+        throw();
+    static void widen(const bfloat16 * from, size_t count, double * to)
+        throw();
+};
+
+
+CANNON_TARGET_AVX2
+inline void converter<double, bfloat16, CONVERT_AVX2>::narrow(
+        const double * from,
+        size_t count,
+        bfloat16 * to,
+        rounding_stats & stats)
+    throw()
+{
+    avx2_rounding lanes;
+    avx2_clear(lanes);
+    size_t i = 0;
+    for(; i + 8 <= count; i += 8)
+    {
+        const __m256d value0 = _mm256_loadu_pd(from + i);
+        const __m256d value1 = _mm256_loadu_pd(from + i + 4);
+        const __m256 narrowed = _mm256_insertf128_ps(
+                _mm256_castps128_ps256(_mm256_cvtpd_ps(value0)), _mm256_cvtpd_ps(value1), 1);
+        const __m256i upper = avx2_round_bfloat16(narrowed);
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(to + i), avx2_pack_upper(upper));
+        const __m256 back = _mm256_castsi256_ps(upper);
+        avx2_account(lanes, value0, _mm256_cvtps_pd(_mm256_castps256_ps128(back)));
+        avx2_account(lanes, value1, _mm256_cvtps_pd(_mm256_extractf128_ps(back, 1)));
+    }
+    avx2_reduce(lanes, false, stats);
+    ::cannon::narrow(from + i, count - i, to + i, stats);
+}
+
+
+CANNON_TARGET_AVX2
+inline void converter<double, bfloat16, CONVERT_AVX2>::widen(
+        const bfloat16 * from,
+        size_t count,
+        double * to)
+    throw()
+{
+    size_t i = 0;
+    for(; i + 8 <= count; i += 8)
+    {
+        const __m128i narrowed = _mm_loadu_si128(reinterpret_cast<const __m128i *>(from + i));
+        const __m256 widened = _mm256_castsi256_ps(_mm256_slli_epi32(_mm256_cvtepu16_epi32(narrowed), 16));
+        _mm256_storeu_pd(to + i, _mm256_cvtps_pd(_mm256_castps256_ps128(widened)));
+        _mm256_storeu_pd(to + i + 4, _mm256_cvtps_pd(_mm256_extractf128_ps(widened, 1)));
+    }
+    ::cannon::widen(from + i, count - i, to + i);
+}
+
+
+// Complex double precision to single: part by part, the errors are the
+// elements' (not the parts') ones.
+template<>
+struct converter< ::std::complex<double>, ::std::complex<float>, CONVERT_SSE2>
+{
+    static void narrow(
+            const ::std::complex<double> * from,
+            size_t count,
+            ::std::complex<float> * to,
+            rounding_stats & stats)
+        throw();
+    static void widen(const ::std::complex<float> * from, size_t count, ::std::complex<double> * to)
+        throw()
+    {
+        converter<double, float, CONVERT_SSE2>::widen(
+                reinterpret_cast<const float *>(from), 2 * count, reinterpret_cast<double *>(to));
+    }
+};
+
+
+CANNON_TARGET_SSE2
+inline void converter< ::std::complex<double>, ::std::complex<float>, CONVERT_SSE2>::narrow(
+        const ::std::complex<double> * from,
+        size_t count,
+        ::std::complex<float> * to,
+        rounding_stats & stats)
+    throw()
+{
+    const double * const parts = reinterpret_cast<const double *>(from);
+    float * const narrowed_parts = reinterpret_cast<float *>(to);
+    sse2_rounding lanes;
+    sse2_clear(lanes);
+    size_t i = 0;
+    for(; i + 2 <= count; i += 2)
+    {
+        const __m128d value0 = _mm_loadu_pd(parts + 2 * i);
+        const __m128d value1 = _mm_loadu_pd(parts + 2 * i + 2);
+        const __m128 narrowed0 = _mm_cvtpd_ps(value0);
+        const __m128 narrowed1 = _mm_cvtpd_ps(value1);
+        _mm_storeu_ps(narrowed_parts + 2 * i, _mm_movelh_ps(narrowed0, narrowed1));
+        sse2_account_complex(lanes, value0, _mm_cvtps_pd(narrowed0), value1, _mm_cvtps_pd(narrowed1));
+    }
+    sse2_reduce(lanes, true, stats);
+    ::cannon::narrow(from + i, count - i, to + i, stats);
+}
+
+
+template<>
+struct converter< ::std::complex<double>, ::std::complex<float>, CONVERT_AVX2>
+{
+    static void narrow(
+            const ::std::complex<double> * from,
+            size_t count,
+            ::std::complex<float> * to,
+            rounding_stats & stats)
+        throw();
+    static void widen(const ::std::complex<float> * from, size_t count, ::std::complex<double> * to)
+        throw()
+    {
+        converter<double, float, CONVERT_AVX2>::widen(
+                reinterpret_cast<const float *>(from), 2 * count, reinterpret_cast<double *>(to));
+    }
+};
+
+
+CANNON_TARGET_AVX2
+inline void converter< ::std::complex<double>, ::std::complex<float>, CONVERT_AVX2>::narrow(
+        const ::std::complex<double> * from,
+        size_t count,
+        ::std::complex<float> * to,
+        rounding_stats & stats)
+    throw()
+{
+    const double * const parts = reinterpret_cast<const double *>(from);
+    float * const narrowed_parts = reinterpret_cast<float *>(to);
+    avx2_rounding lanes;
+    avx2_clear(lanes);
+    size_t i = 0;
+    for(; i + 4 <= count; i += 4)
+    {
+        const __m256d value0 = _mm256_loadu_pd(parts + 2 * i);
+        const __m256d value1 = _mm256_loadu_pd(parts + 2 * i + 4);
+        const __m128 narrowed0 = _mm256_cvtpd_ps(value0);
+        const __m128 narrowed1 = _mm256_cvtpd_ps(value1);
+        _mm_storeu_ps(narrowed_parts + 2 * i, narrowed0);
+        _mm_storeu_ps(narrowed_parts + 2 * i + 4, narrowed1);
+        avx2_account_complex(lanes, value0, _mm256_cvtps_pd(narrowed0), value1, _mm256_cvtps_pd(narrowed1));
+    }
+    avx2_reduce(lanes, true, stats);
+    ::cannon::narrow(from + i, count - i, to + i, stats);
+}
+
+
+#endif  // CANNON_X86_KERNELS
+
+
+}  // namespace cannon
+
+
+#endif
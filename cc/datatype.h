@@ -0,0 +1,53 @@
+// Author: Cezary Bartoszuk
+// Email: cbart@students.mimuw.edu.pl
+
+#ifndef __CANNON__DATATYPE__H__
+#define __CANNON__DATATYPE__H__
+
+
+#include <complex>
+#include <boost/mpl/bool.hpp>
+#include <boost/mpi/datatype.hpp>
+
+
+// Boost.MPI doesn't map `std::complex` to MPI datatypes, so without
+// these the partials would be sent through serialization.
+namespace boost
+{
+namespace mpi
+{
+
+
+template<>
+inline MPI_Datatype get_mpi_datatype< ::std::complex<float> >(const ::std::complex<float> &)
+{
+    return MPI_C_FLOAT_COMPLEX;
+}
+
+
+template<>
+struct is_mpi_complex_datatype< ::std::complex<float> >
+  : ::boost::mpl::true_
+{
+};
+
+
+template<>
+inline MPI_Datatype get_mpi_datatype< ::std::complex<double> >(const ::std::complex<double> &)
+{
+    return MPI_C_DOUBLE_COMPLEX;
+}
+
+
+template<>
+struct is_mpi_complex_datatype< ::std::complex<double> >
+  : ::boost::mpl::true_
+{
+};
+
+
+}  // namespace mpi
+}  // namespace boost
+
+
+#endif
@@ -6,7 +6,15 @@
 #define __DEBUG_TOOLS__H__
 
 
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
 #include <iostream>
+#include <streambuf>
+#include <string>
+#include <unistd.h>
+#include <boost/thread/thread.hpp>
+#include <boost/thread/tss.hpp>
 
 
 namespace debug
@@ -41,128 +49,428 @@ const debug_level_t INFO_DEBUG_LEVEL = INFOLEVEL;
 const debug_level_t INFO_DEBUG_LEVEL = 2;
 #endif
 
-// A tool for managing diagnostic info.
-class diagstream
+// Levels printed with the `DEBUG_LEVEL` we're compiled with.
+const bool ERROR_ENABLED = DEBUG_LEVEL >= ERROR_DEBUG_LEVEL;
+const bool WARNING_ENABLED = DEBUG_LEVEL >= WARNING_DEBUG_LEVEL;
+const bool INFO_ENABLED = DEBUG_LEVEL >= INFO_DEBUG_LEVEL;
+
+// The log ring of a process: `LOG_SLOTS` lines of `LOG_SLOT_SIZE`
+// characters at most (longer ones take more slots), flushed every
+// `LOG_FLUSH_PERIOD` microseconds.
+const size_t LOG_SLOTS = 4096;
+const size_t LOG_SLOT_SIZE = 256;
+const useconds_t LOG_FLUSH_PERIOD = 10000;
+
+
+// Bounded multiple producers, single consumer ring of log lines
+// (D. Vyukov's bounded queue): a producer claims a slot with a single
+// compare-and-swap and publishes it with its sequence number, so the
+// logging threads never block. Lines that don't fit are dropped and
+// counted. A flusher thread writes the lines to `stderr` in the
+// background, prefixed with the MPI rank of the process if it's known.
+class log_ring
 {
-
 private:
-
-    // Minimal level of debugging with which
-    // this object will print the output.
-    const debug_level_t MIN_DEBUG_LEVEL;
-
+    struct slot
+    {
+        volatile size_t sequence;
+        size_t length;
+        char text[LOG_SLOT_SIZE];
+    };
+    slot slots[LOG_SLOTS];
+    // Next slot to be claimed / flushed.
+    volatile size_t head;
+    size_t tail;
+    volatile size_t dropped;
+    // Taken by whoever flushes.
+    volatile int flushing;
+    volatile bool stopping;
+    // Whether the next flushed slot starts a line.
+    bool line_start;
+    char prefix[32];
+    ::boost::thread flusher;
 public:
+    log_ring()
+        throw();
+    ~log_ring()
+        throw();
+    // Appends `length` characters of `text` (a line or its part).
+    void push(const char * text, size_t length)
+        throw();
+    // Writes all the published lines (right away, waits for the flusher
+    // if it's flushing).
+    void flush()
+        throw();
+private:
+    // Writes the published lines unless someone else does, returns
+    // whether it did.
+    bool try_flush()
+        throw();
+    void flush_periodically()
+        throw();
+    log_ring(const log_ring &);
+    log_ring & operator=(const log_ring &);
+};
 
-    typedef ::std::ostream & (* message_fun_t)(::std::ostream &);
 
-    // Creates new diagnostic stream with defined
-    // `min_debug_lv` (minimal debug level).
-    diagstream(debug_level_t min_debug_lv)
-        : MIN_DEBUG_LEVEL(min_debug_lv)
+// Rank from the environment the MPI launchers set, as MPI might not be
+// initialized yet (or already finalized) when we log.
+inline log_ring::log_ring()
+    throw()
+  : head(0),
+    tail(0),
+    dropped(0),
+    flushing(0),
+    stopping(false),
+    line_start(true)
+{
+    for(size_t i = 0; i < LOG_SLOTS; ++i)
+    {
+        slots[i].sequence = i;
+    }
+    prefix[0] = '\0';
+    const char * const rank_variables[] = {"OMPI_COMM_WORLD_RANK", "PMIX_RANK", "PMI_RANK"};
+    for(size_t i = 0; i < sizeof(rank_variables) / sizeof(* rank_variables); ++i)
     {
+        const char * rank = ::std::getenv(rank_variables[i]);
+        if(rank != NULL)
+        {
+            ::std::snprintf(prefix, sizeof(prefix), "[%.16s] ", rank);
+            break;
+        }
     }
+    flusher = ::boost::thread(& log_ring::flush_periodically, this);
+}
+
 
-    // 'Send to stream' operator designed for all kinds
-    // of messages.
-    template<typename message_t>
-    friend diagstream & operator<<(diagstream & ds, const message_t & message);
+inline log_ring::~log_ring()
+    throw()
+{
+    stopping = true;
+    flusher.join();
+    flush();
+    if(dropped > 0)
+    {
+        ::std::fprintf(stderr, "%s(WW) Log ring full, %zu lines dropped!\n", prefix, dropped);
+    }
+}
 
-    // 'Send to stream' operator designed for operations
-    // like ::std::flush, ::std::endl, etc...
-    friend diagstream & operator<<(diagstream & ds, message_fun_t message_fun);
 
-};
+inline void log_ring::push(const char * text, size_t length)
+    throw()
+{
+    size_t position = head;
+    slot * claimed;
+    for(;;)
+    {
+        claimed = & slots[position % LOG_SLOTS];
+        const long difference = static_cast<long>(claimed->sequence - position);
+        if(difference == 0)
+        {
+            if(__sync_bool_compare_and_swap(& head, position, position + 1))
+            {
+                break;
+            }
+            position = head;
+        }
+        else if(difference < 0)
+        {
+            __sync_fetch_and_add(& dropped, 1);
+            return;
+        }
+        else
+        {
+            position = head;
+        }
+    }
+    claimed->length = length < LOG_SLOT_SIZE ? length : LOG_SLOT_SIZE;
+    ::std::memcpy(claimed->text, text, claimed->length);
+    __sync_synchronize();
+    claimed->sequence = position + 1;
+}
 
 
-template<typename message_t>
-inline static diagstream & operator<<(diagstream & ds, const message_t & message)
+inline void log_ring::flush()
+    throw()
 {
-    if(DEBUG_LEVEL >= ds.MIN_DEBUG_LEVEL)
+    while(!try_flush())
     {
-        ::std::cerr << message;
     }
-    return ds;
 }
 
 
-inline diagstream & operator<<(diagstream & ds, diagstream::message_fun_t message_fun)
+inline bool log_ring::try_flush()
+    throw()
 {
-    if(DEBUG_LEVEL >= ds.MIN_DEBUG_LEVEL)
+    if(__sync_lock_test_and_set(& flushing, 1) != 0)
     {
-        ::std::cerr << message_fun;
+        return false;
     }
-    return ds;
+    for(;;)
+    {
+        slot & published = slots[tail % LOG_SLOTS];
+        if(published.sequence != tail + 1)
+        {
+            break;
+        }
+        __sync_synchronize();
+        if(line_start)
+        {
+            ::std::fputs(prefix, stderr);
+        }
+        ::std::fwrite(published.text, 1, published.length, stderr);
+        line_start = published.length > 0 && published.text[published.length - 1] == '\n';
+        __sync_synchronize();
+        published.sequence = tail + LOG_SLOTS;
+        ++tail;
+    }
+    ::std::fflush(stderr);
+    __sync_lock_release(& flushing);
+    return true;
 }
 
 
-// Returns stream for error logging.
-inline diagstream & get_errlog_stream(const ::std::string & info_str)
+inline void log_ring::flush_periodically()
+    throw()
 {
-    static diagstream error_stream = diagstream(ERROR_DEBUG_LEVEL);
-    if(DEBUG_LEVEL >= ERROR_DEBUG_LEVEL)
+    while(!stopping)
     {
-        ::std::cerr << info_str;
+        try_flush();
+        ::usleep(LOG_FLUSH_PERIOD);
     }
-    return error_stream;
 }
 
 
-// Returns stream for warnings logging.
-inline diagstream & get_warnlog_stream(const ::std::string & info_str)
+inline log_ring & get_log_ring()
+{
+    static log_ring ring;
+    return ring;
+}
+
+
+// Buffer of a thread's current line: it's pushed to the log ring once
+// it ends (or fills up, or is flushed). Every chunk of an urgent line is
+// written right away, up to its end or a flush.
+class line_buffer
+  : public ::std::streambuf
+{
+private:
+    char line[LOG_SLOT_SIZE];
+    size_t length;
+    bool urgent;
+public:
+    line_buffer()
+        throw()
+      : length(0),
+        urgent(false)
+    {
+    }
+    // Makes the current line flushed chunk by chunk until it ends.
+    void set_urgent()
+        throw()
+    {
+        urgent = true;
+    }
+protected:
+    virtual ::std::streamsize xsputn(const char * text, ::std::streamsize count)
+    {
+        for(::std::streamsize i = 0; i < count; ++i)
+        {
+            put(text[i]);
+        }
+        return count;
+    }
+    virtual int_type overflow(int_type character)
+    {
+        if(!traits_type::eq_int_type(character, traits_type::eof()))
+        {
+            put(traits_type::to_char_type(character));
+        }
+        return traits_type::not_eof(character);
+    }
+    virtual int sync()
+    {
+        commit();
+        urgent = false;
+        return 0;
+    }
+private:
+    void put(char character)
+        throw()
+    {
+        line[length++] = character;
+        if(character == '\n')
+        {
+            commit();
+            urgent = false;
+        }
+        else if(length == LOG_SLOT_SIZE)
+        {
+            commit();
+        }
+    }
+    void commit()
+        throw()
+    {
+        if(length > 0)
+        {
+            get_log_ring().push(line, length);
+            length = 0;
+        }
+        if(urgent)
+        {
+            get_log_ring().flush();
+        }
+    }
+};
+
+
+// A thread's line buffer and its stream, the rest of the line is
+// pushed when the thread ends.
+struct line_stream
+{
+    line_buffer buffer;
+    ::std::ostream stream;
+    line_stream()
+      : buffer(),
+        stream(& buffer)
+    {
+    }
+    ~line_stream()
+    {
+        stream.flush();
+    }
+};
+
+
+// The line stream of the calling thread, made on its first message and
+// freed when the thread ends.
+inline ::std::ostream & get_line_stream(bool urgent = false)
 {
-    static diagstream warning_stream = diagstream(WARNING_DEBUG_LEVEL);
-    if(DEBUG_LEVEL >= WARNING_DEBUG_LEVEL)
+    // The ring is made first, so it outlives the streams.
+    get_log_ring();
+    static ::boost::thread_specific_ptr<line_stream> streams;
+    line_stream * line = streams.get();
+    if(line == NULL)
+    {
+        line = new line_stream;
+        streams.reset(line);
+    }
+    if(urgent)
     {
-        ::std::cerr << info_str;
+        line->buffer.set_urgent();
     }
-    return warning_stream;
+    return line->stream;
 }
 
 
-// Returns stream for information logging.
-inline diagstream & get_infolog_stream(const ::std::string & info_str)
+// A tool for managing diagnostic info. The levels are resolved at
+// compile time: messages to a disabled one go to `diagstream<false>`,
+// whose operators do nothing, so they compile to nothing. Messages to
+// enabled ones are written to the thread's line and the log ring.
+template<bool ENABLED>
+class diagstream
+{
+public:
+    typedef ::std::ostream & (* message_fun_t)(::std::ostream &);
+};
+
+
+// 'Send to stream' operator designed for all kinds
+// of messages.
+template<typename message_t>
+inline static diagstream<true> & operator<<(diagstream<true> & ds, const message_t & message)
+{
+    get_line_stream() << message;
+    return ds;
+}
+
+
+// 'Send to stream' operator designed for operations
+// like ::std::flush, ::std::endl, etc...
+inline diagstream<true> & operator<<(diagstream<true> & ds, diagstream<true>::message_fun_t message_fun)
+{
+    get_line_stream() << message_fun;
+    return ds;
+}
+
+
+template<typename message_t>
+inline static diagstream<false> & operator<<(diagstream<false> & ds, const message_t &)
+{
+    return ds;
+}
+
+
+inline diagstream<false> & operator<<(diagstream<false> & ds, diagstream<false>::message_fun_t)
+{
+    return ds;
+}
+
+
+// Starts a message of an enabled level.
+template<bool ENABLED>
+inline diagstream<ENABLED> & get_log_stream(const char * indicator, const char * info_str, bool urgent)
 {
-    static diagstream info_stream = diagstream(INFO_DEBUG_LEVEL);
-    if(DEBUG_LEVEL >= INFO_DEBUG_LEVEL)
+    static diagstream<ENABLED> stream;
+    if(ENABLED)
     {
-        ::std::clog << info_str;
+        get_line_stream(urgent) << indicator << info_str << ' ';
     }
-    return info_stream;
+    return stream;
+}
+
+
+// Indicator strings.
+static const char DBG_ERROR_INDICATOR[] = "(EE) ";
+static const char DBG_WARNING_INDICATOR[] = "(WW) ";
+static const char DBG_INFO_INDICATOR[] = "(II) ";
+
+
+// Returns stream for error logging, errors are written right away.
+inline diagstream<ERROR_ENABLED> & get_errlog_stream(const char * info_str)
+{
+    return get_log_stream<ERROR_ENABLED>(DBG_ERROR_INDICATOR, info_str, true);
+}
+
+
+// Returns stream for warnings logging.
+inline diagstream<WARNING_ENABLED> & get_warnlog_stream(const char * info_str)
+{
+    return get_log_stream<WARNING_ENABLED>(DBG_WARNING_INDICATOR, info_str, false);
+}
+
+
+// Returns stream for information logging.
+inline diagstream<INFO_ENABLED> & get_infolog_stream(const char * info_str)
+{
+    return get_log_stream<INFO_ENABLED>(DBG_INFO_INDICATOR, info_str, false);
 }
 
 
 // Some useful defines (so we won't always write __PRETTY_FUNCTION__ or
 // "(II) Quaternion::Quaternion(const Quaternion& q); "
 
-// Indicator strings.
-static const ::std::string DBG_ERROR_INDICATOR("(EE) ");
-static const ::std::string DBG_WARNING_INDICATOR("(WW) ");
-static const ::std::string DBG_INFO_INDICATOR("(II) ");
-static const ::std::string DBG_STRING_WHITESPACE(" ");
-
 
 // `err` definition.
-#define err get_errlog_stream(debug::DBG_ERROR_INDICATOR \
-        + __PRETTY_FUNCTION__ + debug::DBG_STRING_WHITESPACE)
+#define err get_errlog_stream(__PRETTY_FUNCTION__)
 
 
 // `warn` definition.
-#define warn get_warnlog_stream(debug::DBG_WARNING_INDICATOR \
-        + __PRETTY_FUNCTION__ + debug::DBG_STRING_WHITESPACE)
+#define warn get_warnlog_stream(__PRETTY_FUNCTION__)
 
 
 // `info` definition.
-#define info get_infolog_stream(debug::DBG_INFO_INDICATOR \
-        + __PRETTY_FUNCTION__ + debug::DBG_STRING_WHITESPACE)
+#define info get_infolog_stream(__PRETTY_FUNCTION__)
 
 
-void print_self_sig(const ::std::string & sig )
+inline void print_self_sig(const ::std::string & sig )
 {
-    ::std::clog << DBG_INFO_INDICATOR << sig << ::std::endl;
+    get_line_stream() << DBG_INFO_INDICATOR << sig << ::std::endl;
 }
 
 
-// Prints function signature to ::std::clog;
+// Prints function signature to the log;
 #define print_sig print_self_sig(__PRETTY_FUNCTION__)
 
 
@@ -0,0 +1,355 @@
+// Author: Cezary Bartoszuk
+// Email: cbart@students.mimuw.edu.pl
+
+#ifndef __CANNON__DISPATCH__H__
+#define __CANNON__DISPATCH__H__
+
+
+#include <complex>
+#include <cstring>
+#include "convert.h"
+#include "kernel.h"
+#include "multiply.h"
+#include "strassen.h"
+#include "thread_pool.h"
+
+
+namespace cannon
+{
+
+
+// Local product kernel variants compiled into the binary.
+enum kernel_variant
+{
+    KERNEL_AUTO,
+    KERNEL_SCALAR,
+    KERNEL_SSE2,
+    KERNEL_AVX2,
+    KERNEL_AVX512
+};
+
+
+// Micro-kernel implementing `VARIANT` for `element_t`,
+// element types without a specialized kernel use the scalar one.
+// Complex types run the real kernel with `METHOD`.
+template<typename element_t, kernel_variant VARIANT, gemm::complex_method METHOD = gemm::COMPLEX_4M>
+struct variant_kernel
+{
+    typedef gemm::scalar_kernel<element_t> type;
+};
+
+
+template<typename real_t, kernel_variant VARIANT, gemm::complex_method METHOD>
+struct variant_kernel< ::std::complex<real_t>, VARIANT, METHOD>
+{
+    typedef gemm::complex_kernel<typename variant_kernel<real_t, VARIANT>::type, METHOD> type;
+};
+
+
+#ifdef CANNON_X86_KERNELS
+
+template<gemm::complex_method METHOD>
+struct variant_kernel<double, KERNEL_SSE2, METHOD>
+{
+    typedef gemm::sse2_double_kernel type;
+};
+
+template<gemm::complex_method METHOD>
+struct variant_kernel<double, KERNEL_AVX2, METHOD>
+{
+    typedef gemm::avx2_double_kernel type;
+};
+
+template<gemm::complex_method METHOD>
+struct variant_kernel<double, KERNEL_AVX512, METHOD>
+{
+    typedef gemm::avx512_double_kernel type;
+};
+
+template<gemm::complex_method METHOD>
+struct variant_kernel<float, KERNEL_SSE2, METHOD>
+{
+    typedef gemm::sse2_float_kernel type;
+};
+
+template<gemm::complex_method METHOD>
+struct variant_kernel<float, KERNEL_AVX2, METHOD>
+{
+    typedef gemm::avx2_float_kernel type;
+};
+
+template<gemm::complex_method METHOD>
+struct variant_kernel<float, KERNEL_AVX512, METHOD>
+{
+    typedef gemm::avx512_float_kernel type;
+};
+
+#endif
+
+
+// Kernel names as accepted by `--kernel=`.
+inline const char * kernel_name(kernel_variant variant)
+{
+    switch(variant)
+    {
+    case KERNEL_AUTO:
+        return "auto";
+    case KERNEL_SCALAR:
+        return "scalar";
+    case KERNEL_SSE2:
+        return "sse2";
+    case KERNEL_AVX2:
+        return "avx2";
+    case KERNEL_AVX512:
+        return "avx512";
+    }
+    return "unknown";
+}
+
+
+// Parses kernel name, returns false if `name` is not a kernel.
+inline bool parse_kernel_variant(const char * name, kernel_variant & variant)
+{
+    const kernel_variant variants[] =
+        {KERNEL_AUTO, KERNEL_SCALAR, KERNEL_SSE2, KERNEL_AVX2, KERNEL_AVX512};
+    for(size_t i = 0; i < sizeof(variants) / sizeof(variants[0]); ++i)
+    {
+        if(::std::strcmp(name, kernel_name(variants[i])) == 0)
+        {
+            variant = variants[i];
+            return true;
+        }
+    }
+    return false;
+}
+
+
+// Checks (with CPUID) whether this CPU can run `variant`.
+inline bool kernel_supported(kernel_variant variant)
+{
+#ifdef CANNON_X86_KERNELS
+    __builtin_cpu_init();
+    switch(variant)
+    {
+    case KERNEL_AUTO:
+    case KERNEL_SCALAR:
+        return true;
+    case KERNEL_SSE2:
+        return __builtin_cpu_supports("sse2");
+    case KERNEL_AVX2:
+        return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+    case KERNEL_AVX512:
+        return __builtin_cpu_supports("avx512f");
+    }
+    return false;
+#else
+    return variant == KERNEL_AUTO || variant == KERNEL_SCALAR;
+#endif
+}
+
+
+// Picks the fastest variant this CPU supports.
+inline kernel_variant detect_kernel()
+{
+    const kernel_variant preferred[] = {KERNEL_AVX512, KERNEL_AVX2, KERNEL_SSE2};
+    for(size_t i = 0; i < sizeof(preferred) / sizeof(preferred[0]); ++i)
+    {
+        if(kernel_supported(preferred[i]))
+        {
+            return preferred[i];
+        }
+    }
+    return KERNEL_SCALAR;
+}
+
+
+// How the local product is built.
+struct product_config
+{
+    // Kernel variant. `KERNEL_AUTO` has to be resolved (and the variant
+    // checked with `kernel_supported`) before the products are built,
+    // `main` does it once with `detect_kernel`.
+    kernel_variant kernel;
+    // Strassen-Winograd recursion for operands larger
+    // than the cutoff, 0 for the classical product.
+    size_t strassen_cutoff;
+    // 3M or 4M product for complex elements.
+    gemm::complex_method complex;
+    product_config()
+        throw()
+      : kernel(KERNEL_AUTO),
+        strassen_cutoff(0),
+        complex(gemm::COMPLEX_4M)
+    {
+    }
+};
+
+
+// Resolves `config`'s kernel variant and complex method to a micro-kernel
+// type and returns `factory.template create<kernel_type>()`.
+template<typename element_t, kernel_variant VARIANT, typename factory_t>
+typename factory_t::result_type with_variant_kernel(
+        const product_config & config,
+        const factory_t & factory)
+{
+    if(config.complex == gemm::COMPLEX_3M)
+    {
+        return factory.template create<
+            typename variant_kernel<element_t, VARIANT, gemm::COMPLEX_3M>::type>();
+    }
+    return factory.template create<
+        typename variant_kernel<element_t, VARIANT, gemm::COMPLEX_4M>::type>();
+}
+
+
+// Returns `factory.template create<kernel_type>()` for `config`'s kernel
+// variant, as resolved by `main` (an unresolved one runs the scalar kernel).
+template<typename element_t, typename factory_t>
+typename factory_t::result_type with_kernel(
+        const product_config & config,
+        const factory_t & factory)
+{
+    switch(config.kernel)
+    {
+    case KERNEL_SSE2:
+        return with_variant_kernel<element_t, KERNEL_SSE2>(config, factory);
+    case KERNEL_AVX2:
+        return with_variant_kernel<element_t, KERNEL_AVX2>(config, factory);
+    case KERNEL_AVX512:
+        return with_variant_kernel<element_t, KERNEL_AVX512>(config, factory);
+    default:
+        return with_variant_kernel<element_t, KERNEL_SCALAR>(config, factory);
+    }
+}
+
+
+// Builds the whole-partial local product for a given kernel:
+// classical, or Strassen-Winograd if `config` asks for it with
+// scratch preallocated for `planned_size`.
+template<typename element_t, typename storage_t, size_t size>
+struct product_factory
+{
+    typedef typename product_function<element_t, storage_t, size>::type result_type;
+    const product_config & config;
+    thread_pool & pool;
+    size_t planned_size;
+    template<typename kernel_t>
+    result_type create() const
+    {
+        if(config.strassen_cutoff != 0)
+        {
+            return strassen::strassen_prod<element_t, storage_t, size, kernel_t>(
+                    pool, config.strassen_cutoff, planned_size);
+        }
+        return parallel_prod<element_t, storage_t, size, kernel_t>(pool);
+    }
+};
+
+
+// Builds the block (sub-matrix) product for a given kernel.
+template<typename element_t, typename source_t = element_t>
+struct block_product_factory
+{
+    typedef typename block_product_function<element_t, source_t>::type result_type;
+    thread_pool & pool;
+    template<typename kernel_t>
+    result_type create() const
+    {
+        return parallel_block_prod<kernel_t, source_t>(pool);
+    }
+};
+
+
+// Creates the threaded local product described by `config`,
+// `planned_size` is the size of the operands scratch memory
+// (if any) is preallocated for.
+template<typename element_t, typename storage_t, size_t size>
+typename product_function<element_t, storage_t, size>::type make_product(
+        const product_config & config,
+        thread_pool & pool,
+        size_t planned_size = size)
+{
+    const product_factory<element_t, storage_t, size> factory = {config, pool, planned_size};
+    return with_kernel<element_t>(config, factory);
+}
+
+
+// Creates the threaded block product running `config`'s kernel
+// (always classical - it works on panels, not whole partials).
+template<typename element_t>
+typename block_product_function<element_t>::type make_block_product(
+        const product_config & config,
+        thread_pool & pool)
+{
+    const block_product_factory<element_t> factory = {pool};
+    return with_kernel<element_t>(config, factory);
+}
+
+
+// Creates the threaded block product of `source_t` operands (narrowed
+// `element_t`s, see transport.h) into `element_t` results, they are
+// widened while packed.
+template<typename element_t, typename source_t>
+typename block_product_function<element_t, source_t>::type make_transport_block_product(
+        const product_config & config,
+        thread_pool & pool)
+{
+    const block_product_factory<element_t, source_t> factory = {pool};
+    return with_kernel<element_t>(config, factory);
+}
+
+
+// Builds the narrowing of the operands with a given kernel's
+// instruction set.
+template<typename element_t, typename transport_t>
+struct narrow_factory
+{
+    typedef typename narrow_function<element_t, transport_t>::type result_type;
+    template<typename kernel_t>
+    result_type create() const
+    {
+        return & converter<element_t, transport_t, kernel_isa<kernel_t>::value>::narrow;
+    }
+};
+
+
+// Creates the rounding of `element_t` operands to `transport_t` (see
+// convert.h) vectorized as `config`'s kernel.
+template<typename element_t, typename transport_t>
+typename narrow_function<element_t, transport_t>::type make_narrow(const product_config & config)
+{
+    const narrow_factory<element_t, transport_t> factory = {};
+    return with_kernel<element_t>(config, factory);
+}
+
+
+// Builds the block-sparse product for a given kernel.
+template<typename element_t>
+struct block_sparse_product_factory
+{
+    typedef typename block_sparse_product_function<element_t>::type result_type;
+    thread_pool & pool;
+    template<typename kernel_t>
+    result_type create() const
+    {
+        return parallel_block_sparse_prod<kernel_t>(pool);
+    }
+};
+
+
+// Creates the threaded product of block-sparse partials running
+// `config`'s kernel (classical - on tiles).
+template<typename element_t>
+typename block_sparse_product_function<element_t>::type make_block_sparse_product(
+        const product_config & config,
+        thread_pool & pool)
+{
+    const block_sparse_product_factory<element_t> factory = {pool};
+    return with_kernel<element_t>(config, factory);
+}
+
+
+}  // namespace cannon
+
+
+#endif
@@ -6,6 +6,10 @@
 
 
 #include <algorithm>
+#include <cstring>
+#include <boost/numeric/ublas/fwd.hpp>
+#include <boost/type_traits/is_same.hpp>
+#include "thread_pool.h"
 
 
 namespace cannon
@@ -13,6 +17,7 @@ namespace cannon
 
 
 // Fills given matrix with elements returned by `generator()`.
+// Serial - for stateful generators only, see the threaded fills below.
 template<typename matrix_t, typename generator_t>
 void fill(matrix_t & matrix, generator_t generator)
     throw()
@@ -21,6 +26,294 @@ void fill(matrix_t & matrix, generator_t generator)
 }
 
 
+// The threaded fills: every thread of the pool fills its own range of
+// `matrix`'s storage lines (rows of a row-major matrix, columns of
+// a col-major one), walking the storage in order. The matrix storage
+// isn't touched before (see allocator.h), so the fill places the pages
+// on the NUMA node of the thread that fills them - the same contiguous
+// ranges of rows the local product's threads compute on (see
+// `gemm::parallel_gemm`).
+//
+// `filler_t` fills lines `[first, last)` of `length` elements at
+// `lines`: `filler(lines, first, last, length, col_major)`.
+template<typename matrix_t, typename filler_t>
+struct fill_task
+{
+    matrix_t * matrix;
+    const filler_t * filler;
+    void operator()(size_t thread_index, size_t threads) const
+        throw()
+    {
+        typedef typename matrix_t::orientation_category orientation_category;
+        const bool col_major =
+            ::boost::is_same<orientation_category, ::boost::numeric::ublas::column_major_tag>::value;
+        const size_t lines = col_major ? matrix->size2() : matrix->size1();
+        const size_t length = col_major ? matrix->size1() : matrix->size2();
+        size_t first, last;
+        split_range(lines, 1, threads, thread_index, first, last);
+        (* filler)(& matrix->data()[0], first, last, length, col_major);
+    }
+};
+
+
+template<typename matrix_t, typename filler_t>
+void fill_lines(matrix_t & matrix, const filler_t & filler, thread_pool & pool)
+    throw()
+{
+    if(matrix.size1() == 0 || matrix.size2() == 0)
+    {
+        return;
+    }
+    const fill_task<matrix_t, filler_t> task = {& matrix, & filler};
+    pool.run(task);
+}
+
+
+// All bits zero - the zero of all the element types.
+template<typename element_t>
+struct zero_filler
+{
+    void operator()(element_t * lines, size_t first, size_t last, size_t length, bool) const
+        throw()
+    {
+        ::std::memset(static_cast<void *>(lines + first * length), 0,
+                (last - first) * length * sizeof(element_t));
+    }
+};
+
+
+template<typename element_t>
+struct constant_filler
+{
+    element_t value;
+    void operator()(element_t * lines, size_t first, size_t last, size_t length, bool) const
+        throw()
+    {
+        ::std::fill(lines + first * length, lines + last * length, value);
+    }
+};
+
+
+// Ones where the global row and column (from `first_row`, `first_col`
+// on) are equal, zeros elsewhere.
+template<typename element_t>
+struct identity_filler
+{
+    size_t first_row;
+    size_t first_col;
+    void operator()(element_t * lines, size_t first, size_t last, size_t length, bool col_major) const
+        throw()
+    {
+        zero_filler<element_t>()(lines, first, last, length, col_major);
+        // Global index of the lines and of the first element of a line.
+        const size_t line_offset = col_major ? first_col : first_row;
+        const size_t element_offset = col_major ? first_row : first_col;
+        for(size_t line = first; line < last; ++line)
+        {
+            const size_t diagonal = line + line_offset;
+            if(diagonal >= element_offset && diagonal - element_offset < length)
+            {
+                lines[line * length + diagonal - element_offset] = element_t(1);
+            }
+        }
+    }
+};
+
+
+// `generator(global row, global col)` from `first_row`, `first_col` on,
+// a whole block of a row at once (see `random_generator::block`) where
+// it's there: along a row-major line, across `BLOCK` col-major ones.
+template<typename element_t, typename generator_t>
+struct generator_filler
+{
+    static const size_t BLOCK = generator_t::BLOCK;
+    const generator_t * generator;
+    size_t first_row;
+    size_t first_col;
+    void operator()(element_t * lines, size_t first, size_t last, size_t length, bool col_major) const
+        throw()
+    {
+        if(col_major)
+        {
+            fill_cols(lines, first, last, length);
+        }
+        else
+        {
+            fill_rows(lines, first, last, length);
+        }
+    }
+    void fill_rows(element_t * lines, size_t first, size_t last, size_t length) const
+        throw()
+    {
+        const size_t head = ::std::min(length, (BLOCK - first_col % BLOCK) % BLOCK);
+        for(size_t line = first; line < last; ++line)
+        {
+            element_t * out = lines + line * length;
+            const size_t row = first_row + line;
+            size_t j = 0;
+            for(; j < head; ++j)
+            {
+                out[j] = (* generator)(row, first_col + j);
+            }
+            for(; j + BLOCK <= length; j += BLOCK)
+            {
+                generator->block(row, first_col + j, out + j);
+            }
+            for(; j < length; ++j)
+            {
+                out[j] = (* generator)(row, first_col + j);
+            }
+        }
+    }
+    void fill_cols(element_t * lines, size_t first, size_t last, size_t length) const
+        throw()
+    {
+        size_t line = first;
+        while(line < last)
+        {
+            element_t * out = lines + line * length;
+            const size_t col = first_col + line;
+            if(col % BLOCK != 0 || line + BLOCK > last)
+            {
+                for(size_t i = 0; i < length; ++i)
+                {
+                    out[i] = (* generator)(first_row + i, col);
+                }
+                ++line;
+                continue;
+            }
+            for(size_t i = 0; i < length; ++i)
+            {
+                element_t drawn[BLOCK];
+                generator->block(first_row + i, col, drawn);
+                for(size_t k = 0; k < BLOCK; ++k)
+                {
+                    out[k * length + i] = drawn[k];
+                }
+            }
+            line += BLOCK;
+        }
+    }
+};
+
+
+// Fills `matrix` - the part of a global matrix from its `first_row`,
+// `first_col` element on - with elements returned by
+// `generator(global row, global col)`, on all of `pool`'s threads.
+template<typename matrix_t, typename generator_t>
+void fill(
+        matrix_t & matrix,
+        const generator_t & generator,
+        size_t first_row,
+        size_t first_col,
+        thread_pool & pool)
+    throw()
+{
+    const generator_filler<typename matrix_t::value_type, generator_t> filler = {
+        & generator, first_row, first_col};
+    fill_lines(matrix, filler, pool);
+}
+
+
+// Zeroes `matrix` on all of `pool`'s threads.
+template<typename matrix_t>
+void fill_zero(matrix_t & matrix, thread_pool & pool)
+    throw()
+{
+    fill_lines(matrix, zero_filler<typename matrix_t::value_type>(), pool);
+}
+
+
+// Fills `matrix` with `value` on all of `pool`'s threads.
+template<typename matrix_t>
+void fill_constant(matrix_t & matrix, typename matrix_t::value_type value, thread_pool & pool)
+    throw()
+{
+    const constant_filler<typename matrix_t::value_type> filler = {value};
+    fill_lines(matrix, filler, pool);
+}
+
+
+// Fills `matrix` - the part of the identity matrix from its `first_row`,
+// `first_col` element on - on all of `pool`'s threads.
+template<typename matrix_t>
+void fill_identity(matrix_t & matrix, size_t first_row, size_t first_col, thread_pool & pool)
+    throw()
+{
+    const identity_filler<typename matrix_t::value_type> filler = {first_row, first_col};
+    fill_lines(matrix, filler, pool);
+}
+
+
+// Zeroes `tile` x `tile` tiles of the global matrix (from `first_row`,
+// `first_col` on) unless `keep(tile row, tile col)`: every line asks
+// `keep` once per tile it crosses.
+template<typename element_t, typename keep_t>
+struct tile_filler
+{
+    const keep_t * keep;
+    size_t tile;
+    size_t first_row;
+    size_t first_col;
+    void operator()(element_t * lines, size_t first, size_t last, size_t length, bool col_major) const
+        throw()
+    {
+        const size_t line_offset = col_major ? first_col : first_row;
+        const size_t element_offset = col_major ? first_row : first_col;
+        for(size_t line = first; line < last; ++line)
+        {
+            const size_t line_tile = (line + line_offset) / tile;
+            for(size_t i = 0; i < length; )
+            {
+                const size_t element = i + element_offset;
+                const size_t end = ::std::min(length, i + tile - element % tile);
+                const size_t element_tile = element / tile;
+                if(!(* keep)(col_major ? element_tile : line_tile, col_major ? line_tile : element_tile))
+                {
+                    ::std::fill(lines + line * length + i, lines + line * length + end, element_t());
+                }
+                i = end;
+            }
+        }
+    }
+};
+
+
+// Zeroes the tiles `keep` drops of `matrix` - the part of a global
+// matrix from its `first_row`, `first_col` element on - on all of
+// `pool`'s threads.
+template<typename matrix_t, typename keep_t>
+void fill_tiles(
+        matrix_t & matrix,
+        const keep_t & keep,
+        size_t tile,
+        size_t first_row,
+        size_t first_col,
+        thread_pool & pool)
+    throw()
+{
+    const tile_filler<typename matrix_t::value_type, keep_t> filler = {& keep, tile, first_row, first_col};
+    fill_lines(matrix, filler, pool);
+}
+
+
+// Zeroes `matrix`'s padding: elements outside of its top left
+// `rows` x `cols` part. Only edge partials have any.
+template<typename matrix_t>
+void fill_padding(matrix_t & matrix, size_t rows, size_t cols)
+    throw()
+{
+    typedef typename matrix_t::value_type value_type;
+    for(size_t i = 0; i < matrix.size1(); ++i)
+    {
+        for(size_t j = i < rows ? cols : 0; j < matrix.size2(); ++j)
+        {
+            matrix(i, j) = value_type();
+        }
+    }
+}
+
+
 }  // namespace cannon
 
 
@@ -0,0 +1,644 @@
+// Author: Cezary Bartoszuk
+// Email: cbart@students.mimuw.edu.pl
+
+#ifndef __CANNON__GEMM__H__
+#define __CANNON__GEMM__H__
+
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <boost/throw_exception.hpp>
+#include "convert.h"
+#include "kernel.h"
+#include "thread_pool.h"
+
+
+#ifndef L1CACHESIZE
+#define L1CACHESIZE (32l * 1024l)
+#endif
+
+#ifndef L2CACHESIZE
+#define L2CACHESIZE (256l * 1024l)
+#endif
+
+#ifndef L3CACHESIZE
+#define L3CACHESIZE (8l * 1024l * 1024l)
+#endif
+
+
+namespace cannon
+{
+namespace gemm
+{
+
+
+// Cache sizes (in bytes) the blocking is tuned for.
+const size_t L1_CACHE_SIZE = L1CACHESIZE;
+const size_t L2_CACHE_SIZE = L2CACHESIZE;
+const size_t L3_CACHE_SIZE = L3CACHESIZE;
+
+// Alignment of the packing buffers.
+const size_t BUFFER_ALIGNMENT = 64;
+
+
+// Packed operand format of a micro-kernel (see below).
+template<typename kernel_t>
+struct packing;
+
+
+// Cache blocking for a given micro-kernel:
+//   `KC` x `NR` sliver of packed right operand fills half of L1,
+//   `MC` x `KC` block of packed left operand fills half of L2,
+//   `KC` x `NC` panel of packed right operand fills half of L3.
+template<typename kernel_t>
+struct blocking
+{
+    static const size_t ELEMENT_SIZE =
+        packing<kernel_t>::PLANES * sizeof(typename packing<kernel_t>::packed_type);
+    static const size_t MR = kernel_t::MR;
+    static const size_t NR = kernel_t::NR;
+    static const size_t KC = L1_CACHE_SIZE / 2 / (NR * ELEMENT_SIZE);
+    static const size_t MC = L2_CACHE_SIZE / 2 / (KC * ELEMENT_SIZE) / MR * MR;
+    static const size_t NC = L3_CACHE_SIZE / 2 / (KC * ELEMENT_SIZE) / NR * NR;
+};
+
+
+// Uninitialized, `BUFFER_ALIGNMENT` aligned scratch memory. Running out
+// of memory is fatal, as for the matrices (see allocator.h).
+template<typename element_t>
+class aligned_buffer
+{
+public:
+    typedef element_t element_type;
+private:
+    element_type * memory;
+public:
+    explicit aligned_buffer(size_t size)
+      : memory(NULL)
+    {
+        void * ptr = NULL;
+        if(posix_memalign(& ptr, BUFFER_ALIGNMENT, ::std::max<size_t>(size, 1) * sizeof(element_type)) != 0)
+        {
+            ::boost::throw_exception(::std::bad_alloc());
+        }
+        memory = static_cast<element_type *>(ptr);
+    }
+    ~aligned_buffer()
+        throw()
+    {
+        free(memory);
+    }
+    element_type * get() const
+        throw()
+    {
+        return memory;
+    }
+private:
+    aligned_buffer(const aligned_buffer &);
+    aligned_buffer & operator=(const aligned_buffer &);
+};
+
+
+// Packing buffers of `threads` threads, each big enough for the blocks
+// of any kernel: a `blocking`'s `MC` x `KC` block takes half of L2 at
+// most and its `KC` x `NC` panel half of L3. They're allocated once and
+// reused by every `gemm` call; a thread's pages are placed by its own
+// first packing.
+class packing_scratch
+{
+private:
+    static const size_t LEFT_BYTES =
+        (L2_CACHE_SIZE / 2 + BUFFER_ALIGNMENT - 1) / BUFFER_ALIGNMENT * BUFFER_ALIGNMENT;
+    static const size_t RIGHT_BYTES =
+        (L3_CACHE_SIZE / 2 + BUFFER_ALIGNMENT - 1) / BUFFER_ALIGNMENT * BUFFER_ALIGNMENT;
+    const size_t threads;
+    aligned_buffer<char> memory;
+public:
+    explicit packing_scratch(size_t threads)
+      : threads(::std::max<size_t>(threads, 1)),
+        memory(this->threads * (LEFT_BYTES + RIGHT_BYTES))
+    {
+    }
+    // Amount of threads it has buffers for.
+    size_t size() const
+        throw()
+    {
+        return threads;
+    }
+    // Packed left blocks and right panels of thread `thread_index`.
+    template<typename packed_t>
+    packed_t * left(size_t thread_index) const
+        throw()
+    {
+        return reinterpret_cast<packed_t *>(memory.get() + thread_index * (LEFT_BYTES + RIGHT_BYTES));
+    }
+    template<typename packed_t>
+    packed_t * right(size_t thread_index) const
+        throw()
+    {
+        return reinterpret_cast<packed_t *>(
+                memory.get() + thread_index * (LEFT_BYTES + RIGHT_BYTES) + LEFT_BYTES);
+    }
+private:
+    packing_scratch(const packing_scratch &);
+    packing_scratch & operator=(const packing_scratch &);
+};
+
+
+// Packs `mc` x `kc` block of row-major `a` into `MR`-row slivers,
+// each stored column after column. Missing rows are zero-padded.
+template<size_t MR, typename element_t>
+inline void pack_left(
+        size_t mc,
+        size_t kc,
+        const element_t * a,
+        size_t lda,
+        element_t * buffer)
+    throw()
+{
+    for(size_t ir = 0; ir < mc; ir += MR)
+    {
+        const size_t mr = ::std::min(MR, mc - ir);
+        const element_t * sliver = a + ir * lda;
+        for(size_t p = 0; p < kc; ++p)
+        {
+            size_t i = 0;
+            for(; i < mr; ++i)
+            {
+                * buffer++ = sliver[i * lda + p];
+            }
+            for(; i < MR; ++i)
+            {
+                * buffer++ = element_t();
+            }
+        }
+    }
+}
+
+
+// Packs `kc` x `nc` block of col-major `b` into `NR`-column slivers,
+// each stored row after row. Missing columns are zero-padded.
+template<size_t NR, typename element_t>
+inline void pack_right(
+        size_t kc,
+        size_t nc,
+        const element_t * b,
+        size_t ldb,
+        element_t * buffer)
+    throw()
+{
+    for(size_t jr = 0; jr < nc; jr += NR)
+    {
+        const size_t nr = ::std::min(NR, nc - jr);
+        const element_t * sliver = b + jr * ldb;
+        for(size_t p = 0; p < kc; ++p)
+        {
+            size_t j = 0;
+            for(; j < nr; ++j)
+            {
+                * buffer++ = sliver[j * ldb + p];
+            }
+            for(; j < NR; ++j)
+            {
+                * buffer++ = element_t();
+            }
+        }
+    }
+}
+
+
+// Place of `count` narrower `source_t`s at the end of the `place`
+// elements at `buffer`, where they are widened from (see convert.h).
+template<typename source_t, typename element_t>
+inline source_t * narrow_sliver(element_t * buffer, size_t place, size_t count)
+    throw()
+{
+    return reinterpret_cast<source_t *>(buffer + place) - count;
+}
+
+
+// Same as `pack_left` for an operand of a narrower `source_t` (see
+// transport.h): every sliver is packed as it is to the end of its
+// place and widened in place by `convert_t` while in L1.
+template<size_t MR, typename convert_t, typename element_t, typename source_t>
+inline void pack_widened_left(
+        size_t mc,
+        size_t kc,
+        const source_t * a,
+        size_t lda,
+        element_t * buffer)
+    throw()
+{
+    for(size_t ir = 0; ir < mc; ir += MR, buffer += MR * kc)
+    {
+        source_t * const sliver = narrow_sliver<source_t>(buffer, MR * kc, MR * kc);
+        pack_left<MR>(::std::min(MR, mc - ir), kc, a + ir * lda, lda, sliver);
+        convert_t::widen(sliver, MR * kc, buffer);
+    }
+}
+
+
+template<size_t NR, typename convert_t, typename element_t, typename source_t>
+inline void pack_widened_right(
+        size_t kc,
+        size_t nc,
+        const source_t * b,
+        size_t ldb,
+        element_t * buffer)
+    throw()
+{
+    for(size_t jr = 0; jr < nc; jr += NR, buffer += NR * kc)
+    {
+        source_t * const sliver = narrow_sliver<source_t>(buffer, NR * kc, NR * kc);
+        pack_right<NR>(kc, ::std::min(NR, nc - jr), b + jr * ldb, ldb, sliver);
+        convert_t::widen(sliver, NR * kc, buffer);
+    }
+}
+
+
+// Packs `count` x `kc` block of `x` (element `(s, p)` at `x[s * ld + p]`)
+// into `R`-wide slivers of `PLANES` real planes each: real parts,
+// imaginary parts and (for 3 planes) their sums.
+template<size_t R, size_t PLANES, typename real_t>
+inline void pack_complex(
+        size_t count,
+        size_t kc,
+        const ::std::complex<real_t> * x,
+        size_t ld,
+        real_t * buffer)
+    throw()
+{
+    for(size_t sr = 0; sr < count; sr += R)
+    {
+        const size_t r = ::std::min(R, count - sr);
+        const ::std::complex<real_t> * sliver = x + sr * ld;
+        real_t * re = buffer;
+        real_t * im = buffer + R * kc;
+        real_t * sum = buffer + 2 * R * kc;
+        for(size_t p = 0; p < kc; ++p)
+        {
+            size_t s = 0;
+            for(; s < r; ++s)
+            {
+                const ::std::complex<real_t> & value = sliver[s * ld + p];
+                * re++ = value.real();
+                * im++ = value.imag();
+                if(PLANES == 3)
+                {
+                    * sum++ = value.real() + value.imag();
+                }
+            }
+            for(; s < R; ++s)
+            {
+                * re++ = real_t();
+                * im++ = real_t();
+                if(PLANES == 3)
+                {
+                    * sum++ = real_t();
+                }
+            }
+        }
+        buffer += PLANES * R * kc;
+    }
+}
+
+
+// Same as `pack_complex` for a narrower `source_t`: the real and the
+// imaginary planes of every sliver are packed to the end of its place,
+// widened in place by `convert_t` and (3 planes) summed up.
+template<size_t R, size_t PLANES, typename convert_t, typename real_t, typename source_t>
+inline void pack_widened_complex(
+        size_t count,
+        size_t kc,
+        const ::std::complex<source_t> * x,
+        size_t ld,
+        real_t * buffer)
+    throw()
+{
+    for(size_t sr = 0; sr < count; sr += R, buffer += PLANES * R * kc)
+    {
+        source_t * const sliver = narrow_sliver<source_t>(buffer, PLANES * R * kc, 2 * R * kc);
+        pack_complex<R, 2>(::std::min(R, count - sr), kc, x + sr * ld, ld, sliver);
+        convert_t::widen(sliver, 2 * R * kc, buffer);
+        for(size_t i = 0; PLANES == 3 && i < R * kc; ++i)
+        {
+            buffer[2 * R * kc + i] = buffer[i] + buffer[R * kc + i];
+        }
+    }
+}
+
+
+// Packed operand format of a micro-kernel: `packed_type` values,
+// `PLANES` of them per operand element. Operands are `element_type`
+// or narrower `source_t` ones, widened with the kernel's instruction set.
+template<typename kernel_t>
+struct packing
+{
+    typedef typename kernel_t::element_type element_type;
+    typedef element_type packed_type;
+    static const size_t PLANES = 1;
+    static void left(size_t mc, size_t kc, const element_type * a, size_t lda, packed_type * buffer)
+        throw()
+    {
+        pack_left<kernel_t::MR>(mc, kc, a, lda, buffer);
+    }
+    static void right(size_t kc, size_t nc, const element_type * b, size_t ldb, packed_type * buffer)
+        throw()
+    {
+        pack_right<kernel_t::NR>(kc, nc, b, ldb, buffer);
+    }
+    template<typename source_t>
+    static void left(size_t mc, size_t kc, const source_t * a, size_t lda, packed_type * buffer)
+        throw()
+    {
+        pack_widened_left<kernel_t::MR, converter<element_type, source_t, kernel_isa<kernel_t>::value> >(
+                mc, kc, a, lda, buffer);
+    }
+    template<typename source_t>
+    static void right(size_t kc, size_t nc, const source_t * b, size_t ldb, packed_type * buffer)
+        throw()
+    {
+        pack_widened_right<kernel_t::NR, converter<element_type, source_t, kernel_isa<kernel_t>::value> >(
+                kc, nc, b, ldb, buffer);
+    }
+};
+
+
+// Complex kernels take split real/imaginary planes.
+template<typename real_kernel_t, complex_method METHOD>
+struct packing<complex_kernel<real_kernel_t, METHOD> >
+{
+    typedef complex_kernel<real_kernel_t, METHOD> kernel_type;
+    typedef typename kernel_type::element_type element_type;
+    typedef typename kernel_type::real_type packed_type;
+    static const size_t PLANES = kernel_type::PLANES;
+    static void left(size_t mc, size_t kc, const element_type * a, size_t lda, packed_type * buffer)
+        throw()
+    {
+        pack_complex<kernel_type::MR, PLANES>(mc, kc, a, lda, buffer);
+    }
+    static void right(size_t kc, size_t nc, const element_type * b, size_t ldb, packed_type * buffer)
+        throw()
+    {
+        pack_complex<kernel_type::NR, PLANES>(nc, kc, b, ldb, buffer);
+    }
+    template<typename source_t>
+    static void left(
+            size_t mc,
+            size_t kc,
+            const ::std::complex<source_t> * a,
+            size_t lda,
+            packed_type * buffer)
+        throw()
+    {
+        pack_widened_complex<kernel_type::MR, PLANES,
+            converter<packed_type, source_t, kernel_isa<kernel_type>::value> >(mc, kc, a, lda, buffer);
+    }
+    template<typename source_t>
+    static void right(
+            size_t kc,
+            size_t nc,
+            const ::std::complex<source_t> * b,
+            size_t ldb,
+            packed_type * buffer)
+        throw()
+    {
+        pack_widened_complex<kernel_type::NR, PLANES,
+            converter<packed_type, source_t, kernel_isa<kernel_type>::value> >(nc, kc, b, ldb, buffer);
+    }
+};
+
+
+// Edge (partial `mr` x `nr`) tile of the result: masked kernels
+// update it directly...
+template<typename kernel_t, bool MASKED = kernel_t::MASKED>
+struct edge_tile
+{
+    static void run(
+            size_t mr,
+            size_t nr,
+            size_t kc,
+            const typename packing<kernel_t>::packed_type * a,
+            const typename packing<kernel_t>::packed_type * b,
+            typename kernel_t::element_type * c,
+            size_t ldc)
+        throw()
+    {
+        kernel_t::run_masked(kc, a, b, c, ldc, mr, nr);
+    }
+};
+
+
+// ...the others compute into a full-sized scratch tile.
+template<typename kernel_t>
+struct edge_tile<kernel_t, false>
+{
+    static void run(
+            size_t mr,
+            size_t nr,
+            size_t kc,
+            const typename packing<kernel_t>::packed_type * a,
+            const typename packing<kernel_t>::packed_type * b,
+            typename kernel_t::element_type * c,
+            size_t ldc)
+        throw()
+    {
+        typedef typename kernel_t::element_type element_type;
+        element_type tile[kernel_t::MR * kernel_t::NR] = {};
+        kernel_t::run(kc, a, b, tile, kernel_t::NR);
+        for(size_t i = 0; i < mr; ++i)
+        {
+            for(size_t j = 0; j < nr; ++j)
+            {
+                c[i * ldc + j] += tile[i * kernel_t::NR + j];
+            }
+        }
+    }
+};
+
+
+// Runs the micro-kernel on a possibly partial `mr` x `nr` tile.
+template<typename kernel_t>
+inline void micro_tile(
+        size_t mr,
+        size_t nr,
+        size_t kc,
+        const typename packing<kernel_t>::packed_type * a,
+        const typename packing<kernel_t>::packed_type * b,
+        typename kernel_t::element_type * c,
+        size_t ldc)
+    throw()
+{
+    if(mr == kernel_t::MR && nr == kernel_t::NR)
+    {
+        kernel_t::run(kc, a, b, c, ldc);
+        return;
+    }
+    edge_tile<kernel_t>::run(mr, nr, kc, a, b, c, ldc);
+}
+
+
+// Cache-blocked matrix product:
+//   c += a * b
+// where `a` is row-major `m` x `k` (leading dimension `lda`),
+// `b` is col-major `k` x `n` (leading dimension `ldb`) and
+// `c` is row-major `m` x `n` (leading dimension `ldc`).
+// `a` and `b` may be of a narrower `source_t`, they are widened to
+// the kernel's elements when packed into `thread_index`'s buffers of
+// `scratch`.
+template<typename kernel_t, typename source_t>
+void gemm(
+        size_t m,
+        size_t n,
+        size_t k,
+        const source_t * a,
+        size_t lda,
+        const source_t * b,
+        size_t ldb,
+        typename kernel_t::element_type * c,
+        size_t ldc,
+        const packing_scratch & scratch,
+        size_t thread_index = 0)
+    throw()
+{
+    typedef typename packing<kernel_t>::packed_type packed_type;
+    typedef blocking<kernel_t> blocking_type;
+    const size_t PLANES = packing<kernel_t>::PLANES;
+    const size_t MR = blocking_type::MR;
+    const size_t NR = blocking_type::NR;
+    const size_t KC = blocking_type::KC;
+    const size_t MC = blocking_type::MC;
+    const size_t NC = blocking_type::NC;
+    if(m == 0 || n == 0 || k == 0)
+    {
+        return;
+    }
+    packed_type * const left_buffer = scratch.left<packed_type>(thread_index);
+    packed_type * const right_buffer = scratch.right<packed_type>(thread_index);
+    for(size_t jc = 0; jc < n; jc += NC)
+    {
+        const size_t nc = ::std::min(NC, n - jc);
+        for(size_t pc = 0; pc < k; pc += KC)
+        {
+            const size_t kc = ::std::min(KC, k - pc);
+            packing<kernel_t>::right(kc, nc, b + jc * ldb + pc, ldb, right_buffer);
+            for(size_t ic = 0; ic < m; ic += MC)
+            {
+                const size_t mc = ::std::min(MC, m - ic);
+                packing<kernel_t>::left(mc, kc, a + ic * lda + pc, lda, left_buffer);
+                for(size_t jr = 0; jr < nc; jr += NR)
+                {
+                    const size_t nr = ::std::min(NR, nc - jr);
+                    for(size_t ir = 0; ir < mc; ir += MR)
+                    {
+                        const size_t mr = ::std::min(MR, mc - ir);
+                        micro_tile<kernel_t>(
+                                mr, nr, kc,
+                                left_buffer + PLANES * ir * kc,
+                                right_buffer + PLANES * jr * kc,
+                                c + (ic + ir) * ldc + jc + jr,
+                                ldc);
+                    }
+                }
+            }
+        }
+    }
+}
+
+
+// Chooses a `rows` x `cols` grid of `threads` tiles of a `m` x `n`
+// result so that the tiles are as square as possible.
+inline void thread_grid(
+        size_t m,
+        size_t n,
+        size_t threads,
+        size_t & rows,
+        size_t & cols)
+    throw()
+{
+    rows = threads;
+    cols = 1;
+    double best = -1.0;
+    for(size_t r = 1; r <= threads; ++r)
+    {
+        if(threads % r != 0)
+        {
+            continue;
+        }
+        const size_t c = threads / r;
+        const double tile_m = static_cast<double>(m) / r;
+        const double tile_n = static_cast<double>(n) / c;
+        const double score = ::std::min(tile_m, tile_n) / ::std::max(tile_m, tile_n);
+        if(score > best)
+        {
+            best = score;
+            rows = r;
+            cols = c;
+        }
+    }
+}
+
+
+// Per-thread part of `parallel_gemm`: every thread owns
+// a contiguous tile of `c` and runs the serial engine on it
+// with its own packing buffers.
+template<typename kernel_t, typename source_t = typename kernel_t::element_type>
+struct gemm_task
+{
+    typedef typename kernel_t::element_type element_type;
+    const packing_scratch * scratch;
+    size_t m, n, k;
+    const source_t * a;
+    size_t lda;
+    const source_t * b;
+    size_t ldb;
+    element_type * c;
+    size_t ldc;
+    void operator()(size_t thread_index, size_t threads) const
+        throw()
+    {
+        size_t rows, cols;
+        thread_grid(m, n, threads, rows, cols);
+        size_t first_row, last_row, first_col, last_col;
+        split_range(m, kernel_t::MR, rows, thread_index / cols, first_row, last_row);
+        split_range(n, kernel_t::NR, cols, thread_index % cols, first_col, last_col);
+        gemm<kernel_t, source_t>(
+                last_row - first_row, last_col - first_col, k,
+                a + first_row * lda, lda,
+                b + first_col * ldb, ldb,
+                c + first_row * ldc + first_col, ldc,
+                * scratch, thread_index);
+    }
+};
+
+
+// Multi-threaded `gemm` - the result is split into
+// `pool.size()` tiles, one per thread. `scratch` has buffers
+// for all of them.
+template<typename kernel_t, typename source_t>
+void parallel_gemm(
+        thread_pool & pool,
+        const packing_scratch & scratch,
+        size_t m,
+        size_t n,
+        size_t k,
+        const source_t * a,
+        size_t lda,
+        const source_t * b,
+        size_t ldb,
+        typename kernel_t::element_type * c,
+        size_t ldc)
+    throw()
+{
+    const gemm_task<kernel_t, source_t> task = {& scratch, m, n, k, a, lda, b, ldb, c, ldc};
+    pool.run(task);
+}
+
+
+}  // namespace gemm
+}  // namespace cannon
+
+
+#endif
@@ -0,0 +1,918 @@
+// Author: Cezary Bartoszuk
+// Email: cbart@students.mimuw.edu.pl
+
+#ifndef __CANNON__KERNEL__H__
+#define __CANNON__KERNEL__H__
+
+
+#include <algorithm>
+#include <complex>
+#include <cstddef>
+#if defined(__x86_64__) || defined(__i386__)
+#define CANNON_X86_KERNELS 1
+#include <immintrin.h>
+#endif
+
+
+// Kernels for x86 extensions are always compiled (with per-function
+// target attributes) so that one binary can pick the best of them
+// at runtime, see `dispatch.h`.
+#ifdef CANNON_X86_KERNELS
+#define CANNON_TARGET_SSE2 __attribute__((target("sse2")))
+#define CANNON_TARGET_AVX2 __attribute__((target("avx2,fma")))
+#define CANNON_TARGET_AVX512 __attribute__((target("avx512f")))
+#endif
+
+
+namespace cannon
+{
+namespace gemm
+{
+
+
+// Micro-kernels compute a `MR` x `NR` register tile:
+//   c += a * b
+// where `a` is a packed `MR` x `kc` sliver (column after column),
+// `b` is a packed `kc` x `NR` sliver (row after row) and `c`
+// is a row-major tile with leading dimension `ldc`.
+// Kernels with `MASKED` set also have `run_masked` which updates only
+// the top left `mr` x `nr` part of `c` (edge tiles of the result), the
+// others are run on a scratch tile for the edges (see `gemm::micro_tile`).
+
+
+// Portable fallback for any element type.
+template<typename element_t>
+struct scalar_kernel
+{
+    typedef element_t element_type;
+    static const size_t MR = 4;
+    static const size_t NR = 4;
+    static const bool MASKED = true;
+    static void run(
+            size_t kc,
+            const element_type * a,
+            const element_type * b,
+            element_type * c,
+            size_t ldc)
+        throw();
+    static void run_masked(
+            size_t kc,
+            const element_type * a,
+            const element_type * b,
+            element_type * c,
+            size_t ldc,
+            size_t mr,
+            size_t nr)
+        throw();
+};
+
+
+template<typename element_t>
+inline void scalar_kernel<element_t>::run(
+        size_t kc,
+        const element_type * a,
+        const element_type * b,
+        element_type * c,
+        size_t ldc)
+    throw()
+{
+    run_masked(kc, a, b, c, ldc, MR, NR);
+}
+
+
+template<typename element_t>
+void scalar_kernel<element_t>::run_masked(
+        size_t kc,
+        const element_type * a,
+        const element_type * b,
+        element_type * c,
+        size_t ldc,
+        size_t mr,
+        size_t nr)
+    throw()
+{
+    element_type acc[MR][NR] = {};
+    for(size_t p = 0; p < kc; ++p, a += MR, b += NR)
+    {
+        for(size_t i = 0; i < mr; ++i)
+        {
+            for(size_t j = 0; j < nr; ++j)
+            {
+                acc[i][j] += a[i] * b[j];
+            }
+        }
+    }
+    for(size_t i = 0; i < mr; ++i)
+    {
+        for(size_t j = 0; j < nr; ++j)
+        {
+            c[i * ldc + j] += acc[i][j];
+        }
+    }
+}
+
+
+#ifdef CANNON_X86_KERNELS
+
+
+// SSE2 double kernel: 4 x 4 tile kept in 8 xmm accumulators.
+struct sse2_double_kernel
+{
+    typedef double element_type;
+    static const size_t MR = 4;
+    static const size_t NR = 4;
+    static const bool MASKED = true;
+    static void run(
+            size_t kc,
+            const element_type * a,
+            const element_type * b,
+            element_type * c,
+            size_t ldc)
+        throw();
+    static void run_masked(
+            size_t kc,
+            const element_type * a,
+            const element_type * b,
+            element_type * c,
+            size_t ldc,
+            size_t mr,
+            size_t nr)
+        throw();
+};
+
+
+CANNON_TARGET_SSE2
+inline void sse2_double_kernel::run(
+        size_t kc,
+        const element_type * a,
+        const element_type * b,
+        element_type * c,
+        size_t ldc)
+    throw()
+{
+    __m128d acc[MR][2];
+    for(size_t i = 0; i < MR; ++i)
+    {
+        acc[i][0] = _mm_setzero_pd();
+        acc[i][1] = _mm_setzero_pd();
+    }
+    for(size_t p = 0; p < kc; ++p, a += MR, b += NR)
+    {
+        const __m128d b0 = _mm_load_pd(b);
+        const __m128d b1 = _mm_load_pd(b + 2);
+        for(size_t i = 0; i < MR; ++i)
+        {
+            const __m128d ai = _mm_set1_pd(a[i]);
+            acc[i][0] = _mm_add_pd(acc[i][0], _mm_mul_pd(ai, b0));
+            acc[i][1] = _mm_add_pd(acc[i][1], _mm_mul_pd(ai, b1));
+        }
+    }
+    for(size_t i = 0; i < MR; ++i)
+    {
+        _mm_storeu_pd(c + i * ldc, _mm_add_pd(_mm_loadu_pd(c + i * ldc), acc[i][0]));
+        _mm_storeu_pd(c + i * ldc + 2, _mm_add_pd(_mm_loadu_pd(c + i * ldc + 2), acc[i][1]));
+    }
+}
+
+
+// Whole halves of the `nr` wide edge are stored as they are, an odd
+// column with the low lane only.
+CANNON_TARGET_SSE2
+inline void sse2_double_kernel::run_masked(
+        size_t kc,
+        const element_type * a,
+        const element_type * b,
+        element_type * c,
+        size_t ldc,
+        size_t mr,
+        size_t nr)
+    throw()
+{
+    __m128d acc[MR][2];
+    for(size_t i = 0; i < MR; ++i)
+    {
+        acc[i][0] = _mm_setzero_pd();
+        acc[i][1] = _mm_setzero_pd();
+    }
+    for(size_t p = 0; p < kc; ++p, a += MR, b += NR)
+    {
+        const __m128d b0 = _mm_load_pd(b);
+        const __m128d b1 = _mm_load_pd(b + 2);
+        for(size_t i = 0; i < MR; ++i)
+        {
+            const __m128d ai = _mm_set1_pd(a[i]);
+            acc[i][0] = _mm_add_pd(acc[i][0], _mm_mul_pd(ai, b0));
+            acc[i][1] = _mm_add_pd(acc[i][1], _mm_mul_pd(ai, b1));
+        }
+    }
+    for(size_t i = 0; i < mr; ++i)
+    {
+        double * row = c + i * ldc;
+        for(size_t half = 0; half < 2 && 2 * half < nr; ++half)
+        {
+            double * column = row + 2 * half;
+            if(2 * half + 1 < nr)
+            {
+                _mm_storeu_pd(column, _mm_add_pd(_mm_loadu_pd(column), acc[i][half]));
+            }
+            else
+            {
+                _mm_store_sd(column, _mm_add_sd(_mm_load_sd(column), acc[i][half]));
+            }
+        }
+    }
+}
+
+
+// AVX2/FMA double kernel: 6 x 8 tile kept in 12 ymm accumulators.
+struct avx2_double_kernel
+{
+    typedef double element_type;
+    static const size_t MR = 6;
+    static const size_t NR = 8;
+    static const bool MASKED = true;
+    static void run(
+            size_t kc,
+            const element_type * a,
+            const element_type * b,
+            element_type * c,
+            size_t ldc)
+        throw();
+    static void run_masked(
+            size_t kc,
+            const element_type * a,
+            const element_type * b,
+            element_type * c,
+            size_t ldc,
+            size_t mr,
+            size_t nr)
+        throw();
+};
+
+
+CANNON_TARGET_AVX2
+inline void avx2_double_kernel::run(
+        size_t kc,
+        const element_type * a,
+        const element_type * b,
+        element_type * c,
+        size_t ldc)
+    throw()
+{
+    __m256d c00 = _mm256_setzero_pd(), c01 = _mm256_setzero_pd();
+    __m256d c10 = _mm256_setzero_pd(), c11 = _mm256_setzero_pd();
+    __m256d c20 = _mm256_setzero_pd(), c21 = _mm256_setzero_pd();
+    __m256d c30 = _mm256_setzero_pd(), c31 = _mm256_setzero_pd();
+    __m256d c40 = _mm256_setzero_pd(), c41 = _mm256_setzero_pd();
+    __m256d c50 = _mm256_setzero_pd(), c51 = _mm256_setzero_pd();
+    for(size_t p = 0; p < kc; ++p, a += MR, b += NR)
+    {
+        const __m256d b0 = _mm256_load_pd(b);
+        const __m256d b1 = _mm256_load_pd(b + 4);
+        __m256d ai;
+        ai = _mm256_broadcast_sd(a + 0);
+        c00 = _mm256_fmadd_pd(ai, b0, c00);
+        c01 = _mm256_fmadd_pd(ai, b1, c01);
+        ai = _mm256_broadcast_sd(a + 1);
+        c10 = _mm256_fmadd_pd(ai, b0, c10);
+        c11 = _mm256_fmadd_pd(ai, b1, c11);
+        ai = _mm256_broadcast_sd(a + 2);
+        c20 = _mm256_fmadd_pd(ai, b0, c20);
+        c21 = _mm256_fmadd_pd(ai, b1, c21);
+        ai = _mm256_broadcast_sd(a + 3);
+        c30 = _mm256_fmadd_pd(ai, b0, c30);
+        c31 = _mm256_fmadd_pd(ai, b1, c31);
+        ai = _mm256_broadcast_sd(a + 4);
+        c40 = _mm256_fmadd_pd(ai, b0, c40);
+        c41 = _mm256_fmadd_pd(ai, b1, c41);
+        ai = _mm256_broadcast_sd(a + 5);
+        c50 = _mm256_fmadd_pd(ai, b0, c50);
+        c51 = _mm256_fmadd_pd(ai, b1, c51);
+    }
+#define CANNON_AVX2_STORE_ROW(row, lo, hi) \
+    _mm256_storeu_pd(c + (row) * ldc, _mm256_add_pd(_mm256_loadu_pd(c + (row) * ldc), lo)); \
+    _mm256_storeu_pd(c + (row) * ldc + 4, _mm256_add_pd(_mm256_loadu_pd(c + (row) * ldc + 4), hi))
+    CANNON_AVX2_STORE_ROW(0, c00, c01);
+    CANNON_AVX2_STORE_ROW(1, c10, c11);
+    CANNON_AVX2_STORE_ROW(2, c20, c21);
+    CANNON_AVX2_STORE_ROW(3, c30, c31);
+    CANNON_AVX2_STORE_ROW(4, c40, c41);
+    CANNON_AVX2_STORE_ROW(5, c50, c51);
+#undef CANNON_AVX2_STORE_ROW
+}
+
+
+// Masked loads and stores of the `nr` wide edge, 4 lanes per half.
+CANNON_TARGET_AVX2
+inline void avx2_double_kernel::run_masked(
+        size_t kc,
+        const element_type * a,
+        const element_type * b,
+        element_type * c,
+        size_t ldc,
+        size_t mr,
+        size_t nr)
+    throw()
+{
+    const __m256i width = _mm256_set1_epi64x(nr);
+    const __m256i mask0 = _mm256_cmpgt_epi64(width, _mm256_setr_epi64x(0, 1, 2, 3));
+    const __m256i mask1 = _mm256_cmpgt_epi64(width, _mm256_setr_epi64x(4, 5, 6, 7));
+    __m256d acc[MR][2];
+    for(size_t i = 0; i < MR; ++i)
+    {
+        acc[i][0] = _mm256_setzero_pd();
+        acc[i][1] = _mm256_setzero_pd();
+    }
+    for(size_t p = 0; p < kc; ++p, a += MR, b += NR)
+    {
+        const __m256d b0 = _mm256_load_pd(b);
+        const __m256d b1 = _mm256_load_pd(b + 4);
+        for(size_t i = 0; i < MR; ++i)
+        {
+            const __m256d ai = _mm256_broadcast_sd(a + i);
+            acc[i][0] = _mm256_fmadd_pd(ai, b0, acc[i][0]);
+            acc[i][1] = _mm256_fmadd_pd(ai, b1, acc[i][1]);
+        }
+    }
+    for(size_t i = 0; i < mr; ++i)
+    {
+        double * row = c + i * ldc;
+        _mm256_maskstore_pd(row, mask0, _mm256_add_pd(_mm256_maskload_pd(row, mask0), acc[i][0]));
+        _mm256_maskstore_pd(row + 4, mask1, _mm256_add_pd(_mm256_maskload_pd(row + 4, mask1), acc[i][1]));
+    }
+}
+
+
+// AVX-512 double kernel: 12 x 16 tile kept in 24 zmm accumulators.
+struct avx512_double_kernel
+{
+    typedef double element_type;
+    static const size_t MR = 12;
+    static const size_t NR = 16;
+    static const bool MASKED = true;
+    static void run(
+            size_t kc,
+            const element_type * a,
+            const element_type * b,
+            element_type * c,
+            size_t ldc)
+        throw();
+    static void run_masked(
+            size_t kc,
+            const element_type * a,
+            const element_type * b,
+            element_type * c,
+            size_t ldc,
+            size_t mr,
+            size_t nr)
+        throw();
+};
+
+
+CANNON_TARGET_AVX512
+inline void avx512_double_kernel::run(
+        size_t kc,
+        const element_type * a,
+        const element_type * b,
+        element_type * c,
+        size_t ldc)
+    throw()
+{
+    __m512d acc[MR][2];
+    for(size_t i = 0; i < MR; ++i)
+    {
+        acc[i][0] = _mm512_setzero_pd();
+        acc[i][1] = _mm512_setzero_pd();
+    }
+    for(size_t p = 0; p < kc; ++p, a += MR, b += NR)
+    {
+        const __m512d b0 = _mm512_load_pd(b);
+        const __m512d b1 = _mm512_load_pd(b + 8);
+        for(size_t i = 0; i < MR; ++i)
+        {
+            const __m512d ai = _mm512_set1_pd(a[i]);
+            acc[i][0] = _mm512_fmadd_pd(ai, b0, acc[i][0]);
+            acc[i][1] = _mm512_fmadd_pd(ai, b1, acc[i][1]);
+        }
+    }
+    for(size_t i = 0; i < MR; ++i)
+    {
+        _mm512_storeu_pd(c + i * ldc, _mm512_add_pd(_mm512_loadu_pd(c + i * ldc), acc[i][0]));
+        _mm512_storeu_pd(c + i * ldc + 8, _mm512_add_pd(_mm512_loadu_pd(c + i * ldc + 8), acc[i][1]));
+    }
+}
+
+
+// Masked loads and stores of the `nr` wide edge, 8 lanes per half.
+CANNON_TARGET_AVX512
+inline void avx512_double_kernel::run_masked(
+        size_t kc,
+        const element_type * a,
+        const element_type * b,
+        element_type * c,
+        size_t ldc,
+        size_t mr,
+        size_t nr)
+    throw()
+{
+    const __mmask8 mask0 = nr >= 8 ? 0xff : (1u << nr) - 1;
+    const __mmask8 mask1 = nr > 8 ? (1u << (nr - 8)) - 1 : 0;
+    __m512d acc[MR][2];
+    for(size_t i = 0; i < MR; ++i)
+    {
+        acc[i][0] = _mm512_setzero_pd();
+        acc[i][1] = _mm512_setzero_pd();
+    }
+    for(size_t p = 0; p < kc; ++p, a += MR, b += NR)
+    {
+        const __m512d b0 = _mm512_load_pd(b);
+        const __m512d b1 = _mm512_load_pd(b + 8);
+        for(size_t i = 0; i < MR; ++i)
+        {
+            const __m512d ai = _mm512_set1_pd(a[i]);
+            acc[i][0] = _mm512_fmadd_pd(ai, b0, acc[i][0]);
+            acc[i][1] = _mm512_fmadd_pd(ai, b1, acc[i][1]);
+        }
+    }
+    for(size_t i = 0; i < mr; ++i)
+    {
+        double * row = c + i * ldc;
+        _mm512_mask_storeu_pd(row, mask0, _mm512_add_pd(_mm512_maskz_loadu_pd(mask0, row), acc[i][0]));
+        _mm512_mask_storeu_pd(row + 8, mask1, _mm512_add_pd(_mm512_maskz_loadu_pd(mask1, row + 8), acc[i][1]));
+    }
+}
+
+
+// SSE2 float kernel: 4 x 8 tile kept in 8 xmm accumulators.
+struct sse2_float_kernel
+{
+    typedef float element_type;
+    static const size_t MR = 4;
+    static const size_t NR = 8;
+    static const bool MASKED = true;
+    static void run(
+            size_t kc,
+            const element_type * a,
+            const element_type * b,
+            element_type * c,
+            size_t ldc)
+        throw();
+    static void run_masked(
+            size_t kc,
+            const element_type * a,
+            const element_type * b,
+            element_type * c,
+            size_t ldc,
+            size_t mr,
+            size_t nr)
+        throw();
+};
+
+
+CANNON_TARGET_SSE2
+inline void sse2_float_kernel::run(
+        size_t kc,
+        const element_type * a,
+        const element_type * b,
+        element_type * c,
+        size_t ldc)
+    throw()
+{
+    __m128 acc[MR][2];
+    for(size_t i = 0; i < MR; ++i)
+    {
+        acc[i][0] = _mm_setzero_ps();
+        acc[i][1] = _mm_setzero_ps();
+    }
+    for(size_t p = 0; p < kc; ++p, a += MR, b += NR)
+    {
+        const __m128 b0 = _mm_load_ps(b);
+        const __m128 b1 = _mm_load_ps(b + 4);
+        for(size_t i = 0; i < MR; ++i)
+        {
+            const __m128 ai = _mm_set1_ps(a[i]);
+            acc[i][0] = _mm_add_ps(acc[i][0], _mm_mul_ps(ai, b0));
+            acc[i][1] = _mm_add_ps(acc[i][1], _mm_mul_ps(ai, b1));
+        }
+    }
+    for(size_t i = 0; i < MR; ++i)
+    {
+        _mm_storeu_ps(c + i * ldc, _mm_add_ps(_mm_loadu_ps(c + i * ldc), acc[i][0]));
+        _mm_storeu_ps(c + i * ldc + 4, _mm_add_ps(_mm_loadu_ps(c + i * ldc + 4), acc[i][1]));
+    }
+}
+
+
+// Whole halves of the `nr` wide edge are stored as they are, the lanes
+// of a partial one are added one by one.
+CANNON_TARGET_SSE2
+inline void sse2_float_kernel::run_masked(
+        size_t kc,
+        const element_type * a,
+        const element_type * b,
+        element_type * c,
+        size_t ldc,
+        size_t mr,
+        size_t nr)
+    throw()
+{
+    __m128 acc[MR][2];
+    for(size_t i = 0; i < MR; ++i)
+    {
+        acc[i][0] = _mm_setzero_ps();
+        acc[i][1] = _mm_setzero_ps();
+    }
+    for(size_t p = 0; p < kc; ++p, a += MR, b += NR)
+    {
+        const __m128 b0 = _mm_load_ps(b);
+        const __m128 b1 = _mm_load_ps(b + 4);
+        for(size_t i = 0; i < MR; ++i)
+        {
+            const __m128 ai = _mm_set1_ps(a[i]);
+            acc[i][0] = _mm_add_ps(acc[i][0], _mm_mul_ps(ai, b0));
+            acc[i][1] = _mm_add_ps(acc[i][1], _mm_mul_ps(ai, b1));
+        }
+    }
+    for(size_t i = 0; i < mr; ++i)
+    {
+        float * row = c + i * ldc;
+        for(size_t half = 0; half < 2 && 4 * half < nr; ++half)
+        {
+            float * column = row + 4 * half;
+            const size_t width = ::std::min<size_t>(nr - 4 * half, 4);
+            if(width == 4)
+            {
+                _mm_storeu_ps(column, _mm_add_ps(_mm_loadu_ps(column), acc[i][half]));
+                continue;
+            }
+            float lanes[4];
+            _mm_storeu_ps(lanes, acc[i][half]);
+            for(size_t j = 0; j < width; ++j)
+            {
+                column[j] += lanes[j];
+            }
+        }
+    }
+}
+
+
+// AVX2/FMA float kernel: 6 x 16 tile kept in 12 ymm accumulators.
+struct avx2_float_kernel
+{
+    typedef float element_type;
+    static const size_t MR = 6;
+    static const size_t NR = 16;
+    static const bool MASKED = true;
+    static void run(
+            size_t kc,
+            const element_type * a,
+            const element_type * b,
+            element_type * c,
+            size_t ldc)
+        throw();
+    static void run_masked(
+            size_t kc,
+            const element_type * a,
+            const element_type * b,
+            element_type * c,
+            size_t ldc,
+            size_t mr,
+            size_t nr)
+        throw();
+};
+
+
+CANNON_TARGET_AVX2
+inline void avx2_float_kernel::run(
+        size_t kc,
+        const element_type * a,
+        const element_type * b,
+        element_type * c,
+        size_t ldc)
+    throw()
+{
+    __m256 acc[MR][2];
+    for(size_t i = 0; i < MR; ++i)
+    {
+        acc[i][0] = _mm256_setzero_ps();
+        acc[i][1] = _mm256_setzero_ps();
+    }
+    for(size_t p = 0; p < kc; ++p, a += MR, b += NR)
+    {
+        const __m256 b0 = _mm256_load_ps(b);
+        const __m256 b1 = _mm256_load_ps(b + 8);
+        for(size_t i = 0; i < MR; ++i)
+        {
+            const __m256 ai = _mm256_broadcast_ss(a + i);
+            acc[i][0] = _mm256_fmadd_ps(ai, b0, acc[i][0]);
+            acc[i][1] = _mm256_fmadd_ps(ai, b1, acc[i][1]);
+        }
+    }
+    for(size_t i = 0; i < MR; ++i)
+    {
+        _mm256_storeu_ps(c + i * ldc, _mm256_add_ps(_mm256_loadu_ps(c + i * ldc), acc[i][0]));
+        _mm256_storeu_ps(c + i * ldc + 8, _mm256_add_ps(_mm256_loadu_ps(c + i * ldc + 8), acc[i][1]));
+    }
+}
+
+
+// Masked loads and stores of the `nr` wide edge, 8 lanes per half.
+CANNON_TARGET_AVX2
+inline void avx2_float_kernel::run_masked(
+        size_t kc,
+        const element_type * a,
+        const element_type * b,
+        element_type * c,
+        size_t ldc,
+        size_t mr,
+        size_t nr)
+    throw()
+{
+    const __m256i width = _mm256_set1_epi32(nr);
+    const __m256i mask0 = _mm256_cmpgt_epi32(width, _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7));
+    const __m256i mask1 = _mm256_cmpgt_epi32(width, _mm256_setr_epi32(8, 9, 10, 11, 12, 13, 14, 15));
+    __m256 acc[MR][2];
+    for(size_t i = 0; i < MR; ++i)
+    {
+        acc[i][0] = _mm256_setzero_ps();
+        acc[i][1] = _mm256_setzero_ps();
+    }
+    for(size_t p = 0; p < kc; ++p, a += MR, b += NR)
+    {
+        const __m256 b0 = _mm256_load_ps(b);
+        const __m256 b1 = _mm256_load_ps(b + 8);
+        for(size_t i = 0; i < MR; ++i)
+        {
+            const __m256 ai = _mm256_broadcast_ss(a + i);
+            acc[i][0] = _mm256_fmadd_ps(ai, b0, acc[i][0]);
+            acc[i][1] = _mm256_fmadd_ps(ai, b1, acc[i][1]);
+        }
+    }
+    for(size_t i = 0; i < mr; ++i)
+    {
+        float * row = c + i * ldc;
+        _mm256_maskstore_ps(row, mask0, _mm256_add_ps(_mm256_maskload_ps(row, mask0), acc[i][0]));
+        _mm256_maskstore_ps(row + 8, mask1, _mm256_add_ps(_mm256_maskload_ps(row + 8, mask1), acc[i][1]));
+    }
+}
+
+
+// AVX-512 float kernel: 12 x 32 tile kept in 24 zmm accumulators.
+struct avx512_float_kernel
+{
+    typedef float element_type;
+    static const size_t MR = 12;
+    static const size_t NR = 32;
+    static const bool MASKED = true;
+    static void run(
+            size_t kc,
+            const element_type * a,
+            const element_type * b,
+            element_type * c,
+            size_t ldc)
+        throw();
+    static void run_masked(
+            size_t kc,
+            const element_type * a,
+            const element_type * b,
+            element_type * c,
+            size_t ldc,
+            size_t mr,
+            size_t nr)
+        throw();
+};
+
+
+CANNON_TARGET_AVX512
+inline void avx512_float_kernel::run(
+        size_t kc,
+        const element_type * a,
+        const element_type * b,
+        element_type * c,
+        size_t ldc)
+    throw()
+{
+    __m512 acc[MR][2];
+    for(size_t i = 0; i < MR; ++i)
+    {
+        acc[i][0] = _mm512_setzero_ps();
+        acc[i][1] = _mm512_setzero_ps();
+    }
+    for(size_t p = 0; p < kc; ++p, a += MR, b += NR)
+    {
+        const __m512 b0 = _mm512_load_ps(b);
+        const __m512 b1 = _mm512_load_ps(b + 16);
+        for(size_t i = 0; i < MR; ++i)
+        {
+            const __m512 ai = _mm512_set1_ps(a[i]);
+            acc[i][0] = _mm512_fmadd_ps(ai, b0, acc[i][0]);
+            acc[i][1] = _mm512_fmadd_ps(ai, b1, acc[i][1]);
+        }
+    }
+    for(size_t i = 0; i < MR; ++i)
+    {
+        _mm512_storeu_ps(c + i * ldc, _mm512_add_ps(_mm512_loadu_ps(c + i * ldc), acc[i][0]));
+        _mm512_storeu_ps(c + i * ldc + 16, _mm512_add_ps(_mm512_loadu_ps(c + i * ldc + 16), acc[i][1]));
+    }
+}
+
+
+// Masked loads and stores of the `nr` wide edge, 16 lanes per half.
+CANNON_TARGET_AVX512
+inline void avx512_float_kernel::run_masked(
+        size_t kc,
+        const element_type * a,
+        const element_type * b,
+        element_type * c,
+        size_t ldc,
+        size_t mr,
+        size_t nr)
+    throw()
+{
+    const __mmask16 mask0 = nr >= 16 ? 0xffff : (1u << nr) - 1;
+    const __mmask16 mask1 = nr > 16 ? (1u << (nr - 16)) - 1 : 0;
+    __m512 acc[MR][2];
+    for(size_t i = 0; i < MR; ++i)
+    {
+        acc[i][0] = _mm512_setzero_ps();
+        acc[i][1] = _mm512_setzero_ps();
+    }
+    for(size_t p = 0; p < kc; ++p, a += MR, b += NR)
+    {
+        const __m512 b0 = _mm512_load_ps(b);
+        const __m512 b1 = _mm512_load_ps(b + 16);
+        for(size_t i = 0; i < MR; ++i)
+        {
+            const __m512 ai = _mm512_set1_ps(a[i]);
+            acc[i][0] = _mm512_fmadd_ps(ai, b0, acc[i][0]);
+            acc[i][1] = _mm512_fmadd_ps(ai, b1, acc[i][1]);
+        }
+    }
+    for(size_t i = 0; i < mr; ++i)
+    {
+        float * row = c + i * ldc;
+        _mm512_mask_storeu_ps(row, mask0, _mm512_add_ps(_mm512_maskz_loadu_ps(mask0, row), acc[i][0]));
+        _mm512_mask_storeu_ps(row + 16, mask1, _mm512_add_ps(_mm512_maskz_loadu_ps(mask1, row + 16), acc[i][1]));
+    }
+}
+
+
+#endif  // CANNON_X86_KERNELS
+
+
+// Complex products with a real kernel on split real/imaginary planes.
+//   4M: re = ar br - ai bi, im = ar bi + ai br (4 real products)
+//   3M: re = ar br - ai bi, im = (ar + ai)(br + bi) - ar br - ai bi
+//       (3 real products, 25% less flops, slightly less accurate)
+enum complex_method
+{
+    COMPLEX_4M,
+    COMPLEX_3M
+};
+
+
+// Complex kernel built on `real_kernel_t`. Operands are packed as
+// `PLANES` consecutive real slivers: real parts, imaginary parts
+// and (3M only) their sums, see `gemm::packing`.
+template<typename real_kernel_t, complex_method METHOD>
+struct complex_kernel
+{
+    typedef typename real_kernel_t::element_type real_type;
+    typedef ::std::complex<real_type> element_type;
+    static const size_t MR = real_kernel_t::MR;
+    static const size_t NR = real_kernel_t::NR;
+    static const size_t PLANES = METHOD == COMPLEX_3M ? 3 : 2;
+    static const bool MASKED = true;
+    static void run(
+            size_t kc,
+            const real_type * a,
+            const real_type * b,
+            element_type * c,
+            size_t ldc)
+        throw();
+    static void run_masked(
+            size_t kc,
+            const real_type * a,
+            const real_type * b,
+            element_type * c,
+            size_t ldc,
+            size_t mr,
+            size_t nr)
+        throw();
+};
+
+
+template<typename real_kernel_t, complex_method METHOD>
+inline void complex_kernel<real_kernel_t, METHOD>::run(
+        size_t kc,
+        const real_type * a,
+        const real_type * b,
+        element_type * c,
+        size_t ldc)
+    throw()
+{
+    run_masked(kc, a, b, c, ldc, MR, NR);
+}
+
+
+// The real products go to whole scratch tiles, only the edge is added
+// to `c`.
+template<typename real_kernel_t, complex_method METHOD>
+void complex_kernel<real_kernel_t, METHOD>::run_masked(
+        size_t kc,
+        const real_type * a,
+        const real_type * b,
+        element_type * c,
+        size_t ldc,
+        size_t mr,
+        size_t nr)
+    throw()
+{
+    const real_type * a_re = a;
+    const real_type * a_im = a + MR * kc;
+    const real_type * b_re = b;
+    const real_type * b_im = b + NR * kc;
+    real_type re_re[MR * NR] = {};
+    real_type im_im[MR * NR] = {};
+    real_type mixed[MR * NR] = {};
+    real_kernel_t::run(kc, a_re, b_re, re_re, NR);
+    real_kernel_t::run(kc, a_im, b_im, im_im, NR);
+    if(METHOD == COMPLEX_3M)
+    {
+        real_kernel_t::run(kc, a + 2 * MR * kc, b + 2 * NR * kc, mixed, NR);
+    }
+    else
+    {
+        real_kernel_t::run(kc, a_re, b_im, mixed, NR);
+        real_kernel_t::run(kc, a_im, b_re, mixed, NR);
+    }
+    for(size_t i = 0; i < mr; ++i)
+    {
+        for(size_t j = 0; j < nr; ++j)
+        {
+            const size_t t = i * NR + j;
+            real_type * cij = reinterpret_cast<real_type *>(c + i * ldc + j);
+            cij[0] += re_re[t] - im_im[t];
+            cij[1] += METHOD == COMPLEX_3M ? mixed[t] - re_re[t] - im_im[t] : mixed[t];
+        }
+    }
+}
+
+
+// The best kernel the build target supports for the given element type
+// (runtime selection is done by `dispatch.h`).
+template<typename element_t>
+struct default_kernel
+{
+    typedef scalar_kernel<element_t> type;
+};
+
+
+template<typename real_t>
+struct default_kernel< ::std::complex<real_t> >
+{
+    typedef complex_kernel<typename default_kernel<real_t>::type, COMPLEX_4M> type;
+};
+
+
+#if defined(__AVX512F__)
+template<>
+struct default_kernel<double>
+{
+    typedef avx512_double_kernel type;
+};
+template<>
+struct default_kernel<float>
+{
+    typedef avx512_float_kernel type;
+};
+#elif defined(__AVX2__) && defined(__FMA__)
+template<>
+struct default_kernel<double>
+{
+    typedef avx2_double_kernel type;
+};
+template<>
+struct default_kernel<float>
+{
+    typedef avx2_float_kernel type;
+};
+#elif defined(__SSE2__)
+template<>
+struct default_kernel<double>
+{
+    typedef sse2_double_kernel type;
+};
+template<>
+struct default_kernel<float>
+{
+    typedef sse2_float_kernel type;
+};
+#endif
+
+
+}  // namespace gemm
+}  // namespace cannon
+
+
+#endif
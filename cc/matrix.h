@@ -7,6 +7,7 @@
 
 #include <boost/numeric/ublas/matrix.hpp>
 #include <boost/numeric/ublas/storage.hpp>
+#include <algorithm>
 #include <vector>
 
 
@@ -14,12 +15,76 @@ namespace cannon
 {
 
 
+// Size template arguments (`SIZE`, `CART_SIZE`, ...) may be `DYNAMIC_SIZE`
+// when the actual size is known at runtime only.
+const size_t DYNAMIC_SIZE = 0;
+
+
+// `SIZE` unless it is `DYNAMIC_SIZE`, `runtime` otherwise. Fixed sizes
+// stay compile time constants.
+template<size_t SIZE>
+inline size_t actual_size(size_t runtime)
+{
+    return SIZE != DYNAMIC_SIZE ? SIZE : runtime;
+}
+
+
+// Shape of a matrix product: `rows` x `inner` left operand times
+// `inner` x `cols` right one.
+struct product_shape
+{
+    size_t rows;
+    size_t inner;
+    size_t cols;
+};
+
+
+// Side of the partials when a `size` x `size` matrix is split into
+// `blocks` x `blocks` of them - rounded up, so that the matrix size need
+// not be a multiple of `blocks`.
+inline size_t partial_size(size_t size, size_t blocks)
+{
+    return (size + blocks - 1) / blocks;
+}
+
+
+// Amount of `size` x `size` matrix's rows (or columns) that fall into
+// its `block`th `partial`-wide block row (column), the rest of the
+// block is padding.
+inline size_t partial_extent(size_t size, size_t partial, size_t block)
+{
+    const size_t first = block * partial;
+    return first < size ? ::std::min(partial, size - first) : 0;
+}
+
+
+// `storage_t` holding `element_t` elements instead of its own.
+template<typename storage_t, typename element_t>
+struct rebind_storage;
+
+
+template<typename value_t, typename allocator_t, typename element_t>
+struct rebind_storage< ::std::vector<value_t, allocator_t>, element_t>
+{
+    typedef ::std::vector<element_t, typename allocator_t::template rebind<element_t>::other> type;
+};
+
+
+template<typename value_t, typename allocator_t, typename element_t>
+struct rebind_storage< ::boost::numeric::ublas::unbounded_array<value_t, allocator_t>, element_t>
+{
+    typedef ::boost::numeric::ublas::unbounded_array<element_t,
+            typename allocator_t::template rebind<element_t>::other> type;
+};
+
+
 // Possible matrix layouts
 typedef ::boost::numeric::ublas::row_major row_major;
 typedef ::boost::numeric::ublas::column_major col_major;
 
 
-// Square matrix concept
+// Square matrix concept - `SIZE` x `SIZE`, or any rectangular shape
+// for `DYNAMIC_SIZE`.
 template<typename element_t, typename storage_t, typename layout_t, size_t SIZE>
 class square_matrix_concept
 {
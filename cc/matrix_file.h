@@ -0,0 +1,415 @@
+// Author: Cezary Bartoszuk
+// Email: cbart@students.mimuw.edu.pl
+
+#ifndef __CANNON__MATRIX_FILE__H__
+#define __CANNON__MATRIX_FILE__H__
+
+
+#include <complex>
+#include <cstring>
+#include <string>
+#include <stdint.h>
+#include <boost/mpi/communicator.hpp>
+#include <boost/mpi/datatype.hpp>
+#include <boost/numeric/ublas/fwd.hpp>
+#include "datatype.h"
+#include "matrix.h"
+#include "fill.h"
+#include "debug.h"
+
+
+namespace cannon
+{
+namespace mpi
+{
+
+
+// Binary matrix file: `matrix_file_header` followed by the whole
+// `rows` x `cols` matrix, row-major, in native byte order.
+struct matrix_file_header
+{
+    char magic[8];
+    uint64_t element;
+    uint64_t rows;
+    uint64_t cols;
+};
+
+
+namespace
+{
+
+
+static const char MATRIX_FILE_MAGIC[8] = {'C', 'A', 'N', 'N', 'O', 'N', 'M', 'F'};
+
+
+}  // namespace (unnamed)
+
+
+// Element type codes of matrix files.
+template<typename real_t>
+struct matrix_file_element;
+
+
+template<>
+struct matrix_file_element<double>
+{
+    static const uint64_t CODE = 1;
+};
+
+
+template<>
+struct matrix_file_element<float>
+{
+    static const uint64_t CODE = 2;
+};
+
+
+template<>
+struct matrix_file_element< ::std::complex<double> >
+{
+    static const uint64_t CODE = 3;
+};
+
+
+template<>
+struct matrix_file_element< ::std::complex<float> >
+{
+    static const uint64_t CODE = 4;
+};
+
+
+// Matrix file opened collectively by all the processors of a
+// communicator, every one of them reads (writes) its partials straight
+// from (to) its partial matrices' storage: the file view is the
+// partial's subarray of the matrix and the memory datatype its part in
+// the (possibly padded, possibly col-major) partial, so there is no
+// root processor nor any copy in between.
+class matrix_file
+{
+private:
+    MPI_File file;
+    bool opened;
+    matrix_file_header header;
+public:
+    // Opens existing `path` for reading.
+    matrix_file(const ::boost::mpi::communicator & comm, const char * path)
+        throw();
+    // Creates (or truncates) `path` for `rows` x `cols` matrix of
+    // `element` (`matrix_file_element<...>::CODE`) elements.
+    matrix_file(
+            const ::boost::mpi::communicator & comm,
+            const char * path,
+            size_t rows,
+            size_t cols,
+            uint64_t element)
+        throw();
+    ~matrix_file()
+        throw();
+    // Whether the file is open (and its header valid).
+    bool good() const
+        throw();
+    size_t rows() const
+        throw();
+    size_t cols() const
+        throw();
+    // Collectively reads `partial` as the `block_row`, `block_col`
+    // block of `partial`'s size. Padding past the matrix is zeroed.
+    template<typename matrix_t>
+    bool read(matrix_t & partial, size_t block_row, size_t block_col)
+        throw();
+    // Collectively writes `partial` as the `block_row`, `block_col`
+    // block, padding past the matrix is left out.
+    template<typename matrix_t>
+    bool write(const matrix_t & partial, size_t block_row, size_t block_col)
+        throw();
+private:
+    // Sets the view and moves the partial's part of the matrix.
+    template<typename matrix_t>
+    bool transfer(matrix_t & partial, size_t block_row, size_t block_col, bool writing)
+        throw();
+    // Datatype of the top left `rows` x `cols` part of a
+    // `partial_rows` x `partial_cols` partial, enumerated in the file's
+    // (row-major) order.
+    static MPI_Datatype memory_type(
+            size_t rows,
+            size_t cols,
+            size_t partial_rows,
+            size_t partial_cols,
+            MPI_Datatype element,
+            ::boost::numeric::ublas::row_major_tag)
+        throw();
+    static MPI_Datatype memory_type(
+            size_t rows,
+            size_t cols,
+            size_t partial_rows,
+            size_t partial_cols,
+            MPI_Datatype element,
+            ::boost::numeric::ublas::column_major_tag)
+        throw();
+    matrix_file(const matrix_file &);
+    matrix_file & operator=(const matrix_file &);
+};
+
+
+// Every processor reads the header, it's tiny.
+inline matrix_file::matrix_file(const ::boost::mpi::communicator & comm, const char * path)
+    throw()
+  : opened(false)
+{
+    ::std::memset(& header, 0, sizeof(header));
+    if(MPI_File_open(comm, const_cast<char *>(path), MPI_MODE_RDONLY, MPI_INFO_NULL, & file) != MPI_SUCCESS)
+    {
+        ::debug::err << "Can't open matrix file " << path << ::std::endl;
+        return;
+    }
+    opened = true;
+    MPI_Status status;
+    if(MPI_File_read_at_all(file, 0, & header, sizeof(header), MPI_BYTE, & status) != MPI_SUCCESS
+            || ::std::memcmp(header.magic, MATRIX_FILE_MAGIC, sizeof(header.magic)) != 0)
+    {
+        ::debug::err << "Not a matrix file: " << path << ::std::endl;
+        MPI_File_close(& file);
+        opened = false;
+    }
+}
+
+
+// Processor 0 writes the header, the partials' writes extend the
+// (truncated) file.
+inline matrix_file::matrix_file(
+        const ::boost::mpi::communicator & comm,
+        const char * path,
+        size_t rows,
+        size_t cols,
+        uint64_t element)
+    throw()
+  : opened(false)
+{
+    ::std::memset(& header, 0, sizeof(header));
+    ::std::memcpy(header.magic, MATRIX_FILE_MAGIC, sizeof(header.magic));
+    header.element = element;
+    header.rows = rows;
+    header.cols = cols;
+    if(MPI_File_open(comm, const_cast<char *>(path), MPI_MODE_CREATE | MPI_MODE_WRONLY,
+                MPI_INFO_NULL, & file) != MPI_SUCCESS)
+    {
+        ::debug::err << "Can't create matrix file " << path << ::std::endl;
+        return;
+    }
+    opened = true;
+    MPI_File_set_size(file, 0);
+    if(comm.rank() == 0)
+    {
+        MPI_Status status;
+        if(MPI_File_write_at(file, 0, & header, sizeof(header), MPI_BYTE, & status) != MPI_SUCCESS)
+        {
+            ::debug::err << "Can't write matrix file " << path << ::std::endl;
+        }
+    }
+}
+
+
+inline matrix_file::~matrix_file()
+    throw()
+{
+    if(opened)
+    {
+        MPI_File_close(& file);
+    }
+}
+
+
+inline bool matrix_file::good() const
+    throw()
+{
+    return opened;
+}
+
+
+inline size_t matrix_file::rows() const
+    throw()
+{
+    return header.rows;
+}
+
+
+inline size_t matrix_file::cols() const
+    throw()
+{
+    return header.cols;
+}
+
+
+template<typename matrix_t>
+bool matrix_file::read(matrix_t & partial, size_t block_row, size_t block_col)
+    throw()
+{
+    typedef typename matrix_t::value_type value_type;
+    if(header.element != matrix_file_element<value_type>::CODE)
+    {
+        ::debug::err << "Matrix file element type mismatch!" << ::std::endl;
+        return false;
+    }
+    if(!transfer(partial, block_row, block_col, false))
+    {
+        return false;
+    }
+    fill_padding(partial,
+            partial_extent(rows(), partial.size1(), block_row),
+            partial_extent(cols(), partial.size2(), block_col));
+    return true;
+}
+
+
+template<typename matrix_t>
+inline bool matrix_file::write(const matrix_t & partial, size_t block_row, size_t block_col)
+    throw()
+{
+    return transfer(const_cast<matrix_t &>(partial), block_row, block_col, true);
+}
+
+
+// Processors with nothing to move (all padding) still take part in the
+// collective call, with an empty view.
+template<typename matrix_t>
+bool matrix_file::transfer(matrix_t & partial, size_t block_row, size_t block_col, bool writing)
+    throw()
+{
+    typedef typename matrix_t::value_type value_type;
+    typedef typename matrix_t::orientation_category orientation_category;
+    const MPI_Datatype element = ::boost::mpi::get_mpi_datatype<value_type>(value_type());
+    const size_t extent_rows = partial_extent(rows(), partial.size1(), block_row);
+    const size_t extent_cols = partial_extent(cols(), partial.size2(), block_col);
+    const MPI_Offset data = sizeof(header);
+    MPI_Datatype file_type = MPI_BYTE;
+    MPI_Datatype memory = MPI_BYTE;
+    int count = 0;
+    if(extent_rows > 0 && extent_cols > 0)
+    {
+        int sizes[DIMS] = {static_cast<int>(rows()), static_cast<int>(cols())};
+        int subsizes[DIMS] = {static_cast<int>(extent_rows), static_cast<int>(extent_cols)};
+        int starts[DIMS] = {
+            static_cast<int>(block_row * partial.size1()),
+            static_cast<int>(block_col * partial.size2())};
+        MPI_Type_create_subarray(DIMS, sizes, subsizes, starts, MPI_ORDER_C, element, & file_type);
+        MPI_Type_commit(& file_type);
+        memory = memory_type(extent_rows, extent_cols, partial.size1(), partial.size2(),
+                element, orientation_category());
+        count = 1;
+    }
+    MPI_File_set_view(file, data, element, file_type, const_cast<char *>("native"), MPI_INFO_NULL);
+    MPI_Status status;
+    void * buffer = count > 0 ? & partial.data()[0] : NULL;
+    const int error = writing
+        ? MPI_File_write_all(file, buffer, count, memory, & status)
+        : MPI_File_read_all(file, buffer, count, memory, & status);
+    if(count > 0)
+    {
+        MPI_Type_free(& file_type);
+        MPI_Type_free(& memory);
+    }
+    if(error != MPI_SUCCESS)
+    {
+        ::debug::err << "Can't " << (writing ? "write" : "read") << " matrix file!" << ::std::endl;
+        return false;
+    }
+    return true;
+}
+
+
+// Rows of `cols` elements, `partial_cols` elements apart.
+inline MPI_Datatype matrix_file::memory_type(
+        size_t rows,
+        size_t cols,
+        size_t,
+        size_t partial_cols,
+        MPI_Datatype element,
+        ::boost::numeric::ublas::row_major_tag)
+    throw()
+{
+    MPI_Datatype type;
+    MPI_Type_vector(rows, cols, partial_cols, element, & type);
+    MPI_Type_commit(& type);
+    return type;
+}
+
+
+// A row is `cols` elements `partial_rows` apart, the next row starts
+// one element further, so the datatype engine transposes on the fly.
+inline MPI_Datatype matrix_file::memory_type(
+        size_t rows,
+        size_t cols,
+        size_t partial_rows,
+        size_t,
+        MPI_Datatype element,
+        ::boost::numeric::ublas::column_major_tag)
+    throw()
+{
+    MPI_Aint lower_bound;
+    MPI_Aint element_extent;
+    MPI_Type_get_extent(element, & lower_bound, & element_extent);
+    MPI_Datatype row;
+    MPI_Datatype row_resized;
+    MPI_Datatype type;
+    MPI_Type_vector(cols, 1, partial_rows, element, & row);
+    MPI_Type_create_resized(row, 0, element_extent, & row_resized);
+    MPI_Type_contiguous(rows, row_resized, & type);
+    MPI_Type_commit(& type);
+    MPI_Type_free(& row);
+    MPI_Type_free(& row_resized);
+    return type;
+}
+
+
+// Reads the `block_row`, `block_col` partial of `rows` x `cols` matrix
+// from `path` (collectively), fails if the file's matrix is different.
+template<typename matrix_t>
+bool load_partial(
+        const ::boost::mpi::communicator & comm,
+        const ::std::string & path,
+        matrix_t & partial,
+        size_t rows,
+        size_t cols,
+        size_t block_row,
+        size_t block_col)
+    throw()
+{
+    matrix_file file(comm, path.c_str());
+    if(!file.good())
+    {
+        return false;
+    }
+    if(file.rows() != rows || file.cols() != cols)
+    {
+        ::debug::err << path << " is " << file.rows() << " x " << file.cols()
+            << ", expected " << rows << " x " << cols << ::std::endl;
+        return false;
+    }
+    return file.read(partial, block_row, block_col);
+}
+
+
+// Writes the `block_row`, `block_col` partial of `rows` x `cols` matrix
+// to `path` (collectively).
+template<typename matrix_t>
+bool save_partial(
+        const ::boost::mpi::communicator & comm,
+        const ::std::string & path,
+        const matrix_t & partial,
+        size_t rows,
+        size_t cols,
+        size_t block_row,
+        size_t block_col)
+    throw()
+{
+    matrix_file file(comm, path.c_str(), rows, cols,
+            matrix_file_element<typename matrix_t::value_type>::CODE);
+    return file.good() && file.write(partial, block_row, block_col);
+}
+
+
+}  // namespace mpi
+}  // namespace cannon
+
+
+#endif
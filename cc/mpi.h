@@ -21,6 +21,10 @@ typedef ::boost::shared_array<int> coords_type;
 
 const size_t DIMS = 2;
 
+// Dimensions of the layered (2.5D) topology, layers are
+// `DIMS`-dimensional, stacked in `DIRECTION_DEPTH`.
+const size_t LAYERED_DIMS = 3;
+
 
 typedef int rank_type;
 
@@ -37,6 +41,7 @@ const size_t DESTINATION_RANK_INDEX = 1;
 // Possible direction arguments for `shift`
 const int DIRECTION_VERTICAL = 0;
 const int DIRECTION_HORIZONTAL = 1;
+const int DIRECTION_DEPTH = 2;
 
 // Possible displacement arguments for `shift`
 const int DISPLACEMENT_UPWARD = 1;
@@ -45,12 +50,11 @@ const int DISPLACEMENT_DOWNWARD = -1;
 
 // Creates cartesian square sphere
 // The "square sphere" means that the topology is a cartesian square
-// of `DIM_SIZE` * `DIM_SIZE` nodes and there is a period in both dimensions.
-template<size_t DIM_SIZE>
-inline ::boost::mpi::communicator cart_square_sphere_create()
+// of `dim` * `dim` nodes and there is a period in both dimensions.
+inline ::boost::mpi::communicator cart_square_sphere_create(size_t dim)
 {
     MPI_Comm comm_cart;
-    int dim_size[DIMS] = {DIM_SIZE, DIM_SIZE};  // square
+    int dim_size[DIMS] = {static_cast<int>(dim), static_cast<int>(dim)};  // square
     int periods[DIMS] = {true, true};  // periods in both dimensions
     int reorder = true;
     MPI_Cart_create(MPI_COMM_WORLD, DIMS, dim_size, periods, reorder, & comm_cart);
@@ -58,21 +62,121 @@ inline ::boost::mpi::communicator cart_square_sphere_create()
 }
 
 
-// Fails if mpi wasn't run with `PROCESSORS` amount of processors
-template<size_t PROCESSORS>
+template<size_t DIM_SIZE>
+inline ::boost::mpi::communicator cart_square_sphere_create()
+{
+    return cart_square_sphere_create(DIM_SIZE);
+}
+
+
+// Creates `depth` layers of cartesian square spheres stacked on each
+// other (without a period in the depth).
+inline ::boost::mpi::communicator cart_layered_sphere_create(size_t dim, size_t depth)
+{
+    MPI_Comm comm_cart;
+    int dim_size[LAYERED_DIMS] = {static_cast<int>(dim), static_cast<int>(dim), static_cast<int>(depth)};
+    int periods[LAYERED_DIMS] = {true, true, false};
+    int reorder = true;
+    MPI_Cart_create(MPI_COMM_WORLD, LAYERED_DIMS, dim_size, periods, reorder, & comm_cart);
+    return ::boost::mpi::communicator(comm_cart, ::boost::mpi::comm_take_ownership);
+}
+
+
+template<size_t DIM_SIZE>
+inline ::boost::mpi::communicator cart_layered_sphere_create(size_t depth)
+{
+    return cart_layered_sphere_create(DIM_SIZE, depth);
+}
+
+
+// Creates communicator of the calling processor's layer of the layered
+// topology (a square sphere) or of its line across the layers (ranked
+// by the layer) if `ACROSS`.
+template<bool ACROSS>
+inline ::boost::mpi::communicator cart_layer(const ::boost::mpi::communicator & comm)
+{
+    MPI_Comm comm_sub;
+    int remain_dims[LAYERED_DIMS] = {!ACROSS, !ACROSS, ACROSS};
+    MPI_Cart_sub(comm, remain_dims, & comm_sub);
+    return ::boost::mpi::communicator(comm_sub, ::boost::mpi::comm_take_ownership);
+}
+
+
+// Creates cartesian grid of all `comm`'s processors, without periods,
+// shaped after the `rows_extent` x `cols_extent` matrix distributed on it:
+// the `rows` x `cols` factorization with the least
+//   rows_extent / rows + cols_extent / cols
+// (the operand traffic of a processor in SUMMA), so as square as possible
+// for square matrices.
+inline ::boost::mpi::communicator cart_grid_create(
+        const ::boost::mpi::communicator & comm,
+        size_t rows_extent = 1,
+        size_t cols_extent = 1)
+{
+    MPI_Comm comm_cart;
+    const size_t processors = comm.size();
+    int dim_size[DIMS] = {static_cast<int>(processors), 1};
+    double best = -1.0;
+    for(size_t rows = 1; rows <= processors; ++rows)
+    {
+        if(processors % rows != 0)
+        {
+            continue;
+        }
+        const size_t cols = processors / rows;
+        const double traffic = static_cast<double>(rows_extent) / rows + static_cast<double>(cols_extent) / cols;
+        if(best < 0.0 || traffic <= best)
+        {
+            best = traffic;
+            dim_size[DIRECTION_VERTICAL] = rows;
+            dim_size[DIRECTION_HORIZONTAL] = cols;
+        }
+    }
+    int periods[DIMS] = {false, false};
+    int reorder = true;
+    MPI_Cart_create(comm, DIMS, dim_size, periods, reorder, & comm_cart);
+    return ::boost::mpi::communicator(comm_cart, ::boost::mpi::comm_take_ownership);
+}
+
+
+// Creates communicator of the processors of `comm`'s cartesian topology
+// lying on the same line in `DIRECTION` as the calling one, ranked by
+// their `DIRECTION` coordinate.
+template<int DIRECTION>
+inline ::boost::mpi::communicator cart_line(const ::boost::mpi::communicator & comm)
+{
+    MPI_Comm comm_line;
+    int remain_dims[DIMS] = {false, false};
+    remain_dims[DIRECTION] = true;
+    MPI_Cart_sub(comm, remain_dims, & comm_line);
+    return ::boost::mpi::communicator(comm_line, ::boost::mpi::comm_take_ownership);
+}
+
+
+// Fails if mpi wasn't run with `processors` amount of processors
 inline void assert_processors(
         const ::boost::mpi::communicator & comm,
-        const ::boost::mpi::environment & env)
+        const ::boost::mpi::environment & env,
+        size_t processors)
 {
-    if(comm.size() != PROCESSORS)
+    if(static_cast<size_t>(comm.size()) != processors)
     {
-        ::debug::err << "Please run with " << PROCESSORS << " processors!\n";
+        ::debug::err << "Please run with " << processors << " processors!\n";
         ::debug::err << "Aborting..." << ::std::endl;
         env.abort(-1);
     }
 }
 
 
+template<size_t PROCESSORS>
+inline void assert_processors(
+        const ::boost::mpi::communicator & comm,
+        const ::boost::mpi::environment & env)
+{
+    assert_processors(comm, env, PROCESSORS);
+}
+
+
 // Returns a ranks array which `SOURCE_RANK_INDEX`st element
 // is the source rank and the `DESTINATION_RANK_INDEX`st element
 // is the destination rank.
@@ -93,6 +197,50 @@ inline coords_type coords(const ::boost::mpi::communicator & comm)
 }
 
 
+// Sizes of cartesian topology dimensions.
+inline coords_type dims(const ::boost::mpi::communicator & comm)
+{
+    coords_type dims_array(new int[DIMS]);
+    coords_type coords_array(new int[DIMS]);
+    int periods[DIMS];
+    MPI_Cart_get(comm, DIMS, & dims_array[0], periods, & coords_array[0]);
+    return dims_array;
+}
+
+
+// Largest message tag on `comm` (its `MPI_TAG_UB` attribute, the least
+// the MPI standard allows if it isn't there).
+inline int tag_upper_bound(const ::boost::mpi::communicator & comm)
+{
+    int * value;
+    int flag;
+    MPI_Comm_get_attr(comm, MPI_TAG_UB, & value, & flag);
+    return flag ? * value : 32767;
+}
+
+
+// Creates the transposition of `comm`'s square sphere: the processor
+// at (`i`, `j`) of `comm` is at (`j`, `i`) of the new one. A partial of
+// a matrix kept in the other layout is there the partial of the
+// matrix's transposition.
+inline ::boost::mpi::communicator cart_transposed(const ::boost::mpi::communicator & comm)
+{
+    const coords_type dims_array = dims(comm);
+    const coords_type coords_array = coords(comm);
+    MPI_Comm comm_split;
+    const int key = coords_array[DIRECTION_HORIZONTAL] * dims_array[DIRECTION_VERTICAL]
+        + coords_array[DIRECTION_VERTICAL];
+    MPI_Comm_split(comm, 0, key, & comm_split);
+    MPI_Comm comm_cart;
+    int dim_size[DIMS] = {dims_array[DIRECTION_HORIZONTAL], dims_array[DIRECTION_VERTICAL]};
+    int periods[DIMS] = {true, true};
+    int reorder = false;
+    MPI_Cart_create(comm_split, DIMS, dim_size, periods, reorder, & comm_cart);
+    MPI_Comm_free(& comm_split);
+    return ::boost::mpi::communicator(comm_cart, ::boost::mpi::comm_take_ownership);
+}
+
+
 }  // namespace mpi
 }  // namespace cannon
 
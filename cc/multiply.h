@@ -5,8 +5,14 @@
 #define __CANNON__MULTIPLY__H__
 
 
+#include <boost/function.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/shared_ptr.hpp>
 #include <boost/numeric/ublas/matrix_expression.hpp>
 #include "matrix.h"
+#include "block_sparse.h"
+#include "gemm.h"
+#include "thread_pool.h"
 #include "exceptions.h"
 
 
@@ -17,8 +23,9 @@ namespace cannon
 // Runs ublas FORTRAN procedure to perform a matrix product
 // it's actually equal to:
 //   result += left * right
+// Kept as a reference implementation.
 template<typename element_t, typename storage_t, size_t size>
-void prod(
+void ublas_prod(
         typename square_matrix_concept<element_t, storage_t, row_major, size>::type & result,
         typename square_matrix_concept<element_t, storage_t, row_major, size>::type & left,
         typename square_matrix_concept<element_t, storage_t, col_major, size>::type & right)
@@ -29,6 +36,454 @@ void prod(
 }
 
 
+// Runs the packed, cache-blocked gemm engine with the best
+// micro-kernel available for `element_t`:
+//   result += left * right
+// The packing buffers are allocated per call, products run repeatedly
+// keep them (see `parallel_prod`).
+template<typename element_t, typename storage_t, size_t size>
+void prod(
+        typename square_matrix_concept<element_t, storage_t, row_major, size>::type & result,
+        typename square_matrix_concept<element_t, storage_t, row_major, size>::type & left,
+        typename square_matrix_concept<element_t, storage_t, col_major, size>::type & right)
+    throw()
+{
+    typedef square_matrix_concept<element_t, storage_t, row_major, size> row_concept;
+    typedef square_matrix_concept<element_t, storage_t, col_major, size> col_concept;
+    typedef typename gemm::default_kernel<element_t>::type kernel_type;
+    const size_t m = left.size1();
+    const size_t k = left.size2();
+    const size_t n = right.size2();
+    const gemm::packing_scratch scratch(1);
+    gemm::gemm<kernel_type>(
+            m, n, k,
+            row_concept::begin(& left), k,
+            col_concept::begin(& right), k,
+            row_concept::begin(& result), n,
+            scratch);
+}
+
+
+// Type-erased local product, compatible with
+// `cannon_prod::product_function_type`.
+template<typename element_t, typename storage_t, size_t size>
+struct product_function
+{
+    typedef ::boost::function<
+        void (
+                typename square_matrix_concept<element_t, storage_t, row_major, size>::type & result,
+                typename square_matrix_concept<element_t, storage_t, row_major, size>::type & left,
+                typename square_matrix_concept<element_t, storage_t, col_major, size>::type & right)
+        throw()> type;
+};
+
+
+// Multi-threaded `prod` - threads of `pool` own tile ranges of `result`:
+//   result += left * right
+// The micro-kernel is `kernel_t` (the best the build targets by default).
+// The threads' packing buffers are allocated once, with the product, and
+// shared by its copies.
+template<
+    typename element_t,
+    typename storage_t,
+    size_t size,
+    typename kernel_t = typename gemm::default_kernel<element_t>::type>
+class parallel_prod
+{
+public:
+    typedef typename square_matrix_concept<element_t, storage_t, row_major, size>::type row_matrix_type;
+    typedef typename square_matrix_concept<element_t, storage_t, col_major, size>::type col_matrix_type;
+private:
+    thread_pool * pool;
+    ::boost::shared_ptr<gemm::packing_scratch> scratch;
+public:
+    explicit parallel_prod(thread_pool & pool)
+      : pool(& pool),
+        scratch(new gemm::packing_scratch(pool.size()))
+    {
+    }
+    void operator()(
+            row_matrix_type & result,
+            row_matrix_type & left,
+            col_matrix_type & right) const
+        throw();
+};
+
+
+template<typename element_t, typename storage_t, size_t size, typename kernel_t>
+void parallel_prod<element_t, storage_t, size, kernel_t>::operator()(
+        row_matrix_type & result,
+        row_matrix_type & left,
+        col_matrix_type & right) const
+    throw()
+{
+    typedef square_matrix_concept<element_t, storage_t, row_major, size> row_concept;
+    typedef square_matrix_concept<element_t, storage_t, col_major, size> col_concept;
+    const size_t m = left.size1();
+    const size_t k = left.size2();
+    const size_t n = right.size2();
+    gemm::parallel_gemm<kernel_t>(
+            * pool, * scratch,
+            m, n, k,
+            row_concept::begin(& left), k,
+            col_concept::begin(& right), k,
+            row_concept::begin(& result), n);
+}
+
+
+// Type-erased product of sub-matrices given by pointers
+// and leading dimensions (see `gemm::gemm`):
+//   c += a * b
+// `a` and `b` may be of a narrower `source_t` (see transport.h).
+template<typename element_t, typename source_t = element_t>
+struct block_product_function
+{
+    typedef ::boost::function<
+        void (
+                size_t m,
+                size_t n,
+                size_t k,
+                const source_t * a,
+                size_t lda,
+                const source_t * b,
+                size_t ldb,
+                element_t * c,
+                size_t ldc)
+        throw()> type;
+};
+
+
+// Multi-threaded block product with `kernel_t`, packing buffers
+// as `parallel_prod`'s.
+template<typename kernel_t, typename source_t = typename kernel_t::element_type>
+class parallel_block_prod
+{
+public:
+    typedef typename kernel_t::element_type element_type;
+    typedef source_t source_type;
+private:
+    thread_pool * pool;
+    ::boost::shared_ptr<gemm::packing_scratch> scratch;
+public:
+    explicit parallel_block_prod(thread_pool & pool)
+      : pool(& pool),
+        scratch(new gemm::packing_scratch(pool.size()))
+    {
+    }
+    void operator()(
+            size_t m,
+            size_t n,
+            size_t k,
+            const source_type * a,
+            size_t lda,
+            const source_type * b,
+            size_t ldb,
+            element_type * c,
+            size_t ldc) const
+        throw()
+    {
+        gemm::parallel_gemm<kernel_t>(* pool, * scratch, m, n, k, a, lda, b, ldb, c, ldc);
+    }
+};
+
+
+// Type-erased product of block-sparse partials into a dense row-major
+// `c` (leading dimension `ldc`):
+//   c += left * right
+template<typename element_t>
+struct block_sparse_product_function
+{
+    typedef ::boost::function<
+        void (
+                element_t * c,
+                size_t ldc,
+                const block_sparse_matrix<element_t, row_major> & left,
+                const block_sparse_matrix<element_t, col_major> & right)
+        throw()> type;
+};
+
+
+// Packed tiles of `parallel_block_sparse_prod` with `kernel_t`: every
+// thread's tile row of the left partial and the right partial's tiles
+// (room for all of them, shared by the threads). They're allocated by
+// the first product and kept by the next ones, as the partials' shapes
+// don't change between the Cannon's steps.
+template<typename kernel_t>
+class block_sparse_scratch
+{
+public:
+    typedef typename gemm::packing<kernel_t>::packed_type packed_type;
+private:
+    typedef gemm::aligned_buffer<packed_type> buffer_type;
+    const size_t threads;
+    size_t left_tiles;
+    size_t left_stride;
+    size_t right_stride;
+    size_t left_capacity;
+    size_t right_capacity;
+    ::boost::scoped_ptr<buffer_type> left_memory;
+    ::boost::scoped_ptr<buffer_type> right_memory;
+public:
+    explicit block_sparse_scratch(size_t threads)
+      : threads(::std::max<size_t>(threads, 1)),
+        left_tiles(0),
+        left_stride(0),
+        right_stride(0),
+        left_capacity(0),
+        right_capacity(0),
+        left_memory(),
+        right_memory()
+    {
+    }
+    // Makes room for `left_tiles` packed `tile` x `tile` tiles per
+    // thread and `right_tiles` shared ones.
+    void reserve(size_t tile, size_t left_tiles, size_t right_tiles)
+    {
+        const size_t PLANES = gemm::packing<kernel_t>::PLANES;
+        this->left_tiles = left_tiles;
+        left_stride = PLANES * ((tile + kernel_t::MR - 1) / kernel_t::MR * kernel_t::MR) * tile;
+        right_stride = PLANES * ((tile + kernel_t::NR - 1) / kernel_t::NR * kernel_t::NR) * tile;
+        if(threads * left_tiles * left_stride > left_capacity)
+        {
+            left_capacity = threads * left_tiles * left_stride;
+            left_memory.reset(new buffer_type(left_capacity));
+        }
+        if(right_tiles * right_stride > right_capacity)
+        {
+            right_capacity = right_tiles * right_stride;
+            right_memory.reset(new buffer_type(right_capacity));
+        }
+    }
+    // Packed left tile `position` of thread `thread_index`'s row.
+    packed_type * left(size_t thread_index, size_t position) const
+        throw()
+    {
+        return left_memory->get() + (thread_index * left_tiles + position) * left_stride;
+    }
+    // Packed right tile `position`.
+    packed_type * right(size_t position) const
+        throw()
+    {
+        return right_memory->get() + position * right_stride;
+    }
+private:
+    block_sparse_scratch(const block_sparse_scratch &);
+    block_sparse_scratch & operator=(const block_sparse_scratch &);
+};
+
+
+// Packs `m` x `k` tile of row-major `a` (`kc` deep blocks of
+// `blocking`'s slivers, one after another) for `tile_prod`.
+template<typename kernel_t, typename element_t>
+void pack_tile_left(
+        size_t m,
+        size_t k,
+        const element_t * a,
+        size_t lda,
+        typename gemm::packing<kernel_t>::packed_type * buffer)
+    throw()
+{
+    const size_t PLANES = gemm::packing<kernel_t>::PLANES;
+    const size_t KC = gemm::blocking<kernel_t>::KC;
+    const size_t MR = kernel_t::MR;
+    const size_t rows = (m + MR - 1) / MR * MR;
+    for(size_t pc = 0; pc < k; pc += KC)
+    {
+        gemm::packing<kernel_t>::left(m, ::std::min(KC, k - pc), a + pc, lda, buffer + PLANES * rows * pc);
+    }
+}
+
+
+// Packs `k` x `n` tile of col-major `b` likewise.
+template<typename kernel_t, typename element_t>
+void pack_tile_right(
+        size_t k,
+        size_t n,
+        const element_t * b,
+        size_t ldb,
+        typename gemm::packing<kernel_t>::packed_type * buffer)
+    throw()
+{
+    const size_t PLANES = gemm::packing<kernel_t>::PLANES;
+    const size_t KC = gemm::blocking<kernel_t>::KC;
+    const size_t NR = kernel_t::NR;
+    const size_t cols = (n + NR - 1) / NR * NR;
+    for(size_t pc = 0; pc < k; pc += KC)
+    {
+        gemm::packing<kernel_t>::right(::std::min(KC, k - pc), n, b + pc, ldb, buffer + PLANES * cols * pc);
+    }
+}
+
+
+// Product of packed tiles (see above) into row-major `c`:
+//   c += a * b
+// blocked as `gemm::gemm` is.
+template<typename kernel_t>
+void tile_prod(
+        size_t m,
+        size_t n,
+        size_t k,
+        const typename gemm::packing<kernel_t>::packed_type * a,
+        const typename gemm::packing<kernel_t>::packed_type * b,
+        typename kernel_t::element_type * c,
+        size_t ldc)
+    throw()
+{
+    const size_t PLANES = gemm::packing<kernel_t>::PLANES;
+    const size_t MR = kernel_t::MR;
+    const size_t NR = kernel_t::NR;
+    const size_t KC = gemm::blocking<kernel_t>::KC;
+    const size_t MC = gemm::blocking<kernel_t>::MC;
+    const size_t rows = (m + MR - 1) / MR * MR;
+    const size_t cols = (n + NR - 1) / NR * NR;
+    for(size_t pc = 0; pc < k; pc += KC)
+    {
+        const size_t kc = ::std::min(KC, k - pc);
+        const typename gemm::packing<kernel_t>::packed_type * const a_block = a + PLANES * rows * pc;
+        const typename gemm::packing<kernel_t>::packed_type * const b_block = b + PLANES * cols * pc;
+        for(size_t ic = 0; ic < m; ic += MC)
+        {
+            const size_t mc = ::std::min(MC, m - ic);
+            for(size_t jr = 0; jr < n; jr += NR)
+            {
+                const size_t nr = ::std::min(NR, n - jr);
+                for(size_t ir = ic; ir < ic + mc; ir += MR)
+                {
+                    const size_t mr = ::std::min(MR, m - ir);
+                    gemm::micro_tile<kernel_t>(
+                            mr, nr, kc,
+                            a_block + PLANES * ir * kc,
+                            b_block + PLANES * jr * kc,
+                            c + ir * ldc + jr,
+                            ldc);
+                }
+            }
+        }
+    }
+}
+
+
+// First part of `parallel_block_sparse_prod`: the threads pack the
+// non-zero tiles of the right partial, every one once.
+template<typename kernel_t>
+struct block_sparse_pack_task
+{
+    typedef typename kernel_t::element_type element_type;
+    const block_sparse_scratch<kernel_t> * scratch;
+    const block_sparse_matrix<element_type, col_major> * right;
+    void operator()(size_t thread_index, size_t threads) const
+        throw()
+    {
+        const size_t tile = right->tile();
+        size_t first, last;
+        split_range(right->tile_rows() * right->tile_cols(), 1, threads, thread_index, first, last);
+        for(size_t position = first; position < last; ++position)
+        {
+            const size_t p = position / right->tile_cols();
+            const size_t j = position % right->tile_cols();
+            const element_type * b = right->tile_at(p, j);
+            if(b == NULL)
+            {
+                continue;
+            }
+            const size_t k = ::std::min(tile, right->size1() - p * tile);
+            const size_t n = ::std::min(tile, right->size2() - j * tile);
+            pack_tile_right<kernel_t>(k, n, b, tile, scratch->right(position));
+        }
+    }
+};
+
+
+// Second part: every thread owns a contiguous range of tiles of `c`
+// (in row-major order) and runs the micro-kernel on the non-zero tile
+// pairs behind them. A tile row of the left partial is packed once
+// per thread that needs it.
+template<typename kernel_t>
+struct block_sparse_task
+{
+    typedef typename kernel_t::element_type element_type;
+    const block_sparse_scratch<kernel_t> * scratch;
+    element_type * c;
+    size_t ldc;
+    const block_sparse_matrix<element_type, row_major> * left;
+    const block_sparse_matrix<element_type, col_major> * right;
+    void operator()(size_t thread_index, size_t threads) const
+        throw()
+    {
+        const size_t tile = left->tile();
+        const size_t tile_cols = right->tile_cols();
+        size_t first, last;
+        split_range(left->tile_rows() * tile_cols, 1, threads, thread_index, first, last);
+        size_t packed_row = left->tile_rows();
+        for(size_t position = first; position < last; ++position)
+        {
+            const size_t i = position / tile_cols;
+            const size_t j = position % tile_cols;
+            const size_t m = ::std::min(tile, left->size1() - i * tile);
+            if(i != packed_row)
+            {
+                for(size_t p = 0; p < left->tile_cols(); ++p)
+                {
+                    const element_type * a = left->tile_at(i, p);
+                    if(a != NULL)
+                    {
+                        const size_t k = ::std::min(tile, left->size2() - p * tile);
+                        pack_tile_left<kernel_t>(m, k, a, tile, scratch->left(thread_index, p));
+                    }
+                }
+                packed_row = i;
+            }
+            const size_t n = ::std::min(tile, right->size2() - j * tile);
+            element_type * const c_tile = c + i * tile * ldc + j * tile;
+            for(size_t p = 0; p < left->tile_cols(); ++p)
+            {
+                if(left->tile_at(i, p) == NULL || right->tile_at(p, j) == NULL)
+                {
+                    continue;
+                }
+                const size_t k = ::std::min(tile, left->size2() - p * tile);
+                tile_prod<kernel_t>(m, n, k, scratch->left(thread_index, p), scratch->right(p * tile_cols + j),
+                        c_tile, ldc);
+            }
+        }
+    }
+};
+
+
+// Multi-threaded product of block-sparse partials with `kernel_t`,
+// empty tile pairs are skipped. Both partials have the same tiles.
+// The packed tiles are kept by the product's copies, as `parallel_prod`'s
+// packing buffers.
+template<typename kernel_t>
+class parallel_block_sparse_prod
+{
+public:
+    typedef typename kernel_t::element_type element_type;
+private:
+    thread_pool * pool;
+    ::boost::shared_ptr<block_sparse_scratch<kernel_t> > scratch;
+public:
+    explicit parallel_block_sparse_prod(thread_pool & pool)
+      : pool(& pool),
+        scratch(new block_sparse_scratch<kernel_t>(pool.size()))
+    {
+    }
+    void operator()(
+            element_type * c,
+            size_t ldc,
+            const block_sparse_matrix<element_type, row_major> & left,
+            const block_sparse_matrix<element_type, col_major> & right) const
+        throw()
+    {
+        scratch->reserve(left.tile(), left.tile_cols(), right.tile_rows() * right.tile_cols());
+        const block_sparse_pack_task<kernel_t> pack = {scratch.get(), & right};
+        pool->run(pack);
+        const block_sparse_task<kernel_t> task = {scratch.get(), c, ldc, & left, & right};
+        pool->run(task);
+    }
+};
+
+
 }  // namespace cannon
 
 
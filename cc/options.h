@@ -0,0 +1,544 @@
+// Author: Cezary Bartoszuk
+// Email: cbart@students.mimuw.edu.pl
+
+#ifndef __CANNON__OPTIONS__H__
+#define __CANNON__OPTIONS__H__
+
+
+#include <cstdlib>
+#include <cstring>
+#include <limits>
+#include <string>
+#include <stdint.h>
+#include "matrix.h"
+#include "debug.h"
+#include "dispatch.h"
+#include "transport.h"
+
+
+namespace cannon
+{
+
+
+// Matrix element types the binary is instantiated for.
+enum element_kind
+{
+    ELEMENT_DOUBLE,
+    ELEMENT_FLOAT,
+    ELEMENT_COMPLEX_DOUBLE,
+    ELEMENT_COMPLEX_FLOAT
+};
+
+
+inline const char * element_name(element_kind element)
+{
+    switch(element)
+    {
+    case ELEMENT_DOUBLE:
+        return "double";
+    case ELEMENT_FLOAT:
+        return "float";
+    case ELEMENT_COMPLEX_DOUBLE:
+        return "complex-double";
+    case ELEMENT_COMPLEX_FLOAT:
+        return "complex-float";
+    }
+    return "unknown";
+}
+
+
+// Formats of the result file.
+enum file_format
+{
+    // One row-major matrix (see matrix_file.h).
+    FORMAT_FLAT,
+    // The partials as tiles (see tiled_file.h).
+    FORMAT_TILED
+};
+
+
+// Values of the operands not read from files.
+enum operands_kind
+{
+    // Random (see random.h).
+    OPERANDS_RANDOM,
+    OPERANDS_ONES,
+    OPERANDS_IDENTITY
+};
+
+
+// Storage of the partials the Cannon's algorithm shifts and multiplies.
+enum partials_kind
+{
+    // Whole partials.
+    PARTIALS_DENSE,
+    // Non-zero tiles only (see block_sparse.h).
+    PARTIALS_BLOCK_SPARSE
+};
+
+
+// Distributed multiply algorithms.
+enum engine_kind
+{
+    // Cannon's algorithm, square grid of `CART_SIZE` x `CART_SIZE`.
+    ENGINE_CANNON,
+    // SUMMA on a grid of all the processors.
+    ENGINE_SUMMA
+};
+
+
+// Command line options of the `cannon` binary.
+struct options
+{
+    // Size of the (square) matrices multiplied.
+    size_t matrix_size;
+    // Shape of the product, `matrix_size` cubed unless given.
+    product_shape shape;
+    // Side of the (square) MPI cart.
+    size_t cart_size;
+    // Threads computing the local product in every rank.
+    size_t threads;
+    // Matrix element type.
+    element_kind element;
+    // Local product kernel, Strassen cutoff and complex method.
+    product_config product;
+    // Panels every partial is shifted in, 1 shifts whole partials.
+    size_t panels;
+    // Distributed algorithm.
+    engine_kind engine;
+    // Layers of the 2.5D Cannon's algorithm, 1 for the plain one.
+    size_t depth;
+    // Independent products run as a batch (plain Cannon's algorithm only).
+    size_t batch;
+    // Operands of a chained product (plain Cannon's algorithm only),
+    // 1 for the single product.
+    size_t chain;
+    // Matrix files (see matrix_file.h, tiled_file.h) the operands are
+    // read from and the result is written to, random operands and no
+    // output if empty.
+    ::std::string left_file;
+    ::std::string right_file;
+    ::std::string result_file;
+    // Format of the result file, operand files' is detected.
+    file_format result_format;
+    // File the steps' Chrome trace is written to (see trace.h), none if empty.
+    ::std::string trace_file;
+    // Values of the operands.
+    operands_kind operands;
+    // Seed of the random operands, which are the same for every grid.
+    uint32_t seed;
+    // Random vectors of the Freivalds' check of every product, none if 0.
+    size_t verify;
+    // Element type the partials are shifted as (plain Cannon's algorithm only).
+    transport_kind transport;
+    // Partials' storage (block-sparse for the plain Cannon's algorithm only).
+    partials_kind partials;
+    // Side of the tiles of block-sparse partials and of the operands'
+    // zero tiles.
+    size_t tile;
+    // Share of the operands' tiles that are not zeroed, 1 for dense ones.
+    double density;
+    options()
+        throw()
+      : matrix_size(0),
+        shape(),
+        cart_size(0),
+        threads(1),
+        element(ELEMENT_DOUBLE),
+        panels(1),
+        engine(ENGINE_CANNON),
+        depth(1),
+        batch(1),
+        chain(1),
+        left_file(),
+        right_file(),
+        result_file(),
+        result_format(FORMAT_FLAT),
+        trace_file(),
+        operands(OPERANDS_RANDOM),
+        seed(0),
+        verify(0),
+        transport(TRANSPORT_FULL),
+        partials(PARTIALS_DENSE),
+        tile(64),
+        density(1.0)
+    {
+    }
+};
+
+
+namespace
+{
+
+
+// Returns the value of `--name=value` argument or NULL
+// if `argument` is not the `name` option.
+inline const char * option_value(const char * argument, const char * name)
+{
+    const size_t length = ::std::strlen(name);
+    if(::std::strncmp(argument, name, length) == 0 && argument[length] == '=')
+    {
+        return argument + length + 1;
+    }
+    return NULL;
+}
+
+
+// Parses a positive number, returns 0 on failure.
+inline size_t positive_value(const char * value)
+{
+    char * end = NULL;
+    const long number = ::std::strtol(value, & end, 10);
+    return (* value != '\0' && * end == '\0' && number > 0) ? number : 0;
+}
+
+
+// Parses an unsigned 32-bit number (digits only, no sign), returns
+// false on failure.
+inline bool uint32_value(const char * value, uint32_t & number)
+{
+    if(* value < '0' || * value > '9')
+    {
+        return false;
+    }
+    char * end = NULL;
+    const unsigned long long parsed = ::std::strtoull(value, & end, 10);
+    if(* end != '\0' || parsed > ::std::numeric_limits<uint32_t>::max())
+    {
+        return false;
+    }
+    number = static_cast<uint32_t>(parsed);
+    return true;
+}
+
+
+// Parses `MxKxN` product shape, returns false on failure.
+inline bool shape_value(const char * value, product_shape & shape)
+{
+    size_t * dims[] = {& shape.rows, & shape.inner, & shape.cols};
+    const size_t DIMS = sizeof(dims) / sizeof(dims[0]);
+    for(size_t i = 0; i < DIMS; ++i)
+    {
+        char * end = NULL;
+        const long number = ::std::strtol(value, & end, 10);
+        if(end == value || number <= 0 || * end != (i + 1 < DIMS ? 'x' : '\0'))
+        {
+            return false;
+        }
+        * dims[i] = number;
+        value = end + 1;
+    }
+    return true;
+}
+
+
+}  // namespace (unnamed)
+
+
+// Fills `opts` from `argv`, returns false (and reports why)
+// if any of the arguments is not understood.
+//   --size=N     matrices are N x N
+//   --shape=MxKxN  M x K times K x N product instead
+//   --grid=Q     Cannon's algorithm on Q x Q cart
+//   --threads=N  threads per rank computing the local product
+//   --type=T     element type (double, float, complex-double, complex-float)
+//   --kernel=K   force local product kernel (auto, scalar, sse2, avx2, avx512)
+//   --strassen=N Strassen-Winograd product for partials larger than N
+//   --complex=M  complex product method (4m, 3m)
+//   --panels=K   pipelined shifts of K panels per partial
+//   --engine=E   distributed algorithm (cannon, summa)
+//   --depth=C    2.5D Cannon's algorithm with C layers
+//   --batch=N    N independent products in a batch
+//   --chain=N    chained product of N operands
+//   --left=FILE  read the left operand from FILE (the first of a chain)
+//   --right=FILE read the right operand from FILE
+//   --result=FILE  write the result to FILE
+//   --format=F   result file format (flat, tiled)
+//   --operands=V operand values (random, ones, identity)
+//   --trace=FILE write the Chrome trace of Cannon's steps to FILE
+//   --seed=N     seed of the random operands
+//   --verify=N   check every product's result with N random vectors (Freivalds)
+//   --transport=T  shift the partials as T (full, float, bfloat16)
+//   --partials=P shift and multiply the partials as P (dense, block-sparse)
+//   --tile=T     tiles of block-sparse partials (and of `--density`) are T x T
+//   --density=D  zero all but D (0 to 1) of the operands' tiles, at random
+inline bool parse_options(int argc, char * * argv, options & opts)
+{
+    for(int i = 1; i < argc; ++i)
+    {
+        const char * value;
+        if((value = option_value(argv[i], "--size")) != NULL)
+        {
+            opts.matrix_size = positive_value(value);
+            if(opts.matrix_size == 0)
+            {
+                ::debug::err << "Invalid matrix size: " << value << ::std::endl;
+                return false;
+            }
+        }
+        else if((value = option_value(argv[i], "--shape")) != NULL)
+        {
+            if(!shape_value(value, opts.shape))
+            {
+                ::debug::err << "Invalid product shape: " << value << ::std::endl;
+                return false;
+            }
+        }
+        else if((value = option_value(argv[i], "--grid")) != NULL)
+        {
+            opts.cart_size = positive_value(value);
+            if(opts.cart_size == 0)
+            {
+                ::debug::err << "Invalid grid size: " << value << ::std::endl;
+                return false;
+            }
+        }
+        else if((value = option_value(argv[i], "--threads")) != NULL)
+        {
+            opts.threads = positive_value(value);
+            if(opts.threads == 0)
+            {
+                ::debug::err << "Invalid thread count: " << value << ::std::endl;
+                return false;
+            }
+        }
+        else if((value = option_value(argv[i], "--kernel")) != NULL)
+        {
+            if(!parse_kernel_variant(value, opts.product.kernel))
+            {
+                ::debug::err << "Unknown kernel: " << value << ::std::endl;
+                return false;
+            }
+        }
+        else if((value = option_value(argv[i], "--strassen")) != NULL)
+        {
+            opts.product.strassen_cutoff = positive_value(value);
+            if(opts.product.strassen_cutoff == 0)
+            {
+                ::debug::err << "Invalid Strassen cutoff: " << value << ::std::endl;
+                return false;
+            }
+        }
+        else if((value = option_value(argv[i], "--type")) != NULL)
+        {
+            if(::std::strcmp(value, "double") == 0)
+            {
+                opts.element = ELEMENT_DOUBLE;
+            }
+            else if(::std::strcmp(value, "float") == 0)
+            {
+                opts.element = ELEMENT_FLOAT;
+            }
+            else if(::std::strcmp(value, "complex-double") == 0)
+            {
+                opts.element = ELEMENT_COMPLEX_DOUBLE;
+            }
+            else if(::std::strcmp(value, "complex-float") == 0)
+            {
+                opts.element = ELEMENT_COMPLEX_FLOAT;
+            }
+            else
+            {
+                ::debug::err << "Unknown element type: " << value << ::std::endl;
+                return false;
+            }
+        }
+        else if((value = option_value(argv[i], "--complex")) != NULL)
+        {
+            if(::std::strcmp(value, "4m") == 0)
+            {
+                opts.product.complex = gemm::COMPLEX_4M;
+            }
+            else if(::std::strcmp(value, "3m") == 0)
+            {
+                opts.product.complex = gemm::COMPLEX_3M;
+            }
+            else
+            {
+                ::debug::err << "Unknown complex method: " << value << ::std::endl;
+                return false;
+            }
+        }
+        else if((value = option_value(argv[i], "--panels")) != NULL)
+        {
+            opts.panels = positive_value(value);
+            if(opts.panels == 0)
+            {
+                ::debug::err << "Invalid panel count: " << value << ::std::endl;
+                return false;
+            }
+        }
+        else if((value = option_value(argv[i], "--engine")) != NULL)
+        {
+            if(::std::strcmp(value, "cannon") == 0)
+            {
+                opts.engine = ENGINE_CANNON;
+            }
+            else if(::std::strcmp(value, "summa") == 0)
+            {
+                opts.engine = ENGINE_SUMMA;
+            }
+            else
+            {
+                ::debug::err << "Unknown engine: " << value << ::std::endl;
+                return false;
+            }
+        }
+        else if((value = option_value(argv[i], "--depth")) != NULL)
+        {
+            opts.depth = positive_value(value);
+            if(opts.depth == 0)
+            {
+                ::debug::err << "Invalid depth: " << value << ::std::endl;
+                return false;
+            }
+        }
+        else if((value = option_value(argv[i], "--batch")) != NULL)
+        {
+            opts.batch = positive_value(value);
+            if(opts.batch == 0)
+            {
+                ::debug::err << "Invalid batch size: " << value << ::std::endl;
+                return false;
+            }
+        }
+        else if((value = option_value(argv[i], "--chain")) != NULL)
+        {
+            opts.chain = positive_value(value);
+            if(opts.chain == 0)
+            {
+                ::debug::err << "Invalid chain length: " << value << ::std::endl;
+                return false;
+            }
+        }
+        else if((value = option_value(argv[i], "--left")) != NULL)
+        {
+            opts.left_file = value;
+        }
+        else if((value = option_value(argv[i], "--right")) != NULL)
+        {
+            opts.right_file = value;
+        }
+        else if((value = option_value(argv[i], "--result")) != NULL)
+        {
+            opts.result_file = value;
+        }
+        else if((value = option_value(argv[i], "--trace")) != NULL)
+        {
+            opts.trace_file = value;
+        }
+        else if((value = option_value(argv[i], "--operands")) != NULL)
+        {
+            if(::std::strcmp(value, "random") == 0)
+            {
+                opts.operands = OPERANDS_RANDOM;
+            }
+            else if(::std::strcmp(value, "ones") == 0)
+            {
+                opts.operands = OPERANDS_ONES;
+            }
+            else if(::std::strcmp(value, "identity") == 0)
+            {
+                opts.operands = OPERANDS_IDENTITY;
+            }
+            else
+            {
+                ::debug::err << "Unknown operand values: " << value << ::std::endl;
+                return false;
+            }
+        }
+        else if((value = option_value(argv[i], "--seed")) != NULL)
+        {
+            if(!uint32_value(value, opts.seed))
+            {
+                ::debug::err << "Invalid seed: " << value << ::std::endl;
+                return false;
+            }
+        }
+        else if((value = option_value(argv[i], "--verify")) != NULL)
+        {
+            opts.verify = positive_value(value);
+            if(opts.verify == 0 && ::std::strcmp(value, "0") != 0)
+            {
+                ::debug::err << "Invalid verification vector count: " << value << ::std::endl;
+                return false;
+            }
+        }
+        else if((value = option_value(argv[i], "--transport")) != NULL)
+        {
+            if(!parse_transport(value, opts.transport))
+            {
+                ::debug::err << "Unknown transport: " << value << ::std::endl;
+                return false;
+            }
+        }
+        else if((value = option_value(argv[i], "--partials")) != NULL)
+        {
+            if(::std::strcmp(value, "dense") == 0)
+            {
+                opts.partials = PARTIALS_DENSE;
+            }
+            else if(::std::strcmp(value, "block-sparse") == 0)
+            {
+                opts.partials = PARTIALS_BLOCK_SPARSE;
+            }
+            else
+            {
+                ::debug::err << "Unknown partials: " << value << ::std::endl;
+                return false;
+            }
+        }
+        else if((value = option_value(argv[i], "--tile")) != NULL)
+        {
+            opts.tile = positive_value(value);
+            if(opts.tile == 0)
+            {
+                ::debug::err << "Invalid tile size: " << value << ::std::endl;
+                return false;
+            }
+        }
+        else if((value = option_value(argv[i], "--density")) != NULL)
+        {
+            char * end = NULL;
+            opts.density = ::std::strtod(value, & end);
+            if(* value == '\0' || * end != '\0' || !(opts.density >= 0.0 && opts.density <= 1.0))
+            {
+                ::debug::err << "Invalid density: " << value << ::std::endl;
+                return false;
+            }
+        }
+        else if((value = option_value(argv[i], "--format")) != NULL)
+        {
+            if(::std::strcmp(value, "flat") == 0)
+            {
+                opts.result_format = FORMAT_FLAT;
+            }
+            else if(::std::strcmp(value, "tiled") == 0)
+            {
+                opts.result_format = FORMAT_TILED;
+            }
+            else
+            {
+                ::debug::err << "Unknown file format: " << value << ::std::endl;
+                return false;
+            }
+        }
+        else
+        {
+            ::debug::err << "Unknown option: " << argv[i] << ::std::endl;
+            return false;
+        }
+    }
+    if(opts.shape.rows == 0)
+    {
+        const product_shape square = {opts.matrix_size, opts.matrix_size, opts.matrix_size};
+        opts.shape = square;
+    }
+    return true;
+}
+
+
+}  // namespace cannon
+
+
+#endif
@@ -0,0 +1,213 @@
+// Author: Cezary Bartoszuk
+// Email: cbart@students.mimuw.edu.pl
+
+#ifndef __CANNON__PERSISTENT__H__
+#define __CANNON__PERSISTENT__H__
+
+
+#include <limits>
+#include <boost/mpi/communicator.hpp>
+#include <boost/mpi/datatype.hpp>
+#include "mpi.h"
+#include "datatype.h"
+
+
+namespace cannon
+{
+namespace mpi
+{
+
+
+// Largest element count of a single MPI message.
+const size_t MESSAGE_MAX_COUNT = static_cast<size_t>(::std::numeric_limits<int>::max());
+
+
+// Sets `type` to `count` elements of `datatype` as an MPI message of
+// the returned count: `datatype` itself if `count` fits the int MPI
+// takes, else a committed derived datatype (to be freed) of all of them.
+inline int message_type(size_t count, MPI_Datatype datatype, MPI_Datatype * type)
+{
+    if(count <= MESSAGE_MAX_COUNT)
+    {
+        * type = datatype;
+        return static_cast<int>(count);
+    }
+    const size_t chunks = count / MESSAGE_MAX_COUNT;
+    const size_t remainder = count % MESSAGE_MAX_COUNT;
+    MPI_Datatype chunk;
+    MPI_Datatype body;
+    MPI_Type_contiguous(static_cast<int>(MESSAGE_MAX_COUNT), datatype, & chunk);
+    MPI_Type_contiguous(static_cast<int>(chunks), chunk, & body);
+    MPI_Type_free(& chunk);
+    if(remainder == 0)
+    {
+        * type = body;
+    }
+    else
+    {
+        MPI_Aint lower_bound;
+        MPI_Aint extent;
+        MPI_Type_get_extent(datatype, & lower_bound, & extent);
+        int lengths[2] = {1, static_cast<int>(remainder)};
+        MPI_Aint displacements[2] = {0, static_cast<MPI_Aint>(chunks * MESSAGE_MAX_COUNT) * extent};
+        MPI_Datatype types[2] = {body, datatype};
+        MPI_Type_create_struct(2, lengths, displacements, types, type);
+        MPI_Type_free(& body);
+    }
+    MPI_Type_commit(type);
+    return 1;
+}
+
+
+// Persistent send to / receive from fixed neighbours of `count`
+// elements, ping-ponging between two bound buffers: one of them is sent
+// while the other is received into. Requests for both parities are set
+// up (`MPI_Send_init` / `MPI_Recv_init`) at a bind and only started
+// later, they are rebuilt (freed and set up again) only if the buffers
+// change. A product of `cannon_prod` binds its own operands, so every
+// product of a batch and of a chain rebuilds them: they are set up once
+// for the steps of a single product only.
+// Partials of more than `MESSAGE_MAX_COUNT` elements are sent as a
+// single element of a derived datatype.
+template<typename element_t>
+class persistent_shift
+{
+public:
+    typedef element_t element_type;
+private:
+    static const size_t PARITIES = 2;
+    static const size_t SEND_INDEX = 0;
+    static const size_t RECV_INDEX = 1;
+    const ::boost::mpi::communicator & comm;
+    const rank_type destination;
+    const rank_type source;
+    const int tag;
+    const MPI_Datatype datatype;
+    MPI_Datatype type;
+    const int count;
+    element_type * buffers[PARITIES];
+    MPI_Request requests[PARITIES][2];
+    size_t started;
+public:
+    persistent_shift(
+            const ::boost::mpi::communicator & comm,
+            const ranks_array_type & ranks,
+            int tag,
+            size_t count)
+        throw();
+    ~persistent_shift()
+        throw();
+    // Binds the requests to `first` and `second` (in any order).
+    void bind(element_type * first, element_type * second)
+        throw();
+    // Starts sending `from` (a bound buffer) and receiving into the other.
+    void start(element_type * from)
+        throw();
+    // Waits for the started transfer.
+    void wait()
+        throw();
+private:
+    void release()
+        throw();
+    persistent_shift(const persistent_shift &);
+    persistent_shift & operator=(const persistent_shift &);
+};
+
+
+template<typename element_t>
+persistent_shift<element_t>::persistent_shift(
+        const ::boost::mpi::communicator & comm,
+        const ranks_array_type & ranks,
+        int tag,
+        size_t count)
+    throw()
+  : comm(comm),
+    destination(ranks[DESTINATION_RANK_INDEX]),
+    source(ranks[SOURCE_RANK_INDEX]),
+    tag(tag),
+    datatype(::boost::mpi::get_mpi_datatype<element_type>(element_type())),
+    count(message_type(count, datatype, & type)),
+    started(PARITIES)
+{
+    buffers[0] = buffers[1] = NULL;
+}
+
+
+template<typename element_t>
+persistent_shift<element_t>::~persistent_shift()
+    throw()
+{
+    release();
+    if(type != datatype)
+    {
+        MPI_Type_free(& type);
+    }
+}
+
+
+template<typename element_t>
+void persistent_shift<element_t>::bind(element_type * first, element_type * second)
+    throw()
+{
+    if((first == buffers[0] && second == buffers[1])
+            || (first == buffers[1] && second == buffers[0]))
+    {
+        return;
+    }
+    release();
+    buffers[0] = first;
+    buffers[1] = second;
+    for(size_t parity = 0; parity < PARITIES; ++parity)
+    {
+        MPI_Send_init(buffers[parity], count, type, destination, tag, comm,
+                & requests[parity][SEND_INDEX]);
+        MPI_Recv_init(buffers[1 - parity], count, type, source, tag, comm,
+                & requests[parity][RECV_INDEX]);
+    }
+}
+
+
+template<typename element_t>
+inline void persistent_shift<element_t>::start(element_type * from)
+    throw()
+{
+    started = from == buffers[0] ? 0 : 1;
+    MPI_Startall(2, requests[started]);
+}
+
+
+template<typename element_t>
+inline void persistent_shift<element_t>::wait()
+    throw()
+{
+    MPI_Waitall(2, requests[started], MPI_STATUSES_IGNORE);
+    started = PARITIES;
+}
+
+
+template<typename element_t>
+void persistent_shift<element_t>::release()
+    throw()
+{
+    if(buffers[0] == NULL)
+    {
+        return;
+    }
+    if(started != PARITIES)
+    {
+        wait();
+    }
+    for(size_t parity = 0; parity < PARITIES; ++parity)
+    {
+        MPI_Request_free(& requests[parity][SEND_INDEX]);
+        MPI_Request_free(& requests[parity][RECV_INDEX]);
+    }
+    buffers[0] = buffers[1] = NULL;
+}
+
+
+}  // namespace mpi
+}  // namespace cannon
+
+
+#endif
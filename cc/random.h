@@ -5,63 +5,243 @@
 #define __CANNON__RANDOM__H__
 
 
-#include <boost/random/linear_congruential.hpp>
-#include <boost/random/uniform_01.hpp>
-#include <boost/random/variate_generator.hpp>
+#include <complex>
+#include <stdint.h>
 
 
 namespace cannon
 {
 
 
-// Random numbers generator. To run just create an instance yourself
-// and run the operator() to get next random number.
-template<typename result_t>
-class random_generator
+// Philox4x32-10 counter-based generator (Salmon et al., "Parallel random
+// numbers: as easy as 1, 2, 3"): `counter` is encrypted with `key` into
+// four random words. No state, so every block of elements is computed
+// on its own and the loops over them are vectorized.
+namespace philox
 {
-public:
-    typedef result_t result_type;
-    typedef ::boost::rand48 engine_type;
-    typedef engine_type & engine_ref;
-    typedef ::boost::uniform_01<result_t> distribution_type;
-    typedef ::boost::variate_generator<engine_ref, distribution_type> generator_type;
-private:
-    engine_type engine;
-    distribution_type distribution;
-    generator_type generator;
-public:
-    random_generator()
-        throw();
-    ~random_generator()
-        throw();
-    result_t operator()();
-};
 
 
-template<typename result_t>
-random_generator<result_t>::random_generator()
+const uint32_t MULTIPLIER_0 = 0xD2511F53u;
+const uint32_t MULTIPLIER_1 = 0xCD9E8D57u;
+const uint32_t WEYL_0 = 0x9E3779B9u;
+const uint32_t WEYL_1 = 0xBB67AE85u;
+const size_t ROUNDS = 10;
+
+
+inline void round(uint32_t counter[4], const uint32_t key[2])
     throw()
-  : engine(),
-    distribution(),
-    generator(engine, distribution)
 {
+    const uint64_t product_0 = static_cast<uint64_t>(MULTIPLIER_0) * counter[0];
+    const uint64_t product_1 = static_cast<uint64_t>(MULTIPLIER_1) * counter[2];
+    const uint32_t next_0 = static_cast<uint32_t>(product_1 >> 32) ^ counter[1] ^ key[0];
+    const uint32_t next_2 = static_cast<uint32_t>(product_0 >> 32) ^ counter[3] ^ key[1];
+    counter[1] = static_cast<uint32_t>(product_1);
+    counter[3] = static_cast<uint32_t>(product_0);
+    counter[0] = next_0;
+    counter[2] = next_2;
 }
 
 
-template<typename result_t>
-random_generator<result_t>::~random_generator()
+// Replaces `counter` with its random words.
+inline void generate(uint32_t counter[4], uint32_t key_0, uint32_t key_1)
     throw()
 {
+    uint32_t key[2] = {key_0, key_1};
+    for(size_t i = 0; i < ROUNDS; ++i)
+    {
+        round(counter, key);
+        key[0] += WEYL_0;
+        key[1] += WEYL_1;
+    }
 }
 
 
-template<typename result_t>
-typename random_generator<result_t>::result_type random_generator<result_t>::operator()()
+// Uniform [0, 1) numbers out of random words.
+// The top 53 bits of `high` and `low` are converted as two 32-bit
+// halves, both exact, whose sum is exact too: there's no vector
+// conversion of 64-bit integers below AVX-512, of 32-bit ones there is.
+inline double to_unit(uint32_t low, uint32_t high)
+    throw()
 {
-    return generator();
+    const int32_t top = static_cast<int32_t>(high >> 1);
+    const int32_t bottom = static_cast<int32_t>((high & 1) << 21 | low >> 11);
+    return static_cast<double>(top) * (1.0 / 2147483648.0)
+        + static_cast<double>(bottom) * (1.0 / 9007199254740992.0);
 }
 
 
+inline float to_unit(uint32_t word)
+    throw()
+{
+    return static_cast<float>(static_cast<int32_t>(word >> 8)) * (1.0f / 16777216.0f);
+}
+
+
+}  // namespace philox
+
+
+// Random words of a global matrix's elements, keyed by `seed` and
+// `stream`.
+class random_words
+{
+private:
+    uint32_t seed;
+    uint32_t stream;
+protected:
+    random_words(uint32_t seed, uint32_t stream)
+        throw()
+      : seed(seed),
+        stream(stream)
+    {
+    }
+    void generate(uint64_t row, uint64_t col, uint32_t words[4]) const
+        throw()
+    {
+        words[0] = static_cast<uint32_t>(col);
+        words[1] = static_cast<uint32_t>(col >> 32);
+        words[2] = static_cast<uint32_t>(row);
+        words[3] = static_cast<uint32_t>(row >> 32);
+        philox::generate(words, seed, stream);
+    }
+};
+
+
+// Random numbers generator: `(row, col)` gives the element of a global
+// matrix, uniform in [0, 1), the same whichever processor (and thread)
+// generates it, so a matrix is bit-identical on all grid sizes.
+// Matrices of the same `seed` differ in `stream`.
+// The four words of a counter make `BLOCK` consecutive elements of a
+// row, `block` gives all of them at once (see `generator_filler`), a
+// single element costs the whole block.
+template<typename result_t>
+class random_generator;
+
+
+template<>
+class random_generator<double>
+  : private random_words
+{
+public:
+    typedef double result_type;
+    static const size_t BLOCK = 2;
+    random_generator(uint32_t seed, uint32_t stream)
+        throw()
+      : random_words(seed, stream)
+    {
+    }
+    // Elements `(row, col)` to `(row, col + BLOCK - 1)`, `col` is
+    // a multiple of `BLOCK`.
+    void block(uint64_t row, uint64_t col, result_type out[BLOCK]) const
+        throw()
+    {
+        uint32_t words[4];
+        generate(row, col / BLOCK, words);
+        out[0] = philox::to_unit(words[0], words[1]);
+        out[1] = philox::to_unit(words[2], words[3]);
+    }
+    result_type operator()(uint64_t row, uint64_t col) const
+        throw()
+    {
+        result_type out[BLOCK];
+        block(row, col - col % BLOCK, out);
+        return out[col % BLOCK];
+    }
+};
+
+
+template<>
+class random_generator<float>
+  : private random_words
+{
+public:
+    typedef float result_type;
+    static const size_t BLOCK = 4;
+    random_generator(uint32_t seed, uint32_t stream)
+        throw()
+      : random_words(seed, stream)
+    {
+    }
+    void block(uint64_t row, uint64_t col, result_type out[BLOCK]) const
+        throw()
+    {
+        uint32_t words[4];
+        generate(row, col / BLOCK, words);
+        out[0] = philox::to_unit(words[0]);
+        out[1] = philox::to_unit(words[1]);
+        out[2] = philox::to_unit(words[2]);
+        out[3] = philox::to_unit(words[3]);
+    }
+    result_type operator()(uint64_t row, uint64_t col) const
+        throw()
+    {
+        result_type out[BLOCK];
+        block(row, col - col % BLOCK, out);
+        return out[col % BLOCK];
+    }
+};
+
+
+// Complex numbers get uniformly distributed real and imaginary parts,
+// out of two words each (four of a double one).
+template<>
+class random_generator< ::std::complex<double> >
+  : private random_words
+{
+public:
+    typedef ::std::complex<double> result_type;
+    static const size_t BLOCK = 1;
+    random_generator(uint32_t seed, uint32_t stream)
+        throw()
+      : random_words(seed, stream)
+    {
+    }
+    void block(uint64_t row, uint64_t col, result_type out[BLOCK]) const
+        throw()
+    {
+        uint32_t words[4];
+        generate(row, col / BLOCK, words);
+        out[0] = result_type(philox::to_unit(words[0], words[1]), philox::to_unit(words[2], words[3]));
+    }
+    result_type operator()(uint64_t row, uint64_t col) const
+        throw()
+    {
+        result_type out[BLOCK];
+        block(row, col - col % BLOCK, out);
+        return out[col % BLOCK];
+    }
+};
+
+
+template<>
+class random_generator< ::std::complex<float> >
+  : private random_words
+{
+public:
+    typedef ::std::complex<float> result_type;
+    static const size_t BLOCK = 2;
+    random_generator(uint32_t seed, uint32_t stream)
+        throw()
+      : random_words(seed, stream)
+    {
+    }
+    void block(uint64_t row, uint64_t col, result_type out[BLOCK]) const
+        throw()
+    {
+        uint32_t words[4];
+        generate(row, col / BLOCK, words);
+        out[0] = result_type(philox::to_unit(words[0]), philox::to_unit(words[1]));
+        out[1] = result_type(philox::to_unit(words[2]), philox::to_unit(words[3]));
+    }
+    result_type operator()(uint64_t row, uint64_t col) const
+        throw()
+    {
+        result_type out[BLOCK];
+        block(row, col - col % BLOCK, out);
+        return out[col % BLOCK];
+    }
+};
+
+
 }  // namespace cannon
 
 
@@ -0,0 +1,305 @@
+// Author: Cezary Bartoszuk
+// Email: cbart@students.mimuw.edu.pl
+
+#ifndef __CANNON__STRASSEN__H__
+#define __CANNON__STRASSEN__H__
+
+
+#include <algorithm>
+#include <vector>
+#include <boost/shared_ptr.hpp>
+#include "matrix.h"
+#include "gemm.h"
+#include "thread_pool.h"
+
+
+namespace cannon
+{
+namespace strassen
+{
+
+
+// Elementwise `dst = x - y` (or `dst = x + y` unless `subtract`)
+// on `rows` x `cols` blocks of the same layout (`dst` may be `x`),
+// split by rows between the threads.
+template<typename element_t>
+struct combine_task
+{
+    size_t rows, cols;
+    const element_t * x;
+    size_t ldx;
+    const element_t * y;
+    size_t ldy;
+    element_t * dst;
+    size_t ldd;
+    bool subtract;
+    void operator()(size_t thread_index, size_t threads) const
+        throw()
+    {
+        size_t first, last;
+        split_range(rows, 1, threads, thread_index, first, last);
+        for(size_t i = first; i < last; ++i)
+        {
+            const element_t * xi = x + i * ldx;
+            const element_t * yi = y + i * ldy;
+            element_t * di = dst + i * ldd;
+            if(subtract)
+            {
+                for(size_t j = 0; j < cols; ++j)
+                {
+                    di[j] = xi[j] - yi[j];
+                }
+            }
+            else
+            {
+                for(size_t j = 0; j < cols; ++j)
+                {
+                    di[j] = xi[j] + yi[j];
+                }
+            }
+        }
+    }
+};
+
+
+// Strassen-Winograd local product:
+//   result += left * right
+// Squares larger than `cutoff` (and of even size) are split into
+// quadrants and multiplied with 7 recursive products; smaller ones
+// (and rectangular operands) go to the classical threaded gemm with
+// `kernel_t`. The scratch memory for all recursion levels is allocated
+// once, up front.
+template<typename element_t, typename storage_t, size_t size, typename kernel_t>
+class strassen_prod
+{
+public:
+    typedef element_t element_type;
+    typedef square_matrix_concept<element_t, storage_t, row_major, size> row_matrix_concept;
+    typedef typename row_matrix_concept::type row_matrix_type;
+    typedef square_matrix_concept<element_t, storage_t, col_major, size> col_matrix_concept;
+    typedef typename col_matrix_concept::type col_matrix_type;
+private:
+    // Per-level scratch: `S` (row-major), `T` (col-major) and `M`
+    // (row-major) operands, each a quadrant of that level's square.
+    struct workspace
+    {
+        size_t planned_size;
+        ::std::vector<size_t> offsets;
+        ::boost::shared_ptr<gemm::aligned_buffer<element_type> > memory;
+    };
+    thread_pool * pool;
+    size_t cutoff;
+    ::boost::shared_ptr<workspace> scratch;
+    // Packing buffers of the classical products' threads.
+    ::boost::shared_ptr<gemm::packing_scratch> packing;
+public:
+    // Preallocates the scratch for `planned_size` x `planned_size` operands.
+    strassen_prod(thread_pool & pool, size_t cutoff, size_t planned_size);
+    void operator()(
+            row_matrix_type & result,
+            row_matrix_type & left,
+            col_matrix_type & right) const
+        throw();
+private:
+    void plan(size_t n) const
+        throw();
+    bool split(size_t n) const
+        throw();
+    void multiply_add(
+            size_t level,
+            size_t n,
+            const element_type * a,
+            size_t lda,
+            const element_type * b,
+            size_t ldb,
+            element_type * c,
+            size_t ldc) const
+        throw();
+    void combine(
+            size_t n,
+            const element_type * x,
+            size_t ldx,
+            const element_type * y,
+            size_t ldy,
+            element_type * dst,
+            size_t ldd,
+            bool subtract) const
+        throw();
+};
+
+
+template<typename element_t, typename storage_t, size_t size, typename kernel_t>
+strassen_prod<element_t, storage_t, size, kernel_t>::strassen_prod(
+        thread_pool & pool,
+        size_t cutoff,
+        size_t planned_size)
+  : pool(& pool),
+    cutoff(::std::max<size_t>(cutoff, 1)),
+    scratch(new workspace()),
+    packing(new gemm::packing_scratch(pool.size()))
+{
+    plan(planned_size);
+}
+
+
+template<typename element_t, typename storage_t, size_t size, typename kernel_t>
+void strassen_prod<element_t, storage_t, size, kernel_t>::operator()(
+        row_matrix_type & result,
+        row_matrix_type & left,
+        col_matrix_type & right) const
+    throw()
+{
+    const size_t n = left.size1();
+    if(left.size2() != n || right.size2() != n)
+    {
+        // Rectangular partials - classical product.
+        gemm::parallel_gemm<kernel_t>(
+                * pool, * packing,
+                n, right.size2(), left.size2(),
+                row_matrix_concept::begin(& left), left.size2(),
+                col_matrix_concept::begin(& right), left.size2(),
+                row_matrix_concept::begin(& result), right.size2());
+        return;
+    }
+    if(n != scratch->planned_size)
+    {
+        plan(n);
+    }
+    multiply_add(
+            0, n,
+            row_matrix_concept::begin(& left), n,
+            col_matrix_concept::begin(& right), n,
+            row_matrix_concept::begin(& result), n);
+}
+
+
+template<typename element_t, typename storage_t, size_t size, typename kernel_t>
+inline bool strassen_prod<element_t, storage_t, size, kernel_t>::split(size_t n) const
+    throw()
+{
+    return n > cutoff && n % 2 == 0;
+}
+
+
+template<typename element_t, typename storage_t, size_t size, typename kernel_t>
+void strassen_prod<element_t, storage_t, size, kernel_t>::plan(size_t n) const
+    throw()
+{
+    const size_t OPERANDS_PER_LEVEL = 3;
+    scratch->planned_size = n;
+    scratch->offsets.clear();
+    size_t total = 0;
+    for(; split(n); n /= 2)
+    {
+        scratch->offsets.push_back(total);
+        total += OPERANDS_PER_LEVEL * (n / 2) * (n / 2);
+    }
+    scratch->memory.reset(new gemm::aligned_buffer<element_type>(total));
+}
+
+
+template<typename element_t, typename storage_t, size_t size, typename kernel_t>
+inline void strassen_prod<element_t, storage_t, size, kernel_t>::combine(
+        size_t n,
+        const element_type * x,
+        size_t ldx,
+        const element_type * y,
+        size_t ldy,
+        element_type * dst,
+        size_t ldd,
+        bool subtract) const
+    throw()
+{
+    const combine_task<element_type> task = {n, n, x, ldx, y, ldy, dst, ldd, subtract};
+    pool->run(task);
+}
+
+
+// Winograd's variant (7 products, 8 operand additions), scheduled so
+// that the products feeding a single quadrant accumulate straight into it.
+//   S1 = A21 + A22   T1 = B12 - B11   M5 = S1 T1 -> C12, C22
+//   S2 = S1 - A11    T2 = B22 - T1    M6 = S2 T2 -> C12, C21, C22
+//   S4 = A12 - S2                     M3 = S4 B22 -> C12
+//                    T4 = T2 - B21    M4 = A22 T4 -> -C21
+//   S3 = A11 - A21   T3 = B22 - B12   M7 = S3 T3 -> C21, C22
+//                                     M1 = A11 B11 -> C11, C12, C21, C22
+//                                     M2 = A12 B21 -> C11
+template<typename element_t, typename storage_t, size_t size, typename kernel_t>
+void strassen_prod<element_t, storage_t, size, kernel_t>::multiply_add(
+        size_t level,
+        size_t n,
+        const element_type * a,
+        size_t lda,
+        const element_type * b,
+        size_t ldb,
+        element_type * c,
+        size_t ldc) const
+    throw()
+{
+    if(!split(n))
+    {
+        gemm::parallel_gemm<kernel_t>(* pool, * packing, n, n, n, a, lda, b, ldb, c, ldc);
+        return;
+    }
+    const size_t h = n / 2;
+    // Quadrants, `b` is col-major so its row offset is `h`.
+    const element_type * a11 = a;
+    const element_type * a12 = a + h;
+    const element_type * a21 = a + h * lda;
+    const element_type * a22 = a + h * lda + h;
+    const element_type * b11 = b;
+    const element_type * b21 = b + h;
+    const element_type * b12 = b + h * ldb;
+    const element_type * b22 = b + h * ldb + h;
+    element_type * c11 = c;
+    element_type * c12 = c + h;
+    element_type * c21 = c + h * ldc;
+    element_type * c22 = c + h * ldc + h;
+    element_type * s = scratch->memory->get() + scratch->offsets[level];
+    element_type * t = s + h * h;
+    element_type * m = t + h * h;
+    // M5
+    combine(h, a21, lda, a22, lda, s, h, false);
+    combine(h, b12, ldb, b11, ldb, t, h, true);
+    ::std::fill(m, m + h * h, element_type());
+    multiply_add(level + 1, h, s, h, t, h, m, h);
+    combine(h, c12, ldc, m, h, c12, ldc, false);
+    combine(h, c22, ldc, m, h, c22, ldc, false);
+    // M6
+    combine(h, s, h, a11, lda, s, h, true);
+    combine(h, b22, ldb, t, h, t, h, true);
+    ::std::fill(m, m + h * h, element_type());
+    multiply_add(level + 1, h, s, h, t, h, m, h);
+    combine(h, c12, ldc, m, h, c12, ldc, false);
+    combine(h, c21, ldc, m, h, c21, ldc, false);
+    combine(h, c22, ldc, m, h, c22, ldc, false);
+    // M3
+    combine(h, a12, lda, s, h, s, h, true);
+    multiply_add(level + 1, h, s, h, b22, ldb, c12, ldc);
+    // M4 (negated T4, so it accumulates)
+    combine(h, b21, ldb, t, h, t, h, true);
+    multiply_add(level + 1, h, a22, lda, t, h, c21, ldc);
+    // M7
+    combine(h, a11, lda, a21, lda, s, h, true);
+    combine(h, b22, ldb, b12, ldb, t, h, true);
+    ::std::fill(m, m + h * h, element_type());
+    multiply_add(level + 1, h, s, h, t, h, m, h);
+    combine(h, c21, ldc, m, h, c21, ldc, false);
+    combine(h, c22, ldc, m, h, c22, ldc, false);
+    // M1
+    ::std::fill(m, m + h * h, element_type());
+    multiply_add(level + 1, h, a11, lda, b11, ldb, m, h);
+    combine(h, c11, ldc, m, h, c11, ldc, false);
+    combine(h, c12, ldc, m, h, c12, ldc, false);
+    combine(h, c21, ldc, m, h, c21, ldc, false);
+    combine(h, c22, ldc, m, h, c22, ldc, false);
+    // M2
+    multiply_add(level + 1, h, a12, lda, b21, ldb, c11, ldc);
+}
+
+
+}  // namespace strassen
+}  // namespace cannon
+
+
+#endif
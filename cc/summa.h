@@ -0,0 +1,277 @@
+// Author: Cezary Bartoszuk
+// Email: cbart@students.mimuw.edu.pl
+
+#ifndef __CANNON__SUMMA__H__
+#define __CANNON__SUMMA__H__
+
+
+#include <vector>
+#include <boost/function.hpp>
+#include <boost/array.hpp>
+#include <boost/mpi/communicator.hpp>
+#include <boost/static_assert.hpp>
+#include "matrix.h"
+#include "mpi.h"
+#include "datatype.h"
+#include "debug.h"
+
+
+namespace cannon
+{
+namespace algorithm
+{
+
+
+// Steps of SUMMA on a `grid_rows` x `grid_cols` grid (see below).
+inline size_t summa_steps(size_t grid_rows, size_t grid_cols)
+{
+    size_t a = grid_rows;
+    size_t b = grid_cols;
+    while(b != 0)
+    {
+        const size_t rest = a % b;
+        a = b;
+        b = rest;
+    }
+    return grid_rows / a * grid_cols;
+}
+
+
+// SUMMA (broadcast based) multiply algorithm on any `grid_rows` x `grid_cols`
+// cartesian grid (see `mpi::cart_grid_create`), with the same partials
+// and local product as `cannon_prod`.
+//   result(i, j) += sum over k of left(i, k) * right(k, j)
+// where `k` runs over `depth = lcm(grid_rows, grid_cols)` partials, so
+// that every processor holds the same amount of each operand:
+//   left(i, k) is `left[k / grid_cols]` of processor (i, k mod grid_cols),
+//   right(k, j) is `right[k / grid_rows]` of processor (k mod grid_rows, j).
+// Step `k` broadcasts left(., k) along the grid rows and right(k, .)
+// along the columns. The broadcasts of step `k + 1` are started
+// (nonblocking) before the local product of step `k`.
+// `SIZE` may be `DYNAMIC_SIZE`, then the partial shapes are given to
+// the constructor: left ones `rows` x `inner`, right ones `inner` x `cols`.
+template<typename real_t, typename storage_t, size_t SIZE>
+class summa_prod
+{
+public:
+    typedef real_t real_type;
+    typedef storage_t storage_type;
+    // Row-major matrix type
+    typedef square_matrix_concept<real_type, storage_type, row_major, SIZE> row_matrix_concept;
+    typedef typename row_matrix_concept::type row_matrix_type;
+    // Column-major matrix type
+    typedef square_matrix_concept<real_type, storage_type, col_major, SIZE> col_matrix_concept;
+    typedef typename col_matrix_concept::type col_matrix_type;
+    // Partials of an operand held by a single processor.
+    typedef ::std::vector<row_matrix_type> row_partials_type;
+    typedef ::std::vector<col_matrix_type> col_partials_type;
+    // Local multiplication function
+    typedef ::boost::function<
+        void (
+                row_matrix_type & product_result,
+                row_matrix_type & product_first_argument,
+                col_matrix_type & product_second_argument)
+        throw()> product_function_type;
+    // MPI Communicator - boost wrapped
+    typedef ::boost::mpi::communicator communicator_type;
+    BOOST_STATIC_ASSERT(::boost::mpi::is_mpi_datatype<real_type>::value);
+private:
+    // Broadcasts in flight: current and next step.
+    static const size_t SLOTS = 2;
+    typedef ::boost::array<MPI_Request, SLOTS> mpi_request_array_type;
+private:
+    // Used only for `DYNAMIC_SIZE`, see `rows()`, `inner()` and `cols()`.
+    const size_t runtime_rows;
+    const size_t runtime_inner;
+    const size_t runtime_cols;
+    const product_function_type local_product;
+    const communicator_type row_line;
+    const communicator_type col_line;
+    const size_t grid_rows;
+    const size_t grid_cols;
+    const size_t row;
+    const size_t col;
+    const size_t steps;
+    ::boost::array<row_matrix_type, SLOTS> row_temp;
+    ::boost::array<col_matrix_type, SLOTS> col_temp;
+    ::boost::array<row_matrix_type *, SLOTS> left_current;
+    ::boost::array<col_matrix_type *, SLOTS> right_current;
+    mpi_request_array_type left_requests;
+    mpi_request_array_type right_requests;
+public:
+    // Creates the algorithm framework on `grid_2d` cartesian grid
+    // for `rows` x `inner` left and `inner` x `cols` right partials.
+    summa_prod(
+            const communicator_type & grid_2d,
+            product_function_type local_product,
+            size_t rows = SIZE,
+            size_t inner = SIZE,
+            size_t cols = SIZE)
+        throw();
+    ~summa_prod()
+        throw();
+    // Amount of left and right partials every processor holds.
+    size_t left_partials() const
+        throw();
+    size_t right_partials() const
+        throw();
+    // Performs the multiplication.
+    //   result += first * second
+    // `left` and `right` are this processor's partials, as described
+    // above, and are not modified.
+    void operator()(
+            row_matrix_type & result,
+            row_partials_type & left,
+            col_partials_type & right)
+        throw();
+private:
+    size_t rows() const
+        throw();
+    size_t inner() const
+        throw();
+    size_t cols() const
+        throw();
+    // Starts the broadcasts of step `step`.
+    void ibroadcast(size_t step, row_partials_type & left, col_partials_type & right)
+        throw();
+    // Waits for the broadcasts of step `step`.
+    void wait(size_t step)
+        throw();
+};
+
+
+template<typename real_t, typename storage_t, size_t SIZE>
+summa_prod<real_t, storage_t, SIZE>::summa_prod(
+        const communicator_type & grid_2d,
+        product_function_type local_product,
+        size_t rows,
+        size_t inner,
+        size_t cols)
+    throw()
+  : runtime_rows(rows),
+    runtime_inner(inner),
+    runtime_cols(cols),
+    local_product(local_product),
+    row_line(mpi::cart_line<mpi::DIRECTION_HORIZONTAL>(grid_2d)),
+    col_line(mpi::cart_line<mpi::DIRECTION_VERTICAL>(grid_2d)),
+    grid_rows(col_line.size()),
+    grid_cols(row_line.size()),
+    row(col_line.rank()),
+    col(row_line.rank()),
+    steps(summa_steps(grid_rows, grid_cols))
+{
+    for(size_t slot = 0; slot < SLOTS; ++slot)
+    {
+        row_temp[slot].resize(this->rows(), this->inner(), false);
+        col_temp[slot].resize(this->inner(), this->cols(), false);
+    }
+}
+
+
+template<typename real_t, typename storage_t, size_t SIZE>
+summa_prod<real_t, storage_t, SIZE>::~summa_prod()
+    throw()
+{
+}
+
+
+template<typename real_t, typename storage_t, size_t SIZE>
+inline size_t summa_prod<real_t, storage_t, SIZE>::rows() const
+    throw()
+{
+    return actual_size<SIZE>(runtime_rows);
+}
+
+
+template<typename real_t, typename storage_t, size_t SIZE>
+inline size_t summa_prod<real_t, storage_t, SIZE>::inner() const
+    throw()
+{
+    return actual_size<SIZE>(runtime_inner);
+}
+
+
+template<typename real_t, typename storage_t, size_t SIZE>
+inline size_t summa_prod<real_t, storage_t, SIZE>::cols() const
+    throw()
+{
+    return actual_size<SIZE>(runtime_cols);
+}
+
+
+template<typename real_t, typename storage_t, size_t SIZE>
+inline size_t summa_prod<real_t, storage_t, SIZE>::left_partials() const
+    throw()
+{
+    return steps / grid_cols;
+}
+
+
+template<typename real_t, typename storage_t, size_t SIZE>
+inline size_t summa_prod<real_t, storage_t, SIZE>::right_partials() const
+    throw()
+{
+    return steps / grid_rows;
+}
+
+
+template<typename real_t, typename storage_t, size_t SIZE>
+void summa_prod<real_t, storage_t, SIZE>::operator()(
+        row_matrix_type & result,
+        row_partials_type & left,
+        col_partials_type & right)
+    throw()
+{
+    ibroadcast(0, left, right);
+    for(size_t step = 0; step < steps; ++step)
+    {
+        ::debug::info << "Begin SUMMA iteration " << step + 1 << ".\n" << ::std::flush;
+        if(step + 1 < steps)
+        {
+            ibroadcast(step + 1, left, right);
+        }
+        ::debug::info << "Waiting for broadcast.\n" << ::std::flush;
+        wait(step);
+        ::debug::info << "Begin product.\n" << ::std::flush;
+        local_product(result, * left_current[step % SLOTS], * right_current[step % SLOTS]);
+    }
+}
+
+
+// The root broadcasts straight from its partial, the others
+// receive into the slot's temp partial.
+template<typename real_t, typename storage_t, size_t SIZE>
+void summa_prod<real_t, storage_t, SIZE>::ibroadcast(
+        size_t step,
+        row_partials_type & left,
+        col_partials_type & right)
+    throw()
+{
+    const size_t slot = step % SLOTS;
+    const MPI_Datatype datatype = ::boost::mpi::get_mpi_datatype<real_type>(real_type());
+    const size_t left_root = step % grid_cols;
+    left_current[slot] = left_root == col ? & left[step / grid_cols] : & row_temp[slot];
+    MPI_Ibcast(row_matrix_concept::begin(left_current[slot]), rows() * inner(), datatype,
+            left_root, row_line, & left_requests[slot]);
+    const size_t right_root = step % grid_rows;
+    right_current[slot] = right_root == row ? & right[step / grid_rows] : & col_temp[slot];
+    MPI_Ibcast(col_matrix_concept::begin(right_current[slot]), inner() * cols(), datatype,
+            right_root, col_line, & right_requests[slot]);
+}
+
+
+template<typename real_t, typename storage_t, size_t SIZE>
+inline void summa_prod<real_t, storage_t, SIZE>::wait(size_t step)
+    throw()
+{
+    const size_t slot = step % SLOTS;
+    MPI_Wait(& left_requests[slot], MPI_STATUS_IGNORE);
+    MPI_Wait(& right_requests[slot], MPI_STATUS_IGNORE);
+}
+
+
+}  // namespace algorithm
+}  // namespace cannon
+
+
+#endif
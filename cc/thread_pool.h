@@ -0,0 +1,176 @@
+// Author: Cezary Bartoszuk
+// Email: cbart@students.mimuw.edu.pl
+
+#ifndef __CANNON__THREAD_POOL__H__
+#define __CANNON__THREAD_POOL__H__
+
+
+#include <algorithm>
+#include <boost/bind.hpp>
+#include <boost/function.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+
+
+namespace cannon
+{
+
+
+// Fork-join pool of `size()` threads (the calling thread included).
+// Workers are started once and sleep between `run` calls, so the pool
+// can be reused through all the Cannon's steps.
+class thread_pool
+{
+public:
+    // Task run by every thread, gets thread's index and pool size.
+    typedef ::boost::function<void (size_t thread_index, size_t threads)> task_type;
+private:
+    typedef ::boost::mutex mutex_type;
+    typedef ::boost::unique_lock<mutex_type> lock_type;
+    const size_t threads;
+    ::boost::thread_group workers;
+    mutex_type mutex;
+    ::boost::condition_variable work_ready;
+    ::boost::condition_variable work_done;
+    const task_type * task;
+    unsigned long generation;
+    size_t pending;
+    bool stopping;
+public:
+    explicit thread_pool(size_t threads)
+        throw();
+    ~thread_pool()
+        throw();
+    // Amount of threads running the tasks.
+    size_t size() const
+        throw();
+    // Runs `task` on all the threads and waits for all of them.
+    void run(const task_type & task)
+        throw();
+private:
+    void worker(size_t thread_index)
+        throw();
+    thread_pool(const thread_pool &);
+    thread_pool & operator=(const thread_pool &);
+};
+
+
+inline thread_pool::thread_pool(size_t threads)
+    throw()
+  : threads(threads == 0 ? 1 : threads),
+    task(NULL),
+    generation(0),
+    pending(0),
+    stopping(false)
+{
+    for(size_t thread_index = 1; thread_index < this->threads; ++thread_index)
+    {
+        workers.create_thread(::boost::bind(& thread_pool::worker, this, thread_index));
+    }
+}
+
+
+inline thread_pool::~thread_pool()
+    throw()
+{
+    {
+        lock_type lock(mutex);
+        stopping = true;
+    }
+    work_ready.notify_all();
+    workers.join_all();
+}
+
+
+inline size_t thread_pool::size() const
+    throw()
+{
+    return threads;
+}
+
+
+inline void thread_pool::run(const task_type & task)
+    throw()
+{
+    if(threads == 1)
+    {
+        task(0, 1);
+        return;
+    }
+    {
+        lock_type lock(mutex);
+        this->task = & task;
+        pending = threads - 1;
+        ++generation;
+    }
+    work_ready.notify_all();
+    task(0, threads);
+    lock_type lock(mutex);
+    while(pending != 0)
+    {
+        work_done.wait(lock);
+    }
+    this->task = NULL;
+}
+
+
+inline void thread_pool::worker(size_t thread_index)
+    throw()
+{
+    unsigned long seen_generation = 0;
+    for(;;)
+    {
+        const task_type * current_task;
+        {
+            lock_type lock(mutex);
+            while(!stopping && generation == seen_generation)
+            {
+                work_ready.wait(lock);
+            }
+            if(stopping)
+            {
+                return;
+            }
+            seen_generation = generation;
+            current_task = task;
+        }
+        (* current_task)(thread_index, threads);
+        bool last;
+        {
+            lock_type lock(mutex);
+            last = (--pending == 0);
+        }
+        if(last)
+        {
+            work_done.notify_one();
+        }
+    }
+}
+
+
+// Splits `[0, size)` into `parts` ranges aligned to `grain`
+// and returns the `part`th one as `[first, last)`.
+inline void split_range(
+        size_t size,
+        size_t grain,
+        size_t parts,
+        size_t part,
+        size_t & first,
+        size_t & last)
+    throw()
+{
+    const size_t grains = (size + grain - 1) / grain;
+    const size_t per_part = grains / parts;
+    const size_t remainder = grains % parts;
+    const size_t first_grain = part * per_part + ::std::min(part, remainder);
+    const size_t grain_count = per_part + (part < remainder ? 1 : 0);
+    first = ::std::min(size, first_grain * grain);
+    last = ::std::min(size, (first_grain + grain_count) * grain);
+}
+
+
+}  // namespace cannon
+
+
+#endif
@@ -0,0 +1,445 @@
+// Author: Cezary Bartoszuk
+// Email: cbart@students.mimuw.edu.pl
+
+#ifndef __CANNON__TILED_FILE__H__
+#define __CANNON__TILED_FILE__H__
+
+
+#include <cstring>
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <boost/numeric/ublas/fwd.hpp>
+#include <boost/type_traits/is_same.hpp>
+#include "allocator.h"
+#include "matrix.h"
+#include "matrix_file.h"
+#include "fill.h"
+#include "debug.h"
+
+
+// Alignment of the tiles in a tiled file, at least the page size for
+// the tiles to be mapped in place.
+#ifndef TILED_FILE_ALIGNMENT
+#define TILED_FILE_ALIGNMENT 4096l
+#endif
+
+
+namespace cannon
+{
+
+
+// Tiled matrix file: `tiled_file_header`, padded to
+// `TILED_FILE_ALIGNMENT`, followed by the `rows` x `cols` matrix cut
+// into `tile_rows` x `tile_cols` tiles - the partials, edge ones padded
+// with zeros. Tile (`block_row`, `block_col`) is stored whole, in
+// `layout` (as the partial it's read into is), at its own
+// `TILED_FILE_ALIGNMENT` aligned place, block row after block row.
+// Every processor's partial is thus one contiguous, page aligned run
+// of the file, which it maps instead of reading.
+struct tiled_file_header
+{
+    char magic[8];
+    uint64_t element;
+    uint64_t rows;
+    uint64_t cols;
+    uint64_t tile_rows;
+    uint64_t tile_cols;
+    uint64_t layout;
+};
+
+
+// Layouts of the tiles.
+const uint64_t TILE_ROW_MAJOR = 0;
+const uint64_t TILE_COL_MAJOR = 1;
+
+
+namespace
+{
+
+
+static const char TILED_FILE_MAGIC[8] = {'C', 'A', 'N', 'N', 'O', 'N', 'T', 'F'};
+
+
+// Layout code of `matrix_t`'s tiles.
+template<typename matrix_t>
+inline uint64_t tile_layout()
+{
+    typedef typename matrix_t::orientation_category orientation_category;
+    return ::boost::is_same<orientation_category, ::boost::numeric::ublas::column_major_tag>::value
+        ? TILE_COL_MAJOR
+        : TILE_ROW_MAJOR;
+}
+
+
+// `bytes` rounded up to `TILED_FILE_ALIGNMENT`.
+inline size_t tile_aligned(size_t bytes)
+{
+    return (bytes + TILED_FILE_ALIGNMENT - 1) / TILED_FILE_ALIGNMENT * TILED_FILE_ALIGNMENT;
+}
+
+
+// Storage we can't replace, it's read into.
+template<typename storage_t>
+inline bool map_storage(storage_t &, int, off_t)
+{
+    return false;
+}
+
+
+// Replaces `storage`'s pages with a private mapping of the file at
+// `offset`: nothing is read until the product (or a shift) touches
+// it, so partials larger than the memory page in lazily, and writes
+// (received partials) never reach the file.
+template<typename element_t>
+inline bool map_storage(
+        ::std::vector<element_t, matrix_allocator<element_t> > & storage,
+        int descriptor,
+        off_t offset)
+{
+    if(!matrix_allocator<element_t>::mapped(storage.size())
+            || offset % sysconf(_SC_PAGESIZE) != 0)
+    {
+        return false;
+    }
+    void * memory = & storage[0];
+    const size_t length = tile_aligned(storage.size() * sizeof(element_t));
+    if(mmap(memory, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, descriptor, offset) == MAP_FAILED)
+    {
+        // A failed fixed mapping may have unmapped the storage.
+        mmap(memory, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0);
+        return false;
+    }
+    // Shifts and the packing of the local product stream the partial.
+    madvise(memory, length, MADV_SEQUENTIAL);
+    return true;
+}
+
+
+}  // namespace (unnamed)
+
+
+// Tiled matrix file opened by a single processor, every processor
+// maps (writes) its own tiles without any communication.
+class tiled_file
+{
+private:
+    int descriptor;
+    tiled_file_header header;
+public:
+    // Opens existing `path` for reading.
+    explicit tiled_file(const char * path)
+        throw();
+    // Creates (or, if some other processor did, opens) `path` for
+    // `rows` x `cols` matrix of `element` (`matrix_file_element<...>::CODE`)
+    // elements in `tile_rows` x `tile_cols` `layout` tiles.
+    tiled_file(
+            const char * path,
+            size_t rows,
+            size_t cols,
+            size_t tile_rows,
+            size_t tile_cols,
+            uint64_t element,
+            uint64_t layout)
+        throw();
+    ~tiled_file()
+        throw();
+    // Whether the file is open (and its header valid).
+    bool good() const
+        throw();
+    size_t rows() const
+        throw();
+    size_t cols() const
+        throw();
+    // Maps the `block_row`, `block_col` tile into `partial` (of the
+    // tiles' size) if its layout and storage permit, reads it otherwise.
+    template<typename matrix_t>
+    bool read(matrix_t & partial, size_t block_row, size_t block_col)
+        throw();
+    // Writes `partial` (of the tiles' size and layout) as the
+    // `block_row`, `block_col` tile.
+    template<typename matrix_t>
+    bool write(const matrix_t & partial, size_t block_row, size_t block_col)
+        throw();
+    // Whether `path` is a tiled (not a flat, see matrix_file.h) file.
+    static bool is_tiled(const char * path)
+        throw();
+private:
+    // Offset of the `block_row`, `block_col` tile.
+    off_t tile_offset(size_t block_row, size_t block_col) const
+        throw();
+    size_t tile_bytes() const
+        throw();
+    template<typename matrix_t>
+    bool check_tile(const matrix_t & partial, size_t block_row, size_t block_col) const
+        throw();
+    tiled_file(const tiled_file &);
+    tiled_file & operator=(const tiled_file &);
+};
+
+
+inline tiled_file::tiled_file(const char * path)
+    throw()
+  : descriptor(open(path, O_RDONLY))
+{
+    ::std::memset(& header, 0, sizeof(header));
+    if(descriptor < 0)
+    {
+        ::debug::err << "Can't open matrix file " << path << ::std::endl;
+        return;
+    }
+    if(pread(descriptor, & header, sizeof(header), 0) != static_cast<ssize_t>(sizeof(header))
+            || ::std::memcmp(header.magic, TILED_FILE_MAGIC, sizeof(header.magic)) != 0
+            || header.tile_rows == 0 || header.tile_cols == 0)
+    {
+        ::debug::err << "Not a tiled matrix file: " << path << ::std::endl;
+        close(descriptor);
+        descriptor = -1;
+    }
+}
+
+
+// Every processor writes the (same) header and sizes the file, so none
+// has to wait for the others.
+inline tiled_file::tiled_file(
+        const char * path,
+        size_t rows,
+        size_t cols,
+        size_t tile_rows,
+        size_t tile_cols,
+        uint64_t element,
+        uint64_t layout)
+    throw()
+  : descriptor(open(path, O_WRONLY | O_CREAT, 0644))
+{
+    ::std::memset(& header, 0, sizeof(header));
+    ::std::memcpy(header.magic, TILED_FILE_MAGIC, sizeof(header.magic));
+    header.element = element;
+    header.rows = rows;
+    header.cols = cols;
+    header.tile_rows = tile_rows;
+    header.tile_cols = tile_cols;
+    header.layout = layout;
+    if(descriptor < 0)
+    {
+        ::debug::err << "Can't create matrix file " << path << ::std::endl;
+        return;
+    }
+    const size_t tiles = partial_size(rows, tile_rows) * partial_size(cols, tile_cols);
+    if(pwrite(descriptor, & header, sizeof(header), 0) != static_cast<ssize_t>(sizeof(header))
+            || ftruncate(descriptor, tile_aligned(sizeof(header)) + tiles * tile_aligned(tile_bytes())) != 0)
+    {
+        ::debug::err << "Can't write matrix file " << path << ::std::endl;
+        close(descriptor);
+        descriptor = -1;
+    }
+}
+
+
+inline tiled_file::~tiled_file()
+    throw()
+{
+    if(descriptor >= 0)
+    {
+        close(descriptor);
+    }
+}
+
+
+inline bool tiled_file::good() const
+    throw()
+{
+    return descriptor >= 0;
+}
+
+
+inline size_t tiled_file::rows() const
+    throw()
+{
+    return header.rows;
+}
+
+
+inline size_t tiled_file::cols() const
+    throw()
+{
+    return header.cols;
+}
+
+
+// Elements of the tile are copied (transposed, if the layouts differ)
+// from a temporary mapping when `partial` can't take the file's pages.
+template<typename matrix_t>
+bool tiled_file::read(matrix_t & partial, size_t block_row, size_t block_col)
+    throw()
+{
+    typedef typename matrix_t::value_type value_type;
+    if(header.element != mpi::matrix_file_element<value_type>::CODE)
+    {
+        ::debug::err << "Matrix file element type mismatch!" << ::std::endl;
+        return false;
+    }
+    if(!check_tile(partial, block_row, block_col))
+    {
+        return false;
+    }
+    const off_t offset = tile_offset(block_row, block_col);
+    if(header.layout == tile_layout<matrix_t>() && map_storage(partial.data(), descriptor, offset))
+    {
+        return true;
+    }
+    void * memory = mmap(NULL, tile_bytes(), PROT_READ, MAP_PRIVATE, descriptor, offset);
+    if(memory == MAP_FAILED)
+    {
+        ::debug::err << "Can't map matrix file!" << ::std::endl;
+        return false;
+    }
+    madvise(memory, tile_bytes(), MADV_SEQUENTIAL);
+    const value_type * tile = static_cast<const value_type *>(memory);
+    const size_t extent_rows = partial_extent(rows(), partial.size1(), block_row);
+    const size_t extent_cols = partial_extent(cols(), partial.size2(), block_col);
+    for(size_t i = 0; i < extent_rows; ++i)
+    {
+        for(size_t j = 0; j < extent_cols; ++j)
+        {
+            partial(i, j) = header.layout == TILE_COL_MAJOR
+                ? tile[j * header.tile_rows + i]
+                : tile[i * header.tile_cols + j];
+        }
+    }
+    munmap(memory, tile_bytes());
+    fill_padding(partial, extent_rows, extent_cols);
+    return true;
+}
+
+
+template<typename matrix_t>
+bool tiled_file::write(const matrix_t & partial, size_t block_row, size_t block_col)
+    throw()
+{
+    if(header.layout != tile_layout<matrix_t>() || !check_tile(partial, block_row, block_col))
+    {
+        return false;
+    }
+    const char * bytes = reinterpret_cast<const char *>(& partial.data()[0]);
+    const off_t offset = tile_offset(block_row, block_col);
+    for(size_t written = 0; written < tile_bytes(); )
+    {
+        const ssize_t count = pwrite(descriptor, bytes + written, tile_bytes() - written, offset + written);
+        if(count <= 0)
+        {
+            ::debug::err << "Can't write matrix file!" << ::std::endl;
+            return false;
+        }
+        written += count;
+    }
+    return true;
+}
+
+
+inline bool tiled_file::is_tiled(const char * path)
+    throw()
+{
+    char magic[sizeof(TILED_FILE_MAGIC)];
+    const int descriptor = open(path, O_RDONLY);
+    if(descriptor < 0)
+    {
+        return false;
+    }
+    const bool tiled = ::read(descriptor, magic, sizeof(magic)) == static_cast<ssize_t>(sizeof(magic))
+        && ::std::memcmp(magic, TILED_FILE_MAGIC, sizeof(magic)) == 0;
+    close(descriptor);
+    return tiled;
+}
+
+
+inline off_t tiled_file::tile_offset(size_t block_row, size_t block_col) const
+    throw()
+{
+    const size_t tile = block_row * partial_size(cols(), header.tile_cols) + block_col;
+    return tile_aligned(sizeof(header)) + tile * tile_aligned(tile_bytes());
+}
+
+
+inline size_t tiled_file::tile_bytes() const
+    throw()
+{
+    // The element size is implied by the element type, checked on read.
+    static const size_t ELEMENT_SIZES[] = {0, sizeof(double), sizeof(float), 2 * sizeof(double), 2 * sizeof(float)};
+    const size_t element_size = header.element < sizeof(ELEMENT_SIZES) / sizeof(ELEMENT_SIZES[0])
+        ? ELEMENT_SIZES[header.element]
+        : 0;
+    return header.tile_rows * header.tile_cols * element_size;
+}
+
+
+template<typename matrix_t>
+bool tiled_file::check_tile(const matrix_t & partial, size_t block_row, size_t block_col) const
+    throw()
+{
+    if(partial.size1() != header.tile_rows || partial.size2() != header.tile_cols
+            || block_row >= partial_size(rows(), header.tile_rows)
+            || block_col >= partial_size(cols(), header.tile_cols))
+    {
+        ::debug::err << "Matrix file has " << header.tile_rows << " x " << header.tile_cols
+            << " tiles, expected " << partial.size1() << " x " << partial.size2()
+            << " ones!" << ::std::endl;
+        return false;
+    }
+    return true;
+}
+
+
+// Maps (reads) the `block_row`, `block_col` partial of `rows` x `cols`
+// matrix from tiled `path`, fails if the file's matrix is different.
+template<typename matrix_t>
+bool load_tiled_partial(
+        const ::std::string & path,
+        matrix_t & partial,
+        size_t rows,
+        size_t cols,
+        size_t block_row,
+        size_t block_col)
+    throw()
+{
+    tiled_file file(path.c_str());
+    if(!file.good())
+    {
+        return false;
+    }
+    if(file.rows() != rows || file.cols() != cols)
+    {
+        ::debug::err << path << " is " << file.rows() << " x " << file.cols()
+            << ", expected " << rows << " x " << cols << ::std::endl;
+        return false;
+    }
+    return file.read(partial, block_row, block_col);
+}
+
+
+// Writes the `block_row`, `block_col` partial of `rows` x `cols` matrix
+// to tiled `path`, tiles are the partials.
+template<typename matrix_t>
+bool save_tiled_partial(
+        const ::std::string & path,
+        const matrix_t & partial,
+        size_t rows,
+        size_t cols,
+        size_t block_row,
+        size_t block_col)
+    throw()
+{
+    tiled_file file(path.c_str(), rows, cols, partial.size1(), partial.size2(),
+            mpi::matrix_file_element<typename matrix_t::value_type>::CODE, tile_layout<matrix_t>());
+    return file.good() && file.write(partial, block_row, block_col);
+}
+
+
+}  // namespace cannon
+
+
+#endif
@@ -0,0 +1,251 @@
+// Author: Cezary Bartoszuk
+// Email: cbart@students.mimuw.edu.pl
+
+#ifndef __CANNON__TRACE__H__
+#define __CANNON__TRACE__H__
+
+
+#include <algorithm>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include <boost/mpi/communicator.hpp>
+#include "debug.h"
+
+
+namespace cannon
+{
+
+
+// Traced intervals of a product.
+enum trace_kind
+{
+    // Initial skew of the partials.
+    TRACE_SKEW,
+    // A local product (a tile's in the pipelined mode).
+    TRACE_PRODUCT,
+    // Blocked on the shift (or, pipelined, on the next panel).
+    TRACE_WAIT,
+    // Blocked on the realign.
+    TRACE_REALIGN,
+    TRACE_KINDS
+};
+
+
+inline const char * trace_name(trace_kind kind)
+{
+    switch(kind)
+    {
+    case TRACE_SKEW:
+        return "skew";
+    case TRACE_PRODUCT:
+        return "product";
+    case TRACE_WAIT:
+        return "wait";
+    case TRACE_REALIGN:
+        return "realign";
+    case TRACE_KINDS:
+        break;
+    }
+    return "unknown";
+}
+
+
+// One traced interval, in seconds since the tracer's start.
+struct trace_event
+{
+    double begin;
+    double end;
+    uint32_t kind;
+    uint32_t step;
+};
+
+
+// Timeline of the products on every processor: intervals are recorded
+// into a buffer allocated up front (events past its capacity are only
+// counted), so tracing costs two `MPI_Wtime` calls per interval. At the
+// end the buffers are gathered on processor 0 and written as Chrome
+// trace JSON (chrome://tracing, ui.perfetto.dev), a process per rank,
+// with a summary of the compute / communication overlap.
+class tracer
+{
+private:
+    const ::boost::mpi::communicator & comm;
+    ::std::vector<trace_event> events;
+    size_t count;
+    size_t dropped;
+    double origin;
+public:
+    // Starts the clock of all the processors together.
+    tracer(const ::boost::mpi::communicator & comm, size_t capacity)
+        throw();
+    // The clock, `begin` of `record`.
+    double now() const
+        throw();
+    // Records the interval from `begin` until now.
+    void record(trace_kind kind, size_t step, double begin)
+        throw();
+    // Gathers the timelines and writes them (by processor 0) to `path`.
+    bool write(const ::std::string & path) const
+        throw();
+private:
+    // Writes the summary of `all` events (`counts[rank]` of every
+    // processor, in order of ranks) to `file` and the log.
+    static void write_summary(
+            FILE * file,
+            const ::std::vector<trace_event> & all,
+            const ::std::vector<int> & counts)
+        throw();
+};
+
+
+inline tracer::tracer(const ::boost::mpi::communicator & comm, size_t capacity)
+    throw()
+  : comm(comm),
+    events(capacity),
+    count(0),
+    dropped(0),
+    origin(0.0)
+{
+    comm.barrier();
+    origin = MPI_Wtime();
+}
+
+
+inline double tracer::now() const
+    throw()
+{
+    return MPI_Wtime() - origin;
+}
+
+
+inline void tracer::record(trace_kind kind, size_t step, double begin)
+    throw()
+{
+    if(count == events.size())
+    {
+        ++dropped;
+        return;
+    }
+    trace_event & event = events[count++];
+    event.begin = begin;
+    event.end = now();
+    event.kind = kind;
+    event.step = step;
+}
+
+
+// Events are plain data, gathered as bytes.
+inline bool tracer::write(const ::std::string & path) const
+    throw()
+{
+    if(dropped > 0)
+    {
+        ::debug::warn << "Trace buffer full, " << dropped << " events dropped!" << ::std::endl;
+    }
+    const int bytes = count * sizeof(trace_event);
+    const bool root = comm.rank() == 0;
+    ::std::vector<int> sizes(root ? comm.size() : 0);
+    MPI_Gather(const_cast<int *>(& bytes), 1, MPI_INT, root ? & sizes[0] : NULL, 1, MPI_INT, 0, comm);
+    ::std::vector<int> displacements(sizes.size(), 0);
+    for(size_t rank = 1; rank < sizes.size(); ++rank)
+    {
+        displacements[rank] = displacements[rank - 1] + sizes[rank - 1];
+    }
+    const size_t total = sizes.empty() ? 0 : displacements.back() + sizes.back();
+    ::std::vector<trace_event> all(total / sizeof(trace_event) + 1);
+    MPI_Gatherv(const_cast<trace_event *>(& events[0]), bytes, MPI_BYTE,
+            & all[0], root ? & sizes[0] : NULL, root ? & displacements[0] : NULL, MPI_BYTE, 0, comm);
+    if(!root)
+    {
+        return true;
+    }
+    all.pop_back();
+    FILE * file = ::std::fopen(path.c_str(), "w");
+    if(file == NULL)
+    {
+        ::debug::err << "Can't open trace " << path << ::std::endl;
+        return false;
+    }
+    ::std::vector<int> counts(sizes.size());
+    ::std::fprintf(file, "{\"traceEvents\": [");
+    size_t event = 0;
+    for(size_t rank = 0; rank < sizes.size(); ++rank)
+    {
+        counts[rank] = sizes[rank] / sizeof(trace_event);
+        ::std::fprintf(file, "%s\n{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": %zu, "
+                "\"args\": {\"name\": \"rank %zu\"}}", rank > 0 ? "," : "", rank, rank);
+        for(int i = 0; i < counts[rank]; ++i, ++event)
+        {
+            const trace_event & traced = all[event];
+            ::std::fprintf(file, ",\n{\"name\": \"%s\", \"ph\": \"X\", \"pid\": %zu, \"tid\": 0, "
+                    "\"ts\": %.3f, \"dur\": %.3f, \"args\": {\"step\": %u}}",
+                    trace_name(static_cast<trace_kind>(traced.kind)), rank,
+                    traced.begin * 1e6, (traced.end - traced.begin) * 1e6, traced.step);
+        }
+    }
+    ::std::fprintf(file, "\n],\n\"otherData\": {");
+    write_summary(file, all, counts);
+    ::std::fprintf(file, "}}\n");
+    return ::std::fclose(file) == 0;
+}
+
+
+// Overlap efficiency is the share of the products in the time spent
+// computing or blocked on communication; wait skew is the difference
+// between the longest and the shortest total wait of a rank. The rank
+// that waits least is the straggler the others wait for.
+inline void tracer::write_summary(
+        FILE * file,
+        const ::std::vector<trace_event> & all,
+        const ::std::vector<int> & counts)
+    throw()
+{
+    ::std::vector<double> compute(counts.size(), 0.0);
+    ::std::vector<double> wait(counts.size(), 0.0);
+    size_t event = 0;
+    for(size_t rank = 0; rank < counts.size(); ++rank)
+    {
+        for(int i = 0; i < counts[rank]; ++i, ++event)
+        {
+            const double duration = all[event].end - all[event].begin;
+            if(all[event].kind == TRACE_PRODUCT)
+            {
+                compute[rank] += duration;
+            }
+            else
+            {
+                wait[rank] += duration;
+            }
+        }
+    }
+    double total_compute = 0.0;
+    double total_wait = 0.0;
+    double worst_efficiency = 1.0;
+    for(size_t rank = 0; rank < counts.size(); ++rank)
+    {
+        total_compute += compute[rank];
+        total_wait += wait[rank];
+        if(compute[rank] + wait[rank] > 0.0)
+        {
+            worst_efficiency = ::std::min(worst_efficiency, compute[rank] / (compute[rank] + wait[rank]));
+        }
+    }
+    const double efficiency = total_compute + total_wait > 0.0
+        ? total_compute / (total_compute + total_wait)
+        : 1.0;
+    const size_t straggler = ::std::min_element(wait.begin(), wait.end()) - wait.begin();
+    const double skew = * ::std::max_element(wait.begin(), wait.end()) - wait[straggler];
+    ::std::fprintf(file, "\"overlap_efficiency\": %.6f, \"worst_overlap_efficiency\": %.6f, "
+            "\"wait_skew\": %.9f, \"straggler\": %zu",
+            efficiency, worst_efficiency, skew, straggler);
+    ::debug::info << "Overlap efficiency " << efficiency << " (worst rank " << worst_efficiency
+        << "), wait skew " << skew << "s, straggler rank " << straggler << ::std::endl;
+}
+
+
+}  // namespace cannon
+
+
+#endif
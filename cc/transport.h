@@ -0,0 +1,305 @@
+// Author: Cezary Bartoszuk
+// Email: cbart@students.mimuw.edu.pl
+
+#ifndef __CANNON__TRANSPORT__H__
+#define __CANNON__TRANSPORT__H__
+
+
+#include <algorithm>
+#include <cmath>
+#include <complex>
+#include <cstring>
+#include <limits>
+#include <stdint.h>
+#include <boost/mpi/communicator.hpp>
+#include <boost/mpi/datatype.hpp>
+#include <boost/mpl/bool.hpp>
+
+
+namespace cannon
+{
+
+
+// Element types the partials are shifted as.
+enum transport_kind
+{
+    // The matrix elements themselves.
+    TRANSPORT_FULL,
+    // Single precision (complex single for complex elements).
+    TRANSPORT_FLOAT,
+    // Brain floating point: float's exponent, 8 bits of mantissa.
+    TRANSPORT_BFLOAT16
+};
+
+
+// Transport names as accepted by `--transport=`.
+inline const char * transport_name(transport_kind kind)
+{
+    switch(kind)
+    {
+    case TRANSPORT_FULL:
+        return "full";
+    case TRANSPORT_FLOAT:
+        return "float";
+    case TRANSPORT_BFLOAT16:
+        return "bfloat16";
+    }
+    return "unknown";
+}
+
+
+// Parses transport name, returns false if `name` is not a transport.
+inline bool parse_transport(const char * name, transport_kind & kind)
+{
+    const transport_kind kinds[] = {TRANSPORT_FULL, TRANSPORT_FLOAT, TRANSPORT_BFLOAT16};
+    for(size_t i = 0; i < sizeof(kinds) / sizeof(kinds[0]); ++i)
+    {
+        if(::std::strcmp(name, transport_name(kinds[i])) == 0)
+        {
+            kind = kinds[i];
+            return true;
+        }
+    }
+    return false;
+}
+
+
+// Upper 16 bits of a float. Rounded to nearest (ties to even), NaNs
+// stay (quiet) NaNs. Doubles are rounded to float first, which is
+// an ulp off at most in the rare ties of the second rounding.
+struct bfloat16
+{
+    uint16_t bits;
+    bfloat16()
+        throw()
+      : bits(0)
+    {
+    }
+    explicit bfloat16(float value)
+        throw()
+      : bits(round(value))
+    {
+    }
+    explicit bfloat16(double value)
+        throw()
+      : bits(round(static_cast<float>(value)))
+    {
+    }
+    operator float() const
+        throw()
+    {
+        const uint32_t widened = static_cast<uint32_t>(bits) << 16;
+        float value;
+        ::std::memcpy(& value, & widened, sizeof(value));
+        return value;
+    }
+private:
+    static uint16_t round(float value)
+        throw()
+    {
+        uint32_t bits;
+        ::std::memcpy(& bits, & value, sizeof(bits));
+        if((bits & 0x7fffffffu) > 0x7f800000u)
+        {
+            return static_cast<uint16_t>((bits >> 16) | 0x0040u);
+        }
+        bits += 0x7fffu + ((bits >> 16) & 1u);
+        return static_cast<uint16_t>(bits >> 16);
+    }
+};
+
+
+// Element type `real_t` partials are shifted as with `KIND`, if
+// `SUPPORTED`. Narrowing a type to itself or widening it is not.
+template<typename real_t, transport_kind KIND>
+struct transport_of
+{
+    typedef real_t type;
+    static const bool SUPPORTED = KIND == TRANSPORT_FULL;
+};
+
+
+template<>
+struct transport_of<double, TRANSPORT_FLOAT>
+{
+    typedef float type;
+    static const bool SUPPORTED = true;
+};
+
+
+template<>
+struct transport_of<double, TRANSPORT_BFLOAT16>
+{
+    typedef bfloat16 type;
+    static const bool SUPPORTED = true;
+};
+
+
+template<>
+struct transport_of<float, TRANSPORT_BFLOAT16>
+{
+    typedef bfloat16 type;
+    static const bool SUPPORTED = true;
+};
+
+
+template<>
+struct transport_of< ::std::complex<double>, TRANSPORT_FLOAT>
+{
+    typedef ::std::complex<float> type;
+    static const bool SUPPORTED = true;
+};
+
+
+// Relative rounding error of a value shipped as `kind`, 0 for the
+// full transport.
+inline double transport_epsilon(transport_kind kind)
+{
+    switch(kind)
+    {
+    case TRANSPORT_FULL:
+        break;
+    case TRANSPORT_FLOAT:
+        return ::std::numeric_limits<float>::epsilon() / 2;
+    case TRANSPORT_BFLOAT16:
+        return ::std::ldexp(1.0, -8);
+    }
+    return 0.0;
+}
+
+
+// Rounding errors of the narrowed operands.
+struct rounding_stats
+{
+    // Largest relative error of an element.
+    double max_error;
+    // Sums of the squared errors and the squared values.
+    double error_squares;
+    double value_squares;
+    rounding_stats()
+        throw()
+      : max_error(0.0),
+        error_squares(0.0),
+        value_squares(0.0)
+    {
+    }
+    // Relative 2-norm of the errors.
+    double norm_error() const
+        throw()
+    {
+        return value_squares > 0.0 ? ::std::sqrt(error_squares / value_squares) : 0.0;
+    }
+    // Sums up (the largest error is the largest) the stats of `comm`'s
+    // processors on all of them.
+    void all_reduce(const ::boost::mpi::communicator & comm)
+        throw()
+    {
+        double squares[] = {error_squares, value_squares};
+        MPI_Allreduce(MPI_IN_PLACE, & max_error, 1, MPI_DOUBLE, MPI_MAX, comm);
+        MPI_Allreduce(MPI_IN_PLACE, squares, 2, MPI_DOUBLE, MPI_SUM, comm);
+        error_squares = squares[0];
+        value_squares = squares[1];
+    }
+};
+
+
+// Rounds `count` elements of `from` to `to`, adding their errors to
+// `stats`. Element by element, the vectorized conversions are in
+// convert.h; they run this one on their tails.
+template<typename real_t, typename transport_t>
+void narrow(const real_t * from, size_t count, transport_t * to, rounding_stats & stats)
+    throw()
+{
+    double max_error = stats.max_error;
+    double error_squares = 0.0;
+    double value_squares = 0.0;
+    for(size_t i = 0; i < count; ++i)
+    {
+        const transport_t narrowed(from[i]);
+        to[i] = narrowed;
+        const double value = ::std::abs(from[i]);
+        const double error = ::std::abs(from[i] - static_cast<real_t>(narrowed));
+        error_squares += error * error;
+        value_squares += value * value;
+        max_error = ::std::max(max_error, error / ::std::max(value, ::std::numeric_limits<double>::min()));
+    }
+    stats.max_error = max_error;
+    stats.error_squares += error_squares;
+    stats.value_squares += value_squares;
+}
+
+
+// Complex elements are narrowed part by part.
+template<typename real_t, typename transport_t>
+void narrow(
+        const ::std::complex<real_t> * from,
+        size_t count,
+        ::std::complex<transport_t> * to,
+        rounding_stats & stats)
+    throw()
+{
+    double max_error = stats.max_error;
+    double error_squares = 0.0;
+    double value_squares = 0.0;
+    for(size_t i = 0; i < count; ++i)
+    {
+        const ::std::complex<transport_t> narrowed(
+                static_cast<transport_t>(from[i].real()), static_cast<transport_t>(from[i].imag()));
+        to[i] = narrowed;
+        const double error_real = from[i].real() - static_cast<real_t>(narrowed.real());
+        const double error_imag = from[i].imag() - static_cast<real_t>(narrowed.imag());
+        const double error = error_real * error_real + error_imag * error_imag;
+        const double value = ::std::norm(from[i]);
+        error_squares += error;
+        value_squares += value;
+        max_error = ::std::max(max_error,
+                ::std::sqrt(error / ::std::max(value, ::std::numeric_limits<double>::min())));
+    }
+    stats.max_error = max_error;
+    stats.error_squares += error_squares;
+    stats.value_squares += value_squares;
+}
+
+
+// Widens `count` rounded elements of `from` back to `to`, one by one.
+// `from` may lie inside `to` if it doesn't end before it (see convert.h).
+template<typename real_t, typename transport_t>
+void widen(const transport_t * from, size_t count, real_t * to)
+    throw()
+{
+    for(size_t i = 0; i < count; ++i)
+    {
+        to[i] = static_cast<real_t>(from[i]);
+    }
+}
+
+
+}  // namespace cannon
+
+
+// bfloat16 values are shipped as their bits.
+namespace boost
+{
+namespace mpi
+{
+
+
+template<>
+inline MPI_Datatype get_mpi_datatype< ::cannon::bfloat16>(const ::cannon::bfloat16 &)
+{
+    return MPI_UINT16_T;
+}
+
+
+template<>
+struct is_mpi_builtin_datatype< ::cannon::bfloat16>
+  : ::boost::mpl::true_
+{
+};
+
+
+}  // namespace mpi
+}  // namespace boost
+
+
+#endif
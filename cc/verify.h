@@ -0,0 +1,248 @@
+// Author: Cezary Bartoszuk
+// Email: cbart@students.mimuw.edu.pl
+
+#ifndef __CANNON__VERIFY__H__
+#define __CANNON__VERIFY__H__
+
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <vector>
+#include <stdint.h>
+#include <boost/mpi/communicator.hpp>
+#include <boost/mpi/datatype.hpp>
+#include <boost/numeric/ublas/fwd.hpp>
+#include <boost/numeric/ublas/traits.hpp>
+#include <boost/type_traits/is_same.hpp>
+#include "random.h"
+
+
+namespace cannon
+{
+
+
+// Freivalds' check of a distributed product
+//   result = operands[0] * operands[1] * ... * operands[n - 1]
+// with a random vector `r`: `result * r` is compared with
+// `operands[0] * (... * (operands[n - 1] * r))`, so it takes O(n^2)
+// matrix-vector products instead of the O(n^3) product. A wrong product
+// gives a different vector with probability 1.
+//
+// Every processor multiplies the blocks of the matrices it has, placed
+// at their global `first_row`, `first_col` (edge partials' padding is
+// skipped), whatever their distribution as long as every block is given
+// by one processor only:
+//   freivalds<value_type> check(comm, cols, seed, stream);
+//   check.multiply_result(result, ...);
+//   check.multiply(operands[n - 1], ...);
+//   check.next();
+//   ...
+//   check.multiply(operands[0], ...);
+//   double error = check.error();
+// `next` sums the vector up (`MPI_Allreduce`) on all the processors,
+// so they have all of it for the next operand's blocks.
+template<typename value_t>
+class freivalds
+{
+public:
+    typedef value_t value_type;
+    typedef typename ::boost::numeric::ublas::type_traits<value_type>::real_type real_type;
+private:
+    typedef ::std::vector<value_type> vector_type;
+    const ::boost::mpi::communicator & comm;
+    // The vector the operands multiply, all of it.
+    vector_type vector;
+    // This processor's blocks' part of the next one.
+    vector_type partial;
+    // This processor's blocks' part of `result * r`.
+    vector_type expected;
+public:
+    // Draws `r` of `length` (the result's columns) elements, the same
+    // on every processor, out of `seed`'s `stream` (see random.h).
+    freivalds(const ::boost::mpi::communicator & comm, size_t length, uint32_t seed, uint32_t stream)
+        throw();
+    // Adds `block` (of a `length` rows matrix) times `r`.
+    template<typename matrix_t>
+    void multiply_result(const matrix_t & block, size_t first_row, size_t first_col, size_t length)
+        throw();
+    // Adds `block` (of a `length` rows operand) times the vector.
+    template<typename matrix_t>
+    void multiply(const matrix_t & block, size_t first_row, size_t first_col, size_t length)
+        throw();
+    // The operand is done, its product is the next vector.
+    void next()
+        throw();
+    // After the first operand: relative norm of the difference.
+    double error()
+        throw();
+    // Relative error of a right product of `products` matrix products
+    // of `inner` dimension (at most).
+    static double tolerance(size_t inner, size_t products)
+        throw();
+private:
+    template<typename matrix_t>
+    static void multiply(
+            const matrix_t & block,
+            size_t first_row,
+            size_t first_col,
+            const vector_type & in,
+            vector_type & out)
+        throw();
+    void sum(vector_type & values) const
+        throw();
+};
+
+
+template<typename value_t>
+freivalds<value_t>::freivalds(
+        const ::boost::mpi::communicator & comm,
+        size_t length,
+        uint32_t seed,
+        uint32_t stream)
+    throw()
+  : comm(comm),
+    vector(length),
+    partial(),
+    expected()
+{
+    const random_generator<value_type> generator(seed, stream);
+    for(size_t i = 0; i < length; ++i)
+    {
+        vector[i] = generator(0, i);
+    }
+}
+
+
+template<typename value_t>
+template<typename matrix_t>
+inline void freivalds<value_t>::multiply_result(
+        const matrix_t & block,
+        size_t first_row,
+        size_t first_col,
+        size_t length)
+    throw()
+{
+    expected.resize(length);
+    multiply(block, first_row, first_col, vector, expected);
+}
+
+
+template<typename value_t>
+template<typename matrix_t>
+inline void freivalds<value_t>::multiply(
+        const matrix_t & block,
+        size_t first_row,
+        size_t first_col,
+        size_t length)
+    throw()
+{
+    partial.resize(length);
+    multiply(block, first_row, first_col, vector, partial);
+}
+
+
+template<typename value_t>
+inline void freivalds<value_t>::next()
+    throw()
+{
+    sum(partial);
+    vector.swap(partial);
+    partial.clear();
+}
+
+
+// Both vectors are summed up at once.
+template<typename value_t>
+double freivalds<value_t>::error()
+    throw()
+{
+    const size_t length = partial.size();
+    partial.insert(partial.end(), expected.begin(), expected.end());
+    sum(partial);
+    double difference = 0.0;
+    double norm = 0.0;
+    for(size_t i = 0; i < length; ++i)
+    {
+        const double expected_abs = ::std::abs(partial[length + i]);
+        const double difference_abs = ::std::abs(partial[i] - partial[length + i]);
+        norm += expected_abs * expected_abs;
+        difference += difference_abs * difference_abs;
+    }
+    partial.clear();
+    return norm > 0.0 ? ::std::sqrt(difference / norm) : ::std::sqrt(difference);
+}
+
+
+// Rounding errors of a dot product of `inner` elements are
+// `inner * epsilon` relative at most, both sides have them.
+template<typename value_t>
+inline double freivalds<value_t>::tolerance(size_t inner, size_t products)
+    throw()
+{
+    return 2.0 * products * inner * ::std::numeric_limits<real_type>::epsilon();
+}
+
+
+// Row-major blocks take dot products of their rows, col-major ones add
+// up their columns.
+template<typename value_t>
+template<typename matrix_t>
+void freivalds<value_t>::multiply(
+        const matrix_t & block,
+        size_t first_row,
+        size_t first_col,
+        const vector_type & in,
+        vector_type & out)
+    throw()
+{
+    typedef typename matrix_t::orientation_category orientation_category;
+    const bool col_major =
+        ::boost::is_same<orientation_category, ::boost::numeric::ublas::column_major_tag>::value;
+    if(first_row >= out.size() || first_col >= in.size() || block.size1() == 0 || block.size2() == 0)
+    {
+        return;
+    }
+    const size_t rows = ::std::min(block.size1(), out.size() - first_row);
+    const size_t cols = ::std::min(block.size2(), in.size() - first_col);
+    const value_type * data = & block.data()[0];
+    const value_type * x = & in[first_col];
+    value_type * y = & out[first_row];
+    if(col_major)
+    {
+        for(size_t j = 0; j < cols; ++j)
+        {
+            const value_type * column = data + j * block.size1();
+            for(size_t i = 0; i < rows; ++i)
+            {
+                y[i] += column[i] * x[j];
+            }
+        }
+        return;
+    }
+    for(size_t i = 0; i < rows; ++i)
+    {
+        const value_type * row = data + i * block.size2();
+        value_type dot = value_type();
+        for(size_t j = 0; j < cols; ++j)
+        {
+            dot += row[j] * x[j];
+        }
+        y[i] += dot;
+    }
+}
+
+
+template<typename value_t>
+inline void freivalds<value_t>::sum(vector_type & values) const
+    throw()
+{
+    MPI_Allreduce(MPI_IN_PLACE, & values[0], values.size(),
+            ::boost::mpi::get_mpi_datatype<value_type>(value_type()), MPI_SUM, comm);
+}
+
+
+}  // namespace cannon
+
+
+#endif